@@ -275,6 +275,18 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Parallel JPEG finishing (local addition)
+//
+// The passes after entropy decoding - dequantize + IDCT of progressive JPEGs
+// and upsampling + colour conversion of every JPEG - work on independent row
+// bands. Define STBI_PARALLEL_FOR(count, fn, ctx) before the implementation
+// to run them on your own threads: it must call fn(ctx, i) for every i in
+// [0, count), in any order and on any threads, and return once all calls
+// have finished. fn has type void (*)(void *ctx, int i). Without it the
+// bands run in order on the calling thread.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image supports loading HDR images in general, and currently the Radiance
@@ -795,6 +807,11 @@ static int stbi__sse2_available(void)
 #define STBI_MAX_DIMENSIONS (1 << 24)
 #endif
 
+#ifndef STBI_PARALLEL_FOR
+#define STBI_PARALLEL_FOR(count, fn, ctx) \
+   do { int stbi__pf_i, stbi__pf_n = (count); for (stbi__pf_i = 0; stbi__pf_i < stbi__pf_n; ++stbi__pf_i) (fn)((ctx), stbi__pf_i); } while (0)
+#endif
+
 ///////////////////////////////////////////////
 //
 //  stbi__context struct and start_xxx functions
@@ -1997,6 +2014,7 @@ typedef struct
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+   int simd_dequantize;
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -3069,29 +3087,67 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
    }
 }
 
-static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
+// rows of 8x8 blocks per parallel work item in stbi__jpeg_finish
+#define STBI__FINISH_BAND_BLOCKS 4
+
+typedef struct
 {
+   stbi__jpeg *z;
+   int bands[4];     // work items per component
+} stbi__finish_job;
+
+// Dequantize a block into a temporary and IDCT it, leaving the coefficients
+// untouched (and saving the separate in-place dequantize pass)
+static void stbi__jpeg_dequantize_idct(stbi__jpeg *z, stbi_uc *out, int out_stride, const short *data, const stbi__uint16 *dequant)
+{
+   STBI_SIMD_ALIGN(short, block[64]);
    int i;
+#ifdef STBI_SSE2
+   if (z->simd_dequantize) {
+      for (i=0; i < 64; i += 8) {
+         __m128i c = _mm_loadu_si128((const __m128i *) (data + i));
+         __m128i q = _mm_loadu_si128((const __m128i *) (dequant + i));
+         _mm_store_si128((__m128i *) (block + i), _mm_mullo_epi16(c, q));
+      }
+   } else
+#endif
    for (i=0; i < 64; ++i)
-      data[i] *= dequant[i];
+      block[i] = (short) (data[i] * dequant[i]);
+   z->idct_block_kernel(out, out_stride, block);
+}
+
+static void stbi__jpeg_finish_band(void *ctx, int item)
+{
+   stbi__finish_job *job = (stbi__finish_job *) ctx;
+   stbi__jpeg *z = job->z;
+   int n = 0, i, j, w, h, j0, j1;
+   while (item >= job->bands[n]) item -= job->bands[n++];
+
+   w = (z->img_comp[n].x+7) >> 3;
+   h = (z->img_comp[n].y+7) >> 3;
+   j0 = item * STBI__FINISH_BAND_BLOCKS;
+   j1 = j0 + STBI__FINISH_BAND_BLOCKS < h ? j0 + STBI__FINISH_BAND_BLOCKS : h;
+   for (j=j0; j < j1; ++j) {
+      for (i=0; i < w; ++i) {
+         short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+         stbi__jpeg_dequantize_idct(z, z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+      }
+   }
 }
 
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
+      // dequantize and idct the data, in bands of block rows
+      stbi__finish_job job;
+      int n, count = 0;
+      job.z = z;
       for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
-         }
+         job.bands[n] = (h + STBI__FINISH_BAND_BLOCKS-1) / STBI__FINISH_BAND_BLOCKS;
+         count += job.bands[n];
       }
+      STBI_PARALLEL_FOR(count, stbi__jpeg_finish_band, &job);
    }
 }
 
@@ -3250,8 +3306,8 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
       if (z->img_comp[i].raw_coeff) {
          STBI_FREE(z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
-         z->img_comp[i].coeff = 0;
       }
+      z->img_comp[i].coeff = 0;
       if (z->img_comp[i].linebuf) {
          STBI_FREE(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
@@ -3342,10 +3398,24 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
          // w2, h2 are multiples of 8 (see above)
          z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
          z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
-         if (z->img_comp[i].raw_coeff == NULL)
-            return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-         z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+      }
+   }
+
+   if (z->progressive) {
+      // one coefficient buffer for every component, owned by component 0,
+      // instead of an allocation each
+      size_t total = 0, offset = 0;
+      for (i=0; i < s->img_n; ++i) {
+         if (!stbi__mad3sizes_valid(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15))
+            return stbi__free_jpeg_components(z, s->img_n, stbi__err("outofmem", "Out of memory"));
+         total += ((size_t) z->img_comp[i].w2 * z->img_comp[i].h2 * sizeof(short) + 15) & ~(size_t) 15;
+      }
+      z->img_comp[0].raw_coeff = stbi__malloc(total + 15);
+      if (z->img_comp[0].raw_coeff == NULL)
+         return stbi__free_jpeg_components(z, s->img_n, stbi__err("outofmem", "Out of memory"));
+      for (i=0; i < s->img_n; ++i) {
+         z->img_comp[i].coeff = (short*) ((((size_t) z->img_comp[0].raw_coeff + 15) & ~(size_t) 15) + offset);
+         offset += ((size_t) z->img_comp[i].w2 * z->img_comp[i].h2 * sizeof(short) + 15) & ~(size_t) 15;
       }
    }
 
@@ -3828,6 +3898,7 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
       j->idct_block_kernel = stbi__idct_simd;
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+      j->simd_dequantize = 1;
    }
 #endif
 
@@ -3861,6 +3932,161 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+// rows per parallel work item of the resample + colour conversion pass
+#define STBI__CONVERT_BAND_ROWS 32
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample res_comp[4];   // resampling state at row 0
+   stbi_uc *output;
+   int n, decode_n, is_rgb;
+   volatile int failed;
+} stbi__convert_job;
+
+static void stbi__jpeg_convert_band(void *ctx, int band)
+{
+   stbi__convert_job *job = (stbi__convert_job *) ctx;
+   stbi__jpeg *z = job->z;
+   int k, n = job->n, decode_n = job->decode_n, is_rgb = job->is_rgb;
+   unsigned int i,j;
+   unsigned int j0 = (unsigned int) band * STBI__CONVERT_BAND_ROWS;
+   unsigned int j1 = j0 + STBI__CONVERT_BAND_ROWS < z->s->img_y ? j0 + STBI__CONVERT_BAND_ROWS : z->s->img_y;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *linebuf[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *lastrow = NULL;
+   stbi__resample res_comp[4];
+
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+      *r = job->res_comp[k];
+      // step the vertical resampling state on to the band's first row
+      for (j=0; j < j0; ++j) {
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      // each band has its own line buffers, big enough for upsampling off
+      // the edges with upsample factor of 4
+      linebuf[k] = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!linebuf[k]) { job->failed = 1; goto done; }
+   }
+   // the converters below store a 4th byte after every pixel even when n < 4,
+   // so the last pixel of a row touches the first byte of the next one. Rows
+   // written in order cover that up; the band's last row goes through a
+   // scratch row instead, so it cannot clobber the next band.
+   if (j1 < z->s->img_y) {
+      lastrow = (stbi_uc *) stbi__malloc(n * z->s->img_x + 1);
+      if (!lastrow) { job->failed = 1; goto done; }
+   }
+
+   for (j=j0; j < j1; ++j) {
+      stbi_uc *dest = job->output + n * z->s->img_x * j;
+      stbi_uc *out = (j+1 == j1 && lastrow) ? lastrow : dest;
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+      if (j+1 == j1 && lastrow)
+         memcpy(dest, lastrow, n * z->s->img_x);
+   }
+
+done:
+   STBI_FREE(lastrow);
+   for (k=0; k < decode_n; ++k)
+      STBI_FREE(linebuf[k]);
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -3888,20 +4114,11 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    // resample and color-convert
    {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
+      int k, bands;
+      stbi__convert_job job;
 
       for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+         stbi__resample *r = &job.res_comp[k];
 
          r->hs      = z->img_h_max / z->img_comp[k].h;
          r->vs      = z->img_v_max / z->img_comp[k].v;
@@ -3917,110 +4134,24 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
          else                               r->resample = stbi__resample_row_generic;
       }
 
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
-      }
+      job.output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+      if (!job.output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+
+      // now go ahead and resample, in independent bands of rows
+      job.z = z;
+      job.n = n;
+      job.decode_n = decode_n;
+      job.is_rgb = is_rgb;
+      job.failed = 0;
+      bands = (int) ((z->s->img_y + STBI__CONVERT_BAND_ROWS-1) / STBI__CONVERT_BAND_ROWS);
+      STBI_PARALLEL_FOR(bands, stbi__jpeg_convert_band, &job);
+
       stbi__cleanup_jpeg(z);
+      if (job.failed) { STBI_FREE(job.output); return stbi__errpuc("outofmem", "Out of memory"); }
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
       if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
+      return job.output;
    }
 }
 
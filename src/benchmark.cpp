@@ -0,0 +1,809 @@
+#include "benchmark.h"
+#include "common.h"
+#include "frustum.h"
+#include "grid_mesh.h"
+#include "height_normals.h"
+#include "mesh_optimizer.h"
+#include "mipmap.h"
+#include "obj_mesh.h"
+#include "patch_field.h"
+#include "snow_gpu.h"
+#include "snow_sim.h"
+#include "snow_texture.h"
+#include "texture_storage.h"
+#include "tangent_space.h"
+#include "texture_compress.h"
+#include "texture_loader.h"
+#include "texture_pack.h"
+#include "thread_pool.h"
+#include "vertex_format.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+static const int BENCH_RUNS = 5;
+static const int BENCH_FRAMES = 60;
+
+template <typename Fn>
+static double best_of(int runs, Fn fn)
+{
+    double best = 1e30;
+    for (int i = 0; i < runs; ++i)
+    {
+        BenchClock::time_point start = BenchClock::now();
+        fn();
+        best = std::min(best, bench_ms(start));
+    }
+    return best;
+}
+
+void benchmark_mipmaps()
+{
+    const char *paths[] = { "SnowTextures/diffuse.jpg", "SnowTextures/normal.jpg", "SnowTextures/height.jpg" };
+
+    bool saved = cpu_mipmaps;
+    cpu_mipmaps = false;
+
+    std::cout << "Mipmap benchmark (" << worker_pool().size() + 1 << " threads)" << std::endl;
+    for (int i = 0; i < 3; ++i)
+    {
+        DecodedImage image = decode_image(paths[i]);
+        if (!image.pixels)
+            continue;
+
+        GLenum format = image.channels == 1 ? GL_RED : image.channels == 4 ? GL_RGBA : GL_RGB;
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.pixels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glFinish();
+
+        double driver = best_of(BENCH_RUNS, [] { glGenerateMipmap(GL_TEXTURE_2D); glFinish(); });
+        glDeleteTextures(1, &texture);
+
+        MipOptions options;
+        options.parallel = false;
+        double box_serial = best_of(BENCH_RUNS, [&] { build_mips(image.pixels, image.width, image.height, image.channels, options); });
+        options.parallel = true;
+        double box = best_of(BENCH_RUNS, [&] { build_mips(image.pixels, image.width, image.height, image.channels, options); });
+        options.normal_map = true;
+        double box_normal = best_of(BENCH_RUNS, [&] { build_mips(image.pixels, image.width, image.height, image.channels, options); });
+        options.normal_map = false;
+        options.filter = MIP_KAISER;
+        double kaiser = best_of(BENCH_RUNS, [&] { build_mips(image.pixels, image.width, image.height, image.channels, options); });
+
+        std::cout << "  " << paths[i] << " " << image.width << "x" << image.height << "x" << image.channels
+                  << ": glGenerateMipmap " << driver << " ms, box " << box_serial << " ms serial / "
+                  << box << " ms parallel, box+renormalize " << box_normal << " ms, Kaiser "
+                  << kaiser << " ms" << std::endl;
+        free_image(image);
+    }
+
+    cpu_mipmaps = saved;
+}
+
+void benchmark_compression()
+{
+    // As texture_loader.cpp picks them: diffuse BC1, normal BC5, height BC4
+    const char *paths[] = { "SnowTextures/diffuse.jpg", "SnowTextures/normal.jpg", "SnowTextures/height.jpg" };
+    const BlockFormat formats[] = { BLOCK_BC1, BLOCK_BC5, BLOCK_BC4 };
+    const char *names[] = { "BC1", "BC5", "BC4" };
+
+    std::cout << "Block compression benchmark (" << worker_pool().size() + 1 << " threads)" << std::endl;
+    for (int i = 0; i < 3; ++i)
+    {
+        DecodedImage image = decode_raw_image(paths[i]);
+        if (!image.pixels)
+            continue;
+
+        std::vector<unsigned char> blocks(compressed_size(formats[i], image.width, image.height));
+        double ms = best_of(BENCH_RUNS, [&] {
+            encode_blocks(formats[i], image.pixels, image.width, image.height, image.channels, blocks.data());
+        });
+        double psnr = block_psnr(formats[i], image.pixels, image.width, image.height, image.channels, blocks.data());
+
+        std::cout << "  " << paths[i] << " " << image.width << "x" << image.height << " " << names[i] << ": "
+                  << ms << " ms, " << psnr << " dB PSNR against the reference decoder" << std::endl;
+        free_image(image);
+    }
+}
+
+void benchmark_jpeg_decode()
+{
+    const char *paths[] = { "SnowTextures/diffuse.jpg", "SnowTextures/normal.jpg", "SnowTextures/height.jpg" };
+
+    bool saved = parallel_jpeg;
+    std::cout << "JPEG decode benchmark (" << worker_pool().size() + 1 << " threads)" << std::endl;
+    for (int i = 0; i < 3; ++i)
+    {
+        DecodedImage image = decode_raw_image(paths[i]);
+        if (!image.pixels)
+            continue;
+
+        parallel_jpeg = false;
+        double serial = best_of(BENCH_RUNS, [&] { DecodedImage d = decode_raw_image(paths[i]); free_image(d); });
+        parallel_jpeg = true;
+        double parallel = best_of(BENCH_RUNS, [&] { DecodedImage d = decode_raw_image(paths[i]); free_image(d); });
+
+        std::cout << "  " << paths[i] << " " << image.width << "x" << image.height << "x" << image.channels
+                  << ": " << serial << " ms serial, " << parallel << " ms banded ("
+                  << serial / parallel << "x)" << std::endl;
+        free_image(image);
+    }
+    parallel_jpeg = saved;
+}
+
+void benchmark_tangents()
+{
+    GridMeshData grid = build_grid_mesh(VERTEX_BENCH_RESOLUTION, true);
+    std::vector<uint32_t> triangles = strip_triangles(grid.indices, grid.restart, grid.restart_index);
+    std::vector<float> &vertices = grid.vertices;
+    int count = grid.vertex_count();
+
+    std::cout << "Tangent generation benchmark (" << count << " vertices, " << triangles.size() / 3
+              << " triangles, " << worker_pool().size() + 1 << " threads)" << std::endl;
+
+    TangentGenerator generator(triangles.data(), triangles.size(), count);
+    TangentOptions options;
+    options.simd = false;
+    options.parallel = false;
+    double scalar = best_of(BENCH_RUNS, [&] { generator.generate(vertices.data(), options); });
+    options.simd = true;
+    double simd = best_of(BENCH_RUNS, [&] { generator.generate(vertices.data(), options); });
+    options.parallel = true;
+    double parallel = best_of(BENCH_RUNS, [&] { generator.generate(vertices.data(), options); });
+    double one_off = best_of(BENCH_RUNS, [&] {
+        generate_tangents(vertices.data(), count, triangles.data(), triangles.size());
+    });
+
+    // A snow surface that changes every frame: displace, re-derive normals
+    // from the height, then regenerate the tangents
+    int frame = 0;
+    double deformed = best_of(BENCH_RUNS, [&] {
+        ++frame;
+        for (int i = 0; i < count; ++i)
+        {
+            float *v = &vertices[(size_t) i * VERTEX_FLOATS];
+            float phase = 8.0f * v[0] + 6.0f * v[1] + 0.1f * frame;
+            v[2] = 0.05f * std::sin(phase);
+            float slope = 0.05f * std::cos(phase);
+            float n[3] = { -8.0f * slope, -6.0f * slope, 1.0f };
+            float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + 1.0f);
+            v[3] = n[0] / length, v[4] = n[1] / length, v[5] = 1.0f / length;
+        }
+        generator.generate(vertices.data());
+    });
+
+    std::cout << "  scalar " << scalar << " ms, SSE " << simd << " ms, SSE parallel " << parallel
+              << " ms, with topology setup " << one_off << " ms, deform + regenerate " << deformed
+              << " ms/frame" << std::endl;
+}
+
+double time_frames(int frames, const std::function<void()> &draw)
+{
+    draw();   // warm up: first use of a program or texture can compile/upload lazily
+    glFinish();
+
+    if (GLEW_VERSION_3_3 || GLEW_ARB_timer_query)
+    {
+        GLuint query;
+        glGenQueries(1, &query);
+        GLuint64 total = 0;
+        BenchClock::time_point start = BenchClock::now();
+        for (int i = 0; i < frames; ++i)
+        {
+            glBeginQuery(GL_TIME_ELAPSED, query);
+            draw();
+            glEndQuery(GL_TIME_ELAPSED);
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+            total += ns;
+        }
+        glFinish();
+        double wall = bench_ms(start);
+        glDeleteQueries(1, &query);
+        // Software rasterizers (llvmpipe) run the draws at the flush, outside
+        // the query, and report next to nothing
+        return std::max(total / 1e6, wall) / frames;
+    }
+
+    BenchClock::time_point start = BenchClock::now();
+    for (int i = 0; i < frames; ++i)
+        draw();
+    glFinish();
+    return bench_ms(start) / frames;
+}
+
+void benchmark_packing(const std::function<void(int)> &draw_with)
+{
+    // Worst case for the 10-layer march in fshader5.glsl: 11 height fetches,
+    // then one normal and one diffuse fetch (none for the normal when packed).
+    const int march_fetches = 11;
+    double height_bytes = compress_textures ? 0.5 : 1.0;   // BC4 or R8
+    double normal_bytes = compress_textures ? 1.0 : 4.0;   // BC5 or RGB8 (padded)
+    double packed_bytes = 4.0;                              // RGBA8
+    double diffuse_bytes = compress_textures && GLEW_EXT_texture_compression_s3tc ? 0.5 : 4.0;
+
+    std::cout << "Normal/height packing benchmark (" << BENCH_FRAMES << " frames each)" << std::endl;
+    for (int packing = 0; packing < NUM_PACKINGS; ++packing)
+    {
+        double ms = time_frames(BENCH_FRAMES, [&] { draw_with(packing); });
+
+        int samplers = packing == PACK_SEPARATE ? 3 : 2;
+        int fetches = packing == PACK_SEPARATE ? march_fetches + 2 : march_fetches + 1;
+        double bytes = packing == PACK_SEPARATE
+            ? march_fetches * height_bytes + normal_bytes + diffuse_bytes
+            : march_fetches * packed_bytes + diffuse_bytes;
+
+        std::cout << "  " << packing_name((NormalHeightPacking) packing) << ": " << ms << " ms/frame, "
+                  << samplers << " samplers, <= " << fetches << " fetches and " << bytes
+                  << " texel bytes per fragment" << std::endl;
+    }
+}
+
+void benchmark_vertex_formats(const std::function<void(int)> &draw_with)
+{
+    const double vertices = (VERTEX_BENCH_RESOLUTION + 1.0) * (VERTEX_BENCH_RESOLUTION + 1.0);
+
+    std::cout << "Vertex format benchmark (" << vertices << " vertices, " << BENCH_FRAMES << " frames each)" << std::endl;
+    for (int format = 0; format < NUM_VERTEX_FORMATS; ++format)
+    {
+        double shaded = time_frames(BENCH_FRAMES, [&] { draw_with(format); });
+        glEnable(GL_RASTERIZER_DISCARD);
+        double discarded = time_frames(BENCH_FRAMES, [&] { draw_with(format); });
+        glDisable(GL_RASTERIZER_DISCARD);
+
+        int size = vertex_size((VertexFormat) format);
+        std::cout << "  " << vertex_format_name((VertexFormat) format) << ": " << size << " bytes/vertex ("
+                  << size * vertices / (1024.0 * 1024.0) << " MB), " << shaded << " ms/frame shaded, "
+                  << discarded << " ms/frame vertex only" << std::endl;
+    }
+}
+
+void benchmark_instancing(const std::function<void(int, bool)> &draw_with)
+{
+    const int counts[] = { 64, 256, 1024, 4096, 16384 };
+
+    std::cout << "Instancing benchmark (" << BENCH_FRAMES << " frames each, "
+              << worker_pool().size() + 1 << " threads)" << std::endl;
+
+    // The per-frame matrix pass alone, serial and on the pool
+    {
+        PatchField field(counts[4]);
+        double serial = best_of(BENCH_RUNS, [&] { field.update(1.0f, false); });
+        double parallel = best_of(BENCH_RUNS, [&] { field.update(1.0f, true); });
+        std::cout << "  " << counts[4] << " instance matrices: " << serial << " ms serial, "
+                  << parallel << " ms parallel (including upload)" << std::endl;
+    }
+
+    for (int i = 0; i < 5; ++i)
+    {
+        std::cout << "  " << counts[i] << " patches:";
+        for (int instanced = 0; instanced < 2; ++instanced)
+        {
+            // Wall clock covers the CPU cost of issuing the calls; the GPU
+            // time alone comes from time_frames
+            double wall = best_of(BENCH_RUNS, [&] {
+                for (int frame = 0; frame < BENCH_FRAMES; ++frame)
+                    draw_with(counts[i], instanced != 0);
+                glFinish();
+            }) / BENCH_FRAMES;
+            double gpu = time_frames(BENCH_FRAMES, [&] { draw_with(counts[i], instanced != 0); });
+            if (instanced)
+                std::cout << "; instanced, 1 draw call: ";
+            else
+                std::cout << " " << counts[i] << " draw calls: ";
+            std::cout << wall << " ms/frame (GPU " << gpu << " ms)";
+        }
+        std::cout << std::endl;
+    }
+}
+
+void benchmark_culling()
+{
+    const int count = 100000;
+    glm::mat4 proj = glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 600.0f);
+    glm::mat4 view = glm::lookAt(glm::vec3(0, 2, 0), glm::vec3(0, 1.7f, -1), glm::vec3(0, 1, 0));
+    Frustum frustum = frustum_from_matrix(proj * view);
+
+    // Boxes of 0.5 to 10 units scattered over a 1 km square around the eye
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> position(-500.0f, 500.0f), size(0.5f, 10.0f);
+    BoxList boxes;
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 low(position(random), 0.02f * position(random), position(random));
+        boxes.add(low, low + glm::vec3(size(random), size(random), size(random)));
+    }
+
+    std::cout << "Culling benchmark (" << count << " random boxes)" << std::endl;
+    std::vector<unsigned char> expected(count), results(count);
+    for (int k = CULL_KERNEL_SCALAR; k <= CULL_KERNEL_AVX; ++k)
+    {
+        CullKernel kernel = (CullKernel) k;
+        if (k > best_cull_kernel())
+        {
+            std::cout << "  " << (k == CULL_KERNEL_AVX ? "AVX" : "SSE2") << ": not compiled in" << std::endl;
+            continue;
+        }
+        double ms = best_of(BENCH_RUNS, [&] { classify_boxes(frustum, boxes, results.data(), kernel); });
+        if (k == CULL_KERNEL_SCALAR)
+            expected = results;
+        int outside = (int) std::count(results.begin(), results.end(), (unsigned char) FRUSTUM_OUTSIDE);
+        std::cout << "  " << cull_kernel_name(kernel) << ": " << ms << " ms, " << count - outside << " in view"
+                  << (results == expected ? "" : " (differs from scalar)") << std::endl;
+    }
+
+    // The patch field seen from above its middle, looking along a row
+    PatchField field(16384);
+    proj = glm::perspective(glm::radians(45.0f), 1.0f, 0.5f, 100.0f);
+    view = glm::lookAt(glm::vec3(0, 2, 0), glm::vec3(0, 1, -3), glm::vec3(0, 1, 0));
+    frustum = frustum_from_matrix(proj * view);
+    double all = best_of(BENCH_RUNS, [&] { field.update(1.0f, true); glFinish(); });
+    double culled = best_of(BENCH_RUNS, [&] { field.update(1.0f, true, &frustum); glFinish(); });
+    std::cout << "  " << field.count() << " patches: update and upload " << all << " ms, with culling "
+              << culled << " ms (" << field.cull_ms() << " ms classifying and compacting), "
+              << field.drawn() << " in view" << std::endl;
+}
+
+void benchmark_displacement(const std::function<void(bool, float)> &draw_with)
+{
+    const float edge_pixels[] = { 8.0f, 4.0f, 2.0f, 1.0f };
+    const int modes = GridMesh::tessellation_supported() ? 5 : 1;
+
+    std::cout << "Displacement benchmark (" << BENCH_FRAMES << " frames each)" << std::endl;
+    GLuint query;
+    glGenQueries(1, &query);
+    for (int mode = 0; mode < modes; ++mode)
+    {
+        bool tessellated = mode > 0;
+        float pixels = tessellated ? edge_pixels[mode - 1] : 0.0f;
+        double ms = time_frames(BENCH_FRAMES, [&] { draw_with(tessellated, pixels); });
+
+        // Triangles reaching the rasterizer, after tessellation
+        GLuint triangles = 0;
+        glBeginQuery(GL_PRIMITIVES_GENERATED, query);
+        draw_with(tessellated, pixels);
+        glEndQuery(GL_PRIMITIVES_GENERATED);
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT, &triangles);
+
+        if (tessellated)
+            std::cout << "  tessellation, " << pixels << " px edges: ";
+        else
+            std::cout << "  parallax march: ";
+        std::cout << ms << " ms/frame, " << triangles << " triangles" << std::endl;
+    }
+    glDeleteQueries(1, &query);
+    if (modes == 1)
+        std::cout << "  tessellation needs OpenGL 4.0" << std::endl;
+}
+
+void benchmark_mesh_loading()
+{
+    // A 1M-triangle OBJ written from the surface grid, with positions,
+    // texcoords and normals on every corner
+    const char *path = "benchmark_mesh.obj";
+    GridMeshData grid = build_grid_mesh(707, false);
+    std::vector<uint32_t> triangles = strip_triangles(grid.indices, grid.restart, grid.restart_index);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        return;
+    for (int i = 0; i < grid.vertex_count(); ++i)
+    {
+        const float *v = &grid.vertices[(size_t) i * VERTEX_FLOATS];
+        fprintf(fp, "v %.6f %.6f %.6f\nvt %.6f %.6f\nvn %.6f %.6f %.6f\n", v[0], v[1], v[2], v[6], v[7], v[3], v[4], v[5]);
+    }
+    for (size_t i = 0; i < triangles.size(); i += 3)
+        fprintf(fp, "f %u/%u/%u %u/%u/%u %u/%u/%u\n", triangles[i] + 1, triangles[i] + 1, triangles[i] + 1,
+                triangles[i + 1] + 1, triangles[i + 1] + 1, triangles[i + 1] + 1,
+                triangles[i + 2] + 1, triangles[i + 2] + 1, triangles[i + 2] + 1);
+    long bytes = ftell(fp);
+    fclose(fp);
+    remove(mesh_cache_path(path).c_str());
+
+    std::cout << "Mesh loading benchmark (" << bytes / (1024 * 1024) << " MB OBJ, " << triangles.size() / 3
+              << " triangles, " << worker_pool().size() + 1 << " threads)" << std::endl;
+
+    MeshData mesh;
+    double serial = best_of(BENCH_RUNS, [&] { parse_obj(path, mesh, false); });
+    double parallel = best_of(BENCH_RUNS, [&] { parse_obj(path, mesh, true); });
+    std::cout << "  parse (weld, normals, tangents included): " << serial << " ms serial, "
+              << parallel << " ms parallel, " << mesh.vertex_count() << " vertices after welding" << std::endl;
+
+    MeshLoadOptions options;
+    options.use_cache = false;
+    double cold = best_of(BENCH_RUNS, [&] { ObjMesh obj; obj.load(path, options); glFinish(); });
+
+    write_mesh_cache(path, mesh, options.format);
+    options.use_cache = true;
+    bool cached = false;
+    double warm = best_of(BENCH_RUNS, [&] { ObjMesh obj; obj.load(path, options); glFinish(); cached = obj.loaded_from_cache(); });
+    std::cout << "  load to GL buffers: " << cold << " ms parsing, " << warm << " ms from "
+              << (cached ? "the mapped cache" : "a rejected cache (parsed)") << std::endl;
+
+    remove(mesh_cache_path(path).c_str());
+    remove(path);
+}
+
+void benchmark_mesh_optimizer()
+{
+    const int resolution = 707;
+    const char *names[] = { "blocked strips", "full-width rows", "shuffled triangles" };
+
+    std::cout << "Mesh optimizer benchmark (" << 2 * resolution * resolution << " triangles, "
+              << VERTEX_CACHE_SIZE << "-entry FIFO)" << std::endl;
+    for (int order = 0; order < 3; ++order)
+    {
+        GridMeshData grid = build_grid_mesh(resolution, true, order == 1 ? resolution : GRID_STRIP_WIDTH);
+        std::vector<uint32_t> triangles = strip_triangles(grid.indices, grid.restart, grid.restart_index);
+        if (order == 2)
+        {
+            std::vector<uint32_t> shuffled(triangles.size());
+            std::vector<uint32_t> permutation(triangles.size() / 3);
+            for (size_t i = 0; i < permutation.size(); ++i)
+                permutation[i] = (uint32_t) i;
+            std::shuffle(permutation.begin(), permutation.end(), std::mt19937(1));
+            for (size_t i = 0; i < permutation.size(); ++i)
+                std::copy(&triangles[permutation[i] * 3], &triangles[permutation[i] * 3] + 3, &shuffled[i * 3]);
+            triangles.swap(shuffled);
+        }
+
+        MeshOptimizeStats stats = optimize_mesh(grid.vertices, VERTEX_FLOATS, triangles);
+        std::cout << "  " << names[order] << ": ACMR " << stats.before.acmr << " -> " << stats.after.acmr
+                  << ", ATVR " << stats.before.atvr << " -> " << stats.after.atvr << " in " << stats.ms << " ms"
+                  << std::endl;
+    }
+}
+
+void benchmark_snow()
+{
+    const int counts[] = { 64, 256, 1024 };
+    const int ticks = 120;
+    DecodedImage height = decode_raw_image("SnowTextures/height.jpg");
+    if (!height.pixels)
+        return;
+
+    std::cout << "Snow simulation benchmark (" << height.width << "x" << height.height << ", " << ticks
+              << " ticks at 60 Hz, " << worker_pool().size() + 1 << " threads)" << std::endl;
+    for (int i = 0; i < 3; ++i)
+    {
+        std::cout << "  " << counts[i] << " walkers:";
+        for (int parallel = 0; parallel < 2; ++parallel)
+        {
+            SnowField field(height.pixels, height.width, height.height, height.channels);
+            std::vector<SnowWalker> walkers = scatter_walkers(counts[i]);
+            double worst = 0.0, visited = 0.0;
+            BenchClock::time_point start = BenchClock::now();
+            for (int tick = 0; tick < ticks; ++tick)
+            {
+                walk_and_stamp(walkers, tick / 60.0f, 1.0f / 60.0f, field);
+                field.tick(1.0f / 60.0f, parallel != 0);
+                worst = std::max(worst, field.last_tick().ms);
+                visited += field.last_tick().active_tiles;
+            }
+            double mean = bench_ms(start) / ticks;
+            std::cout << (parallel ? "; parallel " : " serial ") << mean << " ms/tick (worst " << worst << ", "
+                      << visited / ticks << " of " << field.tiles_x() * field.tiles_y() << " tiles)";
+        }
+        std::cout << std::endl;
+    }
+    free_image(height);
+}
+
+// A frame of gameplay stamps: a tenth repeat an earlier one, shallower
+static void snow_frame_commands(std::mt19937 &rng, int count, SnowCommandBuffer &commands)
+{
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<SnowBrush> pressed;
+    for (int i = 0; i < count; ++i)
+    {
+        float kind = unit(rng);
+        SnowBrush brush;
+        if (i >= count / 10 && kind < 0.1f)
+        {
+            brush = pressed[(size_t) (unit(rng) * (pressed.size() - 1))];
+            brush.depth *= 0.5f;
+        }
+        else if (kind < 0.7f)
+        {
+            SnowBrush footprint = { unit(rng), unit(rng), 0.006f, 0.004f, unit(rng) * 6.2831853f, 0.3f, 0.5f,
+                                    SNOW_BRUSH_DISC };
+            brush = footprint;
+        }
+        else
+        {
+            SnowBrush track = { unit(rng), unit(rng), 0.01f, 0.002f, unit(rng) * 6.2831853f, 0.25f, 0.3f,
+                                SNOW_BRUSH_BOX };
+            brush = track;
+        }
+        if (kind > 0.95f)
+        {
+            brush.depth = 0.05f;
+            commands.fill(brush);
+        }
+        else
+            pressed.push_back(brush);
+    }
+    commands.press(pressed.data(), pressed.size());
+}
+
+void benchmark_snow_commands()
+{
+    const int count = 10000, frames = 30;
+    DecodedImage height = decode_raw_image("SnowTextures/height.jpg");
+    if (!height.pixels)
+        return;
+
+    std::cout << "Snow command benchmark (" << count << " stamps per frame, " << frames << " frames, "
+              << worker_pool().size() + 1 << " threads)" << std::endl;
+    const char *names[] = { "scalar", "SSE", "SSE parallel" };
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        SnowParams params;
+        params.simd = mode > 0;
+        SnowField field(height.pixels, height.width, height.height, height.channels, params);
+        std::mt19937 rng(1);
+        double compress = 0.0, total = 0.0;
+        int merged = 0;
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            snow_frame_commands(rng, count, field.commands());
+            field.tick(1.0f / 60.0f, mode == 2);
+            compress += field.last_tick().compress_ms;
+            total += field.last_tick().ms;
+            merged += field.last_tick().merged;
+        }
+        std::cout << "  " << names[mode] << ": " << compress / frames << " ms to merge, bin and rasterize ("
+                  << count * frames / compress << " stamps/ms), " << total / frames << " ms/tick; "
+                  << merged / frames << " merged per frame" << std::endl;
+    }
+    free_image(height);
+}
+
+void benchmark_snow_upload()
+{
+    const int counts[] = { 16, 64, 256 };
+    const int ticks = 120;
+    DecodedImage height = decode_raw_image("SnowTextures/height.jpg");
+    if (!height.pixels)
+        return;
+
+    std::cout << "Snow texture upload benchmark (" << height.width << "x" << height.height << ", " << ticks
+              << " ticks at 60 Hz)" << std::endl;
+    for (int i = 0; i < 3; ++i)
+    {
+        std::cout << "  " << counts[i] << " walkers:";
+        for (int incremental = 0; incremental < 2; ++incremental)
+        {
+            SnowField field(height.pixels, height.width, height.height, height.channels);
+            SnowTexture texture(field, false);
+            std::vector<SnowWalker> walkers = scatter_walkers(counts[i]);
+            size_t bytes = 0;
+            double ms = 0.0;
+            for (int tick = 0; tick < ticks; ++tick)
+            {
+                walk_and_stamp(walkers, tick / 60.0f, 1.0f / 60.0f, field);
+                field.tick(1.0f / 60.0f);
+                BenchClock::time_point start = BenchClock::now();
+                texture.update(field, incremental != 0);
+                glFinish();
+                ms += bench_ms(start);
+                bytes += texture.frame_bytes;
+            }
+            std::cout << (incremental ? "; dirty rectangles " : " full ") << bytes / (1024.0 * ticks) << " KB, "
+                      << ms / ticks << " ms/frame";
+        }
+        std::cout << std::endl;
+    }
+    free_image(height);
+}
+
+void benchmark_snow_gpu()
+{
+    const int counts[] = { 64, 256, 1024 };
+    const int ticks = 120;
+    if (!GpuSnowField::supported())
+    {
+        std::cout << "GPU snow benchmark: needs OpenGL 3.3" << std::endl;
+        return;
+    }
+    DecodedImage height = decode_raw_image("SnowTextures/height.jpg");
+    if (!height.pixels)
+        return;
+
+    std::cout << "GPU snow benchmark (" << height.width << "x" << height.height << ", " << ticks
+              << " ticks at 60 Hz, " << glGetString(GL_RENDERER) << ")" << std::endl;
+    for (int i = 0; i < 3; ++i)
+    {
+        SnowField cpu(height.pixels, height.width, height.height, height.channels);
+        GpuSnowField gpu(height.pixels, height.width, height.height, height.channels, 2);
+        std::vector<SnowWalker> walkers = scatter_walkers(counts[i]);
+        std::vector<SnowStamp> stamps;
+        double cpu_ms = 0.0, gpu_ms = 0.0;
+        for (int tick = 0; tick < ticks; ++tick)
+        {
+            step_walkers(walkers, tick / 60.0f, 1.0f / 60.0f, stamps);
+            BenchClock::time_point start = BenchClock::now();
+            cpu.stamp(stamps.data(), stamps.size());
+            cpu.tick(1.0f / 60.0f);
+            cpu_ms += bench_ms(start);
+
+            start = BenchClock::now();
+            gpu.stamp(stamps.data(), stamps.size());
+            gpu.tick(1.0f / 60.0f);
+            glFinish();
+            gpu_ms += bench_ms(start);
+        }
+
+        std::vector<unsigned char> expected((size_t) cpu.width() * cpu.height()), actual;
+        cpu.depth_texels(0, 0, cpu.width(), cpu.height(), expected.data(), cpu.width());
+        gpu.read_depth(actual);
+        int worst = 0;
+        for (size_t t = 0; t < expected.size(); ++t)
+            worst = std::max(worst, std::abs(expected[t] - actual[t]));
+        std::cout << "  " << counts[i] << " walkers: GPU " << gpu_ms / ticks << " ms/tick, CPU "
+                  << cpu_ms / ticks << " ms/tick; depths at most " << worst << "/255 apart" << std::endl;
+    }
+    free_image(height);
+}
+
+// Largest difference of any channel of two normal images, in steps of the
+// packing
+static int normal_difference(const std::vector<unsigned char> &a, const std::vector<unsigned char> &b,
+                             NormalPacking packing)
+{
+    int worst = 0;
+    if (packing == NORMALS_RG8)
+    {
+        for (size_t i = 0; i < a.size(); ++i)
+            worst = std::max(worst, std::abs(a[i] - b[i]));
+        return worst;
+    }
+    const unsigned int *x = (const unsigned int *) a.data(), *y = (const unsigned int *) b.data();
+    for (size_t i = 0; i < a.size() / 4; ++i)
+        for (int c = 0; c < 3; ++c)
+            worst = std::max(worst, std::abs((int) ((x[i] >> (10 * c)) & 1023u) - (int) ((y[i] >> (10 * c)) & 1023u)));
+    return worst;
+}
+
+void benchmark_snow_normals()
+{
+    const int repeats = 20;
+    DecodedImage height = decode_raw_image("SnowTextures/height.jpg");
+    if (!height.pixels)
+        return;
+    SnowField field(height.pixels, height.width, height.height, height.channels);
+    free_image(height);
+    const int width = field.width(), rows = field.height();
+    const float slope_scale = 0.1f * width;
+
+    // A trodden field, and the tiles one more tick dirties
+    std::vector<SnowWalker> walkers = scatter_walkers(64);
+    std::vector<SnowStamp> stamps;
+    std::vector<DirtyRect> dirty;
+    for (int tick = 0; tick <= 60; ++tick)
+    {
+        field.take_dirty_rects(dirty);
+        step_walkers(walkers, tick / 60.0f, 1.0f / 60.0f, stamps);
+        field.stamp(stamps.data(), stamps.size());
+        field.tick(1.0f / 60.0f);
+    }
+    field.take_dirty_rects(dirty, false);
+    size_t dirty_texels = 0;
+    for (size_t r = 0; r < dirty.size(); ++r)
+        dirty_texels += dirty[r].area();
+
+    // The depth as the GPU field holds it
+    std::vector<float> depth((size_t) width * rows);
+    for (size_t i = 0; i < depth.size(); ++i)
+        depth[i] = field.rest_depth()[i] + field.pressed_depth()[i];
+
+    GLint active, borrowed;
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+    glActiveTexture(GL_TEXTURE3);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &borrowed);
+    GLuint depth_texture;
+    glGenTextures(1, &depth_texture);
+    glBindTexture(GL_TEXTURE_2D, depth_texture);
+    allocate_texture_2d(1, GL_R32F, width, rows);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, rows, GL_RED, GL_FLOAT, depth.data());
+    NormalShader shader(3);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean blending = glIsEnabled(GL_BLEND), culling = glIsEnabled(GL_CULL_FACE),
+              depth_test = glIsEnabled(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+
+    std::cout << "Snow normals benchmark (" << width << "x" << rows << " after 60 ticks of 64 walkers; "
+              << dirty.size() << " dirty rectangles, " << 100.0 * dirty_texels / depth.size() << "% of the field; "
+              << glGetString(GL_RENDERER) << ")" << std::endl;
+    for (int p = 0; p < 2; ++p)
+    {
+        NormalPacking packing = (NormalPacking) p;
+        const int bytes = normal_texel_bytes(packing);
+        const size_t row_bytes = (size_t) width * bytes;
+        std::vector<unsigned char> expected(row_bytes * rows), actual(row_bytes * rows);
+        std::cout << "  " << (packing == NORMALS_RG8 ? "RG8" : "RGB10_A2") << ":" << std::endl;
+
+        for (int k = NORMAL_KERNEL_SCALAR; k <= NORMAL_KERNEL_AVX; ++k)
+        {
+            NormalKernel kernel = (NormalKernel) k;
+            if (k > best_normal_kernel())
+            {
+                std::cout << "    " << (k == NORMAL_KERNEL_AVX ? "AVX" : "SSE2") << ": not compiled in" << std::endl;
+                continue;
+            }
+            BenchClock::time_point start = BenchClock::now();
+            for (int r = 0; r < repeats; ++r)
+                height_normals(field.rest_depth(), field.pressed_depth(), width, rows, 0, 0, width, rows,
+                               slope_scale, packing, actual.data(), row_bytes, kernel);
+            double full_ms = bench_ms(start) / repeats;
+            if (k == NORMAL_KERNEL_SCALAR)
+                expected = actual;
+
+            // The dirty rectangles grown by the filter's reach
+            start = BenchClock::now();
+            for (int r = 0; r < repeats; ++r)
+                for (size_t d = 0; d < dirty.size(); ++d)
+                {
+                    int x0 = std::max(dirty[d].x - 1, 0), y0 = std::max(dirty[d].y - 1, 0);
+                    int x1 = std::min(dirty[d].x + dirty[d].width + 1, width);
+                    int y1 = std::min(dirty[d].y + dirty[d].height + 1, rows);
+                    height_normals(field.rest_depth(), field.pressed_depth(), width, rows, x0, y0, x1, y1,
+                                   slope_scale, packing, &actual[(size_t) y0 * row_bytes + (size_t) x0 * bytes],
+                                   row_bytes, kernel);
+                }
+            double dirty_ms = bench_ms(start) / repeats;
+            std::cout << "    " << normal_kernel_name(kernel) << ": whole field " << full_ms << " ms, dirty tiles "
+                      << dirty_ms << " ms" << (actual == expected ? "" : " (differs from scalar)") << std::endl;
+        }
+
+        // The same filter in fshader5_normals.glsl
+        GLuint normal_texture, framebuffer;
+        glGenTextures(1, &normal_texture);
+        glBindTexture(GL_TEXTURE_2D, normal_texture);
+        allocate_texture_2d(1, normal_internal_format(packing), width, rows);
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, normal_texture, 0);
+        glViewport(0, 0, width, rows);
+        shader.draw(depth_texture, framebuffer, slope_scale);
+        glFinish();
+        BenchClock::time_point start = BenchClock::now();
+        for (int r = 0; r < repeats; ++r)
+            shader.draw(depth_texture, framebuffer, slope_scale);
+        glFinish();
+        double gpu_ms = bench_ms(start) / repeats;
+
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, rows, normal_format(packing), normal_type(packing), actual.data());
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteTextures(1, &normal_texture);
+        std::cout << "    fragment shader: whole field " << gpu_ms << " ms; at most "
+                  << normal_difference(expected, actual, packing) << " steps from the CPU's" << std::endl;
+    }
+
+    glDeleteTextures(1, &depth_texture);
+    glBindTexture(GL_TEXTURE_2D, borrowed);
+    glActiveTexture(active);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (blending)
+        glEnable(GL_BLEND);
+    if (culling)
+        glEnable(GL_CULL_FACE);
+    if (depth_test)
+        glEnable(GL_DEPTH_TEST);
+}
@@ -0,0 +1,105 @@
+// On-demand benchmarks, started from the keyboard. Results are printed to
+// stdout; every timing is the best of several runs.
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <chrono>
+#include <functional>
+
+typedef std::chrono::steady_clock BenchClock;
+
+inline double bench_ms(BenchClock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(BenchClock::now() - since).count();
+}
+
+// CPU mip generation (box serial/parallel, Kaiser, normal-map renormalize)
+// against glGenerateMipmap, for the snow texture set.
+void benchmark_mipmaps();
+
+// CPU block compression (texture_compress.h) of level 0 of the snow texture
+// set in the format the loader gives it, with the PSNR of the round trip
+// through the reference decoder.
+void benchmark_compression();
+
+// stb_image decode of the snow texture set with the JPEG IDCT and colour
+// conversion run serially and split across the worker pool.
+void benchmark_jpeg_decode();
+
+// Tangent generation (tangent_space.h) for a 1M-vertex grid: scalar, SSE,
+// SSE on the worker pool, and regenerating a deforming grid with a reused
+// TangentGenerator.
+void benchmark_tangents();
+
+// Render frames with draw() and return the mean time per frame in ms: the
+// larger of the GL_TIME_ELAPSED queries' total, when available, and the wall
+// clock up to a final glFinish.
+double time_frames(int frames, const std::function<void()> &draw);
+
+// Frame time and texture traffic per fragment for every NormalHeightPacking
+// mode (texture_pack.h); draw_with(packing) renders one frame in that mode.
+void benchmark_packing(const std::function<void(int)> &draw_with);
+
+// Grid resolution of the vertex format benchmark: 1000 x 1000 vertices.
+const int VERTEX_BENCH_RESOLUTION = 999;
+
+// Frame time of every VertexFormat (vertex_format.h) for a 1M-vertex grid,
+// shaded and with the rasterizer discarded (vertex work alone);
+// draw_with(format) renders one frame of that grid in that format.
+void benchmark_vertex_formats(const std::function<void(int)> &draw_with);
+
+// Frame time against draw calls for fields of up to 16k patches
+// (patch_field.h) drawn with a draw call per patch and with one instanced
+// call, plus the cost of the parallel instance matrix pass;
+// draw_with(count, instanced) renders one frame of count patches.
+void benchmark_instancing(const std::function<void(int, bool)> &draw_with);
+
+// Frustum culling (frustum.h): 100k random boxes around a perspective view
+// classified by the scalar, SSE2 and AVX kernels, checked against each
+// other, and the patch field's per-frame cull and compaction of 16k patches.
+void benchmark_culling();
+
+// Frame time and generated triangles of the surface shaded with the parallax
+// march and with true displacement by tessellation (teshader5.glsl) at
+// several target edge lengths; draw_with(tessellated, edge_pixels) renders
+// one frame from the same viewpoint in that mode.
+void benchmark_displacement(const std::function<void(bool, float)> &draw_with);
+
+// OBJ import (obj_mesh.h) of a generated 1M-triangle file: parsing serially
+// and in parallel chunks, and loading into GL buffers by parsing against
+// mapping the binary cache.
+void benchmark_mesh_loading();
+
+// Vertex cache optimization (mesh_optimizer.h) of a 1M-triangle grid
+// ordered as the blocked strips, as full-width rows and shuffled: ACMR and
+// ATVR before and after, and the time taken.
+void benchmark_mesh_optimizer();
+
+// Snow simulation (snow_sim.h) ticks on the height map with 64 to 1024
+// walkers stamping every tick, serially and across the worker pool.
+void benchmark_snow();
+
+// Keeping a texture of the snow depth current with 16 to 256 walkers: the
+// whole of level 0 plus glGenerateMipmap against the dirty rectangles of
+// every level (snow_texture.h); bytes per frame and ms including glFinish.
+// Uses the active texture unit.
+void benchmark_snow_upload();
+
+// 10,000 stamps per frame through the snow command buffer
+// (snow_commands.h): footprints, rotated tracks, fills and repeats, merged,
+// binned and rasterized scalar, with SSE, and with SSE across the pool.
+void benchmark_snow_commands();
+
+// The snow simulation on the GPU (snow_gpu.h) against SnowField with 64 to
+// 1024 walkers: ms per tick including glFinish, and how far the two depths
+// end up apart. Borrows texture units 2 and 3.
+void benchmark_snow_gpu();
+
+// Normals from the snow trodden by 64 walkers (height_normals.h), RG8 and
+// RGB10_A2: the whole field and only the dirty tiles, scalar, SSE2 and AVX,
+// and fshader5_normals.glsl on the same depth, read back and compared with
+// the CPU's. Borrows texture unit 3.
+void benchmark_snow_normals();
+
+#endif // BENCHMARK_H
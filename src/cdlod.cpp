@@ -0,0 +1,281 @@
+#include "cdlod.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+CdlodTerrain::CdlodTerrain(const unsigned char *depth, int width, int height, int channels,
+                           const CdlodSettings &settings)
+    : settings(settings), map_width(width), map_height(height),
+      full_mesh(settings.patch_resolution, VERTEX_PACKED), half_mesh(settings.patch_resolution / 2, VERTEX_PACKED),
+      instance_buffer(0), instanced(GLEW_VERSION_3_3 != 0), full_count(0), frustum(NULL)
+{
+    this->settings.levels = std::max(1, std::min(settings.levels, CDLOD_MAX_LEVELS));
+    for (int level = 0; level < this->settings.levels; ++level)
+    {
+        ranges[level] = settings.lod0_range * (float) (1 << level);
+        float previous = level > 0 ? ranges[level - 1] : 0.0f;
+        morph[level][1] = ranges[level];
+        morph[level][0] = ranges[level] - (ranges[level] - previous) * settings.morph_ratio;
+    }
+
+    depth_map.resize((size_t) width * height);
+    for (size_t i = 0; i < depth_map.size(); ++i)
+        depth_map[i] = depth[i * channels];
+
+    // Min/max pyramid; a cell of level L covers 2^L x 2^L texels
+    MinMaxLevel base = { width, height, depth_map, depth_map };
+    pyramid.push_back(base);
+    while (pyramid.back().width > 1 || pyramid.back().height > 1)
+    {
+        const MinMaxLevel &src = pyramid.back();
+        MinMaxLevel dst;
+        dst.width = (src.width + 1) / 2;
+        dst.height = (src.height + 1) / 2;
+        dst.low.assign((size_t) dst.width * dst.height, 255);
+        dst.high.assign((size_t) dst.width * dst.height, 0);
+        for (int y = 0; y < src.height; ++y)
+            for (int x = 0; x < src.width; ++x)
+            {
+                size_t from = (size_t) y * src.width + x, to = (size_t) (y / 2) * dst.width + x / 2;
+                dst.low[to] = std::min(dst.low[to], src.low[from]);
+                dst.high[to] = std::max(dst.high[to], src.high[from]);
+            }
+        pyramid.push_back(dst);
+    }
+
+    glGenBuffers(1, &instance_buffer);
+    if (instanced)
+    {
+        const GridMesh *meshes[2] = { &full_mesh, &half_mesh };
+        for (int i = 0; i < 2; ++i)
+        {
+            glBindVertexArray(meshes[i]->vertex_array());
+            glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+            glEnableVertexAttribArray(6);
+            glVertexAttribDivisor(6, 1);
+        }
+        glBindVertexArray(0);
+    }
+}
+
+CdlodTerrain::~CdlodTerrain()
+{
+    glDeleteBuffers(1, &instance_buffer);
+}
+
+// Depth range of the map under a node, conservatively: whole pyramid cells,
+// plus a texel on every side for bilinear filtering
+void CdlodTerrain::height_range(float x, float z, float size, float &low, float &high) const
+{
+    float texels_per_unit = map_width / settings.texture_tile;
+    float extent = size * texels_per_unit + 2.0f;
+    int level = 0;
+    while (level + 1 < (int) pyramid.size() && (float) (1 << level) < extent)
+        ++level;
+
+    const MinMaxLevel &cells = pyramid[level];
+    int cell = 1 << level;
+    int x0 = (int) std::floor(x * texels_per_unit - 1.0f), z0 = (int) std::floor(z * texels_per_unit - 1.0f);
+    int cx0 = (int) std::floor((float) x0 / cell), cz0 = (int) std::floor((float) z0 / cell);
+    int cx1 = (int) std::floor((x0 + extent) / cell), cz1 = (int) std::floor((z0 + extent) / cell);
+
+    unsigned char lo = 255, hi = 0;
+    for (int cz = cz0; cz <= std::min(cz1, cz0 + cells.height - 1); ++cz)
+        for (int cx = cx0; cx <= std::min(cx1, cx0 + cells.width - 1); ++cx)
+        {
+            int wx = ((cx % cells.width) + cells.width) % cells.width;
+            int wz = ((cz % cells.height) + cells.height) % cells.height;
+            size_t at = (size_t) wz * cells.width + wx;
+            lo = std::min(lo, cells.low[at]);
+            hi = std::max(hi, cells.high[at]);
+        }
+
+    low = (1.0f - hi / 255.0f) * settings.height_scale;
+    high = (1.0f - lo / 255.0f) * settings.height_scale;
+}
+
+CdlodTerrain::Node CdlodTerrain::make_node(float x, float z, float size, int level) const
+{
+    Node node = { x, z, size, 0.0f, 0.0f, level };
+    height_range(x, z, size, node.low, node.high);
+    return node;
+}
+
+// Does the node's bounding box reach into the sphere of level's range?
+bool CdlodTerrain::in_range(const Node &node, int level, const glm::vec3 &camera) const
+{
+    float dx = std::max(std::max(node.x - camera.x, camera.x - (node.x + node.size)), 0.0f);
+    float dy = std::max(std::max(node.low - camera.y, camera.y - node.high), 0.0f);
+    float dz = std::max(std::max(node.z - camera.z, camera.z - (node.z + node.size)), 0.0f);
+    return dx * dx + dy * dy + dz * dz <= ranges[level] * ranges[level];
+}
+
+// False when the node is entirely beyond its level's range, leaving it to
+// the parent; a child outside the frustum counts as handled. inside: the
+// node is known to be entirely inside the frustum
+bool CdlodTerrain::select_node(const Node &node, const glm::vec3 &camera, bool inside)
+{
+    ++cull.nodes_visited;
+    if (!in_range(node, node.level, camera))
+        return false;
+
+    TerrainPatch patch = { node.x, node.z, node.size, (float) node.level };
+    if (node.level == 0 || !in_range(node, node.level - 1, camera))
+    {
+        selected.push_back(patch);
+        return true;
+    }
+
+    float half = node.size * 0.5f;
+    Node child[4];
+    unsigned char visibility[4] = { FRUSTUM_INSIDE, FRUSTUM_INSIDE, FRUSTUM_INSIDE, FRUSTUM_INSIDE };
+    for (int i = 0; i < 4; ++i)
+        child[i] = make_node(node.x + half * (i & 1), node.z + half * (i >> 1), half, node.level - 1);
+    if (frustum && !inside)
+    {
+        children.clear();
+        for (int i = 0; i < 4; ++i)
+            children.add(glm::vec3(child[i].x, child[i].low, child[i].z),
+                         glm::vec3(child[i].x + half, child[i].high, child[i].z + half));
+        classify_boxes(*frustum, children, visibility);
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        if (visibility[i] == FRUSTUM_OUTSIDE)
+        {
+            ++cull.nodes_visited;
+            ++cull.nodes_culled;
+            continue;
+        }
+        if (!select_node(child[i], camera, visibility[i] == FRUSTUM_INSIDE))
+        {
+            TerrainPatch quadrant = { child[i].x, child[i].z, half, (float) node.level };
+            quadrants.push_back(quadrant);
+        }
+    }
+    return true;
+}
+
+void CdlodTerrain::select(const glm::vec3 &camera, const Frustum *frustum)
+{
+    selected.clear();
+    quadrants.clear();
+    cull = CullStats();
+    this->frustum = frustum;
+
+    float size = settings.world_size, corner = -0.5f * size;
+    Node root = make_node(corner, corner, size, settings.levels - 1);
+    FrustumResult visibility = FRUSTUM_INSIDE;
+    if (frustum)
+        visibility = classify_box(*frustum, glm::vec3(root.x, root.low, root.z),
+                                  glm::vec3(root.x + size, root.high, root.z + size));
+
+    if (visibility == FRUSTUM_OUTSIDE)
+    {
+        ++cull.nodes_visited;
+        ++cull.nodes_culled;
+    }
+    else if (!select_node(root, camera, visibility == FRUSTUM_INSIDE))
+    {
+        TerrainPatch patch = { root.x, root.z, size, (float) root.level };
+        selected.push_back(patch);
+    }
+
+    full_count = (int) selected.size();
+    selected.insert(selected.end(), quadrants.begin(), quadrants.end());
+    cull.chunks_drawn = (int) selected.size();
+    this->frustum = NULL;
+}
+
+void CdlodTerrain::draw_patches(GLuint program, const GridMesh &mesh, int first, int count, int resolution)
+{
+    if (count == 0)
+        return;
+    glUniform1f(glGetUniformLocation(program, "patchResolution"), (float) resolution);
+
+    if (instanced)
+    {
+        glBindVertexArray(mesh.vertex_array());
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(TerrainPatch),
+                              BUFFER_OFFSET(first * sizeof(TerrainPatch)));
+        mesh.draw(count);
+        return;
+    }
+
+    // No instanced arrays: the patch is a constant attribute per draw
+    for (int i = first; i < first + count; ++i)
+    {
+        const TerrainPatch &patch = selected[i];
+        glVertexAttrib4f(6, patch.x, patch.z, patch.size, patch.level);
+        mesh.draw();
+    }
+}
+
+void CdlodTerrain::set_uniforms(GLuint program) const
+{
+    glUniform2fv(glGetUniformLocation(program, "terrainMorph"), settings.levels, &morph[0][0]);
+    glUniform1f(glGetUniformLocation(program, "terrainHeightScale"), settings.height_scale);
+    glUniform1f(glGetUniformLocation(program, "terrainTile"), settings.texture_tile);
+}
+
+void CdlodTerrain::draw(GLuint program)
+{
+    glUniform1i(glGetUniformLocation(program, "terrain"), 1);
+    set_uniforms(program);
+
+    if (instanced)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        glBufferData(GL_ARRAY_BUFFER, selected.size() * sizeof(TerrainPatch), NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, selected.size() * sizeof(TerrainPatch), selected.data());
+    }
+
+    draw_patches(program, full_mesh, 0, full_count, full_mesh.resolution());
+    draw_patches(program, half_mesh, full_count, (int) selected.size() - full_count, half_mesh.resolution());
+    glBindVertexArray(0);
+
+    glUniform1i(glGetUniformLocation(program, "terrain"), 0);
+}
+
+float CdlodTerrain::height_at(float x, float z) const
+{
+    float tx = x / settings.texture_tile * map_width - 0.5f;
+    float tz = z / settings.texture_tile * map_height - 0.5f;
+    int x0 = (int) std::floor(tx), z0 = (int) std::floor(tz);
+    float fx = tx - x0, fz = tz - z0;
+
+    float depth[2][2];
+    for (int j = 0; j < 2; ++j)
+        for (int i = 0; i < 2; ++i)
+        {
+            int wx = (((x0 + i) % map_width) + map_width) % map_width;
+            int wz = (((z0 + j) % map_height) + map_height) % map_height;
+            depth[j][i] = depth_map[(size_t) wz * map_width + wx] / 255.0f;
+        }
+    float d = (depth[0][0] * (1 - fx) + depth[0][1] * fx) * (1 - fz) + (depth[1][0] * (1 - fx) + depth[1][1] * fx) * fz;
+    return (1.0f - d) * settings.height_scale;
+}
+
+int CdlodTerrain::triangles() const
+{
+    return full_count * full_mesh.triangles() + ((int) selected.size() - full_count) * half_mesh.triangles();
+}
+
+void CdlodTerrain::print_stats() const
+{
+    int per_level[CDLOD_MAX_LEVELS] = { 0 };
+    for (size_t i = 0; i < selected.size(); ++i)
+        ++per_level[(int) selected[i].level];
+
+    std::cout << "Terrain: " << full_count << " patches + " << selected.size() - full_count
+              << " quadrants, " << triangles() << " triangles (" << (instanced ? "instanced" : "one draw per patch")
+              << "); per level:";
+    for (int level = 0; level < settings.levels; ++level)
+        std::cout << " " << per_level[level];
+    std::cout << std::endl;
+    std::cout << "Terrain culling: " << cull.nodes_visited << " nodes visited, " << cull.nodes_culled
+              << " culled, " << cull.chunks_drawn << " chunks drawn" << std::endl;
+}
@@ -0,0 +1,136 @@
+// CDLOD terrain (Strugar, "Continuous Distance-Dependent Level of Detail for
+// Rendering Heightmaps") for a snowfield built from the surface's height map.
+//
+// The terrain is a square quadtree in the XZ plane. Every frame, nodes are
+// selected by distance from the camera: level l covers the sphere of radius
+// lod0_range * 2^l around it, so the mesh density falls off with distance and
+// the number of patches (and triangles) stays roughly constant however large
+// the terrain is. Every selected node is drawn with the same shared grid
+// (grid_mesh.h), instanced once per node; a node that is only partly in
+// range of the finer level draws its remaining quadrants with a half
+// resolution grid, so their vertex spacing still matches the node's level.
+//
+// vshader5.glsl places each vertex, samples its height from depthMap and,
+// over the last morph_ratio of each level's range, slides the odd vertices
+// onto the coarser level's grid, so levels meet without cracks or popping.
+//
+// Heights repeat every texture_tile world units, like the surface textures;
+// node bounds come from a min/max pyramid of the same height map. Given a
+// frustum, selection also culls: the four children of a node are classified
+// together in one SIMD batch (frustum.h), and the subtree under a node that
+// is entirely inside skips the tests.
+
+#ifndef CDLOD_H
+#define CDLOD_H
+
+#include "common.h"
+#include "frustum.h"
+#include "grid_mesh.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+const int CDLOD_MAX_LEVELS = 8;    // terrainMorph[] in terrain5.glsl
+
+// Per-instance attribute 6 of the patch grids.
+struct TerrainPatch
+{
+    float x, z;      // corner with the smallest coordinates
+    float size;
+    float level;
+};
+
+struct CdlodSettings
+{
+    float world_size;       // side of the terrain, centred on the origin
+    int levels;             // leaf nodes are world_size / 2^(levels - 1) wide
+    int patch_resolution;   // quads per side of the shared grid; even
+    float height_scale;     // world height of a full-range height texel
+    float texture_tile;     // world units per repeat of the height map
+    float lod0_range;       // radius covered by level 0; doubles per level
+    float morph_ratio;      // morph over this last fraction of each range
+
+    CdlodSettings()
+        : world_size(512.0f), levels(7), patch_resolution(32), height_scale(0.6f),
+          texture_tile(4.0f), lod0_range(24.0f), morph_ratio(0.3f) {}
+};
+
+class CdlodTerrain
+{
+public:
+    // depth: the depthMap image (height = 1 - depth), channel 0 is used.
+    CdlodTerrain(const unsigned char *depth, int width, int height, int channels,
+                 const CdlodSettings &settings = CdlodSettings());
+    ~CdlodTerrain();
+
+    // Choose the patches to draw from camera, dropping those outside
+    // frustum when there is one.
+    void select(const glm::vec3 &camera, const Frustum *frustum = NULL);
+
+    // Draw the selected patches with program, which must be in use and be
+    // built from vshader5.glsl; depthMap must be bound.
+    void draw(GLuint program);
+
+    // The terrain uniforms every level shares (morph ranges, height scale,
+    // tiling), for program in use.
+    void set_uniforms(GLuint program) const;
+
+    // Terrain height at world xz, as the vertex shader computes it.
+    float height_at(float x, float z) const;
+
+    // Whole nodes first, drawn with a patch_resolution() grid, then the
+    // quadrants, drawn with a grid of half that.
+    const std::vector<TerrainPatch> &patches() const { return selected; }
+    int whole_patches() const { return full_count; }
+    int patch_resolution() const { return full_mesh.resolution(); }
+    int triangles() const;
+    const CullStats &cull_stats() const { return cull; }
+    void print_stats() const;
+
+private:
+    CdlodTerrain(const CdlodTerrain &);
+    CdlodTerrain &operator=(const CdlodTerrain &);
+
+    // A quadtree node and its height bounds
+    struct Node
+    {
+        float x, z, size;
+        float low, high;
+        int level;
+    };
+
+    Node make_node(float x, float z, float size, int level) const;
+    bool select_node(const Node &node, const glm::vec3 &camera, bool inside);
+    void height_range(float x, float z, float size, float &low, float &high) const;
+    bool in_range(const Node &node, int level, const glm::vec3 &camera) const;
+    void draw_patches(GLuint program, const GridMesh &mesh, int first, int count, int resolution);
+
+    CdlodSettings settings;
+    float ranges[CDLOD_MAX_LEVELS];
+    float morph[CDLOD_MAX_LEVELS][2];
+
+    // Height map, and its min/max pyramid (level 0 is the map itself)
+    int map_width, map_height;
+    std::vector<unsigned char> depth_map;
+    struct MinMaxLevel
+    {
+        int width, height;
+        std::vector<unsigned char> low, high;   // depth
+    };
+    std::vector<MinMaxLevel> pyramid;
+
+    GridMesh full_mesh, half_mesh;
+    GLuint instance_buffer;
+    bool instanced;
+
+    // Whole nodes, then quadrants drawn with half_mesh
+    std::vector<TerrainPatch> selected, quadrants;
+    int full_count;
+
+    const Frustum *frustum;     // during select()
+    BoxList children;
+    CullStats cull;
+};
+
+#endif // CDLOD_H
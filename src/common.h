@@ -18,6 +18,8 @@
 #define BUFFER_OFFSET( offset )   ((GLvoid*) (offset))
 
 extern GLuint InitShader(const char* vShaderFile, const char* fShaderFile);
+extern GLuint InitShader(const char* vShaderFile, const char* tcShaderFile,
+                         const char* teShaderFile, const char* fShaderFile);
 
 // Implement the following...
 
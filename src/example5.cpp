@@ -5,9 +5,25 @@
 
 #include <iostream>
 #include <chrono>
-
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#include <cmath>
+#include <algorithm>
+
+#include "benchmark.h"
+#include "cdlod.h"
+#include "frustum.h"
+#include "grid_mesh.h"
+#include "material.h"
+#include "obj_mesh.h"
+#include "patch_field.h"
+#include "snow_gpu.h"
+#include "snow_sim.h"
+#include "snow_texture.h"
+#include "tangent_space.h"
+#include "terrain_indirect.h"
+#include "texture_loader.h"
+#include "texture_pack.h"
+#include "texture_storage.h"
+#include "virtual_texture.h"
 
 #include <glm/glm.hpp>
 #include <glm/gtx/string_cast.hpp>
@@ -55,7 +71,95 @@ GLuint  Time;
 // The Snow shape texture
 GLuint snow_start_texture;
 
-// renders a 1x1 quad in NDC with manually calculated tangent vectors
+// Surface textures, and how the normal and height maps are combined
+GLuint snow_diffuse, snow_normals, snow_displacement;
+NormalHeightPacking packing = PACK_SEPARATE;
+GLuint packed_textures[NUM_PACKINGS];
+
+// Every material set as texture array layers; -1 draws the Snow textures above
+MaterialArrays materials;
+int material_layer = -1;
+
+// Virtual-textured snowfield on units 6-9, created the first time it is used
+VirtualTexture *virtual_texture = NULL;
+bool virtual_texturing = false;
+
+// Kept for the virtual texture's feedback pass, which draws with its own program
+glm::mat4 projection;
+int window_width = 512, window_height = 512;
+
+// The height field surface: an indexed grid (grid_mesh.h), or the original
+// single quad for comparison
+GridMesh *grid = NULL;
+int grid_resolution = 128;
+VertexFormat vertex_format = VERTEX_PACKED;
+bool draw_grid = true;
+
+// CDLOD snowfield (cdlod.h) seen from a walking camera, instead of the surface
+CdlodTerrain *terrain = NULL;
+bool terrain_mode = false;
+glm::vec3 camera_pos( 0.0f, 0.0f, 0.0f );
+float camera_yaw = 0.0f;                  // degrees, 0 looks down -Z
+const float CAMERA_EYE_HEIGHT = 1.7f;
+const float TERRAIN_FAR_PLANE = 1000.0f;
+
+// Instanced field of patches (patch_field.h) below the surface, each in one
+// of the material sets
+PatchField *patch_field = NULL;
+bool draw_patch_field = false;
+bool instancing = true;
+int patch_count = 4096;
+
+// A prop standing on the surface (obj_mesh.h), loaded with L: a small sled
+const char *PROP_PATH = "Models/prop.obj";
+ObjMesh *prop = NULL;
+
+// The terrain drawn with one glMultiDrawElementsIndirect (terrain_indirect.h)
+// and its own program, when GL 4.3 is there
+TerrainIndirect *terrain_indirect = NULL;
+GLuint indirect_program = 0;
+bool indirect_terrain = false;
+
+// The surface grid tessellated and truly displaced by depthMap
+// (tcshader5.glsl, teshader5.glsl) instead of the parallax march, when GL 4.0
+// is there
+GLuint tess_program = 0;
+bool tessellation = false;
+// The default 128-quad grid's quads are 3-4 pixels across in the default
+// window: at 8 pixels no triangle would be cut at all
+float tess_edge_pixels = 2.0f;
+float tess_max_level = 64.0f;
+// World units the surface sinks at depth 1: heightScale's 0.1 of the texture
+// over the grid's 2 units per texture
+const float TESS_DISPLACEMENT = 0.2f;
+
+// Deformable snow (snow_sim.h) trodden by a crowd of walkers; its depth
+// (snow_texture.h) replaces SnowTextures/height.jpg on unit 2 while it runs,
+// uploaded as dirty rectangles or, for comparison, whole. On the GPU
+// (snow_gpu.h) they draw straight into depthMap. A sled circles through
+// the crowd; both go through the field's command buffer (snow_commands.h).
+// Its normals (height_normals.h) are regenerated from the depth and replace
+// SnowTextures/normal.jpg on unit 1, so the tracks are lit as they sink.
+SnowField *snow = NULL;
+SnowTexture *snow_texture = NULL;
+GpuSnowField *gpu_snow = NULL;
+bool snow_simulation = false;
+bool snow_incremental = true;
+bool snow_on_gpu = false;
+std::vector<SnowWalker> snow_walkers;
+std::vector<SnowStamp> snow_stamps;
+const int SNOW_WALKERS = 256;
+NormalPacking snow_normal_packing = NORMALS_RG8;
+// heightScale (0.1 of the texture at depth 1) over one texel of the field
+const float SNOW_SLOPE_SCALE = 0.1f;
+GLuint snow_normal_texture( void );
+
+// Frustum culling of the terrain's quadtree, the surface, the prop and the
+// patch field (frustum.h)
+bool frustum_culling = true;
+CullStats scene_cull;
+
+// renders a 1x1 quad in NDC, tangents from tangent_space.h
 // ------------------------------------------------------------------
 unsigned int quadVAO = 0;
 unsigned int quadVBO;
@@ -63,132 +167,90 @@ void render_quad()
 {
     if (quadVAO == 0)
     {
-        // positions
-        glm::vec3 pos1(-1.0f,  1.0f, 0.0f);
-        glm::vec3 pos2(-1.0f, -1.0f, 0.0f);
-        glm::vec3 pos3( 1.0f, -1.0f, 0.0f);
-        glm::vec3 pos4( 1.0f,  1.0f, 0.0f);
-        // texture coordinates
-        glm::vec2 uv1(0.0f, 1.0f);
-        glm::vec2 uv2(0.0f, 0.0f);
-        glm::vec2 uv3(1.0f, 0.0f);
-        glm::vec2 uv4(1.0f, 1.0f);
-        // normal vector
-        glm::vec3 nm(0.0f, 0.0f, 1.0f);
-
-        // calculate tangent/bitangent vectors of both triangles
-        glm::vec3 tangent1, bitangent1;
-        glm::vec3 tangent2, bitangent2;
-        // triangle 1
-        // ----------
-        glm::vec3 edge1 = pos2 - pos1;
-        glm::vec3 edge2 = pos3 - pos1;
-        glm::vec2 deltaUV1 = uv2 - uv1;
-        glm::vec2 deltaUV2 = uv3 - uv1;
-
-        float f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
-
-        tangent1.x = f * (deltaUV2.y * edge1.x - deltaUV1.y * edge2.x);
-        tangent1.y = f * (deltaUV2.y * edge1.y - deltaUV1.y * edge2.y);
-        tangent1.z = f * (deltaUV2.y * edge1.z - deltaUV1.y * edge2.z);
-        tangent1 = glm::normalize(tangent1);
-
-        bitangent1.x = f * (-deltaUV2.x * edge1.x + deltaUV1.x * edge2.x);
-        bitangent1.y = f * (-deltaUV2.x * edge1.y + deltaUV1.x * edge2.y);
-        bitangent1.z = f * (-deltaUV2.x * edge1.z + deltaUV1.x * edge2.z);
-        bitangent1 = glm::normalize(bitangent1);
-
-        // triangle 2
-        // ----------
-        edge1 = pos3 - pos1;
-        edge2 = pos4 - pos1;
-        deltaUV1 = uv3 - uv1;
-        deltaUV2 = uv4 - uv1;
-
-        f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
-
-        tangent2.x = f * (deltaUV2.y * edge1.x - deltaUV1.y * edge2.x);
-        tangent2.y = f * (deltaUV2.y * edge1.y - deltaUV1.y * edge2.y);
-        tangent2.z = f * (deltaUV2.y * edge1.z - deltaUV1.y * edge2.z);
-        tangent2 = glm::normalize(tangent2);
-
-
-        bitangent2.x = f * (-deltaUV2.x * edge1.x + deltaUV1.x * edge2.x);
-        bitangent2.y = f * (-deltaUV2.x * edge1.y + deltaUV1.x * edge2.y);
-        bitangent2.z = f * (-deltaUV2.x * edge1.z + deltaUV1.x * edge2.z);
-        bitangent2 = glm::normalize(bitangent2);
-
-
-        float quadVertices[] = {
-            // positions            // normal         // texcoords  // tangent                          // bitangent
-            pos1.x, pos1.y, pos1.z, nm.x, nm.y, nm.z, uv1.x, uv1.y, tangent1.x, tangent1.y, tangent1.z, bitangent1.x, bitangent1.y, bitangent1.z,
-            pos2.x, pos2.y, pos2.z, nm.x, nm.y, nm.z, uv2.x, uv2.y, tangent1.x, tangent1.y, tangent1.z, bitangent1.x, bitangent1.y, bitangent1.z,
-            pos3.x, pos3.y, pos3.z, nm.x, nm.y, nm.z, uv3.x, uv3.y, tangent1.x, tangent1.y, tangent1.z, bitangent1.x, bitangent1.y, bitangent1.z,
-
-            pos1.x, pos1.y, pos1.z, nm.x, nm.y, nm.z, uv1.x, uv1.y, tangent2.x, tangent2.y, tangent2.z, bitangent2.x, bitangent2.y, bitangent2.z,
-            pos3.x, pos3.y, pos3.z, nm.x, nm.y, nm.z, uv3.x, uv3.y, tangent2.x, tangent2.y, tangent2.z, bitangent2.x, bitangent2.y, bitangent2.z,
-            pos4.x, pos4.y, pos4.z, nm.x, nm.y, nm.z, uv4.x, uv4.y, tangent2.x, tangent2.y, tangent2.z, bitangent2.x, bitangent2.y, bitangent2.z
+        // positions, normal and texture coordinates of both triangles; the
+        // tangent and bitangent are filled in below
+        float quadVertices[6 * VERTEX_FLOATS] = {
+            -1.0f,  1.0f, 0.0f,   0.0f, 0.0f, 1.0f,   0.0f, 1.0f,   0, 0, 0,   0, 0, 0,
+            -1.0f, -1.0f, 0.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,   0, 0, 0,   0, 0, 0,
+             1.0f, -1.0f, 0.0f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,   0, 0, 0,   0, 0, 0,
+
+            -1.0f,  1.0f, 0.0f,   0.0f, 0.0f, 1.0f,   0.0f, 1.0f,   0, 0, 0,   0, 0, 0,
+             1.0f, -1.0f, 0.0f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,   0, 0, 0,   0, 0, 0,
+             1.0f,  1.0f, 0.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,   0, 0, 0,   0, 0, 0
         };
+        const uint32_t quadTriangles[] = { 0, 1, 2, 3, 4, 5 };
+        generate_tangents(quadVertices, 6, quadTriangles, 6);
+
         // configure plane VAO
         glGenVertexArrays(1, &quadVAO);
         glGenBuffers(1, &quadVBO);
         glBindVertexArray(quadVAO);
         glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
         glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(3 * sizeof(float)));
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(6 * sizeof(float)));
-        glEnableVertexAttribArray(3);
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(8 * sizeof(float)));
-        glEnableVertexAttribArray(4);
-        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(11 * sizeof(float)));
+        set_vertex_attributes(VERTEX_FLOAT);
     }
     glBindVertexArray(quadVAO);
     glDrawArrays(GL_TRIANGLES, 0, 6);
     glBindVertexArray(0);
 }
 
+void render_surface()
+{
+    if ( draw_grid )
+        grid->draw();
+    else
+        render_quad();
+}
 
-// Loading Textures
-unsigned int load_texture(char const * path)
+// Terrain camera on the ground, and its view and projection
+glm::mat4 terrain_camera( glm::mat4 &view )
 {
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
+    camera_pos.y = terrain->height_at( camera_pos.x, camera_pos.z ) + CAMERA_EYE_HEIGHT;
+    float yaw = glm::radians( camera_yaw );
+    glm::vec3 forward( std::sin(yaw), -0.15f, -std::cos(yaw) );
+    view = glm::lookAt( camera_pos, camera_pos + forward, glm::vec3(0, 1, 0) );
+    return glm::perspective( glm::radians(45.0f), GLfloat(window_width)/window_height, 0.1f, TERRAIN_FAR_PLANE );
+}
 
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(path, &width, &height, &nrComponents, 0);
-    if (data)
-    {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
-    }
-    else
-    {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
-    }
+// Is the box [low, high] under model in view?
+bool box_visible( const glm::mat4 &model, const glm::vec3 &low, const glm::vec3 &high, const Frustum &frustum )
+{
+    glm::vec3 world_low, world_high;
+    transform_box( model, low, high, world_low, world_high );
+    return classify_box( frustum, world_low, world_high ) != FRUSTUM_OUTSIDE;
+}
 
-    return textureID;
+// The prop's model matrix: half a unit tall, standing on the surface's plane
+glm::mat4 prop_model( const glm::mat4 &surface_model )
+{
+    glm::vec3 size = prop->high() - prop->low();
+    float scale = 0.5f / std::max( size.y, 1e-6f );
+    glm::vec3 base( 0.5f * (prop->low().x + prop->high().x), prop->low().y, 0.5f * (prop->low().z + prop->high().z) );
+    return surface_model * glm::rotate( glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(1, 0, 0) )
+        * glm::scale( glm::mat4(1.0f), glm::vec3(scale) ) * glm::translate( glm::mat4(1.0f), -base );
 }
+
+void set_grid( int resolution, VertexFormat format )
+{
+    grid_resolution = std::max( 1, std::min( resolution, GRID_MAX_RESOLUTION ) );
+    vertex_format = format;
+    delete grid;
+    grid = new GridMesh( grid_resolution, vertex_format );
+    grid->print_stats();
+}
+
+
+// Texture units of fshader5.glsl's samplers, for shading programs in use
+void set_samplers( GLuint shading )
+{
+    glUniform1i(glGetUniformLocation(shading, "diffuseMap"), 0);
+    glUniform1i(glGetUniformLocation(shading, "normalMap"), 1);
+    glUniform1i(glGetUniformLocation(shading, "depthMap"), 2);
+    glUniform1i(glGetUniformLocation(shading, "diffuseArray"), 3);
+    glUniform1i(glGetUniformLocation(shading, "normalArray"), 4);
+    glUniform1i(glGetUniformLocation(shading, "heightArray"), 5);
+}
+
 //----------------------------------------------------------------------------
 
 // OpenGL initialization
@@ -235,13 +297,27 @@ init()
 //     glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW );
 
 
+    // Start decoding the textures on the worker pool; they are uploaded once
+    // the shaders have been compiled
+    // snow_diffuse = request_texture("BrickTextures/bricks2.jpg");
+    // snow_normals = request_texture("BrickTextures/bricks2_normal.jpg", TEX_NORMAL);
+    // snow_displacement = request_texture("BrickTextures/parallax_mapping_height_map.png", TEX_HEIGHT);
+
+    snow_diffuse = request_texture("SnowTextures/diffuse.jpg");
+    snow_normals = request_texture("SnowTextures/normal.jpg", TEX_NORMAL);
+    snow_displacement = request_texture("SnowTextures/height.jpg", TEX_HEIGHT);
+
+    // snow_diffuse = request_texture("WoodTextures/wood.png");
+    // snow_normals = request_texture("WoodTextures/toy_box_normal.png", TEX_NORMAL);
+    // snow_displacement = request_texture("WoodTextures/toy_box_disp.png", TEX_HEIGHT);
+
+    materials = request_material_arrays();
+
     // Load shaders and use the resulting shader program
     program = InitShader( "vshader5.glsl", "fshader5.glsl" );
     glUseProgram( program );
 
-    glUniform1i(glGetUniformLocation(program, "diffuseMap"), 0);
-    glUniform1i(glGetUniformLocation(program, "normalMap"), 1);
-    glUniform1i(glGetUniformLocation(program, "depthMap"), 2);
+    set_samplers( program );
     
 
 
@@ -251,26 +327,23 @@ init()
     Projection = glGetUniformLocation( program, "Projection" );
     Time = glGetUniformLocation(program, "Time");
 
-    
-
-    // GLuint snow_diffuse = load_texture(std::string("bricks2.jpg").c_str());
-    // GLuint snow_normals = load_texture(std::string("bricks2_normal.jpg").c_str());
-    // GLuint snow_displacement = load_texture(std::string("parallax_mapping_height_map.png").c_str());
 
-    GLuint snow_diffuse = load_texture(std::string("SnowTextures/diffuse.jpg").c_str());
-    GLuint snow_normals = load_texture(std::string("SnowTextures/height.jpg").c_str());
-    GLuint snow_displacement = load_texture(std::string("SnowTextures/normal.jpg").c_str());
+    set_grid( grid_resolution, vertex_format );
 
-    // GLuint snow_diffuse = load_texture(std::string("wood.png").c_str());
-    // GLuint snow_normals = load_texture(std::string("toy_box_normal.png").c_str());
-    // GLuint snow_displacement = load_texture(std::string("toy_box_disp.png").c_str());
+    upload_pending_textures();
+    upload_material_arrays(materials);
+    report_texture_memory();
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, snow_diffuse);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, snow_normals);
     glActiveTexture(GL_TEXTURE2);
     glBindTexture(GL_TEXTURE_2D, snow_displacement);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, materials.diffuse);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, materials.normal);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, materials.height);
 
     glEnable( GL_DEPTH_TEST );
 
@@ -308,22 +381,130 @@ display( void )
     // model_view = trans * glm::translate(glm::mat4(), model_trans);
     // model_view = trans;//glm::translate(glm::mat4(), model_trans);
     
+    glm::mat4 proj = projection;
+    glm::vec3 eye = viewer_pos;
+    if ( terrain_mode ) {
+        proj = terrain_camera( view );
+        model = glm::mat4( 1.0f );
+        eye = camera_pos;
+    }
+
+    Frustum frustum = frustum_from_matrix( proj * view );
+    bool draw_surface = true, draw_prop = prop && !terrain_mode;
+    scene_cull = CullStats();
+    if ( terrain_mode )
+        terrain->select( camera_pos, frustum_culling ? &frustum : NULL );
+    else {
+        // The surface is the grid's [-1,1] square in its XY plane
+        draw_surface = !frustum_culling || box_visible( model, glm::vec3(-1, -1, 0), glm::vec3(1, 1, 0), frustum );
+        scene_cull.nodes_visited = 1;
+        scene_cull.chunks_drawn = draw_surface ? 1 : 0;
+        if ( prop ) {
+            draw_prop = !frustum_culling || box_visible( prop_model( model ), prop->low(), prop->high(), frustum );
+            scene_cull.nodes_visited++;
+            scene_cull.chunks_drawn += draw_prop ? 1 : 0;
+        }
+    }
+
     long long ms = std::chrono::duration_cast< std::chrono::milliseconds >(
        std::chrono::system_clock::now().time_since_epoch()).count();
 
-    glUniform1f( Time, (ms % 1000000) / 1000.0 );
-    glUniformMatrix4fv( Model, 1, GL_FALSE, glm::value_ptr(model) );
-    glUniformMatrix4fv( View, 1, GL_FALSE, glm::value_ptr(view) );
-    
-    GLuint ViewPos = glGetUniformLocation(program, "ViewPos");
-    glUniform3f(ViewPos, 0, 0, 3);
+    if ( draw_patch_field && !terrain_mode ) {
+        patch_field->update( (ms % 1000000) / 1000.0f, true, frustum_culling ? &frustum : NULL );
+        scene_cull.nodes_visited += patch_field->count();
+        scene_cull.chunks_drawn += patch_field->drawn();
+    }
+    scene_cull.nodes_culled = scene_cull.nodes_visited - scene_cull.chunks_drawn;
+
+    if ( virtual_texturing ) {
+        virtual_texture->update();
+        virtual_texture->render_feedback( window_width, window_height, [&]( GLuint feedback ) {
+            glUniformMatrix4fv( glGetUniformLocation(feedback, "Model"), 1, GL_FALSE, glm::value_ptr(model) );
+            glUniformMatrix4fv( glGetUniformLocation(feedback, "View"), 1, GL_FALSE, glm::value_ptr(view) );
+            glUniformMatrix4fv( glGetUniformLocation(feedback, "Projection"), 1, GL_FALSE, glm::value_ptr(proj) );
+            glUniform1i( glGetUniformLocation(feedback, "vertexFormat"), draw_grid ? grid->format() : VERTEX_FLOAT );
+            if ( terrain_mode ) {
+                glUniform3fv( glGetUniformLocation(feedback, "ViewPos"), 1, glm::value_ptr(eye) );
+                glUniform1i( glGetUniformLocation(feedback, "depthMap"), 2 );
+                terrain->draw( feedback );
+            }
+            else if ( draw_surface )
+                render_surface();
+            if ( draw_patch_field && !terrain_mode )
+                patch_field->draw_instanced( feedback );
+        } );
+        glUseProgram( program );
+    }
 
-    GLuint LightPos = glGetUniformLocation(program, "LightPos");
-    glUniform3f(LightPos, 0.5f, 1.f, 0.3f);
+    // The indirect terrain and the tessellated surface shade with their own
+    // programs; program stays set up for the prop and patch field
+    GLuint shading = program;
+    if ( terrain_mode && indirect_terrain )
+        shading = indirect_program;
+    else if ( !terrain_mode && tessellation && draw_grid )
+        shading = tess_program;
 
-    glUniform1f(glGetUniformLocation(program, "heightScale"), 0.1f);
+    // Packed modes read the normal and height from one texture on unit 1
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, packing == PACK_SEPARATE ? snow_normal_texture() : packed_textures[packing]);
+    // The simulation's own normals say whether they are x and y only
+    bool normals_rg = compress_textures;
+    if ( snow_simulation && packing == PACK_SEPARATE )
+        normals_rg = snow_normal_packing == NORMALS_RG8;
+
+    auto set_frame_uniforms = [&]( GLuint target ) {
+        glUniform1f( glGetUniformLocation(target, "Time"), (ms % 1000000) / 1000.0 );
+        glUniformMatrix4fv( glGetUniformLocation(target, "Model"), 1, GL_FALSE, glm::value_ptr(model) );
+        glUniformMatrix4fv( glGetUniformLocation(target, "View"), 1, GL_FALSE, glm::value_ptr(view) );
+        glUniformMatrix4fv( glGetUniformLocation(target, "Projection"), 1, GL_FALSE, glm::value_ptr(proj) );
+
+        GLuint ViewPos = glGetUniformLocation(target, "ViewPos");
+        glUniform3fv(ViewPos, 1, glm::value_ptr(eye));
+
+        GLuint LightPos = glGetUniformLocation(target, "LightPos");
+        glm::vec3 light = glm::vec3(0.5f, 1.f, 0.3f) + (terrain_mode ? eye : glm::vec3(0));
+        glUniform3fv(LightPos, 1, glm::value_ptr(light));
+
+        glUniform1f(glGetUniformLocation(target, "heightScale"), 0.1f);
+
+        glUniform1i(glGetUniformLocation(target, "normalHeightPacking"), packing);
+        glUniform1i(glGetUniformLocation(target, "normalMapRG"), normals_rg);
+        glUniform1i(glGetUniformLocation(target, "materialLayer"), material_layer);
+        glUniform1i(glGetUniformLocation(target, "virtualTexturing"), virtual_texturing);
+        glUniform1i(glGetUniformLocation(target, "vertexFormat"), draw_grid ? grid->format() : VERTEX_FLOAT);
+    };
+    set_frame_uniforms( program );
+    if ( shading != program ) {
+        glUseProgram( shading );
+        set_frame_uniforms( shading );
+    }
 
-    render_quad();
+    if ( terrain_mode && indirect_terrain )
+        terrain_indirect->draw( *terrain, shading );
+    else if ( terrain_mode )
+        terrain->draw( program );
+    else if ( draw_surface && shading == tess_program ) {
+        glUniform2f( glGetUniformLocation(shading, "viewportSize"), window_width, window_height );
+        glUniform1f( glGetUniformLocation(shading, "tessEdgePixels"), tess_edge_pixels );
+        glUniform1f( glGetUniformLocation(shading, "tessMaxLevel"), tess_max_level );
+        glUniform1f( glGetUniformLocation(shading, "displacementScale"), TESS_DISPLACEMENT );
+        grid->draw_patches();
+    }
+    else if ( draw_surface )
+        render_surface();
+    if ( shading != program )
+        glUseProgram( program );
+    if ( draw_prop ) {
+        glUniformMatrix4fv( Model, 1, GL_FALSE, glm::value_ptr(prop_model( model )) );
+        glUniform1i( glGetUniformLocation(program, "vertexFormat"), prop->format() );
+        prop->draw();
+    }
+    if ( draw_patch_field && !terrain_mode ) {
+        if ( instancing )
+            patch_field->draw_instanced( program );
+        else
+            patch_field->draw_individually( program );
+    }
     // glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
     
     glutSwapBuffers();
@@ -348,9 +529,62 @@ mouse( int button, int state, int x, int y )
 int spaced = 1;
 bool rotate = false;
 
+// Switch normal/height packing, baking the packed texture on first use
+void
+set_packing( NormalHeightPacking mode )
+{
+    if ( mode != PACK_SEPARATE && packed_textures[mode] == 0 ) {
+        packed_textures[mode] = request_packed_texture( "SnowTextures/normal.jpg", "SnowTextures/height.jpg", mode );
+        upload_pending_textures();
+    }
+    packing = mode;
+}
+
+// Walk the terrain camera; turn with a and d
+void
+move_camera( float distance )
+{
+    float yaw = glm::radians( camera_yaw );
+    camera_pos.x += std::sin(yaw) * distance;
+    camera_pos.z -= std::cos(yaw) * distance;
+}
+
 void
 update( void )
 {
+    if ( snow_simulation ) {
+        static float snow_time = 0.0f;
+        float dt = FRAME_RATE_MS / 1000.0;
+        step_walkers( snow_walkers, snow_time, dt, snow_stamps );
+        SnowCommandBuffer &commands = snow_on_gpu ? gpu_snow->commands() : snow->commands();
+        for ( size_t i = 0; i < snow_stamps.size(); ++i )
+            commands.press( snow_brush(snow_stamps[i]) );
+
+        // A sled circling the field, its two runners pressing tracks
+        float angle = 0.2f * snow_time;
+        for ( int side = -1; side <= 1; side += 2 ) {
+            float offset = 0.3f + 0.01f * side;
+            SnowBrush runner = { 0.5f + offset * std::cos(angle), 0.5f + offset * std::sin(angle),
+                                 0.008f, 0.002f, angle + 1.5707963f, 0.25f, 0.3f, SNOW_BRUSH_BOX };
+            commands.press( runner );
+        }
+
+        if ( snow_on_gpu )
+            gpu_snow->tick( dt );
+        else {
+            snow->tick( dt );
+            glActiveTexture( GL_TEXTURE2 );
+            snow_texture->update( *snow, snow_incremental );
+        }
+        snow_time += dt;
+    }
+
+    if (terrain_mode) {
+        if (rotate)
+            move_camera( 0.2f * spaced );
+        return;
+    }
+
     if (rotate) {
         Theta[Axis] += 0.3 * spaced;
     }
@@ -362,6 +596,85 @@ update( void )
 
 //----------------------------------------------------------------------------
 
+// Start the snow simulation from SnowTextures/height.jpg on first use
+bool
+create_snow( void )
+{
+    if ( snow )
+        return true;
+    DecodedImage height = decode_raw_image( "SnowTextures/height.jpg" );
+    if ( !height.pixels ) {
+        std::cout << "Snow: cannot read SnowTextures/height.jpg" << std::endl;
+        return false;
+    }
+    snow = new SnowField( height.pixels, height.width, height.height, height.channels );
+    free_image( height );
+    snow_walkers = scatter_walkers( SNOW_WALKERS );
+    glActiveTexture( GL_TEXTURE2 );
+    snow_texture = new SnowTexture( *snow );
+    glActiveTexture( GL_TEXTURE1 );
+    snow_texture->enable_normals( *snow, snow_normal_packing, SNOW_SLOPE_SCALE * snow->width() );
+    return true;
+}
+
+// The GPU copy of the simulation, on first use
+bool
+create_gpu_snow( void )
+{
+    if ( gpu_snow )
+        return true;
+    if ( !GpuSnowField::supported() ) {
+        std::cout << "GPU snow needs OpenGL 3.3" << std::endl;
+        return false;
+    }
+    DecodedImage height = decode_raw_image( "SnowTextures/height.jpg" );
+    if ( !height.pixels )
+        return false;
+    gpu_snow = new GpuSnowField( height.pixels, height.width, height.height, height.channels, 2 );
+    gpu_snow->enable_normals( snow_normal_packing, SNOW_SLOPE_SCALE * gpu_snow->width() );
+    free_image( height );
+    return true;
+}
+
+// What unit 2 shows as depthMap
+GLuint
+snow_depth_texture( void )
+{
+    if ( !snow_simulation )
+        return snow_displacement;
+    return snow_on_gpu ? gpu_snow->texture() : snow_texture->texture();
+}
+
+// What unit 1 shows as normalMap with separate textures
+GLuint
+snow_normal_texture( void )
+{
+    if ( !snow_simulation )
+        return snow_normals;
+    return snow_on_gpu ? gpu_snow->normal_texture() : snow_texture->normal_texture();
+}
+
+//----------------------------------------------------------------------------
+
+void
+create_tess_program( void )
+{
+    if ( tess_program )
+        return;
+    tess_program = InitShader( "vshader5_tess.glsl", "tcshader5.glsl", "teshader5.glsl", "fshader5.glsl" );
+    glUseProgram( tess_program );
+    set_samplers( tess_program );
+    glUniform1i( glGetUniformLocation(tess_program, "displaced"), 1 );
+    GLint max_level = 64;
+    glGetIntegerv( GL_MAX_TESS_GEN_LEVEL, &max_level );
+    tess_max_level = std::min( 64.0f, (float) max_level );
+    if ( virtual_texture )
+        virtual_texture->bind( tess_program );
+    glUseProgram( program );
+}
+
+//----------------------------------------------------------------------------
+
 void
 keyboard( unsigned char key, int x, int y )
 {
@@ -376,6 +689,287 @@ keyboard( unsigned char key, int x, int y )
     case 'r':
         rotate = !rotate;
         break;
+    case 'm':
+        benchmark_mipmaps();
+        break;
+    case 'j':
+        benchmark_jpeg_decode();
+        break;
+    case 'J':
+        benchmark_compression();
+        break;
+    case 'g':
+        draw_grid = !draw_grid;
+        std::cout << "Surface: " << (draw_grid ? "grid" : "single quad") << std::endl;
+        break;
+    case '+': case '=':
+        set_grid( grid_resolution * 2, vertex_format );
+        break;
+    case '-':
+        set_grid( grid_resolution / 2, vertex_format );
+        break;
+    case 'f':
+        set_grid( grid_resolution, VertexFormat( (vertex_format + 1) % NUM_VERTEX_FORMATS ) );
+        break;
+    case 't':
+        benchmark_tangents();
+        break;
+    case 'F': {
+        int saved_resolution = grid_resolution;
+        VertexFormat saved_format = vertex_format;
+        bool saved_draw_grid = draw_grid;
+        draw_grid = true;
+        benchmark_vertex_formats( []( int format ) {
+            if ( grid->resolution() != VERTEX_BENCH_RESOLUTION || grid->format() != format )
+                set_grid( VERTEX_BENCH_RESOLUTION, VertexFormat(format) );
+            display();
+        } );
+        draw_grid = saved_draw_grid;
+        set_grid( saved_resolution, saved_format );
+        break;
+    }
+    case 'T':
+        if ( !terrain ) {
+            DecodedImage height = decode_raw_image( "SnowTextures/height.jpg" );
+            if ( !height.pixels ) {
+                std::cout << "Terrain: cannot read SnowTextures/height.jpg" << std::endl;
+                break;
+            }
+            terrain = new CdlodTerrain( height.pixels, height.width, height.height, height.channels );
+            free_image( height );
+            if ( TerrainIndirect::supported() )
+                terrain_indirect = new TerrainIndirect( terrain->patch_resolution() );
+        }
+        terrain_mode = !terrain_mode;
+        std::cout << "Terrain " << (terrain_mode ? "on" : "off") << std::endl;
+        if ( terrain_mode ) {
+            camera_pos.y = terrain->height_at( camera_pos.x, camera_pos.z ) + CAMERA_EYE_HEIGHT;
+            terrain->select( camera_pos );
+            terrain->print_stats();
+        }
+        break;
+    case 'w':
+        move_camera( 1.0f );
+        break;
+    case 's':
+        move_camera( -1.0f );
+        break;
+    case 'a':
+        camera_yaw -= 5.0f;
+        break;
+    case 'd':
+        camera_yaw += 5.0f;
+        break;
+    case 'x':
+        if ( !TerrainIndirect::supported() ) {
+            std::cout << "Indirect terrain needs OpenGL 4.3" << std::endl;
+            break;
+        }
+        if ( !indirect_program ) {
+            indirect_program = InitShader( "vshader5_mdi.glsl", "fshader5.glsl" );
+            glUseProgram( indirect_program );
+            set_samplers( indirect_program );
+            if ( virtual_texture )
+                virtual_texture->bind( indirect_program );
+            glUseProgram( program );
+        }
+        indirect_terrain = !indirect_terrain;
+        std::cout << "Terrain submission: " << (indirect_terrain ? "multi-draw indirect" : "instanced") << std::endl;
+        break;
+    case 'e':
+        if ( !GridMesh::tessellation_supported() ) {
+            std::cout << "Tessellation needs OpenGL 4.0" << std::endl;
+            break;
+        }
+        create_tess_program();
+        tessellation = !tessellation;
+        std::cout << "Surface depth: " << (tessellation ? "tessellated displacement" : "parallax march")
+                  << (tessellation && !draw_grid ? " (needs the grid, g)" : "") << std::endl;
+        break;
+    case 'E': {
+        bool saved_tessellation = tessellation;
+        float saved_pixels = tess_edge_pixels;
+        if ( GridMesh::tessellation_supported() )
+            create_tess_program();
+        benchmark_displacement( []( bool tessellated, float edge_pixels ) {
+            tessellation = tessellated;
+            if ( tessellated )
+                tess_edge_pixels = edge_pixels;
+            display();
+        } );
+        tessellation = saved_tessellation;
+        tess_edge_pixels = saved_pixels;
+        break;
+    }
+    case 'X':
+        // Switch the indirect terrain between its two per-draw paths
+        if ( terrain_indirect ) {
+            terrain_indirect->set_draw_id_fetch( !terrain_indirect->draw_id_fetch() );
+            terrain_indirect->print_stats();
+        }
+        break;
+    case 'c':
+        frustum_culling = !frustum_culling;
+        std::cout << "Frustum culling " << (frustum_culling ? "on" : "off") << std::endl;
+        break;
+    case 'C':
+        if ( terrain_mode )
+            terrain->print_stats();
+        else
+            std::cout << "Scene culling: " << scene_cull.nodes_visited << " objects visited, "
+                      << scene_cull.nodes_culled << " culled, " << scene_cull.chunks_drawn << " drawn" << std::endl;
+        break;
+    case 'B':
+        benchmark_culling();
+        break;
+    case 'I':
+        if ( !patch_field ) {
+            patch_field = new PatchField( patch_count );
+            patch_field->set_materials( NUM_MATERIALS );
+        }
+        draw_patch_field = !draw_patch_field;
+        std::cout << "Patch field " << (draw_patch_field ? "on" : "off") << std::endl;
+        if ( draw_patch_field )
+            patch_field->print_stats();
+        break;
+    case 'o':
+        instancing = !instancing;
+        std::cout << "Patch field: " << (instancing ? "instanced" : "one draw per patch") << std::endl;
+        break;
+    case 'b': {
+        if ( !patch_field ) {
+            patch_field = new PatchField( patch_count );
+            patch_field->set_materials( NUM_MATERIALS );
+        }
+        bool saved_draw = draw_patch_field, saved_instancing = instancing;
+        draw_patch_field = true;
+        benchmark_instancing( []( int count, bool instanced ) {
+            if ( patch_field->count() != count )
+                patch_field->resize( count );
+            instancing = instanced;
+            display();
+        } );
+        patch_field->resize( patch_count );
+        draw_patch_field = saved_draw;
+        instancing = saved_instancing;
+        break;
+    }
+    case 'L':
+        if ( !prop ) {
+            prop = new ObjMesh();
+            if ( !prop->load( PROP_PATH ) ) {
+                delete prop;
+                prop = NULL;
+                break;
+            }
+        }
+        prop->print_stats();
+        break;
+    case 'M':
+        benchmark_mesh_loading();
+        break;
+    case 'O':
+        benchmark_mesh_optimizer();
+        break;
+    case 'k':
+        if ( !create_snow() )
+            break;
+        snow_simulation = !snow_simulation;
+        glActiveTexture( GL_TEXTURE2 );
+        glBindTexture( GL_TEXTURE_2D, snow_depth_texture() );
+        glActiveTexture( GL_TEXTURE0 );
+        std::cout << "Snow simulation " << (snow_simulation ? "on" : "off") << " (" << SNOW_WALKERS
+                  << " walkers, " << (snow_on_gpu ? "GPU" : "CPU") << ")" << std::endl;
+        break;
+    case 'K':
+        if ( snow ) {
+            snow->print_stats();
+            snow_texture->print_stats();
+        }
+        if ( gpu_snow )
+            gpu_snow->print_stats();
+        benchmark_snow();
+        benchmark_snow_commands();
+        break;
+    case 'y':
+        if ( !create_snow() || !create_gpu_snow() )
+            break;
+        snow_on_gpu = !snow_on_gpu;
+        glActiveTexture( GL_TEXTURE2 );
+        glBindTexture( GL_TEXTURE_2D, snow_depth_texture() );
+        glActiveTexture( GL_TEXTURE0 );
+        std::cout << "Snow simulation on the " << (snow_on_gpu ? "GPU" : "CPU") << std::endl;
+        break;
+    case 'Y':
+        benchmark_snow_gpu();
+        glActiveTexture( GL_TEXTURE2 );
+        glBindTexture( GL_TEXTURE_2D, snow_depth_texture() );
+        glActiveTexture( GL_TEXTURE0 );
+        break;
+    case 'h':
+        snow_normal_packing = snow_normal_packing == NORMALS_RG8 ? NORMALS_RGB10_A2 : NORMALS_RG8;
+        if ( snow ) {
+            glActiveTexture( GL_TEXTURE1 );
+            snow_texture->enable_normals( *snow, snow_normal_packing, SNOW_SLOPE_SCALE * snow->width() );
+            glActiveTexture( GL_TEXTURE0 );
+        }
+        if ( gpu_snow )
+            gpu_snow->enable_normals( snow_normal_packing, SNOW_SLOPE_SCALE * gpu_snow->width() );
+        std::cout << "Snow normals: " << (snow_normal_packing == NORMALS_RG8 ? "RG8" : "RGB10_A2") << std::endl;
+        break;
+    case 'H':
+        benchmark_snow_normals();
+        break;
+    case 'u':
+        snow_incremental = !snow_incremental;
+        std::cout << "Snow texture upload: " << (snow_incremental ? "dirty rectangles" : "whole level 0")
+                  << std::endl;
+        break;
+    case 'U':
+        glActiveTexture( GL_TEXTURE2 );
+        benchmark_snow_upload();
+        glBindTexture( GL_TEXTURE_2D, snow_depth_texture() );
+        glActiveTexture( GL_TEXTURE0 );
+        break;
+    case 'p':
+        set_packing( NormalHeightPacking( (packing + 1) % NUM_PACKINGS ) );
+        std::cout << "Normal/height packing: " << packing_name(packing) << std::endl;
+        break;
+    case 'n':
+        material_layer = material_layer + 1 < NUM_MATERIALS ? material_layer + 1 : -1;
+        std::cout << "Material: " << (material_layer < 0 ? "snow (separate textures)"
+                                                         : material_name(Material(material_layer))) << std::endl;
+        break;
+    case 'i':
+        report_texture_memory();
+        break;
+    case 'v':
+        if ( !virtual_texture ) {
+            virtual_texture = new VirtualTexture( 128, 16, 6 );
+            if ( indirect_program ) {
+                glUseProgram( indirect_program );
+                virtual_texture->bind( indirect_program );
+            }
+            if ( tess_program ) {
+                glUseProgram( tess_program );
+                virtual_texture->bind( tess_program );
+            }
+            glUseProgram( program );
+            virtual_texture->bind( program );
+        }
+        virtual_texturing = !virtual_texturing;
+        std::cout << "Virtual texturing " << (virtual_texturing ? "on" : "off") << std::endl;
+        break;
+    case 'V':
+        if ( virtual_texture )
+            virtual_texture->print_stats();
+        break;
+    case 'P': {
+        NormalHeightPacking saved = packing;
+        benchmark_packing( []( int mode ) { set_packing( NormalHeightPacking(mode) ); display(); } );
+        set_packing( saved );
+        break;
+    }
     }
 }
 
@@ -387,7 +981,9 @@ reshape( int width, int height )
     glViewport( 0, 0, width, height );
 
     GLfloat aspect = GLfloat(width)/height;
-    glm::mat4  projection = glm::perspective( glm::radians(45.0f), aspect, 0.5f, 100.0f );
+    projection = glm::perspective( glm::radians(45.0f), aspect, 0.5f, 100.0f );
+    window_width = width;
+    window_height = height;
 
     glUniformMatrix4fv( Projection, 1, GL_FALSE, glm::value_ptr(projection) );
 }
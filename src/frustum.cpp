@@ -0,0 +1,213 @@
+#include "frustum.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define FRUSTUM_SSE2 1
+#  include <xmmintrin.h>
+#endif
+#if defined(__AVX__)
+#  define FRUSTUM_AVX 1
+#  include <immintrin.h>
+#endif
+
+Frustum frustum_from_matrix(const glm::mat4 &m)
+{
+    // Rows of the matrix (glm is column-major)
+    glm::vec4 row[4];
+    for (int i = 0; i < 4; ++i)
+        row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+
+    Frustum frustum;
+    frustum.planes[0] = row[3] + row[0];    // left
+    frustum.planes[1] = row[3] - row[0];    // right
+    frustum.planes[2] = row[3] + row[1];    // bottom
+    frustum.planes[3] = row[3] - row[1];    // top
+    frustum.planes[4] = row[3] + row[2];    // near
+    frustum.planes[5] = row[3] - row[2];    // far
+    for (int i = 0; i < 6; ++i)
+        frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+    return frustum;
+}
+
+void BoxList::clear()
+{
+    min_x.clear();
+    min_y.clear();
+    min_z.clear();
+    max_x.clear();
+    max_y.clear();
+    max_z.clear();
+}
+
+void BoxList::resize(int count)
+{
+    min_x.resize(count);
+    min_y.resize(count);
+    min_z.resize(count);
+    max_x.resize(count);
+    max_y.resize(count);
+    max_z.resize(count);
+}
+
+void BoxList::set(int i, const glm::vec3 &low, const glm::vec3 &high)
+{
+    min_x[i] = low.x;
+    min_y[i] = low.y;
+    min_z[i] = low.z;
+    max_x[i] = high.x;
+    max_y[i] = high.y;
+    max_z[i] = high.z;
+}
+
+void BoxList::add(const glm::vec3 &low, const glm::vec3 &high)
+{
+    min_x.push_back(low.x);
+    min_y.push_back(low.y);
+    min_z.push_back(low.z);
+    max_x.push_back(high.x);
+    max_y.push_back(high.y);
+    max_z.push_back(high.z);
+}
+
+void transform_box(const glm::mat4 &model, const glm::vec3 &low, const glm::vec3 &high,
+                   glm::vec3 &world_low, glm::vec3 &world_high)
+{
+    // Centre and half extent: each world axis reaches as far as the absolute
+    // matrix row takes the extent
+    glm::vec3 centre = glm::vec3(model * glm::vec4(0.5f * (low + high), 1.0f));
+    glm::vec3 extent = 0.5f * (high - low), reach;
+    for (int a = 0; a < 3; ++a)
+        reach[a] = std::fabs(model[0][a]) * extent.x + std::fabs(model[1][a]) * extent.y + std::fabs(model[2][a]) * extent.z;
+    world_low = centre - reach;
+    world_high = centre + reach;
+}
+
+FrustumResult classify_box(const Frustum &frustum, const glm::vec3 &low, const glm::vec3 &high)
+{
+    FrustumResult result = FRUSTUM_INSIDE;
+    for (int i = 0; i < 6; ++i)
+    {
+        const glm::vec4 &p = frustum.planes[i];
+        // Same order of operations as the SIMD lanes
+        float far_d = p.w + p.x * (p.x > 0 ? high.x : low.x) + p.y * (p.y > 0 ? high.y : low.y) +
+                      p.z * (p.z > 0 ? high.z : low.z);
+        if (far_d < 0)
+            return FRUSTUM_OUTSIDE;
+        float near_d = p.w + p.x * (p.x > 0 ? low.x : high.x) + p.y * (p.y > 0 ? low.y : high.y) +
+                       p.z * (p.z > 0 ? low.z : high.z);
+        if (near_d < 0)
+            result = FRUSTUM_INTERSECTS;
+    }
+    return result;
+}
+
+CullKernel best_cull_kernel()
+{
+#if FRUSTUM_AVX
+    return CULL_KERNEL_AVX;
+#elif FRUSTUM_SSE2
+    return CULL_KERNEL_SSE2;
+#else
+    return CULL_KERNEL_SCALAR;
+#endif
+}
+
+const char *cull_kernel_name(CullKernel kernel)
+{
+    switch (std::min(kernel, best_cull_kernel()))
+    {
+    case CULL_KERNEL_AVX: return "AVX";
+    case CULL_KERNEL_SSE2: return "SSE2";
+    default: return "scalar";
+    }
+}
+
+// Results of a batch from the lane masks of "some plane has the far corner
+// behind it" and "some plane has the near corner behind it"
+static inline void store_results(int outside, int partial, int lanes, unsigned char *results)
+{
+    for (int k = 0; k < lanes; ++k)
+        results[k] = (outside >> k) & 1 ? FRUSTUM_OUTSIDE : (partial >> k) & 1 ? FRUSTUM_INTERSECTS : FRUSTUM_INSIDE;
+}
+
+void classify_boxes(const Frustum &frustum, const BoxList &boxes, unsigned char *results, CullKernel kernel)
+{
+    const int count = boxes.size();
+    const float *bounds[2][3] = {
+        { boxes.min_x.data(), boxes.min_y.data(), boxes.min_z.data() },
+        { boxes.max_x.data(), boxes.max_y.data(), boxes.max_z.data() }
+    };
+
+    // Per plane and axis, which bound gives the far corner
+    int far_side[6][3];
+    for (int i = 0; i < 6; ++i)
+        for (int a = 0; a < 3; ++a)
+            far_side[i][a] = frustum.planes[i][a] > 0 ? 1 : 0;
+
+    int first = 0;
+#if FRUSTUM_AVX
+    if (kernel >= CULL_KERNEL_AVX)
+    {
+        const __m256 zero = _mm256_setzero_ps();
+        for (; first + 8 <= count; first += 8)
+        {
+            __m256 b[2][3];
+            for (int s = 0; s < 2; ++s)
+                for (int a = 0; a < 3; ++a)
+                    b[s][a] = _mm256_loadu_ps(bounds[s][a] + first);
+
+            __m256 outside = zero, partial = zero;
+            for (int i = 0; i < 6; ++i)
+            {
+                const glm::vec4 &p = frustum.planes[i];
+                __m256 far_d = _mm256_set1_ps(p.w), near_d = far_d;
+                for (int a = 0; a < 3; ++a)
+                {
+                    __m256 n = _mm256_set1_ps(p[a]);
+                    far_d = _mm256_add_ps(far_d, _mm256_mul_ps(n, b[far_side[i][a]][a]));
+                    near_d = _mm256_add_ps(near_d, _mm256_mul_ps(n, b[1 - far_side[i][a]][a]));
+                }
+                outside = _mm256_or_ps(outside, _mm256_cmp_ps(far_d, zero, _CMP_LT_OQ));
+                partial = _mm256_or_ps(partial, _mm256_cmp_ps(near_d, zero, _CMP_LT_OQ));
+            }
+            store_results(_mm256_movemask_ps(outside), _mm256_movemask_ps(partial), 8, results + first);
+        }
+    }
+#endif
+#if FRUSTUM_SSE2
+    if (kernel >= CULL_KERNEL_SSE2)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        for (; first + 4 <= count; first += 4)
+        {
+            __m128 b[2][3];
+            for (int s = 0; s < 2; ++s)
+                for (int a = 0; a < 3; ++a)
+                    b[s][a] = _mm_loadu_ps(bounds[s][a] + first);
+
+            __m128 outside = zero, partial = zero;
+            for (int i = 0; i < 6; ++i)
+            {
+                const glm::vec4 &p = frustum.planes[i];
+                __m128 far_d = _mm_set1_ps(p.w), near_d = far_d;
+                for (int a = 0; a < 3; ++a)
+                {
+                    __m128 n = _mm_set1_ps(p[a]);
+                    far_d = _mm_add_ps(far_d, _mm_mul_ps(n, b[far_side[i][a]][a]));
+                    near_d = _mm_add_ps(near_d, _mm_mul_ps(n, b[1 - far_side[i][a]][a]));
+                }
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(far_d, zero));
+                partial = _mm_or_ps(partial, _mm_cmplt_ps(near_d, zero));
+            }
+            store_results(_mm_movemask_ps(outside), _mm_movemask_ps(partial), 4, results + first);
+        }
+    }
+#endif
+
+    for (int i = first; i < count; ++i)
+        results[i] = (unsigned char) classify_box(frustum,
+                                                  glm::vec3(boxes.min_x[i], boxes.min_y[i], boxes.min_z[i]),
+                                                  glm::vec3(boxes.max_x[i], boxes.max_y[i], boxes.max_z[i]));
+}
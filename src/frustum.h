@@ -0,0 +1,71 @@
+// View frustum culling of axis-aligned boxes.
+//
+// The six planes are extracted from a Projection * View matrix (Gribb and
+// Hartmann), so culling runs in world space with the matrices display()
+// already builds. Boxes are classified against every plane through their
+// nearest and farthest corners: outside if the farthest corner is behind any
+// plane, inside if the nearest corner is in front of all of them. A node
+// that is inside needs no tests for its children.
+//
+// classify_boxes() works on boxes in struct-of-arrays form, four per SSE
+// instruction (eight with AVX when compiled with -mavx), each plane's
+// coefficients broadcast across the lanes. Callers batch everything they
+// cull in a frame into one call: the quadtree's children, the patch field's
+// instances.
+
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+enum FrustumResult { FRUSTUM_OUTSIDE, FRUSTUM_INTERSECTS, FRUSTUM_INSIDE };
+
+struct Frustum
+{
+    glm::vec4 planes[6];    // xyz: unit normal pointing inwards, w: offset
+};
+
+Frustum frustum_from_matrix(const glm::mat4 &projection_view);
+
+// Boxes to classify together, one array per bound component.
+struct BoxList
+{
+    std::vector<float> min_x, min_y, min_z, max_x, max_y, max_z;
+
+    void clear();
+    void resize(int count);
+    void add(const glm::vec3 &low, const glm::vec3 &high);
+    void set(int i, const glm::vec3 &low, const glm::vec3 &high);
+    int size() const { return (int) min_x.size(); }
+};
+
+// The world-space bounds of the box [low, high] under model.
+void transform_box(const glm::mat4 &model, const glm::vec3 &low, const glm::vec3 &high,
+                   glm::vec3 &world_low, glm::vec3 &world_high);
+
+FrustumResult classify_box(const Frustum &frustum, const glm::vec3 &low, const glm::vec3 &high);
+
+enum CullKernel { CULL_KERNEL_SCALAR, CULL_KERNEL_SSE2, CULL_KERNEL_AVX };
+
+// The widest kernel compiled in; asking for one that is not falls back to
+// the next narrower.
+CullKernel best_cull_kernel();
+const char *cull_kernel_name(CullKernel kernel);
+
+// results[i] is the FrustumResult of box i.
+void classify_boxes(const Frustum &frustum, const BoxList &boxes, unsigned char *results,
+                    CullKernel kernel = best_cull_kernel());
+
+// Culling work for one frame.
+struct CullStats
+{
+    int nodes_visited;    // quadtree nodes (or objects) reached
+    int nodes_culled;     // ... of which outside the frustum
+    int chunks_drawn;     // patches or objects left to draw
+
+    CullStats() : nodes_visited(0), nodes_culled(0), chunks_drawn(0) {}
+};
+
+#endif // FRUSTUM_H
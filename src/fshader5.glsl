@@ -8,12 +8,80 @@ in VS_OUT {
     vec3 TangentViewPos;
     vec3 TangentFragPos;
 } fs_in;
+flat in int MaterialLayer;      // texture array layer, < 0 for the separate maps
 
 uniform sampler2D diffuseMap;
-uniform sampler2D normalMap;
-uniform sampler2D depthMap;
 
 uniform float heightScale;
+// The geometry is already displaced (teshader5.glsl): no parallax march
+uniform bool displaced;
+// normalMap only stores X and Y (BC5); Z is rebuilt from them
+uniform bool normalMapRG;
+
+#define SURFACE_TEXTURE(sampler, coords) texture(sampler, coords)
+#include "surface5.glsl"
+
+// Layers of the material sets alongside heightArray
+uniform sampler2DArray diffuseArray;
+uniform sampler2DArray normalArray;
+
+// Virtual texture (virtual_texture.h); takes precedence over the maps above
+uniform bool virtualTexturing;
+uniform sampler2D vtPageTable;   // per page: atlas slot x, y and tile level
+uniform sampler2D vtHeight;
+uniform sampler2D vtNormal;      // X and Y only
+uniform sampler2D vtDiffuse;
+uniform float vtPages;           // pages per side at level 0
+uniform float vtAtlasTiles;      // slots per side of the atlases
+uniform float vtMaxLevel;
+
+const float VT_TILE_SIZE = 128.0;
+const float VT_TILE_BORDER = 1.0;
+
+// Virtual level wanted at this pixel, set once in main() so that every fetch
+// of the parallax march resolves through the same page table level
+float vtLevel;
+
+float virtualLevel(vec2 uv)
+{
+    vec2 texels = uv * vtPages * (VT_TILE_SIZE - 2.0 * VT_TILE_BORDER);
+    vec2 dx = dFdx(texels), dy = dFdy(texels);
+    return clamp(0.5 * log2(max(dot(dx, dx), dot(dy, dy))), 0.0, vtMaxLevel);
+}
+
+// Translate virtual coordinates to the atlases through the page table, which
+// points at the finest resident tile covering the page
+vec2 virtualToAtlas(vec2 uv)
+{
+    vec2 wrapped = fract(uv);
+    float level = floor(vtLevel);
+    vec4 entry = floor(texelFetch(vtPageTable, ivec2(wrapped * (vtPages / exp2(level))), int(level)) * 255.0 + 0.5);
+    vec2 inTile = fract(wrapped * (vtPages / exp2(entry.z)));
+    vec2 texel = entry.xy * VT_TILE_SIZE + VT_TILE_BORDER + inTile * (VT_TILE_SIZE - 2.0 * VT_TILE_BORDER);
+    return texel / (vtAtlasTiles * VT_TILE_SIZE);
+}
+
+// The height at uv in .a; with packing, the normal texel fetched with it in .rgb
+vec4 sampleSurface(vec2 uv)
+{
+    if (virtualTexturing)
+        return vec4(0.0, 0.0, 0.0, textureLod(vtHeight, virtualToAtlas(uv), 0.0).r);
+    return materialSurface(uv, MaterialLayer);
+}
+
+// Unpack a [0,1] encoded normal, rebuilding Z when only X and Y are stored
+vec3 decodeNormal(vec3 encoded, bool fromXY)
+{
+    vec3 normal;
+    if (fromXY)
+    {
+        normal.xy = encoded.xy * 2.0 - 1.0;
+        normal.z = sqrt(max(1.0 - dot(normal.xy, normal.xy), 0.0));
+    }
+    else
+        normal = normalize(encoded * 2.0 - 1.0);
+    return normal;
+}
 
 // Working
 // vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
@@ -23,7 +91,9 @@ uniform float heightScale;
 //     return texCoords - viewDir.xy * (height * heightScale);        
 // }
 
-vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
+// surface receives sampleSurface() interpolated to the returned coordinates,
+// so packed modes get their normal without another fetch
+vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir, out vec4 surface)
 { 
     // number of depth layers
     const float numLayers = 10;
@@ -37,15 +107,18 @@ vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
     vec2 deltaTexCoords = P / numLayers;
 
     // get initial values
-    vec2  currentTexCoords     = texCoords;
-    float currentDepthMapValue = texture(depthMap, currentTexCoords).r;
+    vec2 currentTexCoords = texCoords;
+    vec4 currentSurface   = sampleSurface(currentTexCoords);
+    vec4 previousSurface  = currentSurface;
     
-    while(currentLayerDepth < currentDepthMapValue)
+    while(currentLayerDepth < currentSurface.a)
     {
         // shift texture coordinates along direction of P
         currentTexCoords -= deltaTexCoords;
-        // get depthmap value at current texture coordinates
-        currentDepthMapValue = texture(depthMap, currentTexCoords).r;  
+        // get depthmap value at current texture coordinates, keeping the
+        // previous one for the interpolation below
+        previousSurface = currentSurface;
+        currentSurface = sampleSurface(currentTexCoords);  
         // get depth of next layer
         currentLayerDepth += layerDepth;  
     }
@@ -53,12 +126,13 @@ vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
     vec2 prevTexCoords = currentTexCoords + deltaTexCoords;
 
     // get depth after and before collision for linear interpolation
-    float afterDepth  = currentDepthMapValue - currentLayerDepth;
-    float beforeDepth = texture(depthMap, prevTexCoords).r - currentLayerDepth + layerDepth;
+    float afterDepth  = currentSurface.a - currentLayerDepth;
+    float beforeDepth = previousSurface.a - currentLayerDepth + layerDepth;
     
     // interpolation of texture coordinates
     float weight = afterDepth / (afterDepth - beforeDepth);
     vec2 finalTexCoords = prevTexCoords * weight + currentTexCoords * (1.0 - weight);
+    surface = mix(currentSurface, previousSurface, weight);
 
     return finalTexCoords;  
     // return currentTexCoords;
@@ -73,16 +147,35 @@ void main()
 {           
     // offset texture coordinates with Parallax Mapping
     vec3 viewDir = normalize(fs_in.TangentViewPos - fs_in.TangentFragPos);
-    vec2 texCoords = ParallaxMapping(fs_in.TexCoords, viewDir);       
+    vtLevel = virtualTexturing ? virtualLevel(fs_in.TexCoords) : 0.0;
+    vec4 surface;
+    vec2 texCoords = fs_in.TexCoords;
+    if (displaced)
+        surface = sampleSurface(texCoords);
+    else
+        texCoords = ParallaxMapping(fs_in.TexCoords, viewDir, surface);       
     // if(texCoords.x > 1.0 || texCoords.y > 1.0 || texCoords.x < 0.0 || texCoords.y < 0.0)
     //     discard;
 
-    // obtain normal from normal map
-    vec3 normal = texture(normalMap, texCoords).rgb;
-    normal = normalize(normal * 2.0 - 1.0);   
+    // obtain normal from normal map (packed modes already have it)
+    vec3 normal;
+    if (virtualTexturing)
+        normal = decodeNormal(textureLod(vtNormal, virtualToAtlas(texCoords), 0.0).rgb, true);
+    else if (MaterialLayer >= 0)
+        normal = decodeNormal(texture(normalArray, vec3(texCoords, MaterialLayer)).rgb, false);
+    else if (normalHeightPacking == 0)
+        normal = decodeNormal(texture(normalMap, texCoords).rgb, normalMapRG);
+    else
+        normal = decodeNormal(surface.rgb, normalHeightPacking == 2);
    
     // get diffuse color
-    vec3 color = texture(diffuseMap, texCoords).rgb;
+    vec3 color;
+    if (virtualTexturing)
+        color = textureLod(vtDiffuse, virtualToAtlas(texCoords), 0.0).rgb;
+    else if (MaterialLayer >= 0)
+        color = texture(diffuseArray, vec3(texCoords, MaterialLayer)).rgb;
+    else
+        color = texture(diffuseMap, texCoords).rgb;
 
     // ambient
     vec3 ambient = 0.1 * color;
@@ -0,0 +1,28 @@
+#version 330 core
+// Snow brushes (snow_gpu.h): the brush's profile on top of the rest depth.
+// Pressing blends with GL_MAX, so the snow only ever gets deeper; filling
+// blends with GL_MIN and caps the pressed depth at the brush's.
+out vec4 FragColor;
+
+in vec2 Local;
+flat in vec2 HalfExtents;
+flat in vec2 DepthFalloff;
+flat in int Shape;
+
+uniform sampler2D restDepth;
+uniform bool fill;
+
+void main()
+{
+    // 0 at the centre, 1 on the edge: an ellipse, or a box for tracks
+    vec2 q = abs(Local) / HalfExtents;
+    float r = Shape == 1 ? max(q.x, q.y) : length(q);
+    if (r >= 1.0)
+        discard;
+    float t = clamp((1.0 - r) / max(DepthFalloff.y, 1e-6), 0.0, 1.0);
+    float profile = t * t * (3.0 - 2.0 * t);
+
+    float rest = texelFetch(restDepth, ivec2(gl_FragCoord.xy), 0).r;
+    float pressed = fill ? mix(1.0, DepthFalloff.x, profile) : DepthFalloff.x * profile;
+    FragColor = vec4(rest + pressed, 0.0, 0.0, 1.0);
+}
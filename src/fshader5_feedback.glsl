@@ -0,0 +1,29 @@
+#version 330
+// Virtual texture feedback (virtual_texture.h): writes the page and level
+// each pixel samples, as bytes (x, y, level, 255); 0 where nothing was drawn.
+out vec4 FragColor;
+
+in VS_OUT {
+    vec3 FragPos;
+    vec2 TexCoords;
+    vec3 TangentLightPos;
+    vec3 TangentViewPos;
+    vec3 TangentFragPos;
+} fs_in;
+
+uniform float vtPages;
+uniform float vtMaxLevel;
+// log2 of how much coarser this pass is than the frame it stands for
+uniform float vtLodBias;
+
+const float VT_TILE_CONTENT = 126.0;
+
+void main()
+{
+    vec2 texels = fs_in.TexCoords * vtPages * VT_TILE_CONTENT;
+    vec2 dx = dFdx(texels), dy = dFdy(texels);
+    float level = floor(clamp(0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + vtLodBias, 0.0, vtMaxLevel));
+
+    vec2 page = floor(fract(fs_in.TexCoords) * (vtPages / exp2(level)));
+    FragColor = vec4(page, level, 255.0) / 255.0;
+}
@@ -0,0 +1,30 @@
+#version 330 core
+// Normals from the snow's depth (height_normals.h), one texel per fragment,
+// as height_normals() does it on the CPU: a wrapped 3x3 Sobel gradient,
+// scaled into a slope and normalized. An RG8 target keeps x and y only.
+out vec4 FragColor;
+
+uniform sampler2D depth;        // rest depth plus pressed depth, R32F
+uniform float slopeScale;       // heightScale times the field's width
+
+ivec2 size;
+
+float depthAt(ivec2 p)
+{
+    p = (p + size) % size;
+    return texelFetch(depth, p, 0).r;
+}
+
+void main()
+{
+    size = textureSize(depth, 0);
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    float ul = depthAt(p + ivec2(-1, -1)), ux = depthAt(p + ivec2(0, -1)), ur = depthAt(p + ivec2(1, -1));
+    float ml = depthAt(p + ivec2(-1, 0)), mr = depthAt(p + ivec2(1, 0));
+    float dl = depthAt(p + ivec2(-1, 1)), dx = depthAt(p + ivec2(0, 1)), dr = depthAt(p + ivec2(1, 1));
+
+    vec2 gradient = vec2((ur + 2.0 * mr + dr) - (ul + 2.0 * ml + dl),
+                         (dl + 2.0 * dx + dr) - (ul + 2.0 * ux + ur));
+    vec3 normal = normalize(vec3(gradient * (slopeScale * 0.125), 1.0));
+    FragColor = vec4(normal * 0.5 + 0.5, 1.0);
+}
@@ -0,0 +1,37 @@
+#version 330 core
+// Snow relaxation and refill (snow_gpu.h), one texel per fragment, as
+// SnowField::tick() does it on the CPU: the pressed depth (the depth less
+// the rest depth) moves towards any neighbour more than the talus away.
+out vec4 FragColor;
+
+uniform sampler2D depth;        // the previous tick's; written is the other copy
+uniform sampler2D restDepth;
+uniform float relaxRate;
+uniform float talus;
+uniform float refill;
+
+ivec2 size;
+
+float pressed(ivec2 p)
+{
+    p = (p + size) % size;
+    return texelFetch(depth, p, 0).r - texelFetch(restDepth, p, 0).r;
+}
+
+// Share of the step a - b beyond the talus
+float excess(float a, float b)
+{
+    float step = a - b;
+    return step - clamp(step, -talus, talus);
+}
+
+void main()
+{
+    size = textureSize(depth, 0);
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    float d = pressed(p);
+    float flow = excess(pressed(p + ivec2(0, -1)), d) + excess(pressed(p + ivec2(0, 1)), d)
+               + excess(pressed(p + ivec2(-1, 0)), d) + excess(pressed(p + ivec2(1, 0)), d);
+    float rest = texelFetch(restDepth, p, 0).r;
+    FragColor = vec4(rest + max(d + relaxRate * flow - refill, 0.0), 0.0, 0.0, 1.0);
+}
@@ -0,0 +1,204 @@
+#include "grid_mesh.h"
+#include "mesh_optimizer.h"
+#include "tangent_space.h"
+
+#include <algorithm>
+#include <iostream>
+
+GridMeshData build_grid_mesh(int resolution, bool primitive_restart, int strip_width)
+{
+    GridMeshData mesh;
+    mesh.resolution = std::max(1, std::min(resolution, GRID_MAX_RESOLUTION));
+    mesh.restart = primitive_restart;
+    strip_width = std::max(1, strip_width);
+
+    const int n = mesh.resolution;
+    const int side = n + 1;
+    const int count = side * side;
+    mesh.restart_index = count <= 0xFFFF ? 0xFFFF : 0xFFFFFFFF;
+
+    // Strips in grid vertex numbering (row * side + column); each row of a
+    // block alternates top and bottom vertices, which keeps the winding CCW
+    // seen from +Z
+    std::vector<uint32_t> strips;
+    strips.reserve((size_t) n * (2 * side + 2 * (n / strip_width + 1)) + 2 * n);
+    for (int c0 = 0; c0 < n; c0 += strip_width)
+    {
+        int c1 = std::min(c0 + strip_width, n);
+        for (int row = 0; row < n; ++row)
+        {
+            if (!strips.empty())
+            {
+                if (primitive_restart)
+                    strips.push_back(mesh.restart_index);
+                else
+                {
+                    // two repeated indices: four degenerate triangles, and
+                    // every strip has an even length so the winding survives
+                    strips.push_back(strips.back());
+                    strips.push_back((uint32_t) ((row + 1) * side + c0));
+                }
+            }
+            for (int c = c0; c <= c1; ++c)
+            {
+                strips.push_back((uint32_t) ((row + 1) * side + c));
+                strips.push_back((uint32_t) (row * side + c));
+            }
+        }
+    }
+
+    // Renumber vertices in order of first use
+    std::vector<uint32_t> remap(count, 0xFFFFFFFF);
+    std::vector<uint32_t> order;
+    order.reserve(count);
+    mesh.indices.resize(strips.size());
+    for (size_t i = 0; i < strips.size(); ++i)
+    {
+        uint32_t v = strips[i];
+        if (primitive_restart && v == mesh.restart_index)
+        {
+            mesh.indices[i] = v;
+            continue;
+        }
+        if (remap[v] == 0xFFFFFFFF)
+        {
+            remap[v] = (uint32_t) order.size();
+            order.push_back(v);
+        }
+        mesh.indices[i] = remap[v];
+    }
+
+    mesh.vertices.assign((size_t) count * VERTEX_FLOATS, 0.0f);
+    for (int i = 0; i < count; ++i)
+    {
+        int row = order[i] / side, column = order[i] % side;
+        float u = (float) column / n, v = (float) row / n;
+        float *vertex = &mesh.vertices[(size_t) i * VERTEX_FLOATS];
+        vertex[0] = 2.0f * u - 1.0f;
+        vertex[1] = 2.0f * v - 1.0f;
+        vertex[5] = 1.0f;
+        vertex[6] = u;
+        vertex[7] = v;
+    }
+
+    std::vector<uint32_t> triangles = strip_triangles(mesh.indices, mesh.restart, mesh.restart_index);
+    generate_tangents(mesh.vertices.data(), count, triangles.data(), triangles.size());
+    return mesh;
+}
+
+//----------------------------------------------------------------------------
+
+GridMesh::GridMesh(int resolution, VertexFormat format)
+    : vao(0), vbo(0), ebo(0), patch_vao(0), patch_ebo(0), patch_index_count(0), vertex_format(format)
+{
+    GridMeshData mesh = build_grid_mesh(resolution, GLEW_VERSION_3_1 != 0);
+    quads = mesh.resolution;
+    vertex_count = mesh.vertex_count();
+    restart = mesh.restart;
+    restart_index = mesh.restart_index;
+    index_count = (GLsizei) mesh.indices.size();
+
+    std::vector<unsigned char> packed;
+    pack_vertices(format, mesh.vertices.data(), vertex_count, packed);
+    vertex_bytes = packed.size();
+
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+    glGenBuffers(1, &ebo);
+    glBindVertexArray(vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertex_bytes, packed.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    if (mesh.short_indices())
+    {
+        std::vector<uint16_t> short_indices(mesh.indices.begin(), mesh.indices.end());
+        index_type = GL_UNSIGNED_SHORT;
+        index_bytes = short_indices.size() * sizeof(uint16_t);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_bytes, short_indices.data(), GL_STATIC_DRAW);
+    }
+    else
+    {
+        index_type = GL_UNSIGNED_INT;
+        index_bytes = mesh.indices.size() * sizeof(uint32_t);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_bytes, mesh.indices.data(), GL_STATIC_DRAW);
+    }
+
+    set_vertex_attributes(format);
+
+    if (tessellation_supported())
+    {
+        // The strips' vertex order is kept for them, so only the triangles
+        // are reordered
+        std::vector<uint32_t> triangles = strip_triangles(mesh.indices, mesh.restart, mesh.restart_index);
+        optimize_vertex_cache(triangles.data(), triangles.size(), vertex_count);
+        patch_index_count = (GLsizei) triangles.size();
+
+        glGenVertexArrays(1, &patch_vao);
+        glGenBuffers(1, &patch_ebo);
+        glBindVertexArray(patch_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, patch_ebo);
+        if (index_type == GL_UNSIGNED_SHORT)
+        {
+            std::vector<uint16_t> short_indices(triangles.begin(), triangles.end());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, short_indices.size() * sizeof(uint16_t), short_indices.data(), GL_STATIC_DRAW);
+        }
+        else
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * sizeof(uint32_t), triangles.data(), GL_STATIC_DRAW);
+        set_vertex_attributes(format);
+    }
+
+    glBindVertexArray(0);
+}
+
+GridMesh::~GridMesh()
+{
+    glDeleteBuffers(1, &patch_ebo);
+    glDeleteVertexArrays(1, &patch_vao);
+    glDeleteBuffers(1, &ebo);
+    glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &vao);
+}
+
+void GridMesh::draw(int instances) const
+{
+    glBindVertexArray(vao);
+    if (restart)
+    {
+        glEnable(GL_PRIMITIVE_RESTART);
+        glPrimitiveRestartIndex(restart_index);
+    }
+    if (instances == 1)
+        glDrawElements(GL_TRIANGLE_STRIP, index_count, index_type, BUFFER_OFFSET(0));
+    else
+        glDrawElementsInstanced(GL_TRIANGLE_STRIP, index_count, index_type, BUFFER_OFFSET(0), instances);
+    if (restart)
+        glDisable(GL_PRIMITIVE_RESTART);
+    glBindVertexArray(0);
+}
+
+bool GridMesh::tessellation_supported()
+{
+    return GLEW_VERSION_4_0 || GLEW_ARB_tessellation_shader;
+}
+
+void GridMesh::draw_patches() const
+{
+    if (!patch_vao)
+        return;
+    glBindVertexArray(patch_vao);
+    glPatchParameteri(GL_PATCH_VERTICES, 3);
+    glDrawElements(GL_PATCHES, patch_index_count, index_type, BUFFER_OFFSET(0));
+    glBindVertexArray(0);
+}
+
+void GridMesh::print_stats() const
+{
+    std::cout << "Grid " << quads << "x" << quads << ": " << vertex_count << " vertices, "
+              << triangles() << " triangles, " << index_count << " "
+              << (index_type == GL_UNSIGNED_SHORT ? 16 : 32) << "-bit indices ("
+              << (restart ? "primitive restart" : "degenerate joins") << "), "
+              << vertex_format_name(vertex_format) << " vertices, " << bytes() / 1024 << " KB" << std::endl;
+}
@@ -0,0 +1,91 @@
+// Indexed grid meshes for the height field: a resolution x resolution grid of
+// quads over [-1,1]^2 in the XY plane (facing +Z, texture coordinates 0..1),
+// built in the same vertex layout as render_quad() and uploaded in any of the
+// vertex_format.h layouts.
+//
+// The grid is drawn as triangle strips. A strip covering the whole width of a
+// large grid evicts its bottom row from the post-transform cache before the
+// next row could reuse it, so strips only span a column block of
+// GRID_STRIP_WIDTH quads: all rows of one block, bottom to top, then the next
+// block. Vertices are stored in the order the strips first use them, so vertex
+// fetch walks the buffer linearly too.
+//
+// Strips are separated by a primitive restart index where GL 3.1 is available,
+// by degenerate triangles otherwise. Indices are 16-bit whenever the vertex
+// count leaves room for the restart index.
+//
+// Where tessellation shaders are available (GL 4.0), the same vertices are
+// also indexed as a triangle list for draw_patches(), one 3-vertex patch per
+// triangle, in vertex cache order (mesh_optimizer.h).
+
+#ifndef GRID_MESH_H
+#define GRID_MESH_H
+
+#include "common.h"
+#include "vertex_format.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Quads per strip; the strip's previous row (GRID_STRIP_WIDTH + 1 vertices)
+// is still in a 32-entry FIFO cache when the next row reuses it.
+const int GRID_STRIP_WIDTH = 14;
+
+const int GRID_MAX_RESOLUTION = 1024;
+
+struct GridMeshData
+{
+    int resolution;                 // quads per side
+    std::vector<float> vertices;    // VERTEX_FLOATS per vertex
+    std::vector<uint32_t> indices;  // triangle strips
+    bool restart;                   // strips separated by restart_index, else degenerates
+    uint32_t restart_index;
+
+    int vertex_count() const { return (int) (vertices.size() / VERTEX_FLOATS); }
+    bool short_indices() const { return vertex_count() <= 0xFFFF; }
+};
+
+// CPU side of a grid; touches no GL state. resolution is clamped to
+// 1..GRID_MAX_RESOLUTION.
+GridMeshData build_grid_mesh(int resolution, bool primitive_restart, int strip_width = GRID_STRIP_WIDTH);
+
+class GridMesh
+{
+public:
+    // Builds and uploads the grid; restart is used when the context has it.
+    explicit GridMesh(int resolution, VertexFormat format = VERTEX_FLOAT);
+    ~GridMesh();
+
+    // Draw instances copies; per-instance attributes go on vertex_array().
+    void draw(int instances = 1) const;
+    GLuint vertex_array() const { return vao; }
+
+    // Draw the triangles as GL_PATCHES for a tessellating program; does
+    // nothing unless tessellation_supported().
+    void draw_patches() const;
+    static bool tessellation_supported();
+
+    int resolution() const { return quads; }
+    VertexFormat format() const { return vertex_format; }
+    int vertices() const { return vertex_count; }
+    int triangles() const { return 2 * quads * quads; }
+    size_t bytes() const { return vertex_bytes + index_bytes; }
+    void print_stats() const;
+
+private:
+    GridMesh(const GridMesh &);
+    GridMesh &operator=(const GridMesh &);
+
+    GLuint vao, vbo, ebo;
+    GLuint patch_vao, patch_ebo;
+    GLenum index_type;
+    GLsizei index_count, patch_index_count;
+    bool restart;
+    GLuint restart_index;
+    int quads, vertex_count;
+    VertexFormat vertex_format;
+    size_t vertex_bytes, index_bytes;
+};
+
+#endif // GRID_MESH_H
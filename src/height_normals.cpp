@@ -0,0 +1,294 @@
+#include "height_normals.h"
+#include "mipmap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define HEIGHT_NORMALS_SSE2 1
+#  include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#  define HEIGHT_NORMALS_AVX 1
+#  include <immintrin.h>
+#endif
+
+NormalKernel best_normal_kernel()
+{
+#if defined(HEIGHT_NORMALS_AVX)
+    return NORMAL_KERNEL_AVX;
+#elif defined(HEIGHT_NORMALS_SSE2)
+    return NORMAL_KERNEL_SSE2;
+#else
+    return NORMAL_KERNEL_SCALAR;
+#endif
+}
+
+const char *normal_kernel_name(NormalKernel kernel)
+{
+    switch (std::min(kernel, best_normal_kernel()))
+    {
+    case NORMAL_KERNEL_AVX: return "AVX";
+    case NORMAL_KERNEL_SSE2: return "SSE2";
+    default: return "scalar";
+    }
+}
+
+int normal_texel_bytes(NormalPacking packing)
+{
+    return packing == NORMALS_RG8 ? 2 : 4;
+}
+
+GLenum normal_internal_format(NormalPacking packing)
+{
+    return packing == NORMALS_RG8 ? GL_RG8 : GL_RGB10_A2;
+}
+
+GLenum normal_format(NormalPacking packing)
+{
+    return packing == NORMALS_RG8 ? GL_RG : GL_RGBA;
+}
+
+GLenum normal_type(NormalPacking packing)
+{
+    return packing == NORMALS_RG8 ? GL_UNSIGNED_BYTE : GL_UNSIGNED_INT_2_10_10_10_REV;
+}
+
+//----------------------------------------------------------------------------
+
+// One texel. The lanes below repeat these operations in this order, so
+// that every kernel rounds the same way.
+static inline void sobel_texel(const float *rest, const float *pressed, size_t up, size_t row, size_t down,
+                               int l, int x, int r, float k, NormalPacking packing, unsigned char *out)
+{
+    float ul = rest[up + l] + pressed[up + l], ux = rest[up + x] + pressed[up + x], ur = rest[up + r] + pressed[up + r];
+    float ml = rest[row + l] + pressed[row + l], mr = rest[row + r] + pressed[row + r];
+    float dl = rest[down + l] + pressed[down + l], dx = rest[down + x] + pressed[down + x],
+          dr = rest[down + r] + pressed[down + r];
+
+    float gx = ((ur + (mr + mr)) + dr) - ((ul + (ml + ml)) + dl);
+    float gy = ((dl + (dx + dx)) + dr) - ((ul + (ux + ux)) + ur);
+    float sx = gx * k, sy = gy * k;
+    float inv = 1.0f / std::sqrt((sx * sx + sy * sy) + 1.0f);
+    float n[3] = { sx * inv, sy * inv, inv };
+
+    if (packing == NORMALS_RG8)
+    {
+        out[0] = (unsigned char) (int) ((n[0] * 0.5f + 0.5f) * 255.0f + 0.5f);
+        out[1] = (unsigned char) (int) ((n[1] * 0.5f + 0.5f) * 255.0f + 0.5f);
+    }
+    else
+    {
+        unsigned int texel = 3u << 30;
+        for (int c = 0; c < 3; ++c)
+            texel |= (unsigned int) (int) ((n[c] * 0.5f + 0.5f) * 1023.0f + 0.5f) << (10 * c);
+        std::memcpy(out, &texel, 4);
+    }
+}
+
+#ifdef HEIGHT_NORMALS_SSE2
+struct Sse2Lanes
+{
+    typedef __m128 F;
+    enum { count = 4 };
+
+    static F set(float v) { return _mm_set1_ps(v); }
+    static F load(const float *a, const float *b) { return _mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(b)); }
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm_div_ps(a, b); }
+    static F sqrt(F a) { return _mm_sqrt_ps(a); }
+
+    static __m128i quantize(F n, float scale)
+    {
+        F half = _mm_set1_ps(0.5f);
+        return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(n, half), half), _mm_set1_ps(scale)), half));
+    }
+
+    static void store_rg8(F x, F y, unsigned char *out)
+    {
+        // x0..x3 y0..y3 as bytes, then interleaved
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(quantize(x, 255.0f), quantize(y, 255.0f)), _mm_setzero_si128());
+        _mm_storel_epi64((__m128i *) out, _mm_unpacklo_epi8(bytes, _mm_srli_si128(bytes, 4)));
+    }
+
+    static void store_rgb10_a2(F x, F y, F z, unsigned char *out)
+    {
+        __m128i texels = _mm_or_si128(_mm_or_si128(quantize(x, 1023.0f), _mm_slli_epi32(quantize(y, 1023.0f), 10)),
+                                      _mm_or_si128(_mm_slli_epi32(quantize(z, 1023.0f), 20), _mm_set1_epi32((int) (3u << 30))));
+        _mm_storeu_si128((__m128i *) out, texels);
+    }
+};
+#endif
+
+#ifdef HEIGHT_NORMALS_AVX
+struct AvxLanes
+{
+    typedef __m256 F;
+    enum { count = 8 };
+
+    static F set(float v) { return _mm256_set1_ps(v); }
+    static F load(const float *a, const float *b) { return _mm256_add_ps(_mm256_loadu_ps(a), _mm256_loadu_ps(b)); }
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+
+    // Packed four texels at a time, as SSE2 does
+    static void store_rg8(F x, F y, unsigned char *out)
+    {
+        Sse2Lanes::store_rg8(_mm256_castps256_ps128(x), _mm256_castps256_ps128(y), out);
+        Sse2Lanes::store_rg8(_mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), out + 8);
+    }
+
+    static void store_rgb10_a2(F x, F y, F z, unsigned char *out)
+    {
+        Sse2Lanes::store_rgb10_a2(_mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z), out);
+        Sse2Lanes::store_rgb10_a2(_mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1),
+                                  _mm256_extractf128_ps(z, 1), out + 16);
+    }
+};
+#endif
+
+// Texels x .. while a whole group of lanes fits before x1, none of them on
+// the field's edge columns; returns where it stopped
+template <typename L>
+static int sobel_lanes(const float *rest, const float *pressed, size_t up, size_t row, size_t down,
+                       int x, int x1, float k, NormalPacking packing, unsigned char *out)
+{
+    typedef typename L::F F;
+    const int bytes = normal_texel_bytes(packing);
+    F scale = L::set(k), one = L::set(1.0f);
+    for (; x + L::count <= x1; x += L::count, out += L::count * bytes)
+    {
+        F ul = L::load(rest + up + x - 1, pressed + up + x - 1), ux = L::load(rest + up + x, pressed + up + x),
+          ur = L::load(rest + up + x + 1, pressed + up + x + 1);
+        F ml = L::load(rest + row + x - 1, pressed + row + x - 1), mr = L::load(rest + row + x + 1, pressed + row + x + 1);
+        F dl = L::load(rest + down + x - 1, pressed + down + x - 1), dx = L::load(rest + down + x, pressed + down + x),
+          dr = L::load(rest + down + x + 1, pressed + down + x + 1);
+
+        F gx = L::sub(L::add(L::add(ur, L::add(mr, mr)), dr), L::add(L::add(ul, L::add(ml, ml)), dl));
+        F gy = L::sub(L::add(L::add(dl, L::add(dx, dx)), dr), L::add(L::add(ul, L::add(ux, ux)), ur));
+        F sx = L::mul(gx, scale), sy = L::mul(gy, scale);
+        F inv = L::div(one, L::sqrt(L::add(L::add(L::mul(sx, sx), L::mul(sy, sy)), one)));
+        if (packing == NORMALS_RG8)
+            L::store_rg8(L::mul(sx, inv), L::mul(sy, inv), out);
+        else
+            L::store_rgb10_a2(L::mul(sx, inv), L::mul(sy, inv), inv, out);
+    }
+    return x;
+}
+
+void height_normals(const float *rest, const float *pressed, int width, int height,
+                    int x0, int y0, int x1, int y1, float slope_scale, NormalPacking packing,
+                    unsigned char *out, size_t row_bytes, NormalKernel kernel)
+{
+    const int bytes = normal_texel_bytes(packing);
+    const float k = slope_scale * 0.125f;
+    kernel = std::min(kernel, best_normal_kernel());
+    // Columns whose neighbours need no wrapping
+    int inner0 = std::max(x0, 1), inner1 = std::min(x1, width - 1);
+
+    for (int y = y0; y < y1; ++y)
+    {
+        size_t up = (size_t) ((y + height - 1) % height) * width, row = (size_t) y * width,
+               down = (size_t) ((y + 1) % height) * width;
+        unsigned char *texels = out + (y - y0) * row_bytes - (size_t) x0 * bytes;
+
+        int x = x0;
+        for (; x < x1 && x < inner0; ++x)
+            sobel_texel(rest, pressed, up, row, down, (x + width - 1) % width, x, (x + 1) % width, k, packing,
+                        texels + (size_t) x * bytes);
+#ifdef HEIGHT_NORMALS_AVX
+        if (kernel >= NORMAL_KERNEL_AVX)
+            x = sobel_lanes<AvxLanes>(rest, pressed, up, row, down, x, inner1, k, packing, texels + (size_t) x * bytes);
+#endif
+#ifdef HEIGHT_NORMALS_SSE2
+        if (kernel >= NORMAL_KERNEL_SSE2)
+            x = sobel_lanes<Sse2Lanes>(rest, pressed, up, row, down, x, inner1, k, packing, texels + (size_t) x * bytes);
+#endif
+        for (; x < x1; ++x)
+            sobel_texel(rest, pressed, up, row, down, (x + width - 1) % width, x, (x + 1) % width, k, packing,
+                        texels + (size_t) x * bytes);
+    }
+}
+
+//----------------------------------------------------------------------------
+
+void downsample_normals_region(const unsigned char *src, int width, int height, NormalPacking packing,
+                               unsigned char *dst, int x0, int y0, int x1, int y1)
+{
+    if (packing == NORMALS_RG8)
+    {
+        downsample_region(src, width, height, 2, dst, x0, y0, x1, y1);
+        return;
+    }
+
+    int dst_width = std::max(width / 2, 1);
+    for (int y = y0; y < y1; ++y)
+    {
+        const unsigned int *rows[2];
+        rows[0] = (const unsigned int *) src + (size_t) std::min(2 * y, height - 1) * width;
+        rows[1] = (const unsigned int *) src + (size_t) std::min(2 * y + 1, height - 1) * width;
+        unsigned int *out = (unsigned int *) dst + (size_t) y * dst_width;
+        for (int x = x0; x < x1; ++x)
+        {
+            int columns[2] = { std::min(2 * x, width - 1), std::min(2 * x + 1, width - 1) };
+            unsigned int sums[3] = { 0, 0, 0 };
+            for (int j = 0; j < 2; ++j)
+                for (int i = 0; i < 2; ++i)
+                {
+                    unsigned int texel = rows[j][columns[i]];
+                    for (int c = 0; c < 3; ++c)
+                        sums[c] += (texel >> (10 * c)) & 1023u;
+                }
+            out[x] = (3u << 30) | ((sums[0] + 2) / 4) | ((sums[1] + 2) / 4) << 10 | ((sums[2] + 2) / 4) << 20;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+
+NormalShader::NormalShader(int unit)
+    : unit(unit), empty_vao(0)
+{
+    GLint current;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+    program = InitShader("vshader5_fullscreen.glsl", "fshader5_normals.glsl");
+    glUniform1i(glGetUniformLocation(program, "depth"), unit);
+    glUseProgram(current);
+    glGenVertexArrays(1, &empty_vao);
+}
+
+NormalShader::~NormalShader()
+{
+    glDeleteVertexArrays(1, &empty_vao);
+    glDeleteProgram(program);
+}
+
+void NormalShader::draw(GLuint depth_texture, GLuint framebuffer, float slope_scale)
+{
+    GLint active, borrowed, current, vertex_array, bound;
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vertex_array);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &bound);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &borrowed);
+
+    glBindTexture(GL_TEXTURE_2D, depth_texture);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "slopeScale"), slope_scale);
+    glBindVertexArray(empty_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, bound);
+    glBindTexture(GL_TEXTURE_2D, borrowed);
+    glActiveTexture(active);
+    glUseProgram(current);
+    glBindVertexArray(vertex_array);
+}
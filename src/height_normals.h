@@ -0,0 +1,81 @@
+// Normals regenerated from a height field, so that the lighting follows the
+// snow as it is pressed instead of the static SnowTextures/normal.jpg.
+//
+// The depth (rest depth plus pressed depth, depthMap's units) is filtered
+// with a 3x3 Sobel operator, wrapping at the edges to match GL_REPEAT, and
+// turned into a unit normal and packed in the same pass - nothing in between
+// is stored:
+//
+//   gx, gy  Sobel gradient of the depth per texel (divided by 8)
+//   n       normalize(slope_scale * gx, slope_scale * gy, 1)
+//
+// Depth grows downwards, so the normal leans towards the deeper side.
+// slope_scale turns depth per texel into height per texture coordinate,
+// heightScale times the field's width. Two packings are offered:
+//
+//   NORMALS_RG8       x and y only, as fshader5.glsl's normalMapRG rebuilds
+//                     z; 2 bytes a texel
+//   NORMALS_RGB10_A2  all three, GL_UNSIGNED_INT_2_10_10_10_REV; 4 bytes
+//
+// height_normals() works on any rectangle, so only the tiles the snow
+// simulation dirtied are redone; the rows are done four texels per SSE2
+// instruction, eight with AVX when compiled with -mavx, and one at a time
+// elsewhere, with identical results. fshader5_normals.glsl is the same
+// filter for GPU fields (NormalShader below); benchmark_snow_normals()
+// checks the two against each other.
+
+#ifndef HEIGHT_NORMALS_H
+#define HEIGHT_NORMALS_H
+
+#include "common.h"
+
+#include <cstddef>
+
+enum NormalPacking { NORMALS_RG8, NORMALS_RGB10_A2 };
+
+enum NormalKernel { NORMAL_KERNEL_SCALAR, NORMAL_KERNEL_SSE2, NORMAL_KERNEL_AVX };
+
+// The widest kernel compiled in; asking for one that is not falls back to
+// the next narrower.
+NormalKernel best_normal_kernel();
+const char *normal_kernel_name(NormalKernel kernel);
+
+int normal_texel_bytes(NormalPacking packing);
+GLenum normal_internal_format(NormalPacking packing);
+GLenum normal_format(NormalPacking packing);
+GLenum normal_type(NormalPacking packing);
+
+// Normals of the texels [x0, x1) x [y0, y1) of a width x height field whose
+// depth is rest + pressed, written from out (texel x0, y0) with rows
+// row_bytes apart.
+void height_normals(const float *rest, const float *pressed, int width, int height,
+                    int x0, int y0, int x1, int y1, float slope_scale, NormalPacking packing,
+                    unsigned char *out, size_t row_bytes, NormalKernel kernel = best_normal_kernel());
+
+// Box-filter the texels [x0, x1) x [y0, y1) of a packed normal level from
+// the level below src, as downsample_region() does for colour (mipmap.h).
+void downsample_normals_region(const unsigned char *src, int width, int height, NormalPacking packing,
+                               unsigned char *dst, int x0, int y0, int x1, int y1);
+
+// The GPU version: draws the normals of an R32F depth texture into a
+// framebuffer whose colour attachment is an RG8 or RGB10_A2 texture of the
+// same size. Borrows texture unit unit while it runs.
+class NormalShader
+{
+public:
+    explicit NormalShader(int unit);
+    ~NormalShader();
+
+    // Every texel of the framebuffer; the caller sets the viewport and
+    // keeps blending, depth testing and culling off.
+    void draw(GLuint depth_texture, GLuint framebuffer, float slope_scale);
+
+private:
+    NormalShader(const NormalShader &);
+    NormalShader &operator=(const NormalShader &);
+
+    int unit;
+    GLuint program, empty_vao;
+};
+
+#endif // HEIGHT_NORMALS_H
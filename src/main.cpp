@@ -3,47 +3,69 @@
 
  #include "common.h"
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <string>
 
-// Create a NULL-terminated string by reading the provided file
+// Create a NULL-terminated string by reading the provided file. A line
+//    #include "file.glsl"
+// is replaced by that file's contents (one level deep), so that stages can
+// share code; the path is relative to the working directory, as shaderFile.
 static char*
 readShaderSource(const char* shaderFile)
 {
-   FILE* fp = fopen(shaderFile, "rb");
-
-   if ( fp == NULL ) { return NULL; }
-
-   fseek(fp, 0L, SEEK_END);
-   long size = ftell(fp);
-
-   fseek(fp, 0L, SEEK_SET);
-   char* buf = new char[size + 1];
-   fread(buf, 1, size, fp);
-
-   buf[size] = '\0';
-   fclose(fp);
+   std::ifstream in( shaderFile, std::ios::binary );
+   if ( !in ) { return NULL; }
+
+   std::string source, line;
+   while ( std::getline( in, line ) ) {
+      size_t start = line.find_first_not_of( " \t" );
+      if ( start != std::string::npos && line.compare( start, 8, "#include" ) == 0 ) {
+         size_t open = line.find( '"', start ), close = line.rfind( '"' );
+         std::ifstream chunk( line.substr( open + 1, close - open - 1 ).c_str(), std::ios::binary );
+         if ( open == std::string::npos || close == open || !chunk ) {
+            std::cerr << shaderFile << ": cannot include " << line.substr( start ) << std::endl;
+            return NULL;
+         }
+         source.append( std::istreambuf_iterator<char>( chunk ), std::istreambuf_iterator<char>() );
+         source += '\n';
+      }
+      else
+         source += line + '\n';
+   }
 
+   char* buf = new char[source.size() + 1];
+   std::copy( source.begin(), source.end(), buf );
+   buf[source.size()] = '\0';
    return buf;
 }
 
 
-// Create a GLSL program object from vertex and fragment shader files
+// Create a GLSL program object from vertex, tessellation and fragment
+// shader files; the tessellation stages may be NULL
 GLuint
-InitShader(const char* vShaderFile, const char* fShaderFile)
+InitShader(const char* vShaderFile, const char* tcShaderFile,
+           const char* teShaderFile, const char* fShaderFile)
 {
    struct Shader {
       const char*  filename;
       GLenum       type;
       GLchar*      source;
-   }  shaders[2] = {
+   }  shaders[4] = {
       { vShaderFile, GL_VERTEX_SHADER, NULL },
+      { tcShaderFile, GL_TESS_CONTROL_SHADER, NULL },
+      { teShaderFile, GL_TESS_EVALUATION_SHADER, NULL },
       { fShaderFile, GL_FRAGMENT_SHADER, NULL }
    };
 
    GLuint program = glCreateProgram();
     
-   for ( int i = 0; i < 2; ++i ) {
+   for ( int i = 0; i < 4; ++i ) {
       Shader& s = shaders[i];
+      if ( s.filename == NULL )
+         continue;
       s.source = readShaderSource( s.filename );
       if ( shaders[i].source == NULL ) {
          std::cerr << "Failed to read " << s.filename << std::endl;
@@ -96,6 +118,13 @@ InitShader(const char* vShaderFile, const char* fShaderFile)
    return program;
 }
 
+// Create a GLSL program object from vertex and fragment shader files
+GLuint
+InitShader(const char* vShaderFile, const char* fShaderFile)
+{
+   return InitShader( vShaderFile, NULL, NULL, fShaderFile );
+}
+
 void
 timer(int unused)
 {
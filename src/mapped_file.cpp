@@ -0,0 +1,137 @@
+#include "mapped_file.h"
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+    : bytes(NULL), length(0)
+#ifdef _WIN32
+    , file_handle(NULL), mapping_handle(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char *path)
+{
+    close();
+
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    file_handle = file;
+    mapping_handle = mapping;
+    bytes = (const unsigned char *) view;
+    length = (size_t) file_size.QuadPart;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (bytes)
+        UnmapViewOfFile(bytes);
+    if (mapping_handle)
+        CloseHandle((HANDLE) mapping_handle);
+    if (file_handle)
+        CloseHandle((HANDLE) file_handle);
+    bytes = NULL;
+    length = 0;
+    file_handle = mapping_handle = NULL;
+}
+
+#else
+
+bool MappedFile::open(const char *path)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *view = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED)
+        return false;
+
+    bytes = (const unsigned char *) view;
+    length = (size_t) st.st_size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (bytes)
+        munmap((void *) bytes, length);
+    bytes = NULL;
+    length = 0;
+}
+
+#endif // _WIN32
+
+bool file_stat(const char *path, int64_t &mtime, int64_t &size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    mtime = (int64_t) st.st_mtime;
+    size = (int64_t) st.st_size;
+    return true;
+}
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t h = seed;
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
@@ -0,0 +1,42 @@
+// Read-only memory-mapped files (mmap on POSIX, file mappings on Windows).
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // Map the whole file; returns false (and stays closed) on failure or for
+    // an empty file.
+    bool open(const char *path);
+    void close();
+
+    bool is_open() const { return bytes != NULL; }
+    const unsigned char *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const unsigned char *bytes;
+    size_t length;
+#ifdef _WIN32
+    void *file_handle;
+    void *mapping_handle;
+#endif
+};
+
+// Modification time (seconds) and size of a file; false if it does not exist.
+bool file_stat(const char *path, int64_t &mtime, int64_t &size);
+
+// 64-bit FNV-1a of a byte range.
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 14695981039346656037ULL);
+
+#endif // MAPPED_FILE_H
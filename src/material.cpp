@@ -0,0 +1,164 @@
+#include "material.h"
+#include "mipmap.h"
+#include "pbo_upload.h"
+#include "texture_loader.h"
+#include "texture_storage.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct MaterialSet
+{
+    const char *name;
+    const char *diffuse, *normal, *height;
+};
+
+static const MaterialSet material_sets[NUM_MATERIALS] = {
+    { "snow",  "SnowTextures/diffuse.jpg", "SnowTextures/normal.jpg", "SnowTextures/height.jpg" },
+    { "brick", "BrickTextures/bricks2.jpg", "BrickTextures/bricks2_normal.jpg",
+               "BrickTextures/parallax_mapping_height_map.png" },
+    { "wood",  "WoodTextures/wood.png", "WoodTextures/toy_box_normal.png", "WoodTextures/toy_box_disp.png" },
+};
+
+const char *material_name(Material material)
+{
+    return material_sets[material].name;
+}
+
+// Which of the three arrays a layer image belongs to.
+enum MaterialMap { MAP_DIFFUSE, MAP_NORMAL, MAP_HEIGHT, NUM_MAPS };
+
+static const int map_channels[NUM_MAPS] = { 3, 3, 1 };
+static const char *const map_names[NUM_MAPS] = { "diffuse", "normal", "height" };
+
+struct LayerImage
+{
+    std::vector<unsigned char> base;
+    std::vector<MipLevel> mips;
+};
+
+// Indexed [map * NUM_MATERIALS + material]
+static std::vector<LayerImage> layers;
+static std::future<void> layers_decoded;
+static std::chrono::steady_clock::time_point request_time;
+
+// Copy to the array's channel count: grey is replicated into RGB, extra
+// channels (alpha, or RGB in a height map) are dropped.
+static void convert_channels(const unsigned char *src, int channels, unsigned char *dst, int wanted, size_t texels)
+{
+    for (size_t i = 0; i < texels; ++i, src += channels, dst += wanted)
+        for (int c = 0; c < wanted; ++c)
+            dst[c] = src[c < channels ? c : 0];
+}
+
+// Flat stand-in for an image that failed to load: mid grey, an up normal, no
+// height.
+static void fill_missing(MaterialMap map, unsigned char *dst, size_t texels)
+{
+    static const unsigned char flat[NUM_MAPS][3] = { { 128, 128, 128 }, { 128, 128, 255 }, { 0, 0, 0 } };
+    for (size_t i = 0; i < texels; ++i, dst += map_channels[map])
+        for (int c = 0; c < map_channels[map]; ++c)
+            dst[c] = flat[map][c];
+}
+
+static void load_layer(MaterialMap map, Material material, int size, LayerImage &layer)
+{
+    const MaterialSet &set = material_sets[material];
+    const char *path = map == MAP_DIFFUSE ? set.diffuse : map == MAP_NORMAL ? set.normal : set.height;
+    int channels = map_channels[map];
+    size_t texels = (size_t) size * size;
+    layer.base.resize(texels * channels);
+
+    DecodedImage image = decode_raw_image(path);
+    if (!image.pixels)
+    {
+        std::cout << "Texture failed to load at path: " << path << std::endl;
+        fill_missing(map, layer.base.data(), texels);
+    }
+    else
+    {
+        std::vector<unsigned char> converted((size_t) image.width * image.height * channels);
+        convert_channels(image.pixels, image.channels, converted.data(), channels,
+                         (size_t) image.width * image.height);
+        if (image.width == size && image.height == size)
+            layer.base.swap(converted);
+        else
+            resize_image(converted.data(), image.width, image.height, channels, layer.base.data(), size, size);
+    }
+    free_image(image);
+
+    MipOptions options;
+    options.normal_map = map == MAP_NORMAL;
+    layer.mips = build_mips(layer.base.data(), size, size, channels, options);
+}
+
+MaterialArrays request_material_arrays(int size)
+{
+    MaterialArrays arrays;
+    glGenTextures(1, &arrays.diffuse);
+    glGenTextures(1, &arrays.normal);
+    glGenTextures(1, &arrays.height);
+    arrays.size = size;
+
+    request_time = std::chrono::steady_clock::now();
+    layers.assign(NUM_MAPS * NUM_MATERIALS, LayerImage());
+    layers_decoded = worker_pool().submit([size] {
+        worker_pool().parallel_for(NUM_MAPS * NUM_MATERIALS, [size](int i) {
+            load_layer(MaterialMap(i / NUM_MATERIALS), Material(i % NUM_MATERIALS), size, layers[i]);
+        });
+    });
+    return arrays;
+}
+
+void upload_material_arrays(const MaterialArrays &arrays)
+{
+    layers_decoded.wait();
+
+    static const GLenum formats[NUM_MAPS] = { GL_RGB, GL_RGB, GL_RED };
+    static const GLint internal_formats[NUM_MAPS] = { GL_RGB8, GL_RGB8, GL_R8 };
+    const GLuint textures[NUM_MAPS] = { arrays.diffuse, arrays.normal, arrays.height };
+    int levels = mip_level_count(arrays.size, arrays.size);
+    size_t bytes = 0;
+
+    TextureUploader &uploader = texture_uploader();
+    for (int map = 0; map < NUM_MAPS; ++map)
+    {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textures[map]);
+        int channels = map_channels[map];
+        bytes += allocate_texture_array(levels, internal_formats[map], arrays.size, arrays.size, NUM_MATERIALS);
+
+        // Account each layer to its material
+        size_t layer_bytes = texture_storage_bytes(internal_formats[map], arrays.size, arrays.size, 1, levels);
+        for (int material = 0; material < NUM_MATERIALS; ++material)
+        {
+            const MaterialSet &set = material_sets[material];
+            register_texture(textures[map], std::string(map_names[map]) + " array [" + set.name + "]",
+                             texture_group(set.diffuse), layer_bytes);
+        }
+
+        int width = arrays.size;
+        for (int level = 0; level < levels; ++level)
+        {
+            for (int material = 0; material < NUM_MATERIALS; ++material)
+            {
+                const LayerImage &layer = layers[map * NUM_MATERIALS + material];
+                const unsigned char *pixels = level == 0 ? layer.base.data() : layer.mips[level - 1].pixels.data();
+                uploader.sub_image_3d(GL_TEXTURE_2D_ARRAY, level, 0, 0, material, width, width, formats[map],
+                                      GL_UNSIGNED_BYTE, pixels, (size_t) width * channels);
+            }
+            width = width > 1 ? width / 2 : 1;
+        }
+
+        apply_texture_params(GL_TEXTURE_2D_ARRAY);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    layers.clear();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - request_time).count();
+    std::cout << "Materials: " << NUM_MATERIALS << " sets in " << arrays.size << "x" << arrays.size
+              << " texture arrays, " << bytes / 1024 << " KB, ready after " << ms << " ms" << std::endl;
+}
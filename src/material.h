@@ -0,0 +1,35 @@
+// Material texture arrays. Every surface set (Snow, Brick, Wood) is loaded as
+// one layer of three GL_TEXTURE_2D_ARRAYs - diffuse, normal and height - all
+// resampled to a common size, so switching material is a change of layer
+// index rather than of three texture bindings, and patches with different
+// surfaces can share one set of bindings (and one draw call).
+//
+// The arrays are uncompressed RGB8 / RGB8 / R8 with CPU-built mip chains.
+
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include "common.h"
+
+enum Material { MAT_SNOW, MAT_BRICK, MAT_WOOD, NUM_MATERIALS };
+
+// Width and height of every layer.
+const int MATERIAL_ARRAY_SIZE = 512;
+
+const char *material_name(Material material);
+
+struct MaterialArrays
+{
+    GLuint diffuse, normal, height;
+    int size;
+};
+
+// Start decoding and resampling every material on the worker pool. The
+// texture names are valid immediately; they receive their contents in
+// upload_material_arrays().
+MaterialArrays request_material_arrays(int size = MATERIAL_ARRAY_SIZE);
+
+// Wait for the decodes and upload every layer and level. Context thread only.
+void upload_material_arrays(const MaterialArrays &arrays);
+
+#endif // MATERIAL_H
@@ -0,0 +1,295 @@
+#include "mesh_optimizer.h"
+#include "benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+
+// FIFO cache by timestamps: a vertex is resident while fewer than cache_size
+// misses followed its own, so no queue has to be kept
+struct FifoCache
+{
+    std::vector<size_t> stamp;
+    size_t time;
+    size_t size;
+
+    FifoCache(int vertex_count, int cache_size)
+        : stamp(vertex_count, 0), time(cache_size + 1), size(cache_size) {}
+
+    bool resident(uint32_t v) const { return time - stamp[v] <= size; }
+
+    // True on a miss
+    bool touch(uint32_t v)
+    {
+        if (resident(v))
+            return false;
+        stamp[v] = time++;
+        return true;
+    }
+
+    // Forget every vertex
+    void flush() { time += size + 1; }
+};
+
+VertexCacheStats analyze_vertex_cache(const uint32_t *indices, size_t index_count, int vertex_count, int cache_size)
+{
+    FifoCache cache(vertex_count, cache_size);
+    std::vector<char> referenced(vertex_count, 0);
+    VertexCacheStats stats;
+    stats.transforms = 0;
+    int vertices = 0;
+    for (size_t i = 0; i < index_count; ++i)
+    {
+        uint32_t v = indices[i];
+        stats.transforms += cache.touch(v);
+        vertices += !referenced[v];
+        referenced[v] = 1;
+    }
+    stats.acmr = index_count ? (double) stats.transforms / (index_count / 3) : 0.0;
+    stats.atvr = vertices ? (double) stats.transforms / vertices : 0.0;
+    return stats;
+}
+
+//----------------------------------------------------------------------------
+// Vertex cache
+
+void optimize_vertex_cache(uint32_t *indices, size_t index_count, int vertex_count, int cache_size,
+                           std::vector<uint32_t> *clusters)
+{
+    const size_t triangle_count = index_count / 3;
+    if (clusters)
+        clusters->clear();
+    if (triangle_count == 0)
+        return;
+
+    // Triangles around every vertex, and how many of them are still to emit
+    std::vector<uint32_t> first(vertex_count + 1, 0);
+    for (size_t i = 0; i < triangle_count * 3; ++i)
+        ++first[indices[i] + 1];
+    for (int v = 0; v < vertex_count; ++v)
+        first[v + 1] += first[v];
+    std::vector<int> live(vertex_count);
+    for (int v = 0; v < vertex_count; ++v)
+        live[v] = (int) (first[v + 1] - first[v]);
+    std::vector<uint32_t> adjacency(triangle_count * 3);
+    {
+        std::vector<uint32_t> fill(first.begin(), first.end() - 1);
+        for (size_t i = 0; i < triangle_count * 3; ++i)
+            adjacency[fill[indices[i]]++] = (uint32_t) (i / 3);
+    }
+
+    FifoCache cache(vertex_count, cache_size);
+    std::vector<char> emitted(triangle_count, 0);
+    std::vector<uint32_t> dead_ends, candidates, out;
+    out.reserve(triangle_count * 3);
+    int cursor = 0;
+    int fan = (int) indices[0];
+    bool new_cluster = true;
+    while (fan >= 0)
+    {
+        candidates.clear();
+        for (uint32_t k = first[fan]; k < first[fan + 1]; ++k)
+        {
+            uint32_t t = adjacency[k];
+            if (emitted[t])
+                continue;
+            if (new_cluster && clusters)
+                clusters->push_back((uint32_t) (out.size() / 3));
+            new_cluster = false;
+            for (int j = 0; j < 3; ++j)
+            {
+                uint32_t v = indices[t * 3 + j];
+                out.push_back(v);
+                dead_ends.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                cache.touch(v);
+            }
+            emitted[t] = 1;
+        }
+
+        // Next fan: the referenced vertex that has been in the cache longest
+        // and can still have all its remaining triangles' vertices fit in it
+        fan = -1;
+        long best = -1;
+        for (size_t i = 0; i < candidates.size(); ++i)
+        {
+            uint32_t v = candidates[i];
+            if (live[v] <= 0)
+                continue;
+            long age = (long) (cache.time - cache.stamp[v]);
+            long priority = age + 2 * live[v] <= cache_size ? age : 0;
+            if (priority > best)
+            {
+                best = priority;
+                fan = (int) v;
+            }
+        }
+        if (fan >= 0)
+            continue;
+
+        // Dead end: the most recent vertex with triangles left, else the
+        // next one in index order
+        new_cluster = true;
+        while (!dead_ends.empty() && fan < 0)
+        {
+            uint32_t v = dead_ends.back();
+            dead_ends.pop_back();
+            if (live[v] > 0)
+                fan = (int) v;
+        }
+        while (fan < 0 && cursor < vertex_count)
+        {
+            if (live[cursor] > 0)
+                fan = cursor;
+            ++cursor;
+        }
+    }
+    std::copy(out.begin(), out.end(), indices);
+}
+
+//----------------------------------------------------------------------------
+// Overdraw
+
+void optimize_overdraw(uint32_t *indices, size_t index_count, const float *positions, size_t stride,
+                       int vertex_count, const std::vector<uint32_t> &clusters, float threshold, int cache_size)
+{
+    const size_t triangle_count = index_count / 3;
+    if (triangle_count == 0)
+        return;
+
+    std::vector<uint32_t> hard(clusters);
+    if (hard.empty() || hard[0] != 0)
+        hard.insert(hard.begin(), 0);
+    hard.push_back((uint32_t) triangle_count);
+
+    // Split each cluster where the part so far already transforms almost as
+    // few vertices per triangle as the whole
+    std::vector<uint32_t> starts;
+    FifoCache cache(vertex_count, cache_size);
+    for (size_t c = 0; c + 1 < hard.size(); ++c)
+    {
+        uint32_t begin = hard[c], end = hard[c + 1];
+        cache.flush();
+        size_t misses = 0;
+        for (size_t i = (size_t) begin * 3; i < (size_t) end * 3; ++i)
+            misses += cache.touch(indices[i]);
+        double limit = (double) misses / (end - begin) * threshold;
+
+        starts.push_back(begin);
+        cache.flush();
+        misses = 0;
+        uint32_t start = begin;
+        for (uint32_t t = begin; t < end; ++t)
+        {
+            for (int j = 0; j < 3; ++j)
+                misses += cache.touch(indices[t * 3 + j]);
+            if (t + 1 < end && (double) misses / (t + 1 - start) <= limit)
+            {
+                start = t + 1;
+                starts.push_back(start);
+                cache.flush();
+                misses = 0;
+            }
+        }
+    }
+    starts.push_back((uint32_t) triangle_count);
+
+    // Area-weighted centroid and normal of every cluster and of the mesh
+    const size_t count = starts.size() - 1;
+    std::vector<float> centroids(count * 3, 0.0f), normals(count * 3, 0.0f);
+    double mesh_centroid[3] = { 0.0, 0.0, 0.0 }, mesh_area = 0.0;
+    for (size_t c = 0; c < count; ++c)
+    {
+        double area_sum = 0.0, centroid[3] = { 0.0, 0.0, 0.0 }, normal[3] = { 0.0, 0.0, 0.0 };
+        for (uint32_t t = starts[c]; t < starts[c + 1]; ++t)
+        {
+            const float *a = positions + indices[t * 3] * stride;
+            const float *b = positions + indices[t * 3 + 1] * stride;
+            const float *d = positions + indices[t * 3 + 2] * stride;
+            double e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            double e2[3] = { d[0] - a[0], d[1] - a[1], d[2] - a[2] };
+            double n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+            double area = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            for (int k = 0; k < 3; ++k)
+            {
+                centroid[k] += area * (a[k] + b[k] + d[k]) / 3.0;
+                normal[k] += n[k];
+            }
+            area_sum += area;
+        }
+        for (int k = 0; k < 3; ++k)
+        {
+            mesh_centroid[k] += centroid[k];
+            centroids[c * 3 + k] = (float) (area_sum > 0.0 ? centroid[k] / area_sum : 0.0);
+            normals[c * 3 + k] = (float) normal[k];
+        }
+        mesh_area += area_sum;
+    }
+    for (int k = 0; k < 3; ++k)
+        mesh_centroid[k] = mesh_area > 0.0 ? mesh_centroid[k] / mesh_area : 0.0;
+
+    // Outward-facing clusters far from the centre first
+    std::vector<float> keys(count);
+    for (size_t c = 0; c < count; ++c)
+    {
+        const float *n = &normals[c * 3];
+        float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        float key = 0.0f;
+        for (int k = 0; k < 3; ++k)
+            key += (centroids[c * 3 + k] - (float) mesh_centroid[k]) * n[k];
+        keys[c] = length > 0.0f ? key / length : 0.0f;
+    }
+    std::vector<uint32_t> order(count);
+    for (size_t c = 0; c < count; ++c)
+        order[c] = (uint32_t) c;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] > keys[b]; });
+
+    std::vector<uint32_t> out;
+    out.reserve(triangle_count * 3);
+    for (size_t i = 0; i < count; ++i)
+        out.insert(out.end(), indices + (size_t) starts[order[i]] * 3, indices + (size_t) starts[order[i] + 1] * 3);
+    std::copy(out.begin(), out.end(), indices);
+}
+
+//----------------------------------------------------------------------------
+// Vertex fetch
+
+int optimize_vertex_fetch(std::vector<float> &vertices, size_t stride, uint32_t *indices, size_t index_count)
+{
+    const size_t vertex_count = vertices.size() / stride;
+    std::vector<uint32_t> remap(vertex_count, 0xFFFFFFFF);
+    std::vector<float> out;
+    out.reserve(vertices.size());
+    uint32_t next = 0;
+    for (size_t i = 0; i < index_count; ++i)
+    {
+        uint32_t &v = remap[indices[i]];
+        if (v == 0xFFFFFFFF)
+        {
+            v = next++;
+            out.insert(out.end(), vertices.begin() + indices[i] * stride, vertices.begin() + (indices[i] + 1) * stride);
+        }
+        indices[i] = v;
+    }
+    vertices.swap(out);
+    return (int) next;
+}
+
+MeshOptimizeStats optimize_mesh(std::vector<float> &vertices, size_t stride, std::vector<uint32_t> &indices,
+                                int cache_size)
+{
+    BenchClock::time_point start = BenchClock::now();
+    const int vertex_count = (int) (vertices.size() / stride);
+    MeshOptimizeStats stats;
+    stats.before = analyze_vertex_cache(indices.data(), indices.size(), vertex_count, cache_size);
+
+    std::vector<uint32_t> clusters;
+    optimize_vertex_cache(indices.data(), indices.size(), vertex_count, cache_size, &clusters);
+    optimize_overdraw(indices.data(), indices.size(), vertices.data(), stride, vertex_count, clusters, 1.05f,
+                      cache_size);
+    int used = optimize_vertex_fetch(vertices, stride, indices.data(), indices.size());
+
+    stats.after = analyze_vertex_cache(indices.data(), indices.size(), used, cache_size);
+    stats.ms = bench_ms(start);
+    return stats;
+}
@@ -0,0 +1,70 @@
+// Load-time reordering of indexed triangle meshes (imported props, grid
+// triangle lists) for the vertex and fragment stages, in three passes:
+//
+//   vertex cache   Tipsify (Sander, Nehab and Barczak 2007): triangles are
+//                  emitted as fans around a vertex, the next fan chosen
+//                  among the vertices just referenced so that it is still in
+//                  a FIFO cache of cache_size entries.
+//   overdraw       the Tipsify order is cut into clusters, at its dead ends
+//                  and wherever a cluster's own miss rate is within
+//                  threshold of the whole cluster's, and the clusters are
+//                  sorted so that the outward-facing ones, most likely in
+//                  front, draw first; later fragments then fail the depth
+//                  test before the parallax march in fshader5.glsl runs.
+//   vertex fetch   vertices renumbered in order of first use, so that the
+//                  fetches walk the vertex buffer linearly.
+//
+// The cache is measured as ACMR, vertex transforms per triangle (0.5 at
+// best for a regular grid, 3 at worst), and ATVR, transforms per vertex (1
+// at best). Touches no GL state.
+
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Post-transform cache assumed by the optimizer and the statistics: a
+// 32-entry FIFO, as for the grid strips (grid_mesh.h).
+const int VERTEX_CACHE_SIZE = 32;
+
+struct VertexCacheStats
+{
+    size_t transforms;      // cache misses
+    double acmr;            // transforms per triangle
+    double atvr;            // transforms per referenced vertex
+};
+
+// Simulate the FIFO over a triangle list.
+VertexCacheStats analyze_vertex_cache(const uint32_t *indices, size_t index_count, int vertex_count,
+                                      int cache_size = VERTEX_CACHE_SIZE);
+
+// Reorder the triangles of indices in place with Tipsify. clusters, if
+// given, receives the first triangle of every run that started at a dead end.
+void optimize_vertex_cache(uint32_t *indices, size_t index_count, int vertex_count,
+                           int cache_size = VERTEX_CACHE_SIZE, std::vector<uint32_t> *clusters = NULL);
+
+// Reorder the clusters of a cache-optimized triangle list (first triangles
+// from optimize_vertex_cache) front to back. Clusters are split further while
+// that keeps each one's ACMR within threshold of its undivided ACMR.
+// positions: x, y, z at the start of every stride floats.
+void optimize_overdraw(uint32_t *indices, size_t index_count, const float *positions, size_t stride,
+                       int vertex_count, const std::vector<uint32_t> &clusters, float threshold = 1.05f,
+                       int cache_size = VERTEX_CACHE_SIZE);
+
+// Renumber vertices in order of first use, moving the stride-float vertices
+// to match; unreferenced vertices are dropped. Returns the new vertex count.
+int optimize_vertex_fetch(std::vector<float> &vertices, size_t stride, uint32_t *indices, size_t index_count);
+
+struct MeshOptimizeStats
+{
+    VertexCacheStats before, after;
+    double ms;
+};
+
+// All three passes over a mesh of stride-float vertices, positions first.
+MeshOptimizeStats optimize_mesh(std::vector<float> &vertices, size_t stride, std::vector<uint32_t> &indices,
+                                int cache_size = VERTEX_CACHE_SIZE);
+
+#endif // MESH_OPTIMIZER_H
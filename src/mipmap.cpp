@@ -0,0 +1,492 @@
+#include "mipmap.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define MIPMAP_SSE2 1
+#  include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#  define MIPMAP_AVX2 1
+#  include <immintrin.h>
+#endif
+
+int mip_level_count(int width, int height)
+{
+    int levels = 1;
+    while (width > 1 || height > 1)
+    {
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+        ++levels;
+    }
+    return levels;
+}
+
+// Run fn(first_row, last_row) over [0, rows), in bands on the pool when asked.
+template <typename Fn>
+static void for_row_bands(int rows, bool parallel, Fn fn)
+{
+    const int min_band = 16;
+    int bands = parallel ? std::min((int) worker_pool().size() + 1, rows / min_band) : 1;
+    if (bands <= 1)
+    {
+        fn(0, rows);
+        return;
+    }
+
+    worker_pool().parallel_for(bands, [&](int band) {
+        fn(rows * band / bands, rows * (band + 1) / bands);
+    });
+}
+
+//----------------------------------------------------------------------------
+// Box filter
+
+// sum[i] = a[i] + b[i] for n bytes, widened to 16 bits.
+static void add_rows(const unsigned char *a, const unsigned char *b, uint16_t *sum, int n)
+{
+    int i = 0;
+#if MIPMAP_AVX2
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (a + i)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (b + i)));
+        _mm256_storeu_si256((__m256i *) (sum + i), _mm256_add_epi16(va, vb));
+    }
+#endif
+#if MIPMAP_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+        _mm_storeu_si128((__m128i *) (sum + i), lo);
+        _mm_storeu_si128((__m128i *) (sum + i + 8), hi);
+    }
+#endif
+    for (; i < n; ++i)
+        sum[i] = (uint16_t) (a[i] + b[i]);
+}
+
+// dst texel x = rounded average of the two column sums 2x and 2x+1.
+static void reduce_columns(const uint16_t *sum, int src_width, int channels, unsigned char *dst, int dst_width)
+{
+    int x = 0;
+#if MIPMAP_SSE2
+    const __m128i two32 = _mm_set1_epi32(2);
+    const __m128i two16 = _mm_set1_epi16(2);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+    if (channels == 1)
+    {
+        // 8 output texels from 16 column sums: madd adds neighbouring lanes.
+        for (; x + 8 <= dst_width && 2 * x + 16 <= src_width; x += 8)
+        {
+            __m128i p0 = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (sum + 2 * x)), ones);
+            __m128i p1 = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (sum + 2 * x + 8)), ones);
+            p0 = _mm_srli_epi32(_mm_add_epi32(p0, two32), 2);
+            p1 = _mm_srli_epi32(_mm_add_epi32(p1, two32), 2);
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(p0, p1), zero);
+            _mm_storel_epi64((__m128i *) (dst + x), packed);
+        }
+    }
+    else if (channels == 4)
+    {
+        // 4 output texels per iteration; each 128-bit load holds the two
+        // source texels that make up one output texel.
+        for (; x + 4 <= dst_width && 2 * x + 8 <= src_width; x += 4)
+        {
+            const uint16_t *s = sum + 8 * x;
+            __m128i s0 = _mm_loadu_si128((const __m128i *) (s));
+            __m128i s1 = _mm_loadu_si128((const __m128i *) (s + 8));
+            __m128i s2 = _mm_loadu_si128((const __m128i *) (s + 16));
+            __m128i s3 = _mm_loadu_si128((const __m128i *) (s + 24));
+            s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+            s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+            s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+            s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+            __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), two16), 2);
+            __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), two16), 2);
+            _mm_storeu_si128((__m128i *) (dst + 4 * x), _mm_packus_epi16(lo, hi));
+        }
+    }
+    else if (channels == 3)
+    {
+        // 4 output texels per iteration. A load at a texel pair holds both
+        // source texels three lanes apart, so adding it shifted down three
+        // lanes leaves the pair's sum in lanes 0-2; the four sums are then
+        // lined up as twelve lanes and packed.
+        const __m128i low3 = _mm_setr_epi16(-1, -1, -1, 0, 0, 0, 0, 0);
+        for (; x + 4 <= dst_width && 2 * x + 10 <= src_width; x += 4)
+        {
+            __m128i t[4];
+            for (int i = 0; i < 4; ++i)
+            {
+                __m128i s = _mm_loadu_si128((const __m128i *) (sum + 6 * (x + i)));
+                t[i] = _mm_and_si128(_mm_add_epi16(s, _mm_srli_si128(s, 6)), low3);
+            }
+            __m128i a = _mm_or_si128(t[0], _mm_slli_si128(t[1], 6));
+            __m128i b = _mm_or_si128(t[2], _mm_slli_si128(t[3], 6));
+            a = _mm_srli_epi16(_mm_add_epi16(a, two16), 2);
+            b = _mm_srli_epi16(_mm_add_epi16(b, two16), 2);
+            __m128i packed = _mm_packus_epi16(_mm_or_si128(a, _mm_slli_si128(b, 12)), _mm_srli_si128(b, 4));
+            _mm_storel_epi64((__m128i *) (dst + 3 * x), packed);
+            int last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+            memcpy(dst + 3 * x + 8, &last, 4);
+        }
+    }
+#endif
+    for (; x < dst_width; ++x)
+    {
+        int x0 = 2 * x, x1 = std::min(2 * x + 1, src_width - 1);
+        for (int k = 0; k < channels; ++k)
+            dst[x * channels + k] = (unsigned char) ((sum[x0 * channels + k] + sum[x1 * channels + k] + 2) >> 2);
+    }
+}
+
+static void box_rows(const unsigned char *src, int width, int height, int channels,
+                     unsigned char *dst, int dst_width, int first, int last)
+{
+    std::vector<uint16_t> sum(width * channels);
+    size_t src_stride = (size_t) width * channels;
+    size_t dst_stride = (size_t) dst_width * channels;
+
+    for (int y = first; y < last; ++y)
+    {
+        const unsigned char *r0 = src + 2 * y * src_stride;
+        const unsigned char *r1 = src + std::min(2 * y + 1, height - 1) * src_stride;
+        add_rows(r0, r1, sum.data(), (int) src_stride);
+        reduce_columns(sum.data(), width, channels, dst + y * dst_stride, dst_width);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Kaiser-windowed sinc, 6 taps per output texel
+
+static const int KAISER_TAPS = 6;
+static const double PI = 3.14159265358979323846;
+
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 20; ++k)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static void kaiser_weights(float weights[KAISER_TAPS])
+{
+    const double alpha = 4.0, radius = 1.5;   // radius in output texels
+    double total = 0.0;
+    double w[KAISER_TAPS];
+    for (int i = 0; i < KAISER_TAPS; ++i)
+    {
+        // Source texel centres relative to the output centre, in output texels.
+        double t = (i - 2.5) / 2.0;
+        double sinc = t == 0.0 ? 1.0 : sin(PI * t) / (PI * t);
+        double r = t / radius;
+        double window = bessel_i0(alpha * sqrt(std::max(0.0, 1.0 - r * r))) / bessel_i0(alpha);
+        w[i] = sinc * window;
+        total += w[i];
+    }
+    for (int i = 0; i < KAISER_TAPS; ++i)
+        weights[i] = (float) (w[i] / total);
+}
+
+static inline int wrap(int i, int n)
+{
+    i %= n;
+    return i < 0 ? i + n : i;
+}
+
+// dst[i] = src[i] for n bytes, as floats.
+static void widen_row(const unsigned char *src, float *dst, int n)
+{
+    int i = 0;
+#if MIPMAP_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_ps(dst + i + 8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_ps(dst + i + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] = src[i];
+}
+
+// One output texel of the horizontal pass; column holds its six taps'
+// offsets into line.
+static inline void kaiser_texel(const float *line, const int *column, int channels,
+                                const float weights[KAISER_TAPS], float *out)
+{
+    for (int k = 0; k < channels; ++k)
+    {
+        float acc = 0.0f;
+        for (int t = 0; t < KAISER_TAPS; ++t)
+            acc += weights[t] * line[column[t] + k];
+        out[k] = acc;
+    }
+}
+
+// Horizontal pass over one source row, widened to floats in line (with four
+// floats of padding past its end).
+static void kaiser_row(const float *line, int width, int channels, const float weights[KAISER_TAPS],
+                       const int *columns, float *out, int dst_width)
+{
+    // Texels [1, inner) have all six taps inside the row, unwrapped.
+    int inner = width >= 4 ? std::min(dst_width, (width - 4) / 2 + 1) : 0;
+    int x = 1;
+#if MIPMAP_SSE2
+    __m128 w[KAISER_TAPS];
+    for (int t = 0; t < KAISER_TAPS; ++t)
+        w[t] = _mm_set1_ps(weights[t]);
+    if (channels == 1)
+    {
+        // 4 output texels per iteration: their taps are every other float.
+        for (; x + 4 <= inner; x += 4)
+        {
+            __m128 acc = _mm_setzero_ps();
+            for (int t = 0; t < KAISER_TAPS; ++t)
+            {
+                const float *s = line + 2 * x - 2 + t;
+                __m128 even = _mm_shuffle_ps(_mm_loadu_ps(s), _mm_loadu_ps(s + 4), _MM_SHUFFLE(2, 0, 2, 0));
+                acc = _mm_add_ps(acc, _mm_mul_ps(w[t], even));
+            }
+            _mm_storeu_ps(out + x, acc);
+        }
+    }
+    else if (channels >= 3)
+    {
+        // One output texel per iteration, its channels side by side; a
+        // 3-channel load carries the next texel's first channel, unused.
+        for (; x < inner; ++x)
+        {
+            __m128 acc = _mm_setzero_ps();
+            for (int t = 0; t < KAISER_TAPS; ++t)
+                acc = _mm_add_ps(acc, _mm_mul_ps(w[t], _mm_loadu_ps(line + (2 * x - 2 + t) * channels)));
+            if (channels == 4)
+                _mm_storeu_ps(out + 4 * x, acc);
+            else
+            {
+                float texel[4];
+                _mm_storeu_ps(texel, acc);
+                out[3 * x] = texel[0];
+                out[3 * x + 1] = texel[1];
+                out[3 * x + 2] = texel[2];
+            }
+        }
+    }
+#endif
+    kaiser_texel(line, columns, channels, weights, out);
+    for (; x < dst_width; ++x)
+        kaiser_texel(line, &columns[x * KAISER_TAPS], channels, weights, out + x * channels);
+}
+
+// Vertical pass: out[i] = the six rows' weighted sum at i, rounded and
+// clamped, for n values.
+static void kaiser_column(const float *const rows[KAISER_TAPS], const float weights[KAISER_TAPS],
+                          unsigned char *out, size_t n)
+{
+    size_t i = 0;
+#if MIPMAP_SSE2
+    __m128 w[KAISER_TAPS];
+    for (int t = 0; t < KAISER_TAPS; ++t)
+        w[t] = _mm_set1_ps(weights[t]);
+    const __m128 half = _mm_set1_ps(0.5f), low = _mm_setzero_ps(), high = _mm_set1_ps(255.0f);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i quads[4];
+        for (int q = 0; q < 4; ++q)
+        {
+            __m128 acc = _mm_setzero_ps();
+            for (int t = 0; t < KAISER_TAPS; ++t)
+                acc = _mm_add_ps(acc, _mm_mul_ps(w[t], _mm_loadu_ps(rows[t] + i + 4 * q)));
+            acc = _mm_max_ps(low, _mm_min_ps(high, _mm_add_ps(acc, half)));
+            quads[q] = _mm_cvttps_epi32(acc);
+        }
+        __m128i lo = _mm_packs_epi32(quads[0], quads[1]), hi = _mm_packs_epi32(quads[2], quads[3]);
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        float acc = 0.0f;
+        for (int t = 0; t < KAISER_TAPS; ++t)
+            acc += weights[t] * rows[t][i];
+        out[i] = (unsigned char) std::min(255.0f, std::max(0.0f, acc + 0.5f));
+    }
+}
+
+static void kaiser_downsample(const unsigned char *src, int width, int height, int channels,
+                              unsigned char *dst, int dst_width, int dst_height, bool parallel)
+{
+    float weights[KAISER_TAPS];
+    kaiser_weights(weights);
+
+    // Horizontal pass over every source row, then vertical over output rows.
+    std::vector<float> horizontal((size_t) height * dst_width * channels);
+
+    std::vector<int> columns(dst_width * KAISER_TAPS);
+    for (int x = 0; x < dst_width; ++x)
+        for (int t = 0; t < KAISER_TAPS; ++t)
+            columns[x * KAISER_TAPS + t] = wrap(2 * x - 2 + t, width) * channels;
+
+    for_row_bands(height, parallel, [&](int first, int last) {
+        std::vector<float> line((size_t) width * channels + 4);
+        for (int y = first; y < last; ++y)
+        {
+            widen_row(src + (size_t) y * width * channels, line.data(), width * channels);
+            kaiser_row(line.data(), width, channels, weights, columns.data(),
+                       &horizontal[(size_t) y * dst_width * channels], dst_width);
+        }
+    });
+
+    size_t stride = (size_t) dst_width * channels;
+    for_row_bands(dst_height, parallel, [&](int first, int last) {
+        for (int y = first; y < last; ++y)
+        {
+            const float *rows[KAISER_TAPS];
+            for (int t = 0; t < KAISER_TAPS; ++t)
+                rows[t] = &horizontal[wrap(2 * y - 2 + t, height) * stride];
+            kaiser_column(rows, weights, dst + y * stride, stride);
+        }
+    });
+}
+
+//----------------------------------------------------------------------------
+
+static void renormalize_rows(unsigned char *pixels, int width, int channels, int first, int last)
+{
+    for (int y = first; y < last; ++y)
+    {
+        unsigned char *p = pixels + (size_t) y * width * channels;
+        for (int x = 0; x < width; ++x, p += channels)
+        {
+            float nx = p[0] / 127.5f - 1.0f, ny = p[1] / 127.5f - 1.0f, nz = p[2] / 127.5f - 1.0f;
+            float len = std::sqrt(nx * nx + ny * ny + nz * nz);
+            if (len < 1e-6f)
+                continue;
+            float inv = 127.5f / len;
+            p[0] = (unsigned char) std::min(255.0f, nx * inv + 128.0f);
+            p[1] = (unsigned char) std::min(255.0f, ny * inv + 128.0f);
+            p[2] = (unsigned char) std::min(255.0f, nz * inv + 128.0f);
+        }
+    }
+}
+
+void downsample_level(const unsigned char *src, int width, int height, int channels,
+                      unsigned char *dst, const MipOptions &options)
+{
+    int dst_width = std::max(width / 2, 1);
+    int dst_height = std::max(height / 2, 1);
+
+    if (options.filter == MIP_KAISER)
+        kaiser_downsample(src, width, height, channels, dst, dst_width, dst_height, options.parallel);
+
+    bool renormalize = options.normal_map && channels >= 3;
+    bool box = options.filter == MIP_BOX;
+    if (box || renormalize)
+    {
+        for_row_bands(dst_height, options.parallel, [&](int first, int last) {
+            if (box)
+                box_rows(src, width, height, channels, dst, dst_width, first, last);
+            if (renormalize)
+                renormalize_rows(dst, dst_width, channels, first, last);
+        });
+    }
+}
+
+void downsample_region(const unsigned char *src, int width, int height, int channels,
+                       unsigned char *dst, int x0, int y0, int x1, int y1)
+{
+    int dst_width = std::max(width / 2, 1);
+    int src_width = width - 2 * x0;     // columns from 2 * x0 to the edge
+    int columns = std::min(2 * (x1 - x0), src_width);
+    std::vector<uint16_t> sum((size_t) columns * channels);
+    size_t src_stride = (size_t) width * channels;
+    const unsigned char *left = src + (size_t) 2 * x0 * channels;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        const unsigned char *r0 = left + 2 * y * src_stride;
+        const unsigned char *r1 = left + std::min(2 * y + 1, height - 1) * src_stride;
+        add_rows(r0, r1, sum.data(), columns * channels);
+        reduce_columns(sum.data(), columns, channels, dst + ((size_t) y * dst_width + x0) * channels, x1 - x0);
+    }
+}
+
+std::vector<MipLevel> build_mips(const unsigned char *base, int width, int height, int channels,
+                                 const MipOptions &options)
+{
+    std::vector<MipLevel> levels(mip_level_count(width, height) - 1);
+
+    const unsigned char *src = base;
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        MipLevel &level = levels[i];
+        level.width = std::max(width / 2, 1);
+        level.height = std::max(height / 2, 1);
+        level.pixels.resize((size_t) level.width * level.height * channels);
+
+        downsample_level(src, width, height, channels, level.pixels.data(), options);
+
+        src = level.pixels.data();
+        width = level.width;
+        height = level.height;
+    }
+    return levels;
+}
+
+void resize_image(const unsigned char *src, int width, int height, int channels,
+                  unsigned char *dst, int dst_width, int dst_height, bool parallel)
+{
+    float sx = (float) width / dst_width, sy = (float) height / dst_height;
+
+    std::vector<int> x0(dst_width), x1(dst_width);
+    std::vector<float> fx(dst_width);
+    for (int x = 0; x < dst_width; ++x)
+    {
+        float u = (x + 0.5f) * sx - 0.5f;
+        int i = (int) std::floor(u);
+        fx[x] = u - i;
+        x0[x] = wrap(i, width) * channels;
+        x1[x] = wrap(i + 1, width) * channels;
+    }
+
+    for_row_bands(dst_height, parallel, [&](int first, int last) {
+        for (int y = first; y < last; ++y)
+        {
+            float v = (y + 0.5f) * sy - 0.5f;
+            int j = (int) std::floor(v);
+            float fy = v - j;
+            const unsigned char *r0 = src + (size_t) wrap(j, height) * width * channels;
+            const unsigned char *r1 = src + (size_t) wrap(j + 1, height) * width * channels;
+
+            unsigned char *out = dst + (size_t) y * dst_width * channels;
+            for (int x = 0; x < dst_width; ++x)
+            {
+                for (int k = 0; k < channels; ++k)
+                {
+                    float top = r0[x0[x] + k] + fx[x] * (r0[x1[x] + k] - r0[x0[x] + k]);
+                    float bottom = r1[x0[x] + k] + fx[x] * (r1[x1[x] + k] - r1[x0[x] + k]);
+                    out[x * channels + k] = (unsigned char) (top + fy * (bottom - top) + 0.5f);
+                }
+            }
+        }
+    });
+}
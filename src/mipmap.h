@@ -0,0 +1,57 @@
+// CPU mip-chain generation for 8-bit images with 1-4 channels, used in place
+// of glGenerateMipmap so that the filter is ours (not the driver's) and the
+// work can run on the worker pool while assets load.
+//
+// Each level halves the previous one (rounding down, minimum 1, as GL does).
+// The box filter is vectorized for 1, 3 and 4 channels (SSE2, AVX2 when
+// compiled with -mavx2, scalar elsewhere); the Kaiser filter is a separable
+// windowed-sinc that keeps more detail and wraps at the edges to match
+// GL_REPEAT sampling, with both passes in SSE2. Rows of every level are split
+// across the pool.
+
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <vector>
+
+enum MipFilter { MIP_BOX, MIP_KAISER };
+
+struct MipOptions
+{
+    MipFilter filter;
+    bool normal_map;    // renormalize RGB as a unit vector after filtering
+    bool parallel;      // split each level's rows across the worker pool
+
+    MipOptions() : filter(MIP_BOX), normal_map(false), parallel(true) {}
+};
+
+struct MipLevel
+{
+    int width, height;
+    std::vector<unsigned char> pixels;   // tightly packed, channels bytes per texel
+};
+
+int mip_level_count(int width, int height);
+
+// Build levels 1..mip_level_count()-1 from the base image. Level 0 is not
+// copied; callers upload it from their own buffer.
+std::vector<MipLevel> build_mips(const unsigned char *base, int width, int height, int channels,
+                                 const MipOptions &options = MipOptions());
+
+// Produce one level from its parent; dst must hold max(w/2,1) * max(h/2,1) texels.
+void downsample_level(const unsigned char *src, int width, int height, int channels,
+                      unsigned char *dst, const MipOptions &options);
+
+// Box-filter only the texels [x0, x1) x [y0, y1) of the level below src,
+// exactly as downsample_level() would; dst is that whole level. For images
+// edited in place, one rectangle at a time.
+void downsample_region(const unsigned char *src, int width, int height, int channels,
+                       unsigned char *dst, int x0, int y0, int x1, int y1);
+
+// Bilinear resample to an arbitrary size, wrapping at the edges. Exact 2:1
+// reductions come out as a box filter. Used to bring images that are
+// combined or layered together to a common size.
+void resize_image(const unsigned char *src, int width, int height, int channels,
+                  unsigned char *dst, int dst_width, int dst_height, bool parallel = true);
+
+#endif // MIPMAP_H
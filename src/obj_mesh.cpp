@@ -0,0 +1,709 @@
+#include "obj_mesh.h"
+#include "benchmark.h"
+#include "mapped_file.h"
+#include "tangent_space.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+
+static const char MESHCACHE_MAGIC[4] = { 'M', 'S', 'H', '1' };
+static const uint32_t MESHCACHE_VERSION = 2;
+
+static const size_t MIN_CHUNK_BYTES = 256 * 1024;
+
+//----------------------------------------------------------------------------
+// Tokens
+
+static inline bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static inline const char *skip_blanks(const char *p, const char *end)
+{
+    while (p < end && is_blank(*p))
+        ++p;
+    return p;
+}
+
+static const double POW10[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// [sign] digits [. digits] [e [sign] digits]. The first 19 significant
+// digits are gathered exactly in an integer, which is scaled once by a power
+// of ten: exact to well within a float. NULL if there is no number at p.
+static const char *parse_float(const char *p, const char *end, float &value)
+{
+    p = skip_blanks(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; p < end && is_digit(*p); ++p, any = true)
+    {
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        }
+        else
+            ++exponent;
+    }
+    if (p < end && *p == '.')
+        for (++p; p < end && is_digit(*p); ++p, any = true)
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                --exponent;
+            }
+    if (!any)
+        return NULL;
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char *q = p + 1;
+        bool exponent_negative = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            exponent_negative = *q++ == '-';
+        if (q < end && is_digit(*q))
+        {
+            int e = 0;
+            for (; q < end && is_digit(*q); ++q)
+                e = std::min(e * 10 + (*q - '0'), 10000);
+            exponent += exponent_negative ? -e : e;
+            p = q;
+        }
+    }
+
+    double scaled = (double) mantissa;
+    if (exponent >= 0 && exponent <= 22)
+        scaled *= POW10[exponent];
+    else if (exponent < 0 && exponent >= -22)
+        scaled /= POW10[-exponent];
+    else
+        scaled *= std::pow(10.0, exponent);
+    value = (float) (negative ? -scaled : scaled);
+    return p;
+}
+
+// [sign] digits; NULL if there are none.
+static const char *parse_int(const char *p, const char *end, int &value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    if (p >= end || !is_digit(*p))
+        return NULL;
+    long long n = 0;
+    for (; p < end && is_digit(*p); ++p)
+        n = std::min(n * 10 + (*p - '0'), 0x7FFFFFFFLL);
+    value = (int) (negative ? -n : n);
+    return p;
+}
+
+//----------------------------------------------------------------------------
+// Chunked parse
+
+namespace {
+
+enum LineKind { LINE_OTHER, LINE_POSITION, LINE_TEXCOORD, LINE_NORMAL, LINE_FACE };
+
+// A piece of the file, whole lines only
+struct ObjChunk
+{
+    const char *begin, *end;
+    int positions, texcoords, normals, triangles;   // counted, then the bases
+    bool ok;
+};
+
+// Everything of the file, each chunk parsing into its own slice
+struct ObjArrays
+{
+    std::vector<float> positions, texcoords, normals;
+    std::vector<int> corners;   // position, texcoord, normal per corner; -1 if absent
+};
+
+}
+
+// Kind of the line at p (already past leading blanks), and where its
+// payload starts
+static LineKind line_kind(const char *p, const char *end, const char *&payload)
+{
+    if (end - p < 2)
+        return LINE_OTHER;
+    if (p[0] == 'v')
+    {
+        if (is_blank(p[1]))
+        {
+            payload = p + 1;
+            return LINE_POSITION;
+        }
+        if (end - p >= 3 && is_blank(p[2]))
+        {
+            payload = p + 2;
+            if (p[1] == 't')
+                return LINE_TEXCOORD;
+            if (p[1] == 'n')
+                return LINE_NORMAL;
+        }
+        return LINE_OTHER;
+    }
+    if (p[0] == 'f' && is_blank(p[1]))
+    {
+        payload = p + 1;
+        return LINE_FACE;
+    }
+    return LINE_OTHER;
+}
+
+template <typename Fn>
+static void for_lines(const char *begin, const char *end, Fn fn)
+{
+    for (const char *line = begin; line < end;)
+    {
+        const char *newline = (const char *) memchr(line, '\n', end - line);
+        const char *line_end = newline ? newline : end;
+        const char *p = skip_blanks(line, line_end);
+        const char *payload = NULL;
+        LineKind kind = line_kind(p, line_end, payload);
+        if (kind != LINE_OTHER)
+            fn(kind, payload, line_end);
+        line = line_end + 1;
+    }
+}
+
+static int count_face_corners(const char *p, const char *end)
+{
+    int corners = 0;
+    for (;;)
+    {
+        p = skip_blanks(p, end);
+        if (p >= end || *p == '#')
+            return corners;
+        ++corners;
+        while (p < end && !is_blank(*p))
+            ++p;
+    }
+}
+
+static void count_chunk(ObjChunk &chunk)
+{
+    chunk.positions = chunk.texcoords = chunk.normals = chunk.triangles = 0;
+    for_lines(chunk.begin, chunk.end, [&](LineKind kind, const char *p, const char *end) {
+        switch (kind)
+        {
+        case LINE_POSITION: ++chunk.positions; break;
+        case LINE_TEXCOORD: ++chunk.texcoords; break;
+        case LINE_NORMAL: ++chunk.normals; break;
+        case LINE_FACE: chunk.triangles += std::max(count_face_corners(p, end) - 2, 0); break;
+        default: break;
+        }
+    });
+}
+
+// OBJ index (1-based, or negative counting back from the last element read)
+// to 0-based; -1 if it is out of range
+static inline int resolve_index(int index, int read)
+{
+    int resolved = index > 0 ? index - 1 : read + index;
+    return resolved >= 0 && resolved < read ? resolved : -1;
+}
+
+// chunk holds the bases of its slices
+static void parse_chunk(ObjChunk &chunk, ObjArrays &arrays)
+{
+    float *position = arrays.positions.data() + (size_t) chunk.positions * 3;
+    float *texcoord = arrays.texcoords.data() + (size_t) chunk.texcoords * 2;
+    float *normal = arrays.normals.data() + (size_t) chunk.normals * 3;
+    int *corner = arrays.corners.data() + (size_t) chunk.triangles * 9;
+    int positions = chunk.positions, texcoords = chunk.texcoords, normals = chunk.normals;
+
+    chunk.ok = true;
+    for_lines(chunk.begin, chunk.end, [&](LineKind kind, const char *p, const char *end) {
+        if (!chunk.ok)
+            return;
+        int floats = kind == LINE_TEXCOORD ? 2 : 3;
+        float *out = kind == LINE_POSITION ? position : kind == LINE_TEXCOORD ? texcoord : normal;
+        if (kind != LINE_FACE)
+        {
+            // Extra values (w, vertex colours) are ignored
+            for (int i = 0; i < floats && p; ++i)
+                p = parse_float(p, end, out[i]);
+            chunk.ok = p != NULL;
+            if (kind == LINE_POSITION)
+                position += 3, ++positions;
+            else if (kind == LINE_TEXCOORD)
+                texcoord += 2, ++texcoords;
+            else
+                normal += 3, ++normals;
+            return;
+        }
+
+        // v, v/vt, v//vn or v/vt/vn per corner; polygons are fanned from the
+        // first corner
+        int first[3], previous[3], count = 0;
+        for (;;)
+        {
+            p = skip_blanks(p, end);
+            if (p >= end || *p == '#')
+                break;
+            int v = 0, vt = 0, vn = 0, ref[3];
+            p = parse_int(p, end, v);
+            if (p && p < end && *p == '/')
+            {
+                ++p;
+                if (p < end && *p != '/')
+                    p = parse_int(p, end, vt);
+                if (p && p < end && *p == '/')
+                    p = parse_int(p + 1, end, vn);
+            }
+            if (!p || (p < end && !is_blank(*p)))
+            {
+                chunk.ok = false;
+                return;
+            }
+            ref[0] = resolve_index(v, positions);
+            ref[1] = vt ? resolve_index(vt, texcoords) : -1;
+            ref[2] = vn ? resolve_index(vn, normals) : -1;
+            if (ref[0] < 0 || (vt && ref[1] < 0) || (vn && ref[2] < 0))
+            {
+                chunk.ok = false;
+                return;
+            }
+
+            if (count == 0)
+                std::copy(ref, ref + 3, first);
+            else if (count >= 2)
+            {
+                std::copy(first, first + 3, corner);
+                std::copy(previous, previous + 3, corner + 3);
+                std::copy(ref, ref + 3, corner + 6);
+                corner += 9;
+            }
+            std::copy(ref, ref + 3, previous);
+            ++count;
+        }
+    });
+}
+
+//----------------------------------------------------------------------------
+// Welding
+
+namespace {
+
+// Open-addressing table from a corner's index triple to its vertex
+class CornerWelder
+{
+public:
+    explicit CornerWelder(size_t corners)
+    {
+        size_t capacity = 16;
+        while (capacity < corners * 2)
+            capacity *= 2;
+        mask = capacity - 1;
+        slots.assign(capacity, -1);
+        keys.reserve(corners * 3 / 4 * 3);
+    }
+
+    // Vertex of the triple, adding it if it is new
+    uint32_t weld(const int *triple)
+    {
+        uint32_t h = (uint32_t) triple[0] * 0x9E3779B1u ^ (uint32_t) triple[1] * 0x85EBCA77u
+                   ^ (uint32_t) triple[2] * 0xC2B2AE3Du;
+        h ^= h >> 15;
+        for (size_t slot = h & mask;; slot = (slot + 1) & mask)
+        {
+            int vertex = slots[slot];
+            if (vertex < 0)
+            {
+                vertex = (int) (keys.size() / 3);
+                slots[slot] = vertex;
+                keys.insert(keys.end(), triple, triple + 3);
+                return vertex;
+            }
+            const int *key = &keys[(size_t) vertex * 3];
+            if (key[0] == triple[0] && key[1] == triple[1] && key[2] == triple[2])
+                return vertex;
+        }
+    }
+
+    int vertices() const { return (int) (keys.size() / 3); }
+    const int *key(int vertex) const { return &keys[(size_t) vertex * 3]; }
+
+private:
+    size_t mask;
+    std::vector<int> slots;
+    std::vector<int> keys;
+};
+
+}
+
+bool parse_obj(const char *path, MeshData &mesh, bool parallel)
+{
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+    const char *data = (const char *) file.data();
+    const size_t size = file.size();
+
+    int chunk_count = 1;
+    if (parallel)
+        chunk_count = (int) std::max((size_t) 1, std::min(size / MIN_CHUNK_BYTES, (size_t) (worker_pool().size() + 1) * 4));
+
+    std::vector<ObjChunk> chunks(chunk_count);
+    const char *start = data;
+    for (int i = 0; i < chunk_count; ++i)
+    {
+        const char *end = data + size * (i + 1) / chunk_count;
+        if (i + 1 < chunk_count)
+        {
+            const char *newline = (const char *) memchr(end, '\n', data + size - end);
+            end = newline ? newline + 1 : data + size;
+        }
+        end = std::max(end, start);
+        chunks[i].begin = start;
+        chunks[i].end = end;
+        start = end;
+    }
+
+    auto each_chunk = [&](const std::function<void(ObjChunk &)> &fn) {
+        if (chunk_count == 1)
+            fn(chunks[0]);
+        else
+            worker_pool().parallel_for(chunk_count, [&](int i) { fn(chunks[i]); });
+    };
+
+    each_chunk(count_chunk);
+
+    // Counts to bases
+    int totals[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < chunk_count; ++i)
+    {
+        int counts[4] = { chunks[i].positions, chunks[i].texcoords, chunks[i].normals, chunks[i].triangles };
+        chunks[i].positions = totals[0];
+        chunks[i].texcoords = totals[1];
+        chunks[i].normals = totals[2];
+        chunks[i].triangles = totals[3];
+        for (int k = 0; k < 4; ++k)
+            totals[k] += counts[k];
+    }
+    if (totals[0] == 0 || totals[3] == 0)
+        return false;
+
+    ObjArrays arrays;
+    arrays.positions.resize((size_t) totals[0] * 3);
+    arrays.texcoords.resize((size_t) totals[1] * 2);
+    arrays.normals.resize((size_t) totals[2] * 3);
+    arrays.corners.resize((size_t) totals[3] * 9);
+    each_chunk([&](ObjChunk &chunk) { parse_chunk(chunk, arrays); });
+    for (int i = 0; i < chunk_count; ++i)
+        if (!chunks[i].ok)
+            return false;
+
+    const size_t corner_count = (size_t) totals[3] * 3;
+    CornerWelder welder(corner_count);
+    mesh.indices.resize(corner_count);
+    bool missing_normals = false;
+    for (size_t i = 0; i < corner_count; ++i)
+    {
+        const int *triple = &arrays.corners[i * 3];
+        mesh.indices[i] = welder.weld(triple);
+        missing_normals |= triple[2] < 0;
+    }
+
+    // Area-weighted face normals per position, for corners without one
+    std::vector<glm::vec3> face_normals;
+    if (missing_normals)
+    {
+        const glm::vec3 *positions = (const glm::vec3 *) arrays.positions.data();
+        face_normals.assign(totals[0], glm::vec3(0.0f));
+        for (size_t i = 0; i < corner_count; i += 3)
+        {
+            int a = arrays.corners[i * 3], b = arrays.corners[i * 3 + 3], c = arrays.corners[i * 3 + 6];
+            glm::vec3 n = glm::cross(positions[b] - positions[a], positions[c] - positions[a]);
+            face_normals[a] += n;
+            face_normals[b] += n;
+            face_normals[c] += n;
+        }
+    }
+
+    const int vertex_count = welder.vertices();
+    mesh.vertices.assign((size_t) vertex_count * VERTEX_FLOATS, 0.0f);
+    mesh.low = glm::vec3(1e30f);
+    mesh.high = glm::vec3(-1e30f);
+    for (int v = 0; v < vertex_count; ++v)
+    {
+        const int *key = welder.key(v);
+        float *vertex = &mesh.vertices[(size_t) v * VERTEX_FLOATS];
+        glm::vec3 position = glm::vec3(arrays.positions[key[0] * 3], arrays.positions[key[0] * 3 + 1],
+                                       arrays.positions[key[0] * 3 + 2]);
+        glm::vec3 normal = key[2] >= 0 ? glm::vec3(arrays.normals[key[2] * 3], arrays.normals[key[2] * 3 + 1],
+                                                   arrays.normals[key[2] * 3 + 2])
+                                       : face_normals[key[0]];
+        float length = glm::length(normal);
+        normal = length > 0.0f ? normal / length : glm::vec3(0, 1, 0);
+
+        vertex[0] = position.x;
+        vertex[1] = position.y;
+        vertex[2] = position.z;
+        vertex[3] = normal.x;
+        vertex[4] = normal.y;
+        vertex[5] = normal.z;
+        if (key[1] >= 0)
+        {
+            vertex[6] = arrays.texcoords[key[1] * 2];
+            vertex[7] = arrays.texcoords[key[1] * 2 + 1];
+        }
+        mesh.low = glm::min(mesh.low, position);
+        mesh.high = glm::max(mesh.high, position);
+    }
+
+    TangentOptions options;
+    options.parallel = parallel;
+    generate_tangents(mesh.vertices.data(), vertex_count, mesh.indices.data(), mesh.indices.size(), options);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// Cache
+
+std::string mesh_cache_path(const char *source_path)
+{
+    return std::string(source_path) + ".meshcache";
+}
+
+static bool source_hash(const char *source_path, uint64_t &hash)
+{
+    MappedFile source;
+    if (!source.open(source_path))
+        return false;
+    hash = hash_bytes(source.data(), source.size());
+    return true;
+}
+
+static bool open_mesh_cache(const char *source_path, MappedFile &file, const MeshCacheHeader *&header,
+                            VertexFormat format)
+{
+    int64_t mtime, size;
+    if (!file_stat(source_path, mtime, size) || !file.open(mesh_cache_path(source_path).c_str()))
+        return false;
+
+    header = (const MeshCacheHeader *) file.data();
+    bool valid = file.size() >= sizeof(MeshCacheHeader)
+        && memcmp(header->magic, MESHCACHE_MAGIC, 4) == 0
+        && header->version == MESHCACHE_VERSION
+        && header->vertex_format == (uint32_t) format
+        && header->vertex_offset + header->vertex_bytes <= file.size()
+        && header->index_offset + header->index_bytes <= file.size()
+        && header->vertex_bytes == (uint64_t) header->vertex_count * vertex_size(format)
+        && header->index_bytes == (uint64_t) header->index_count * (header->index_type == GL_UNSIGNED_SHORT ? 2 : 4);
+
+    if (valid && (header->source_mtime != mtime || header->source_size != size))
+    {
+        uint64_t hash;
+        valid = header->source_size == size && source_hash(source_path, hash) && hash == header->source_hash;
+    }
+
+    if (!valid)
+        file.close();
+    return valid;
+}
+
+// Packed vertices and indices, as they are uploaded and cached
+static void pack_mesh(const MeshData &mesh, VertexFormat format, MeshCacheHeader &header,
+                      std::vector<unsigned char> &vertices, std::vector<unsigned char> &indices)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESHCACHE_MAGIC, 4);
+    header.version = MESHCACHE_VERSION;
+    header.vertex_format = format;
+    header.vertex_count = mesh.vertex_count();
+    header.index_count = (uint32_t) mesh.indices.size();
+    for (int k = 0; k < 3; ++k)
+    {
+        header.low[k] = mesh.low[k];
+        header.high[k] = mesh.high[k];
+    }
+
+    pack_vertices(format, mesh.vertices.data(), mesh.vertex_count(), vertices);
+    if (mesh.vertex_count() <= 0xFFFF)
+    {
+        header.index_type = GL_UNSIGNED_SHORT;
+        indices.resize(mesh.indices.size() * sizeof(uint16_t));
+        uint16_t *out = (uint16_t *) indices.data();
+        for (size_t i = 0; i < mesh.indices.size(); ++i)
+            out[i] = (uint16_t) mesh.indices[i];
+    }
+    else
+    {
+        header.index_type = GL_UNSIGNED_INT;
+        indices.resize(mesh.indices.size() * sizeof(uint32_t));
+        memcpy(indices.data(), mesh.indices.data(), indices.size());
+    }
+
+    header.vertex_offset = sizeof(MeshCacheHeader);
+    header.vertex_bytes = vertices.size();
+    header.index_offset = (header.vertex_offset + header.vertex_bytes + 3) & ~(uint64_t) 3;
+    header.index_bytes = indices.size();
+}
+
+static bool write_cache_file(const std::string &source_path, MeshCacheHeader header,
+                             const std::vector<unsigned char> &vertices, const std::vector<unsigned char> &indices)
+{
+    if (!file_stat(source_path.c_str(), header.source_mtime, header.source_size)
+        || !source_hash(source_path.c_str(), header.source_hash))
+        return false;
+
+    std::string path = mesh_cache_path(source_path.c_str());
+    std::string temp = path + ".tmp";
+
+    FILE *fp = fopen(temp.c_str(), "wb");
+    if (fp == NULL)
+        return false;
+    const char padding[4] = { 0, 0, 0, 0 };
+    size_t pad = (size_t) (header.index_offset - header.vertex_offset - header.vertex_bytes);
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(vertices.data(), 1, vertices.size(), fp) == vertices.size()
+        && fwrite(padding, 1, pad, fp) == pad
+        && fwrite(indices.data(), 1, indices.size(), fp) == indices.size();
+    ok = fclose(fp) == 0 && ok;
+
+    remove(path.c_str());
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        remove(temp.c_str());
+        std::cerr << "Could not write mesh cache " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool write_mesh_cache(const char *source_path, const MeshData &mesh, VertexFormat format)
+{
+    MeshCacheHeader header;
+    std::vector<unsigned char> vertices, indices;
+    pack_mesh(mesh, format, header, vertices, indices);
+    return write_cache_file(source_path, header, vertices, indices);
+}
+
+//----------------------------------------------------------------------------
+
+ObjMesh::ObjMesh()
+    : vao(0), vbo(0), ebo(0), vertex_format(VERTEX_PACKED), vertex_count(0), index_count(0),
+      index_type(GL_UNSIGNED_INT), bounds_low(0.0f), bounds_high(0.0f), from_cache(false), optimized(false),
+      optimize_stats(), last_load_ms(0.0)
+{
+}
+
+ObjMesh::~ObjMesh()
+{
+    glDeleteBuffers(1, &ebo);
+    glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &vao);
+}
+
+void ObjMesh::upload(const void *vertices, size_t vertex_bytes, const void *indices, size_t index_bytes)
+{
+    if (vao == 0)
+    {
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glGenBuffers(1, &ebo);
+    }
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertex_bytes, vertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_bytes, indices, GL_STATIC_DRAW);
+    set_vertex_attributes(vertex_format);
+    glBindVertexArray(0);
+}
+
+bool ObjMesh::load(const char *source_path, const MeshLoadOptions &options)
+{
+    BenchClock::time_point start = BenchClock::now();
+    path = source_path;
+    vertex_format = options.format;
+
+    // Warm start: the mapped cache goes straight to the driver
+    MappedFile cache;
+    const MeshCacheHeader *header = NULL;
+    if (options.use_cache && open_mesh_cache(source_path, cache, header, options.format))
+    {
+        upload(cache.data() + header->vertex_offset, header->vertex_bytes,
+               cache.data() + header->index_offset, header->index_bytes);
+        vertex_count = header->vertex_count;
+        index_count = header->index_count;
+        index_type = header->index_type;
+        bounds_low = glm::vec3(header->low[0], header->low[1], header->low[2]);
+        bounds_high = glm::vec3(header->high[0], header->high[1], header->high[2]);
+        from_cache = true;
+        optimized = false;
+        last_load_ms = bench_ms(start);
+        return true;
+    }
+
+    MeshData mesh;
+    if (!parse_obj(source_path, mesh, options.parallel))
+    {
+        std::cerr << "Could not load mesh " << source_path << std::endl;
+        return false;
+    }
+    optimized = options.optimize;
+    if (optimized)
+        optimize_stats = optimize_mesh(mesh.vertices, VERTEX_FLOATS, mesh.indices);
+
+    MeshCacheHeader packed_header;
+    std::shared_ptr< std::vector<unsigned char> > vertices = std::make_shared< std::vector<unsigned char> >();
+    std::shared_ptr< std::vector<unsigned char> > indices = std::make_shared< std::vector<unsigned char> >();
+    pack_mesh(mesh, options.format, packed_header, *vertices, *indices);
+    upload(vertices->data(), vertices->size(), indices->data(), indices->size());
+
+    vertex_count = packed_header.vertex_count;
+    index_count = packed_header.index_count;
+    index_type = packed_header.index_type;
+    bounds_low = mesh.low;
+    bounds_high = mesh.high;
+    from_cache = false;
+    last_load_ms = bench_ms(start);
+
+    if (options.use_cache)
+    {
+        std::string source(source_path);
+        worker_pool().submit([source, packed_header, vertices, indices] {
+            write_cache_file(source, packed_header, *vertices, *indices);
+        });
+    }
+    return true;
+}
+
+void ObjMesh::draw(int instances) const
+{
+    glBindVertexArray(vao);
+    if (instances == 1)
+        glDrawElements(GL_TRIANGLES, index_count, index_type, BUFFER_OFFSET(0));
+    else
+        glDrawElementsInstanced(GL_TRIANGLES, index_count, index_type, BUFFER_OFFSET(0), instances);
+    glBindVertexArray(0);
+}
+
+void ObjMesh::print_stats() const
+{
+    std::cout << "Mesh " << path << ": " << vertex_count << " vertices, " << triangles() << " triangles, "
+              << vertex_format_name(vertex_format) << " vertices, "
+              << (from_cache ? "mapped from cache" : "parsed") << " in " << last_load_ms << " ms" << std::endl;
+    if (optimized)
+        std::cout << "  optimized in " << optimize_stats.ms << " ms: ACMR " << optimize_stats.before.acmr << " -> "
+                  << optimize_stats.after.acmr << ", ATVR " << optimize_stats.before.atvr << " -> "
+                  << optimize_stats.after.atvr << std::endl;
+}
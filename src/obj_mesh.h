@@ -0,0 +1,118 @@
+// Wavefront OBJ import for the props that stamp into the snow (boots, sleds,
+// trees).
+//
+// The file is memory-mapped and split at line boundaries into chunks parsed
+// on the worker pool, in two passes: the first counts each chunk's positions,
+// texcoords, normals and triangles, so that the second can parse straight
+// into its slice of the shared arrays and resolve relative (negative)
+// indices. Floats go through a small parser of our own rather than strtof,
+// which is locale-bound and several times slower. Face corners are then
+// welded into unique vertices with an open-addressing hash table keyed on
+// their (position, texcoord, normal) triple, polygons are fanned into
+// triangles, missing normals are computed from the faces and tangents come
+// from tangent_space.h. ObjMesh::load() then reorders triangles and vertices
+// for the vertex cache, overdraw and vertex fetch (mesh_optimizer.h).
+//
+// "<obj>.meshcache" holds the result packed in a vertex format, in the exact
+// layout the buffers take, following texture_cache.h: a warm start maps it
+// and hands the mapping straight to glBufferData. The cache is used while
+// the source's size and mtime (or failing those, content hash) still match.
+
+#ifndef OBJ_MESH_H
+#define OBJ_MESH_H
+
+#include "common.h"
+#include "mesh_optimizer.h"
+#include "vertex_format.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct MeshData
+{
+    std::vector<float> vertices;     // VERTEX_FLOATS per vertex
+    std::vector<uint32_t> indices;   // triangles
+    glm::vec3 low, high;             // bounds of the positions
+
+    int vertex_count() const { return (int) (vertices.size() / VERTEX_FLOATS); }
+};
+
+// Parse the OBJ file at path. False if it cannot be read, has no faces or
+// refers to vertices it does not have.
+bool parse_obj(const char *path, MeshData &mesh, bool parallel = true);
+
+struct MeshCacheHeader
+{
+    char     magic[4];          // "MSH1"
+    uint32_t version;
+    int64_t  source_mtime;
+    int64_t  source_size;
+    uint64_t source_hash;
+    uint32_t vertex_format;     // VertexFormat of the stored vertices
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint32_t index_type;        // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    float    low[3], high[3];
+    uint64_t vertex_offset, vertex_bytes;
+    uint64_t index_offset, index_bytes;
+};
+
+std::string mesh_cache_path(const char *source_path);
+
+// Pack mesh in format and write it as the cache for source_path.
+bool write_mesh_cache(const char *source_path, const MeshData &mesh, VertexFormat format);
+
+struct MeshLoadOptions
+{
+    VertexFormat format;
+    bool parallel;      // parse chunks on the worker pool
+    bool use_cache;     // read, and after a parse write, "<obj>.meshcache"
+    bool optimize;      // reorder for the vertex cache and overdraw after a parse
+
+    MeshLoadOptions() : format(VERTEX_PACKED), parallel(true), use_cache(true), optimize(true) {}
+};
+
+// An OBJ mesh in GL buffers.
+class ObjMesh
+{
+public:
+    ObjMesh();
+    ~ObjMesh();
+
+    // Load path, from its cache when that is valid. The cache is written on
+    // the worker pool after a parse.
+    bool load(const char *path, const MeshLoadOptions &options = MeshLoadOptions());
+
+    void draw(int instances = 1) const;
+
+    int vertices() const { return vertex_count; }
+    int triangles() const { return (int) (index_count / 3); }
+    const glm::vec3 &low() const { return bounds_low; }
+    const glm::vec3 &high() const { return bounds_high; }
+    VertexFormat format() const { return vertex_format; }
+    bool loaded_from_cache() const { return from_cache; }
+    double load_ms() const { return last_load_ms; }
+    void print_stats() const;
+
+private:
+    ObjMesh(const ObjMesh &);
+    ObjMesh &operator=(const ObjMesh &);
+
+    void upload(const void *vertices, size_t vertex_bytes, const void *indices, size_t index_bytes);
+
+    GLuint vao, vbo, ebo;
+    std::string path;
+    VertexFormat vertex_format;
+    int vertex_count;
+    GLsizei index_count;
+    GLenum index_type;
+    glm::vec3 bounds_low, bounds_high;
+    bool from_cache, optimized;
+    MeshOptimizeStats optimize_stats;
+    double last_load_ms;
+};
+
+#endif // OBJ_MESH_H
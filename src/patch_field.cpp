@@ -0,0 +1,194 @@
+#include "patch_field.h"
+#include "benchmark.h"
+#include "thread_pool.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+static const float PATCH_SPACING = 2.5f;   // between patch centres; patches are 2 wide
+static const float PATCH_HEIGHT = -1.2f;   // below the single surface's view
+static const int MIN_PATCHES_PER_JOB = 256;
+
+PatchField::PatchField(int count)
+    : mesh(PATCH_FIELD_RESOLUTION, VERTEX_PACKED), instance_buffer(0), layer_buffer(0), material_count(0),
+      culled(false), last_update_ms(0.0), last_cull_ms(0.0)
+{
+    glGenBuffers(1, &instance_buffer);
+    glGenBuffers(1, &layer_buffer);
+    if (GLEW_VERSION_3_3)
+    {
+        glBindVertexArray(mesh.vertex_array());
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        for (int column = 0; column < 4; ++column)
+        {
+            GLuint attribute = INSTANCE_MODEL_ATTRIBUTE + column;
+            glEnableVertexAttribArray(attribute);
+            glVertexAttribPointer(attribute, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+                                  BUFFER_OFFSET(column * sizeof(glm::vec4)));
+            glVertexAttribDivisor(attribute, 1);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, layer_buffer);
+        glEnableVertexAttribArray(INSTANCE_LAYER_ATTRIBUTE);
+        glVertexAttribIPointer(INSTANCE_LAYER_ATTRIBUTE, 1, GL_INT, sizeof(GLint), BUFFER_OFFSET(0));
+        glVertexAttribDivisor(INSTANCE_LAYER_ATTRIBUTE, 1);
+        glBindVertexArray(0);
+    }
+    resize(count);
+}
+
+PatchField::~PatchField()
+{
+    glDeleteBuffers(1, &instance_buffer);
+    glDeleteBuffers(1, &layer_buffer);
+}
+
+void PatchField::resize(int count)
+{
+    count = std::max(1, count);
+    int side = (int) std::ceil(std::sqrt((double) count));
+    float origin = -0.5f * (side - 1) * PATCH_SPACING;
+
+    placement.resize(count);
+    matrices.resize(count);
+    layers.resize(count);
+    bounds.resize(count);
+    visibility.resize(count);
+    visible.clear();
+    visible_layers.clear();
+    culled = false;
+    for (int i = 0; i < count; ++i)
+    {
+        // Fixed pseudo-random phase and size per patch
+        unsigned hash = (unsigned) i * 2654435761u;
+        float phase = (hash >> 8) / 16777216.0f * 6.2831853f;
+        float scale = 0.8f + 0.2f * ((hash >> 4) & 0xFF) / 255.0f;
+        placement[i] = glm::vec4(origin + (i % side) * PATCH_SPACING, origin + (i / side) * PATCH_SPACING,
+                                 phase, scale);
+    }
+    set_materials(material_count);
+
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    glBufferData(GL_ARRAY_BUFFER, matrices.size() * sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+}
+
+void PatchField::set_materials(int materials)
+{
+    material_count = std::max(0, materials);
+    for (size_t i = 0; i < layers.size(); ++i)
+    {
+        // A different hash from the phase and size, so that materials do not
+        // follow them
+        unsigned hash = (unsigned) (i + 1) * 2246822519u;
+        layers[i] = material_count > 0 ? (GLint) ((hash >> 16) % material_count) : -1;
+    }
+}
+
+void PatchField::update(float time, bool parallel, const Frustum *frustum)
+{
+    BenchClock::time_point start = BenchClock::now();
+
+    const int count = (int) matrices.size();
+    auto fill = [&](int first, int last) {
+        for (int i = first; i < last; ++i)
+        {
+            const glm::vec4 &p = placement[i];
+            float phase = time + p.z;
+            glm::vec3 position(p.x, PATCH_HEIGHT + 0.1f * std::sin(phase), p.y);
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), position);
+            model = glm::rotate(model, p.z, glm::vec3(0, 1, 0));
+            model = glm::rotate(model, glm::radians(-90.0f + 8.0f * std::sin(0.7f * phase)), glm::vec3(1, 0, 0));
+            model = glm::scale(model, glm::vec3(p.w, p.w, p.w * (1.0f + 0.3f * std::cos(phase))));
+            matrices[i] = model;
+
+            // The patch is the grid's flat [-1,1] square in its XY plane
+            glm::vec3 low, high;
+            transform_box(model, glm::vec3(-1, -1, 0), glm::vec3(1, 1, 0), low, high);
+            bounds.set(i, low, high);
+        }
+    };
+
+    int jobs = parallel ? std::min((int) worker_pool().size() + 1, count / MIN_PATCHES_PER_JOB) : 1;
+    if (jobs <= 1)
+        fill(0, count);
+    else
+        worker_pool().parallel_for(jobs, [&](int job) {
+            fill((int) ((long long) count * job / jobs), (int) ((long long) count * (job + 1) / jobs));
+        });
+    last_update_ms = bench_ms(start);
+
+    start = BenchClock::now();
+    culled = frustum != NULL;
+    if (culled)
+    {
+        classify_boxes(*frustum, bounds, visibility.data());
+        visible.clear();
+        visible_layers.clear();
+        for (int i = 0; i < count; ++i)
+            if (visibility[i] != FRUSTUM_OUTSIDE)
+            {
+                visible.push_back(matrices[i]);
+                visible_layers.push_back(layers[i]);
+            }
+    }
+    last_cull_ms = bench_ms(start);
+
+    const std::vector<glm::mat4> &upload = uploaded();
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    glBufferData(GL_ARRAY_BUFFER, matrices.size() * sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, upload.size() * sizeof(glm::mat4), upload.data());
+
+    const std::vector<GLint> &upload_layers = uploaded_layers();
+    glBindBuffer(GL_ARRAY_BUFFER, layer_buffer);
+    glBufferData(GL_ARRAY_BUFFER, layers.size() * sizeof(GLint), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, upload_layers.size() * sizeof(GLint), upload_layers.data());
+}
+
+void PatchField::draw_instanced(GLuint program) const
+{
+    if (!GLEW_VERSION_3_3)
+    {
+        draw_individually(program);
+        return;
+    }
+    if (drawn() == 0)
+        return;
+    glUniform1i(glGetUniformLocation(program, "instanced"), 1);
+    glUniform1i(glGetUniformLocation(program, "vertexFormat"), mesh.format());
+    mesh.draw(drawn());
+    glUniform1i(glGetUniformLocation(program, "instanced"), 0);
+}
+
+void PatchField::draw_individually(GLuint program) const
+{
+    GLint model = glGetUniformLocation(program, "Model");
+    GLint layer = glGetUniformLocation(program, "materialLayer");
+    GLint saved_layer = -1;
+    if (layer >= 0)
+        glGetUniformiv(program, layer, &saved_layer);
+
+    glUniform1i(glGetUniformLocation(program, "vertexFormat"), mesh.format());
+    const std::vector<glm::mat4> &upload = uploaded();
+    const std::vector<GLint> &upload_layers = uploaded_layers();
+    for (size_t i = 0; i < upload.size(); ++i)
+    {
+        glUniformMatrix4fv(model, 1, GL_FALSE, glm::value_ptr(upload[i]));
+        glUniform1i(layer, upload_layers[i]);
+        mesh.draw();
+    }
+    glUniform1i(layer, saved_layer);
+}
+
+void PatchField::print_stats() const
+{
+    std::cout << "Patch field: " << count() << " patches, " << triangles() << " triangles, "
+              << count() * (sizeof(glm::mat4) + sizeof(GLint)) / 1024 << " KB of instance matrices and layers, "
+              << material_count << " materials, updated in "
+              << last_update_ms << " ms";
+    if (culled)
+        std::cout << "; " << drawn() << " in view, culled in " << last_cull_ms << " ms";
+    std::cout << std::endl;
+}
@@ -0,0 +1,83 @@
+// A field of many small snow patches, each with its own model matrix, drawn
+// with one instanced call instead of one draw and Model upload per patch.
+//
+// The patches share one grid (grid_mesh.h). Their matrices are recomputed
+// every frame, each patch drifting, tilting and swelling on its own phase,
+// in ranges of patches across the worker pool together with each patch's
+// world bounds. Given a frustum, the bounds are classified in one
+// classify_boxes() batch and only the matrices of patches in view are
+// compacted into the instance buffer, with one orphaning upload; vshader5.glsl
+// reads them as the per-instance attribute aInstanceModel (locations 8-11)
+// when the instanced uniform is set. Each patch also has a material layer
+// (material.h), uploaded beside its matrix as aInstanceLayer (location 12), so
+// that patches of every material go out in the one call.
+
+#ifndef PATCH_FIELD_H
+#define PATCH_FIELD_H
+
+#include "common.h"
+#include "frustum.h"
+#include "grid_mesh.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+const int INSTANCE_MODEL_ATTRIBUTE = 8;   // a mat4: four vec4 columns
+const int INSTANCE_LAYER_ATTRIBUTE = 12;  // an int: the patch's material layer
+const int PATCH_FIELD_RESOLUTION = 8;     // quads per side of every patch
+
+class PatchField
+{
+public:
+    explicit PatchField(int count);
+    ~PatchField();
+
+    // Lay out count patches on a square grid in the XZ plane.
+    void resize(int count);
+
+    // Give every patch a fixed one of the first materials layers of the
+    // material arrays, or -1 (the separate snow textures) with 0, the default.
+    void set_materials(int materials);
+
+    // Recompute every patch's model matrix at time (seconds) and upload those
+    // of the patches inside frustum, or all of them without one.
+    void update(float time, bool parallel = true, const Frustum *frustum = NULL);
+
+    // One glDrawElementsInstanced of the uploaded patches; program must be
+    // in use.
+    void draw_instanced(GLuint program) const;
+
+    // A Model and materialLayer upload and a draw per uploaded patch, for
+    // comparison.
+    void draw_individually(GLuint program) const;
+
+    int count() const { return (int) matrices.size(); }
+    int drawn() const { return (int) (culled ? visible.size() : matrices.size()); }
+    int triangles() const { return count() * mesh.triangles(); }
+    double update_ms() const { return last_update_ms; }
+    double cull_ms() const { return last_cull_ms; }
+    void print_stats() const;
+
+private:
+    PatchField(const PatchField &);
+    PatchField &operator=(const PatchField &);
+
+    GridMesh mesh;
+    GLuint instance_buffer, layer_buffer;
+    std::vector<glm::vec4> placement;     // x, z, phase, scale per patch
+    std::vector<glm::mat4> matrices;
+    std::vector<GLint> layers;            // material layer per patch
+    int material_count;
+    BoxList bounds;                       // world bounds per patch
+    std::vector<unsigned char> visibility;
+    std::vector<glm::mat4> visible;       // matrices in view, when culled
+    std::vector<GLint> visible_layers;
+    bool culled;
+    double last_update_ms, last_cull_ms;
+
+    const std::vector<glm::mat4> &uploaded() const { return culled ? visible : matrices; }
+    const std::vector<GLint> &uploaded_layers() const { return culled ? visible_layers : layers; }
+};
+
+#endif // PATCH_FIELD_H
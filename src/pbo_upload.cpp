@@ -0,0 +1,290 @@
+#include "pbo_upload.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+TextureUploader::TextureUploader(size_t slot_bytes, int slot_count)
+    : bytes_uploaded(0), uploads(0), stalls(0),
+      slot_bytes(slot_bytes), fences(slot_count, (GLsync) 0), mapped(NULL), current(0)
+{
+    if (GLEW_ARB_buffer_storage)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLuint buffer;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, slot_bytes * slot_count, NULL, flags);
+        mapped = (unsigned char *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slot_bytes * slot_count, flags);
+        buffers.push_back(buffer);
+    }
+    else
+    {
+        buffers.resize(slot_count);
+        glGenBuffers(slot_count, buffers.data());
+        for (int i = 0; i < slot_count; ++i)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, slot_bytes, NULL, GL_STREAM_DRAW);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+TextureUploader::~TextureUploader()
+{
+    for (size_t i = 0; i < fences.size(); ++i)
+        if (fences[i])
+            glDeleteSync(fences[i]);
+    if (mapped)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[0]);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    glDeleteBuffers(buffers.size(), buffers.data());
+}
+
+unsigned char *TextureUploader::acquire()
+{
+    GLsync &fence = fences[current];
+    if (fence)
+    {
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+        {
+            ++stalls;
+            // The slot is overwritten in place (coherent or unsynchronized
+            // mapping), so it may not be handed out before the GPU is done
+            // with it, however long that takes
+            do
+                status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ULL);
+            while (status == GL_TIMEOUT_EXPIRED);
+        }
+        if (status == GL_WAIT_FAILED)
+            glFinish();
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    if (mapped)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[0]);
+        return mapped + current * slot_bytes;
+    }
+
+    // The fence says the GPU is done with this buffer, so no need for the
+    // driver to synchronize (or orphan) it again.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[current]);
+    return (unsigned char *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slot_bytes,
+                                              GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+const void *TextureUploader::finish_writes()
+{
+    if (mapped)
+        return BUFFER_OFFSET(current * slot_bytes);
+
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    return BUFFER_OFFSET(0);
+}
+
+void TextureUploader::release()
+{
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    current = (current + 1) % fences.size();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    ++uploads;
+}
+
+//----------------------------------------------------------------------------
+
+// Bytes per texel of uncompressed client pixels
+static size_t texel_bytes(GLenum format, GLenum type)
+{
+    switch (type)
+    {
+    case GL_UNSIGNED_SHORT_5_6_5:
+    case GL_UNSIGNED_SHORT_4_4_4_4:
+    case GL_UNSIGNED_SHORT_5_5_5_1:
+        return 2;
+    case GL_UNSIGNED_INT_2_10_10_10_REV:
+    case GL_UNSIGNED_INT_8_8_8_8_REV:
+    case GL_UNSIGNED_INT_10F_11F_11F_REV:
+        return 4;
+    }
+
+    size_t components;
+    switch (format)
+    {
+    case GL_RED: case GL_GREEN: case GL_BLUE: case GL_ALPHA: case GL_RED_INTEGER: case GL_DEPTH_COMPONENT:
+        components = 1;
+        break;
+    case GL_RG: case GL_RG_INTEGER:
+        components = 2;
+        break;
+    case GL_RGB: case GL_BGR: case GL_RGB_INTEGER:
+        components = 3;
+        break;
+    default:
+        components = 4;
+    }
+    switch (type)
+    {
+    case GL_SHORT: case GL_UNSIGNED_SHORT: case GL_HALF_FLOAT:
+        return components * 2;
+    case GL_INT: case GL_UNSIGNED_INT: case GL_FLOAT:
+        return components * 4;
+    default:
+        return components;
+    }
+}
+
+// Rows of width_bytes, row_bytes apart in src, packed tightly at dst; the
+// padding past a row's last texel is never read
+static void copy_rows(unsigned char *dst, const unsigned char *src, int rows, size_t width_bytes, size_t row_bytes)
+{
+    if (width_bytes == row_bytes)
+    {
+        memcpy(dst, src, rows * width_bytes);
+        return;
+    }
+    for (int row = 0; row < rows; ++row)
+        memcpy(dst + row * width_bytes, src + row * row_bytes, width_bytes);
+}
+
+void TextureUploader::sub_image_2d(GLenum target, GLint level, int x, int y, int width, int height,
+                                   GLenum format, GLenum type, const void *pixels, size_t row_bytes)
+{
+    const size_t texel = texel_bytes(format, type), width_bytes = width * texel;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    int band = (int) std::min<size_t>(height, slot_bytes / width_bytes);
+    if (band == 0)
+    {
+        // A single row is bigger than a slot: let the driver copy it, rows
+        // and all, from client memory.
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) (row_bytes / texel));
+        glTexSubImage2D(target, level, x, y, width, height, format, type, pixels);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    else
+    {
+        const unsigned char *src = (const unsigned char *) pixels;
+        for (int row = 0; row < height; row += band)
+        {
+            int rows = std::min(band, height - row);
+            copy_rows(acquire(), src + row * row_bytes, rows, width_bytes, row_bytes);
+            const void *offset = finish_writes();
+            glTexSubImage2D(target, level, x, y + row, width, rows, format, type, offset);
+            release();
+        }
+        bytes_uploaded += width_bytes * height;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void TextureUploader::sub_image_3d(GLenum target, GLint level, int x, int y, int layer, int width, int height,
+                                   GLenum format, GLenum type, const void *pixels, size_t row_bytes)
+{
+    const size_t texel = texel_bytes(format, type), width_bytes = width * texel;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    int band = (int) std::min<size_t>(height, slot_bytes / width_bytes);
+    if (band == 0)
+    {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) (row_bytes / texel));
+        glTexSubImage3D(target, level, x, y, layer, width, height, 1, format, type, pixels);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    else
+    {
+        const unsigned char *src = (const unsigned char *) pixels;
+        for (int row = 0; row < height; row += band)
+        {
+            int rows = std::min(band, height - row);
+            copy_rows(acquire(), src + row * row_bytes, rows, width_bytes, row_bytes);
+            const void *offset = finish_writes();
+            glTexSubImage3D(target, level, x, y + row, layer, width, rows, 1, format, type, offset);
+            release();
+        }
+        bytes_uploaded += width_bytes * height;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void TextureUploader::sub_rects_2d(GLenum target, GLenum format, GLenum type, int texel_bytes,
+                                   const SubRect *rects, size_t count)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t tight = (size_t) rects[i].width * texel_bytes * rects[i].height;
+        if (tight > slot_bytes)
+        {
+            // Too big for a slot: the driver reads it from the client image
+            const SubRect &r = rects[i];
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) (r.row_bytes / texel_bytes));
+            glTexSubImage2D(target, r.level, r.x, r.y, r.width, r.height, format, type, r.pixels);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            ++i;
+            continue;
+        }
+
+        // As many rectangles as fit in one slot
+        unsigned char *slot = acquire();
+        size_t used = 0, first = i;
+        std::vector<size_t> offsets;
+        for (; i < count; ++i)
+        {
+            const SubRect &r = rects[i];
+            size_t width_bytes = (size_t) r.width * texel_bytes;
+            if (used + width_bytes * r.height > slot_bytes)
+                break;
+            offsets.push_back(used);
+            const unsigned char *src = (const unsigned char *) r.pixels;
+            for (int row = 0; row < r.height; ++row, used += width_bytes)
+                memcpy(slot + used, src + row * r.row_bytes, width_bytes);
+        }
+        const unsigned char *base = (const unsigned char *) finish_writes();
+        for (size_t k = first; k < i; ++k)
+        {
+            const SubRect &r = rects[k];
+            glTexSubImage2D(target, r.level, r.x, r.y, r.width, r.height, format, type, base + offsets[k - first]);
+        }
+        release();
+        bytes_uploaded += used;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void TextureUploader::compressed_sub_image_2d(GLenum target, GLint level, GLenum internal_format,
+                                              int width, int height, size_t size, const void *data)
+{
+    if (size > slot_bytes)
+    {
+        glCompressedTexSubImage2D(target, level, 0, 0, width, height, internal_format, size, data);
+        return;
+    }
+
+    memcpy(acquire(), data, size);
+    const void *offset = finish_writes();
+    glCompressedTexSubImage2D(target, level, 0, 0, width, height, internal_format, size, offset);
+    release();
+    bytes_uploaded += size;
+}
+
+//----------------------------------------------------------------------------
+
+TextureUploader &texture_uploader()
+{
+    // Never destroyed: it owns GL objects and the context may already be
+    // gone when static destructors run.
+    static TextureUploader *uploader = new TextureUploader(4 << 20, 4);
+    return *uploader;
+}
@@ -0,0 +1,87 @@
+// Texture uploads staged through a ring of pixel unpack buffers. Pixel data is
+// copied into a free slot and the glTexSubImage call sources it from the
+// buffer, so the call returns as soon as the copy is queued instead of the
+// driver copying from client memory on the spot. Each slot is fenced when
+// its upload is issued and only rewritten once the GPU has consumed it.
+//
+// With ARB_buffer_storage the ring is one persistently mapped, coherent
+// buffer; otherwise each slot is its own PBO mapped unsynchronized (the
+// fence already guarantees the GPU is done with it).
+//
+// Images larger than a slot are split into row bands; batches of small
+// sub-rectangles share a slot.
+
+#ifndef PBO_UPLOAD_H
+#define PBO_UPLOAD_H
+
+#include "common.h"
+
+#include <cstddef>
+#include <vector>
+
+class TextureUploader
+{
+public:
+    TextureUploader(size_t slot_bytes, int slot_count);
+    ~TextureUploader();
+
+    // glTexSubImage2D/3D into the texture bound to target (one layer for 3D
+    // targets); storage is allocated beforehand (texture_storage.h). Rows are
+    // row_bytes apart, a whole number of texels.
+    void sub_image_2d(GLenum target, GLint level, int x, int y, int width, int height,
+                      GLenum format, GLenum type, const void *pixels, size_t row_bytes);
+    void sub_image_3d(GLenum target, GLint level, int x, int y, int layer, int width, int height,
+                      GLenum format, GLenum type, const void *pixels, size_t row_bytes);
+
+    // A sub-rectangle of a client image whose rows are row_bytes apart.
+    struct SubRect
+    {
+        GLint level;
+        int x, y, width, height;
+        const void *pixels;     // first texel of the rectangle
+        size_t row_bytes;
+    };
+
+    // glTexSubImage2D of every rectangle into the texture bound to target.
+    // Their rows are packed tightly one rectangle after another into as few
+    // slots as hold them, so a frame's worth of small edits costs one slot
+    // and one fence rather than one each.
+    void sub_rects_2d(GLenum target, GLenum format, GLenum type, int texel_bytes, const SubRect *rects, size_t count);
+
+    // glCompressedTexSubImage2D of a whole level; levels bigger than a slot
+    // go from client memory.
+    void compressed_sub_image_2d(GLenum target, GLint level, GLenum internal_format, int width, int height,
+                                 size_t size, const void *data);
+
+    bool persistent() const { return mapped != NULL; }
+    size_t slot_size() const { return slot_bytes; }
+
+    // Counters since start-up.
+    size_t bytes_uploaded;
+    int uploads;
+    int stalls;    // slot still in use by the GPU when we wanted it
+
+private:
+    TextureUploader(const TextureUploader &);
+    TextureUploader &operator=(const TextureUploader &);
+
+    // Wait until the next slot is free, bind it to GL_PIXEL_UNPACK_BUFFER and
+    // return where to write. finish_writes() returns the buffer offset to pass
+    // to GL in place of a client pointer; release() fences the slot after the
+    // GL call and unbinds it.
+    unsigned char *acquire();
+    const void *finish_writes();
+    void release();
+
+    size_t slot_bytes;
+    std::vector<GLuint> buffers;     // one shared buffer when persistent
+    std::vector<GLsync> fences;
+    unsigned char *mapped;           // persistent mapping, or NULL
+    int current;
+};
+
+// The process-wide uploader (4 slots of 4 MB), created on first use on the
+// context thread.
+TextureUploader &texture_uploader();
+
+#endif // PBO_UPLOAD_H
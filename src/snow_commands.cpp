@@ -0,0 +1,107 @@
+#include "snow_commands.h"
+#include "snow_sim.h"
+
+#include <algorithm>
+#include <cmath>
+
+void SnowCommandBuffer::press(const SnowBrush &brush)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    presses.push_back(brush);
+}
+
+void SnowCommandBuffer::press(const SnowBrush *brushes, size_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    presses.insert(presses.end(), brushes, brushes + count);
+}
+
+void SnowCommandBuffer::fill(const SnowBrush &brush)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    fills.push_back(brush);
+}
+
+size_t SnowCommandBuffer::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return presses.size() + fills.size();
+}
+
+void SnowCommandBuffer::take(std::vector<SnowBrush> &pressed, std::vector<SnowBrush> &filled)
+{
+    pressed.clear();
+    filled.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    pressed.swap(presses);
+    filled.swap(fills);
+}
+
+//----------------------------------------------------------------------------
+
+// Everything about a brush but its depth, quantized; tile first, so sorting
+// by key sorts by tile
+struct BrushKey
+{
+    int values[8];
+    int index;
+
+    bool operator<(const BrushKey &other) const
+    {
+        for (int i = 0; i < 8; ++i)
+            if (values[i] != other.values[i])
+                return values[i] < other.values[i];
+        return index < other.index;
+    }
+
+    bool same_brush(const BrushKey &other) const
+    {
+        return std::equal(values, values + 8, other.values);
+    }
+};
+
+int merge_duplicate_brushes(std::vector<SnowBrush> &brushes, SnowStampMode mode, int width, int height)
+{
+    const float steps = 16.0f * width;     // per texture coordinate
+    const int tiles_x = (width + SNOW_TILE_SIZE - 1) / SNOW_TILE_SIZE;
+    std::vector<BrushKey> keys(brushes.size());
+    for (size_t i = 0; i < brushes.size(); ++i)
+    {
+        SnowBrush &b = brushes[i];
+        b.u -= std::floor(b.u);
+        b.v -= std::floor(b.v);
+        int x = std::min((int) (b.u * width), width - 1), y = std::min((int) (b.v * height), height - 1);
+        // A circle looks the same at any rotation
+        bool round = b.shape == SNOW_BRUSH_DISC && b.half_length == b.half_width;
+        float turns = b.rotation / 6.2831853f;
+
+        BrushKey &key = keys[i];
+        key.values[0] = (y / SNOW_TILE_SIZE) * tiles_x + x / SNOW_TILE_SIZE;
+        key.values[1] = b.shape;
+        key.values[2] = (int) std::lround(b.v * steps);
+        key.values[3] = (int) std::lround(b.u * steps);
+        key.values[4] = (int) std::lround(b.half_length * steps);
+        key.values[5] = (int) std::lround(b.half_width * steps);
+        key.values[6] = round ? 0 : (int) std::lround((turns - std::floor(turns)) * 4096.0f) % 4096;
+        key.values[7] = (int) std::lround(b.falloff * 4096.0f);
+        key.index = (int) i;
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<SnowBrush> merged;
+    merged.reserve(brushes.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        const SnowBrush &b = brushes[keys[i].index];
+        if (i > 0 && keys[i].same_brush(keys[i - 1]))
+        {
+            float &depth = merged.back().depth;
+            depth = mode == SNOW_PRESS ? std::max(depth, b.depth) : std::min(depth, b.depth);
+        }
+        else
+            merged.push_back(b);
+    }
+    int removed = (int) (brushes.size() - merged.size());
+    brushes.swap(merged);
+    return removed;
+}
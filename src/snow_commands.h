@@ -0,0 +1,63 @@
+// Deformation commands for the snow fields (snow_sim.h on the CPU,
+// snow_gpu.h on the GPU). Gameplay code appends stamps to a field's command
+// buffer from any thread during the frame; the field's next tick takes the
+// whole buffer and applies it in one pass. A stamp is a brush - shape,
+// position, rotation, size, depth and falloff - that either presses the
+// snow down or fills it back in. Presses are applied before fills.
+
+#ifndef SNOW_COMMANDS_H
+#define SNOW_COMMANDS_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+enum SnowBrushShape
+{
+    SNOW_BRUSH_DISC,    // an ellipse, for footprints
+    SNOW_BRUSH_BOX      // a rectangle, for wheel and sled tracks
+};
+
+enum SnowStampMode
+{
+    SNOW_PRESS,         // deepen to the brush's profile, never shallower
+    SNOW_FILL           // cap the pressed depth at the brush's profile
+};
+
+struct SnowBrush
+{
+    float u, v;                     // centre in texture coordinates (repeating)
+    float half_length, half_width;  // along and across the brush, in texture coordinates
+    float rotation;                 // of its length from the u axis, radians
+    float depth;                    // below the rest height, in depthMap units (0..1)
+    float falloff;                  // share of the half extents easing back to the surface
+    int shape;                      // SnowBrushShape
+};
+
+class SnowCommandBuffer
+{
+public:
+    // Append stamps. Thread-safe.
+    void press(const SnowBrush &brush);
+    void press(const SnowBrush *brushes, size_t count);
+    void fill(const SnowBrush &brush);
+
+    size_t size() const;
+
+    // Move every command out, presses and fills apart, leaving the buffer
+    // empty for the next frame.
+    void take(std::vector<SnowBrush> &pressed, std::vector<SnowBrush> &filled);
+
+private:
+    mutable std::mutex mutex;
+    std::vector<SnowBrush> presses, fills;
+};
+
+// Sort brushes by the SNOW_TILE_SIZE tile of a width x height field their
+// centre falls in, wrapping them into [0, 1), and merge those that differ
+// only in depth (placed to a sixteenth of a texel): a press keeps the
+// deepest, a fill the shallowest, which is all drawing every one of them
+// would leave. Returns how many were merged away.
+int merge_duplicate_brushes(std::vector<SnowBrush> &brushes, SnowStampMode mode, int width, int height);
+
+#endif // SNOW_COMMANDS_H
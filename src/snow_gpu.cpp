@@ -0,0 +1,331 @@
+#include "snow_gpu.h"
+#include "mipmap.h"
+#include "pbo_upload.h"
+#include "texture_storage.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+bool GpuSnowField::supported()
+{
+    return GLEW_VERSION_3_3 != 0;
+}
+
+GpuSnowField::GpuSnowField(const unsigned char *pixels, int width, int height, int channels, int unit,
+                           const SnowParams &params)
+    : last_quads(0), size_x(width), size_y(height), levels(mip_level_count(width, height)), unit(unit),
+      params(params), rest(0), front(0), instance_capacity(0), normal_shader(NULL), normal_name(0),
+      normal_framebuffer(0), packing(NORMALS_RG8), slope_scale(1.0f)
+{
+    std::vector<unsigned char> rest_texels((size_t) width * height);
+    std::vector<float> start((size_t) width * height);
+    for (size_t i = 0; i < rest_texels.size(); ++i)
+    {
+        rest_texels[i] = pixels[i * channels];
+        start[i] = rest_texels[i] / 255.0f;
+    }
+
+    GLint active, borrowed;
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+    glActiveTexture(GL_TEXTURE0 + unit + 1);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &borrowed);
+
+    glGenTextures(1, &rest);
+    glBindTexture(GL_TEXTURE_2D, rest);
+    size_t bytes = allocate_texture_2d(1, GL_R8, width, height);
+    texture_uploader().sub_image_2d(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE,
+                                    rest_texels.data(), width);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    register_texture(rest, "snow rest depth (GPU)", "Simulation", bytes);
+
+    // Both copies start undisturbed; each is a framebuffer's only attachment
+    glGenTextures(2, depth);
+    glGenFramebuffers(2, framebuffers);
+    for (int i = 0; i < 2; ++i)
+    {
+        glBindTexture(GL_TEXTURE_2D, depth[i]);
+        bytes = allocate_texture_2d(levels, GL_R32F, width, height);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_FLOAT, start.data());
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        register_texture(depth[i], i ? "snow depth (GPU, back)" : "snow depth (GPU, front)", "Simulation", bytes);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, depth[i], 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "Snow depth framebuffer is incomplete" << std::endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, borrowed);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, depth[front]);
+    glActiveTexture(active);
+
+    GLint program;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    brush_program = InitShader("vshader5_brush.glsl", "fshader5_brush.glsl");
+    glUniform1i(glGetUniformLocation(brush_program, "restDepth"), unit + 1);
+    glUniform2f(glGetUniformLocation(brush_program, "fieldSize"), (float) width, (float) height);
+    relax_program = InitShader("vshader5_fullscreen.glsl", "fshader5_relax.glsl");
+    glUniform1i(glGetUniformLocation(relax_program, "depth"), unit);
+    glUniform1i(glGetUniformLocation(relax_program, "restDepth"), unit + 1);
+    glUniform1f(glGetUniformLocation(relax_program, "relaxRate"), params.relax_rate);
+    glUniform1f(glGetUniformLocation(relax_program, "talus"), params.talus);
+    glUseProgram(program);
+
+    // A unit quad per instance; the brushes are the per-instance attributes
+    const GLfloat corners[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+    glGenVertexArrays(1, &brush_vao);
+    glGenVertexArrays(1, &empty_vao);
+    glGenBuffers(1, &corner_buffer);
+    glGenBuffers(1, &instance_buffer);
+    glBindVertexArray(brush_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, corner_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(SnowBrush), BUFFER_OFFSET(0));
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(SnowBrush), BUFFER_OFFSET(4 * sizeof(float)));
+    glVertexAttribDivisor(2, 1);
+    glEnableVertexAttribArray(3);
+    glVertexAttribIPointer(3, 1, GL_INT, sizeof(SnowBrush), BUFFER_OFFSET(7 * sizeof(float)));
+    glVertexAttribDivisor(3, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+GpuSnowField::~GpuSnowField()
+{
+    glDeleteFramebuffers(2, framebuffers);
+    unregister_texture(depth[0]);
+    unregister_texture(depth[1]);
+    unregister_texture(rest);
+    glDeleteTextures(2, depth);
+    glDeleteTextures(1, &rest);
+    glDeleteVertexArrays(1, &brush_vao);
+    glDeleteVertexArrays(1, &empty_vao);
+    glDeleteBuffers(1, &corner_buffer);
+    glDeleteBuffers(1, &instance_buffer);
+    glDeleteProgram(brush_program);
+    glDeleteProgram(relax_program);
+    if (normal_name)
+    {
+        delete normal_shader;
+        glDeleteFramebuffers(1, &normal_framebuffer);
+        unregister_texture(normal_name);
+        glDeleteTextures(1, &normal_name);
+    }
+}
+
+void GpuSnowField::enable_normals(NormalPacking normal_packing, float scale)
+{
+    packing = normal_packing;
+    slope_scale = scale;
+    if (normal_name)
+    {
+        unregister_texture(normal_name);
+        glDeleteTextures(1, &normal_name);
+    }
+    else
+    {
+        normal_shader = new NormalShader(unit + 1);
+        glGenFramebuffers(1, &normal_framebuffer);
+    }
+
+    GLint active, borrowed;
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+    glActiveTexture(GL_TEXTURE0 + unit + 1);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &borrowed);
+    glGenTextures(1, &normal_name);
+    glBindTexture(GL_TEXTURE_2D, normal_name);
+    size_t bytes = allocate_texture_2d(levels, normal_internal_format(packing), size_x, size_y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    register_texture(normal_name, "snow normals (GPU)", "Simulation", bytes);
+    glBindTexture(GL_TEXTURE_2D, borrowed);
+    glActiveTexture(active);
+
+    GLint bound;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &bound);
+    glBindFramebuffer(GL_FRAMEBUFFER, normal_framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, normal_name, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Snow normal framebuffer is incomplete" << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, bound);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean blending = glIsEnabled(GL_BLEND);
+    glDisable(GL_BLEND);
+    glViewport(0, 0, size_x, size_y);
+    draw_normals();
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (blending)
+        glEnable(GL_BLEND);
+}
+
+// The current depth's normals, every level; the viewport covers the field
+void GpuSnowField::draw_normals()
+{
+    normal_shader->draw(depth[front], normal_framebuffer, slope_scale);
+
+    GLint active, borrowed;
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+    glActiveTexture(GL_TEXTURE0 + unit + 1);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &borrowed);
+    glBindTexture(GL_TEXTURE_2D, normal_name);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, borrowed);
+    glActiveTexture(active);
+}
+
+void GpuSnowField::stamp(const SnowStamp *stamps, size_t count)
+{
+    std::vector<SnowBrush> brushes(count);
+    for (size_t i = 0; i < count; ++i)
+        brushes[i] = snow_brush(stamps[i]);
+    buffer.press(brushes.data(), count);
+}
+
+//----------------------------------------------------------------------------
+
+// Every brush once for each wrapped copy that overlaps the field, drawn
+// with the blending already set up
+void GpuSnowField::draw_brushes(const std::vector<SnowBrush> &brushes, bool fill_pass)
+{
+    instances.clear();
+    for (size_t i = 0; i < brushes.size(); ++i)
+    {
+        SnowBrush b = brushes[i];
+        if (b.half_length <= 0.0f || b.half_width <= 0.0f)
+            continue;
+        b.u -= std::floor(b.u);
+        b.v -= std::floor(b.v);
+        b.depth = std::min(std::max(b.depth, 0.0f), 1.0f);
+        b.falloff = std::min(std::max(b.falloff, 0.0f), 1.0f);
+        if (b.depth <= 0.0f && !fill_pass)
+            continue;
+
+        // Bounding circle, as the quad is padded by a texel
+        float reach_u = std::sqrt(b.half_length * b.half_length + b.half_width * b.half_width) + 1.0f / size_x;
+        float reach_v = reach_u * size_x / size_y;
+        for (int sy = -1; sy <= 1; ++sy)
+            for (int sx = -1; sx <= 1; ++sx)
+            {
+                SnowBrush shifted = b;
+                shifted.u += sx;
+                shifted.v += sy;
+                if (shifted.u + reach_u >= 0.0f && shifted.u - reach_u < 1.0f
+                    && shifted.v + reach_v >= 0.0f && shifted.v - reach_v < 1.0f)
+                    instances.push_back(shifted);
+            }
+    }
+    if (instances.empty())
+        return;
+
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    size_t bytes = instances.size() * sizeof(SnowBrush);
+    if (bytes > instance_capacity)
+    {
+        instance_capacity = std::max(bytes, 2 * instance_capacity);
+        glBufferData(GL_ARRAY_BUFFER, instance_capacity, NULL, GL_STREAM_DRAW);
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, instances.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBlendEquation(fill_pass ? GL_MIN : GL_MAX);
+    glUniform1i(glGetUniformLocation(brush_program, "fill"), fill_pass);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei) instances.size());
+    last_quads += (int) instances.size();
+}
+
+void GpuSnowField::tick(float dt)
+{
+    GLint viewport[4], active, borrowed, program, vertex_array;
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vertex_array);
+    GLboolean culling = glIsEnabled(GL_CULL_FACE), depth_test = glIsEnabled(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+    glViewport(0, 0, size_x, size_y);
+
+    glActiveTexture(GL_TEXTURE0 + unit + 1);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &borrowed);
+    glBindTexture(GL_TEXTURE_2D, rest);
+
+    // Brushes, into the current copy
+    buffer.take(pressed, filled);
+    merge_duplicate_brushes(pressed, SNOW_PRESS, size_x, size_y);
+    merge_duplicate_brushes(filled, SNOW_FILL, size_x, size_y);
+    last_quads = 0;
+    if (!pressed.empty() || !filled.empty())
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[front]);
+        glUseProgram(brush_program);
+        glBindVertexArray(brush_vao);
+        glEnable(GL_BLEND);
+        draw_brushes(pressed, false);
+        draw_brushes(filled, true);
+        glBlendEquation(GL_FUNC_ADD);
+        glDisable(GL_BLEND);
+    }
+
+    // Relaxation and refill, from the current copy into the other
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[1 - front]);
+    glUseProgram(relax_program);
+    glUniform1f(glGetUniformLocation(relax_program, "refill"), params.refill_rate * dt);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, depth[front]);
+    glBindVertexArray(empty_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    front = 1 - front;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, depth[front]);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    if (normal_name)
+        draw_normals();
+    glActiveTexture(GL_TEXTURE0 + unit + 1);
+    glBindTexture(GL_TEXTURE_2D, borrowed);
+
+    glActiveTexture(active);
+    glUseProgram(program);
+    glBindVertexArray(vertex_array);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (culling)
+        glEnable(GL_CULL_FACE);
+    if (depth_test)
+        glEnable(GL_DEPTH_TEST);
+}
+
+void GpuSnowField::read_depth(std::vector<unsigned char> &texels)
+{
+    std::vector<float> values((size_t) size_x * size_y);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[front]);
+    glReadPixels(0, 0, size_x, size_y, GL_RED, GL_FLOAT, values.data());
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+    texels.resize(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        texels[i] = (unsigned char) (std::min(values[i], 1.0f) * 255.0f + 0.5f);
+}
+
+void GpuSnowField::print_stats() const
+{
+    std::cout << "GPU snow field " << size_x << "x" << size_y << ", " << levels << " levels"
+              << (normal_name ? (packing == NORMALS_RG8 ? ", RG8 normals" : ", RGB10_A2 normals") : "")
+              << ": last tick " << last_quads << " brush quads" << std::endl;
+}
@@ -0,0 +1,99 @@
+// The deformable snow of snow_sim.h kept on the GPU instead: the depth never
+// leaves video memory, and the texture the stamps are drawn into is the one
+// ParallaxMapping() samples as depthMap.
+//
+// The depth (rest depth plus pressed depth, in depthMap's units) is held in
+// two R32F textures, each the colour attachment of its own framebuffer. A
+// tick draws every queued brush as an instanced quad into the current copy
+// (vshader5_brush.glsl / fshader5_brush.glsl):
+//
+//   press   GL_MAX blending: the snow under the brush only gets deeper, to
+//           the brush's depth in the middle easing out over its falloff
+//   fill    GL_MIN blending: the pressed depth under the brush is capped at
+//           the brush's, for ploughs and fresh drifts
+//
+// then relaxes and refills the whole field into the other copy
+// (fshader5_relax.glsl), with the same rule as SnowField, and swaps the two.
+// With enable_normals(), the normals of the new depth are drawn into a
+// normal texture as well (fshader5_normals.glsl, height_normals.h).
+// Only core GL 3.3 is needed: float render targets, min/max blending and
+// instancing, so it runs on llvmpipe.
+
+#ifndef SNOW_GPU_H
+#define SNOW_GPU_H
+
+#include "common.h"
+#include "height_normals.h"
+#include "snow_sim.h"
+
+#include <cstddef>
+#include <vector>
+
+class GpuSnowField
+{
+public:
+    // The rest depth from an 8-bit image (first channel). The field's
+    // passes borrow texture units unit and unit + 1, and leave the current
+    // depth bound to unit.
+    GpuSnowField(const unsigned char *pixels, int width, int height, int channels, int unit,
+                 const SnowParams &params = SnowParams());
+    ~GpuSnowField();
+
+    static bool supported();
+
+    // This frame's commands, drawn by the next tick.
+    SnowCommandBuffer &commands() { return buffer; }
+
+    // Press footprints on the next tick.
+    void stamp(const SnowStamp *stamps, size_t count);
+
+    // Draw the queued brushes and advance the simulation by dt seconds.
+    void tick(float dt);
+
+    // Draw a mipmapped normal texture each tick from now on; slope_scale as
+    // height_normals().
+    void enable_normals(NormalPacking packing, float slope_scale);
+
+    // The current depth, as depthMap, and its normals (0 until enabled).
+    GLuint texture() const { return depth[front]; }
+    GLuint normal_texture() const { return normal_name; }
+    NormalPacking normal_packing() const { return packing; }
+    int width() const { return size_x; }
+    int height() const { return size_y; }
+
+    // Read the depth back in depthMap's 8-bit encoding, as
+    // SnowField::depth_texels(); stalls, for checks and tests.
+    void read_depth(std::vector<unsigned char> &texels);
+
+    // Last tick: brush quads drawn, wrapped copies included
+    int last_quads;
+    void print_stats() const;
+
+private:
+    GpuSnowField(const GpuSnowField &);
+    GpuSnowField &operator=(const GpuSnowField &);
+
+    void draw_brushes(const std::vector<SnowBrush> &brushes, bool fill_pass);
+    void draw_normals();
+
+    int size_x, size_y, levels;
+    int unit;
+    SnowParams params;
+    GLuint rest;                    // R8, level 0 only
+    GLuint depth[2], framebuffers[2];
+    int front;                      // copy holding the current depth
+
+    GLuint brush_program, relax_program;
+    GLuint brush_vao, corner_buffer, instance_buffer, empty_vao;
+    size_t instance_capacity;
+
+    NormalShader *normal_shader;
+    GLuint normal_name, normal_framebuffer;
+    NormalPacking packing;
+    float slope_scale;
+
+    SnowCommandBuffer buffer;
+    std::vector<SnowBrush> pressed, filled, instances;
+};
+
+#endif // SNOW_GPU_H
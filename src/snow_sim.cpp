@@ -0,0 +1,488 @@
+#include "snow_sim.h"
+#include "benchmark.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define SNOW_SSE2 1
+#  include <emmintrin.h>
+#endif
+
+static const int MIN_TILES_PER_JOB = 2;
+
+// Smallest change of pressed depth that keeps a tile awake
+static const float SNOW_EPSILON = 1e-5f;
+
+// Dirty rectangles are merged while their union is at most this much bigger
+// than the texels they cover
+static const float DIRTY_MERGE_SLACK = 1.5f;
+
+SnowField::SnowField(const unsigned char *pixels, int width, int height, int channels, const SnowParams &params)
+    : size_x(width), size_y(height),
+      tile_count_x((width + SNOW_TILE_SIZE - 1) / SNOW_TILE_SIZE),
+      tile_count_y((height + SNOW_TILE_SIZE - 1) / SNOW_TILE_SIZE),
+      params(params), rest((size_t) width * height), front((size_t) width * height, 0.0f),
+      back((size_t) width * height, 0.0f)
+{
+    for (size_t i = 0; i < rest.size(); ++i)
+        rest[i] = pixels[i * channels] / 255.0f;
+    active.assign(tile_count_x * tile_count_y, 0);
+    stale.assign(tile_count_x * tile_count_y, 0);
+    DirtyRect clean = { 0, 0, 0, 0 };
+    dirty.assign(tile_count_x * tile_count_y, clean);
+    stats = SnowTickStats();
+}
+
+SnowBrush snow_brush(const SnowStamp &stamp)
+{
+    SnowBrush brush = { stamp.u, stamp.v, stamp.radius, stamp.radius, 0.0f, stamp.depth, stamp.falloff,
+                        SNOW_BRUSH_DISC };
+    return brush;
+}
+
+void SnowField::stamp(const SnowStamp &stamp)
+{
+    buffer.press(snow_brush(stamp));
+}
+
+void SnowField::stamp(const SnowStamp *stamps, size_t count)
+{
+    std::vector<SnowBrush> brushes(count);
+    for (size_t i = 0; i < count; ++i)
+        brushes[i] = snow_brush(stamps[i]);
+    buffer.press(brushes.data(), count);
+}
+
+void SnowField::tile_rect(int tile, int &x0, int &y0, int &x1, int &y1) const
+{
+    x0 = (tile % tile_count_x) * SNOW_TILE_SIZE;
+    y0 = (tile / tile_count_x) * SNOW_TILE_SIZE;
+    x1 = std::min(x0 + SNOW_TILE_SIZE, size_x);
+    y1 = std::min(y0 + SNOW_TILE_SIZE, size_y);
+}
+
+void SnowField::mark_dirty(int tile, int x0, int y0, int x1, int y1)
+{
+    DirtyRect &rect = dirty[tile];
+    if (!rect.empty())
+    {
+        x0 = std::min(x0, rect.x);
+        y0 = std::min(y0, rect.y);
+        x1 = std::max(x1, rect.x + rect.width);
+        y1 = std::max(y1, rect.y + rect.height);
+    }
+    rect.x = x0;
+    rect.y = y0;
+    rect.width = x1 - x0;
+    rect.height = y1 - y0;
+}
+
+//----------------------------------------------------------------------------
+// Compression
+
+// The brush in texels, once for each wrapped copy that overlaps the field
+void SnowField::add_texel_stamps(const SnowBrush &brush, bool fill)
+{
+    TexelStamp t;
+    float half_length = brush.half_length * size_x, half_width = brush.half_width * size_x;
+    t.depth = std::min(std::max(brush.depth, 0.0f), 1.0f);
+    if (half_length <= 0.0f || half_width <= 0.0f || (t.depth <= 0.0f && !fill))
+        return;
+    t.x = (brush.u - std::floor(brush.u)) * size_x;
+    t.y = (brush.v - std::floor(brush.v)) * size_y;
+    t.cos_a = std::cos(brush.rotation);
+    t.sin_a = std::sin(brush.rotation);
+    t.reach_x = std::fabs(t.cos_a) * half_length + std::fabs(t.sin_a) * half_width;
+    t.reach_y = std::fabs(t.sin_a) * half_length + std::fabs(t.cos_a) * half_width;
+    t.inv_length = 1.0f / half_length;
+    t.inv_width = 1.0f / half_width;
+    t.inv_falloff = 1.0f / std::max(std::min(brush.falloff, 1.0f), 1e-6f);
+    t.shape = brush.shape;
+    t.fill = fill;
+    for (int sy = -1; sy <= 1; ++sy)
+        for (int sx = -1; sx <= 1; ++sx)
+        {
+            TexelStamp shifted = t;
+            shifted.x += sx * size_x;
+            shifted.y += sy * size_y;
+            if (shifted.x + shifted.reach_x >= 0.0f && shifted.x - shifted.reach_x < size_x
+                && shifted.y + shifted.reach_y >= 0.0f && shifted.y - shifted.reach_y < size_y)
+                texel_stamps.push_back(shifted);
+        }
+}
+
+void SnowField::bin_stamps()
+{
+    // Presses ahead of fills; the sort below keeps that order in every tile
+    texel_stamps.clear();
+    for (size_t i = 0; i < pressed.size(); ++i)
+        add_texel_stamps(pressed[i], false);
+    for (size_t i = 0; i < filled.size(); ++i)
+        add_texel_stamps(filled[i], true);
+
+    // Counting sort of (tile, stamp) pairs by tile
+    const int tiles = tile_count_x * tile_count_y;
+    tile_first.assign(tiles + 1, 0);
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        if (pass == 1)
+        {
+            for (int t = 0; t < tiles; ++t)
+                tile_first[t + 1] += tile_first[t];
+            tile_stamps.resize(tile_first[tiles]);
+        }
+        std::vector<int> fill(tile_first.begin(), tile_first.end() - 1);
+        for (size_t i = 0; i < texel_stamps.size(); ++i)
+        {
+            const TexelStamp &t = texel_stamps[i];
+            int tx0 = std::max(0, (int) std::floor((t.x - t.reach_x) / SNOW_TILE_SIZE));
+            int tx1 = std::min(tile_count_x - 1, (int) std::floor((t.x + t.reach_x) / SNOW_TILE_SIZE));
+            int ty0 = std::max(0, (int) std::floor((t.y - t.reach_y) / SNOW_TILE_SIZE));
+            int ty1 = std::min(tile_count_y - 1, (int) std::floor((t.y + t.reach_y) / SNOW_TILE_SIZE));
+            for (int ty = ty0; ty <= ty1; ++ty)
+                for (int tx = tx0; tx <= tx1; ++tx)
+                {
+                    int tile = ty * tile_count_x + tx;
+                    if (pass == 0)
+                        ++tile_first[tile + 1];
+                    else
+                        tile_stamps[fill[tile]++] = (int) i;
+                }
+        }
+    }
+}
+
+// One texel of a brush, dx and dy from its centre: the new pressed depth.
+// The SSE lanes below do the same operations in the same order.
+inline float SnowField::stamp_texel(const TexelStamp &s, float dx, float dy, float pressed)
+{
+    float lx = (s.cos_a * dx + s.sin_a * dy) * s.inv_length;
+    float ly = (s.cos_a * dy - s.sin_a * dx) * s.inv_width;
+    float r = s.shape == SNOW_BRUSH_BOX ? std::max(std::fabs(lx), std::fabs(ly)) : std::sqrt(lx * lx + ly * ly);
+    float t = std::min(std::max((1.0f - r) * s.inv_falloff, 0.0f), 1.0f);
+    float profile = t * t * (3.0f - 2.0f * t);
+    // Outside the brush the profile is 0, which changes nothing either way
+    return s.fill ? std::min(pressed, 1.0f + (s.depth - 1.0f) * profile) : std::max(pressed, s.depth * profile);
+}
+
+// Texels [x0, x1) of a row dy below the brush's centre
+void SnowField::stamp_span(const TexelStamp &s, float *row, int x0, int x1, float dy, bool simd)
+{
+    int x = x0;
+#if SNOW_SSE2
+    if (simd)
+    {
+        const __m128 cos_a = _mm_set1_ps(s.cos_a), sin_a = _mm_set1_ps(s.sin_a);
+        const __m128 dy4 = _mm_set1_ps(dy), centre = _mm_set1_ps(s.x), half = _mm_set1_ps(0.5f);
+        const __m128 inv_length = _mm_set1_ps(s.inv_length), inv_width = _mm_set1_ps(s.inv_width);
+        const __m128 inv_falloff = _mm_set1_ps(s.inv_falloff), depth = _mm_set1_ps(s.depth);
+        const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+        const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+        const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        for (; x + 4 <= x1; x += 4)
+        {
+            __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_set1_ps((float) x), lanes), half), centre);
+            __m128 lx = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(cos_a, dx), _mm_mul_ps(sin_a, dy4)), inv_length);
+            __m128 ly = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(cos_a, dy4), _mm_mul_ps(sin_a, dx)), inv_width);
+            __m128 r = s.shape == SNOW_BRUSH_BOX
+                ? _mm_max_ps(_mm_and_ps(lx, abs_mask), _mm_and_ps(ly, abs_mask))
+                : _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)));
+            __m128 t = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(one, r), inv_falloff), zero), one);
+            __m128 profile = _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_add_ps(t, t)));
+            __m128 pressed = _mm_loadu_ps(row + x);
+            if (s.fill)
+                pressed = _mm_min_ps(pressed, _mm_add_ps(one, _mm_mul_ps(_mm_sub_ps(depth, one), profile)));
+            else
+                pressed = _mm_max_ps(pressed, _mm_mul_ps(depth, profile));
+            _mm_storeu_ps(row + x, pressed);
+        }
+    }
+#endif
+    for (; x < x1; ++x)
+        row[x] = stamp_texel(s, ((float) x + 0.5f) - s.x, dy, row[x]);
+}
+
+void SnowField::compress_tile(int tile)
+{
+    int x0, y0, x1, y1;
+    tile_rect(tile, x0, y0, x1, y1);
+    for (int k = tile_first[tile]; k < tile_first[tile + 1]; ++k)
+    {
+        const TexelStamp &s = texel_stamps[tile_stamps[k]];
+        int sx0 = std::max(x0, (int) std::ceil(s.x - s.reach_x - 0.5f));
+        int sx1 = std::min(x1, (int) std::floor(s.x + s.reach_x - 0.5f) + 1);
+        int sy0 = std::max(y0, (int) std::ceil(s.y - s.reach_y - 0.5f));
+        int sy1 = std::min(y1, (int) std::floor(s.y + s.reach_y - 0.5f) + 1);
+        if (sx0 >= sx1 || sy0 >= sy1)
+            continue;
+        mark_dirty(tile, sx0, sy0, sx1, sy1);
+        for (int y = sy0; y < sy1; ++y)
+            stamp_span(s, &front[(size_t) y * size_x], sx0, sx1, ((float) y + 0.5f) - s.y, params.simd);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Smoothing and refill
+
+// Share of the step a - b beyond the talus
+static inline float excess(float a, float b, float talus)
+{
+    float step = a - b;
+    return step - std::min(std::max(step, -talus), talus);
+}
+
+// One texel of the relaxation: d with its four neighbours, returning the change
+static inline float relax_texel(float d, float up, float down, float left, float right, float rate, float talus,
+                                float refill, float &out)
+{
+    float flow = excess(up, d, talus) + excess(down, d, talus) + excess(left, d, talus) + excess(right, d, talus);
+    out = std::max(d + rate * flow - refill, 0.0f);
+    return std::fabs(out - d);
+}
+
+// Relax and refill texels [x0, x1) of one row; left and right index the
+// outside neighbours of the first and last texel, which may wrap around.
+// The inner texels need no wrapping and go through a plain loop.
+static float relax_span(const float *row, const float *up, const float *down, float *out, int x0, int x1,
+                        int left, int right, float rate, float talus, float refill)
+{
+    int last = x1 - 1;
+    if (x0 == last)
+        return relax_texel(row[x0], up[x0], down[x0], row[left], row[right], rate, talus, refill, out[x0]);
+
+    float largest = relax_texel(row[x0], up[x0], down[x0], row[left], row[x0 + 1], rate, talus, refill, out[x0]);
+    for (int x = x0 + 1; x < last; ++x)
+        largest = std::max(largest, relax_texel(row[x], up[x], down[x], row[x - 1], row[x + 1], rate, talus,
+                                                refill, out[x]));
+    return std::max(largest, relax_texel(row[last], up[last], down[last], row[last - 1], row[right], rate, talus,
+                                         refill, out[last]));
+}
+
+bool SnowField::relax_tile(int tile, float refill)
+{
+    int x0, y0, x1, y1;
+    tile_rect(tile, x0, y0, x1, y1);
+    const float rate = params.relax_rate, talus = params.talus;
+    int left = x0 == 0 ? size_x - 1 : x0 - 1;
+    int right = x1 == size_x ? 0 : x1;
+    bool moved = false;
+    for (int y = y0; y < y1; ++y)
+    {
+        const float *row = &front[(size_t) y * size_x];
+        const float *up = &front[(size_t) (y == 0 ? size_y - 1 : y - 1) * size_x];
+        const float *down = &front[(size_t) (y == size_y - 1 ? 0 : y + 1) * size_x];
+        float *out = &back[(size_t) y * size_x];
+        if (relax_span(row, up, down, out, x0, x1, left, right, rate, talus, refill) <= SNOW_EPSILON)
+            continue;
+
+        // Bounds of the row's changes, found only for rows that have some
+        int first = x0, last = x1 - 1;
+        while (std::fabs(out[first] - row[first]) <= SNOW_EPSILON)
+            ++first;
+        while (std::fabs(out[last] - row[last]) <= SNOW_EPSILON)
+            --last;
+        mark_dirty(tile, first, y, last + 1, y + 1);
+        moved = true;
+    }
+    return moved;
+}
+
+void SnowField::copy_tile(int tile)
+{
+    int x0, y0, x1, y1;
+    tile_rect(tile, x0, y0, x1, y1);
+    for (int y = y0; y < y1; ++y)
+        std::memcpy(&back[(size_t) y * size_x + x0], &front[(size_t) y * size_x + x0], (x1 - x0) * sizeof(float));
+}
+
+//----------------------------------------------------------------------------
+
+// Run fn(tile) for every tile of list, in ranges across the worker pool
+template <typename Fn>
+static void for_tiles(const std::vector<int> &list, bool parallel, Fn fn)
+{
+    const int count = (int) list.size();
+    int jobs = parallel ? std::min((int) worker_pool().size() + 1, count / MIN_TILES_PER_JOB) : 1;
+    auto range = [&](int first, int last) {
+        for (int i = first; i < last; ++i)
+            fn(i, list[i]);
+    };
+    if (jobs <= 1)
+        range(0, count);
+    else
+        worker_pool().parallel_for(jobs, [&](int job) {
+            range((int) ((long long) count * job / jobs), (int) ((long long) count * (job + 1) / jobs));
+        });
+}
+
+void SnowField::tick(float dt, bool parallel)
+{
+    BenchClock::time_point start = BenchClock::now();
+    const int tiles = tile_count_x * tile_count_y;
+
+    buffer.take(pressed, filled);
+    stats.stamps = (int) (pressed.size() + filled.size());
+    stats.merged = merge_duplicate_brushes(pressed, SNOW_PRESS, size_x, size_y)
+                 + merge_duplicate_brushes(filled, SNOW_FILL, size_x, size_y);
+    bin_stamps();
+
+    std::vector<int> stamped, visit;
+    for (int t = 0; t < tiles; ++t)
+    {
+        if (tile_first[t + 1] > tile_first[t])
+        {
+            stamped.push_back(t);
+            active[t] = 1;
+        }
+        if (active[t])
+            visit.push_back(t);
+        else if (stale[t])
+        {
+            copy_tile(t);
+            stale[t] = 0;
+        }
+    }
+
+    for_tiles(stamped, parallel, [&](int, int tile) { compress_tile(tile); });
+    stats.compress_ms = bench_ms(start);
+
+    std::vector<char> moved(visit.size(), 0);
+    float refill = params.refill_rate * dt;
+    for_tiles(visit, parallel, [&](int i, int tile) { moved[i] = relax_tile(tile, refill); });
+    front.swap(back);
+
+    // Changed tiles and their neighbours are visited again next tick
+    std::fill(active.begin(), active.end(), 0);
+    changed.clear();
+    for (size_t i = 0; i < visit.size(); ++i)
+    {
+        int tile = visit[i];
+        stale[tile] = 1;
+        if (!moved[i] && tile_first[tile + 1] == tile_first[tile])
+            continue;
+        changed.push_back(tile);
+        int tx = tile % tile_count_x, ty = tile / tile_count_x;
+        active[tile] = 1;
+        active[ty * tile_count_x + (tx + 1) % tile_count_x] = 1;
+        active[ty * tile_count_x + (tx + tile_count_x - 1) % tile_count_x] = 1;
+        active[((ty + 1) % tile_count_y) * tile_count_x + tx] = 1;
+        active[((ty + tile_count_y - 1) % tile_count_y) * tile_count_x + tx] = 1;
+    }
+
+    stats.stamped_tiles = (int) stamped.size();
+    stats.active_tiles = (int) visit.size();
+    stats.changed_tiles = (int) changed.size();
+    stats.ms = bench_ms(start);
+}
+
+void SnowField::take_dirty_rects(std::vector<DirtyRect> &rects, bool merge)
+{
+    rects.clear();
+    std::vector<int> covered;       // texels the rectangle stands for
+    for (size_t t = 0; t < dirty.size(); ++t)
+    {
+        if (dirty[t].empty())
+            continue;
+        rects.push_back(dirty[t]);
+        covered.push_back(dirty[t].area());
+        dirty[t].width = dirty[t].height = 0;
+    }
+
+    // Greedily join touching rectangles while the union stays within the
+    // slack of what they cover: fewer, larger uploads for clustered edits
+    for (bool joined = merge; joined; )
+    {
+        joined = false;
+        for (size_t i = 0; i < rects.size(); ++i)
+            for (size_t j = i + 1; j < rects.size(); ++j)
+            {
+                const DirtyRect &a = rects[i], &b = rects[j];
+                int x0 = std::min(a.x, b.x), y0 = std::min(a.y, b.y);
+                int x1 = std::max(a.x + a.width, b.x + b.width), y1 = std::max(a.y + a.height, b.y + b.height);
+                bool touching = x1 - x0 <= a.width + b.width && y1 - y0 <= a.height + b.height;
+                int area = (x1 - x0) * (y1 - y0);
+                if (!touching || area > DIRTY_MERGE_SLACK * (covered[i] + covered[j]))
+                    continue;
+                DirtyRect joint = { x0, y0, x1 - x0, y1 - y0 };
+                rects[i] = joint;
+                covered[i] += covered[j];
+                rects[j] = rects.back();
+                covered[j] = covered.back();
+                rects.pop_back();
+                covered.pop_back();
+                joined = true;
+                --j;
+            }
+    }
+}
+
+void SnowField::depth_texels(int x, int y, int width, int height, unsigned char *out, size_t row_bytes) const
+{
+    for (int row = 0; row < height; ++row)
+    {
+        size_t i = (size_t) (y + row) * size_x + x;
+        unsigned char *texels = out + row * row_bytes;
+        for (int column = 0; column < width; ++column)
+            texels[column] = (unsigned char) (std::min(rest[i + column] + front[i + column], 1.0f) * 255.0f + 0.5f);
+    }
+}
+
+void SnowField::print_stats() const
+{
+    std::cout << "Snow field " << size_x << "x" << size_y << " in " << tile_count_x << "x" << tile_count_y
+              << " tiles of " << SNOW_TILE_SIZE << ": last tick " << stats.stamps << " stamps ("
+              << stats.merged << " merged) into " << stats.stamped_tiles << " tiles in " << stats.compress_ms
+              << " ms, " << stats.active_tiles << " tiles visited, "
+              << stats.changed_tiles << " changed, " << stats.ms << " ms" << std::endl;
+}
+
+//----------------------------------------------------------------------------
+
+std::vector<SnowWalker> scatter_walkers(int count, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<SnowWalker> walkers(count);
+    for (int i = 0; i < count; ++i)
+    {
+        walkers[i].u = unit(rng);
+        walkers[i].v = unit(rng);
+        walkers[i].heading = unit(rng) * 6.2831853f;
+        walkers[i].phase = unit(rng) * 6.2831853f;
+    }
+    return walkers;
+}
+
+void step_walkers(std::vector<SnowWalker> &walkers, float time, float dt, std::vector<SnowStamp> &stamps)
+{
+    const float speed = 0.03f;      // texture widths per second
+    stamps.resize(walkers.size());
+    for (size_t i = 0; i < walkers.size(); ++i)
+    {
+        SnowWalker &w = walkers[i];
+        w.heading += 0.8f * std::sin(0.5f * time + w.phase) * dt;
+        w.u += std::cos(w.heading) * speed * dt;
+        w.v += std::sin(w.heading) * speed * dt;
+        w.u -= std::floor(w.u);
+        w.v -= std::floor(w.v);
+
+        SnowStamp &s = stamps[i];
+        s.u = w.u;
+        s.v = w.v;
+        s.radius = 0.006f;
+        s.depth = 0.3f;
+        s.falloff = 0.5f;
+    }
+}
+
+void walk_and_stamp(std::vector<SnowWalker> &walkers, float time, float dt, SnowField &field)
+{
+    std::vector<SnowStamp> stamps;
+    step_walkers(walkers, time, dt, stamps);
+    field.stamp(stamps.data(), stamps.size());
+}
@@ -0,0 +1,183 @@
+// CPU simulation of the deformable snow on the surface. The field holds, per
+// texel of the height map, how far the snow has been pressed below its rest
+// height (the depth decoded from SnowTextures/height.jpg); depth_texels()
+// gives the sum in depthMap's encoding.
+//
+// Deformers append brushes to commands() (snow_commands.h) from any thread;
+// they are applied on the next tick(), which runs in tiles of SNOW_TILE_SIZE
+// texels across the worker pool:
+//
+//   compression   the frame's brushes are merged where they repeat, binned to
+//                 the tiles they overlap, and each tile rasterizes all of
+//                 its brushes in one pass, four texels at a time with SSE
+//   smoothing     the pressed depth relaxes towards its neighbours wherever
+//                 the slope between them is steeper than the talus, moving
+//                 snow into the tracks without creating or losing any; it
+//                 reads one copy of the field and writes the other, so tiles
+//                 never wait on each other's borders
+//   refill        fresh snow fills every track back in at refill_rate
+//
+// Only tiles that were stamped, changed in the previous tick, or border one
+// that did, are visited; a settled field costs nothing. Storage is row-major
+// (the tiles are rectangles of it), so a tile's rows can be uploaded as they
+// are. Every tile keeps the bounds of its texels changed since they were last
+// taken, for uploads of just those (snow_texture.h).
+
+#ifndef SNOW_SIM_H
+#define SNOW_SIM_H
+
+#include "snow_commands.h"
+
+#include <cstddef>
+#include <vector>
+
+const int SNOW_TILE_SIZE = 64;
+
+// A footprint: a disc of the surface pressed to depth, easing back to the
+// undisturbed snow over the outer falloff fraction of its radius.
+struct SnowStamp
+{
+    float u, v;         // centre in texture coordinates (repeating)
+    float radius;       // in texture coordinates
+    float depth;        // below the rest height, in depthMap units (0..1)
+    float falloff;      // 0: hard edge, 1: a cone
+};
+
+struct SnowParams
+{
+    float refill_rate;  // depth refilled per second
+    float talus;        // steepest stable step between texels
+    float relax_rate;   // share of the excess slope moved per tick, <= 0.25
+    bool simd;          // SSE lanes where available, else one texel at a time
+
+    SnowParams() : refill_rate(0.02f), talus(0.01f), relax_rate(0.2f), simd(true) {}
+};
+
+struct DirtyRect
+{
+    int x, y, width, height;
+
+    bool empty() const { return width <= 0 || height <= 0; }
+    int area() const { return width * height; }
+};
+
+// A footprint as a round brush.
+SnowBrush snow_brush(const SnowStamp &stamp);
+
+struct SnowTickStats
+{
+    int stamps;         // brushes taken from the command buffer
+    int merged;         // of them, duplicates merged into another
+    int stamped_tiles;
+    int active_tiles;
+    int changed_tiles;
+    double compress_ms;
+    double ms;
+};
+
+class SnowField
+{
+public:
+    // The rest depth from an 8-bit image (first channel).
+    SnowField(const unsigned char *pixels, int width, int height, int channels,
+              const SnowParams &params = SnowParams());
+
+    // This frame's commands, applied by the next tick.
+    SnowCommandBuffer &commands() { return buffer; }
+
+    // Press footprints on the next tick. Thread-safe.
+    void stamp(const SnowStamp &stamp);
+    void stamp(const SnowStamp *stamps, size_t count);
+
+    // Advance the simulation by dt seconds.
+    void tick(float dt, bool parallel = true);
+
+    // Depth in depthMap's encoding (rest depth plus pressed depth) of the
+    // rectangle x, y, width x height, as 8-bit texels row_bytes apart.
+    void depth_texels(int x, int y, int width, int height, unsigned char *out, size_t row_bytes) const;
+
+    float pressed_at(int x, int y) const { return front[(size_t) y * size_x + x]; }
+
+    // The whole field, y * width() + x: the rest depth and the current
+    // pressed depth, whose sum is the depth (for height_normals.h).
+    const float *rest_depth() const { return rest.data(); }
+    const float *pressed_depth() const { return front.data(); }
+
+    int width() const { return size_x; }
+    int height() const { return size_y; }
+    int tiles_x() const { return tile_count_x; }
+    int tiles_y() const { return tile_count_y; }
+
+    // Tiles whose depth changed in the last tick, as y * tiles_x() + x.
+    const std::vector<int> &changed_tiles() const { return changed; }
+
+    // Rectangles covering every texel changed since the last call, one per
+    // changed tile, or with merge, joined with their neighbours wherever the
+    // union adds little area; the bounds are then cleared.
+    void take_dirty_rects(std::vector<DirtyRect> &rects, bool merge = true);
+
+    const SnowTickStats &last_tick() const { return stats; }
+    void print_stats() const;
+
+private:
+    SnowField(const SnowField &);
+    SnowField &operator=(const SnowField &);
+
+    // A brush in texels, shifted by whole field sizes to where it overlaps
+    struct TexelStamp
+    {
+        float x, y;
+        float reach_x, reach_y;         // half size of the bounding box
+        float cos_a, sin_a;
+        float inv_length, inv_width;    // 1 / half extents
+        float inv_falloff;
+        float depth;
+        int shape;
+        bool fill;
+    };
+
+    static float stamp_texel(const TexelStamp &s, float dx, float dy, float pressed);
+    static void stamp_span(const TexelStamp &s, float *row, int x0, int x1, float dy, bool simd);
+    void add_texel_stamps(const SnowBrush &brush, bool fill);
+    void bin_stamps();
+    void mark_dirty(int tile, int x0, int y0, int x1, int y1);
+    void compress_tile(int tile);
+    bool relax_tile(int tile, float refill);
+    void copy_tile(int tile);
+    void tile_rect(int tile, int &x0, int &y0, int &x1, int &y1) const;
+
+    int size_x, size_y, tile_count_x, tile_count_y;
+    SnowParams params;
+    std::vector<float> rest;            // depth of the undisturbed snow
+    std::vector<float> front, back;     // pressed depth, read and written copies
+
+    SnowCommandBuffer buffer;
+    std::vector<SnowBrush> pressed, filled;
+
+    // Stamps of every tile: tile_stamps[tile_first[t] .. tile_first[t + 1])
+    std::vector<TexelStamp> texel_stamps;
+    std::vector<int> tile_first, tile_stamps;
+
+    std::vector<char> active;           // to visit next tick
+    std::vector<char> stale;            // back no longer equals front
+    std::vector<int> changed;
+    std::vector<DirtyRect> dirty;       // per tile, texels changed since taken
+    SnowTickStats stats;
+};
+
+// Deformers for the demo and benchmarks: walkers wandering over the field,
+// each pressing a footprint every tick.
+struct SnowWalker
+{
+    float u, v, heading, phase;
+};
+
+std::vector<SnowWalker> scatter_walkers(int count, unsigned int seed = 1);
+
+// Move every walker dt seconds along; stamps gets where each one lands.
+void step_walkers(std::vector<SnowWalker> &walkers, float time, float dt, std::vector<SnowStamp> &stamps);
+
+// Move every walker dt seconds along and stamp where it lands.
+void walk_and_stamp(std::vector<SnowWalker> &walkers, float time, float dt, SnowField &field);
+
+#endif // SNOW_SIM_H
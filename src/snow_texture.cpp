@@ -0,0 +1,293 @@
+#include "snow_texture.h"
+#include "benchmark.h"
+#include "pbo_upload.h"
+#include "texture_storage.h"
+
+#include <algorithm>
+#include <iostream>
+
+SnowTexture::SnowTexture(SnowField &field, bool report_memory)
+    : frame_bytes(0), frame_rects(0), frame_ms(0.0), total_bytes(0), updates(0), name(0), mips_current(false),
+      normal_name(0), packing(NORMALS_RG8), slope_scale(1.0f)
+{
+    int width = field.width(), height = field.height();
+    int count = mip_level_count(width, height);
+    levels.resize(count);
+    for (int i = 0; i < count; ++i)
+    {
+        levels[i].width = width;
+        levels[i].height = height;
+        levels[i].pixels.resize((size_t) width * height);
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+
+    glGenTextures(1, &name);
+    glBindTexture(GL_TEXTURE_2D, name);
+    size_t bytes = allocate_texture_2d(count, GL_R8, field.width(), field.height());
+    if (report_memory)
+        register_texture(name, "snow simulation depth", "Simulation", bytes);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    upload_all(field);
+}
+
+SnowTexture::~SnowTexture()
+{
+    unregister_texture(name);
+    glDeleteTextures(1, &name);
+    if (normal_name)
+    {
+        unregister_texture(normal_name);
+        glDeleteTextures(1, &normal_name);
+    }
+}
+
+void SnowTexture::enable_normals(SnowField &field, NormalPacking normal_packing, float scale)
+{
+    if (normal_name)
+    {
+        unregister_texture(normal_name);
+        glDeleteTextures(1, &normal_name);
+    }
+    packing = normal_packing;
+    slope_scale = scale;
+    int bytes = normal_texel_bytes(packing);
+    normal_levels.resize(levels.size());
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        normal_levels[i].width = levels[i].width;
+        normal_levels[i].height = levels[i].height;
+        normal_levels[i].pixels.assign((size_t) levels[i].width * levels[i].height * bytes, 0);
+    }
+
+    glGenTextures(1, &normal_name);
+    glBindTexture(GL_TEXTURE_2D, normal_name);
+    size_t allocated = allocate_texture_2d((int) levels.size(), normal_internal_format(packing), field.width(),
+                                           field.height());
+    register_texture(normal_name, "snow simulation normals", "Simulation", allocated);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    std::vector<DirtyRect> whole(1);
+    DirtyRect all = { 0, 0, field.width(), field.height() };
+    whole[0] = all;
+    update_normals(field, whole);
+    glBindTexture(GL_TEXTURE_2D, normal_name);
+}
+
+// Rectangles of the level above turned into this level's: the parent's
+// texels 2x and 2x + 1 make up texel x, and an odd parent's last texel is
+// dropped. Once they add up to the whole level, the level (and so every
+// coarser one) goes as a single rectangle instead.
+static void halve_rects(std::vector<DirtyRect> &rects, const MipLevel &level, bool halve)
+{
+    if (halve)
+        for (size_t r = 0; r < rects.size(); ++r)
+        {
+            DirtyRect &d = rects[r];
+            int x0 = std::min(d.x / 2, level.width - 1), y0 = std::min(d.y / 2, level.height - 1);
+            int x1 = std::min((d.x + d.width + 1) / 2, level.width);
+            int y1 = std::min((d.y + d.height + 1) / 2, level.height);
+            d.x = x0;
+            d.y = y0;
+            d.width = std::max(x1 - x0, 1);
+            d.height = std::max(y1 - y0, 1);
+        }
+
+    size_t area = 0;
+    for (size_t r = 0; r < rects.size(); ++r)
+        area += rects[r].area();
+    if (area >= (size_t) level.width * level.height && rects.size() > 1)
+    {
+        DirtyRect whole = { 0, 0, level.width, level.height };
+        rects.assign(1, whole);
+    }
+}
+
+// Every texel whose normal reads one of rects: each grown by a texel, and
+// split where it wraps past the field's edges
+static void normal_neighbourhoods(const std::vector<DirtyRect> &rects, int width, int height,
+                                  std::vector<DirtyRect> &grown)
+{
+    grown.clear();
+    for (size_t r = 0; r < rects.size(); ++r)
+    {
+        const DirtyRect &d = rects[r];
+        for (int sy = -height; sy <= height; sy += height)
+            for (int sx = -width; sx <= width; sx += width)
+            {
+                int x0 = std::max(d.x - 1 + sx, 0), x1 = std::min(d.x + d.width + 1 + sx, width);
+                int y0 = std::max(d.y - 1 + sy, 0), y1 = std::min(d.y + d.height + 1 + sy, height);
+                DirtyRect piece = { x0, y0, x1 - x0, y1 - y0 };
+                if (!piece.empty())
+                    grown.push_back(piece);
+            }
+    }
+}
+
+// Regenerate and send the normals of rects (level 0 texels, consumed) and
+// the matching regions of every coarser level
+void SnowTexture::update_normals(SnowField &field, std::vector<DirtyRect> &rects)
+{
+    const int bytes = normal_texel_bytes(packing);
+    std::vector<TextureUploader::SubRect> uploads;
+    for (size_t i = 0; i < normal_levels.size() && !rects.empty(); ++i)
+    {
+        MipLevel &level = normal_levels[i];
+        halve_rects(rects, level, i > 0);
+        size_t row_bytes = (size_t) level.width * bytes;
+        for (size_t r = 0; r < rects.size(); ++r)
+        {
+            const DirtyRect &d = rects[r];
+            unsigned char *texels = &level.pixels[(size_t) d.y * row_bytes + (size_t) d.x * bytes];
+            if (i == 0)
+                height_normals(field.rest_depth(), field.pressed_depth(), field.width(), field.height(),
+                               d.x, d.y, d.x + d.width, d.y + d.height, slope_scale, packing, texels, row_bytes);
+            else
+                downsample_normals_region(normal_levels[i - 1].pixels.data(), normal_levels[i - 1].width,
+                                          normal_levels[i - 1].height, packing, level.pixels.data(),
+                                          d.x, d.y, d.x + d.width, d.y + d.height);
+            TextureUploader::SubRect rect = { (GLint) i, d.x, d.y, d.width, d.height, texels, row_bytes };
+            uploads.push_back(rect);
+        }
+    }
+
+    for (size_t r = 0; r < uploads.size(); ++r)
+        frame_bytes += (size_t) uploads[r].width * uploads[r].height * bytes;
+    frame_rects += (int) uploads.size();
+    if (!uploads.empty())
+    {
+        glBindTexture(GL_TEXTURE_2D, normal_name);
+        texture_uploader().sub_rects_2d(GL_TEXTURE_2D, normal_format(packing), normal_type(packing), bytes,
+                                        uploads.data(), uploads.size());
+        glBindTexture(GL_TEXTURE_2D, name);
+    }
+}
+
+// Every level from the field's current depth, with the CPU levels rebuilt
+void SnowTexture::upload_all(SnowField &field)
+{
+    field.take_dirty_rects(dirty, false);
+    MipLevel &base = levels[0];
+    field.depth_texels(0, 0, base.width, base.height, base.pixels.data(), base.width);
+
+    std::vector<TextureUploader::SubRect> rects(levels.size());
+    frame_bytes = 0;
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        if (i > 0)
+            downsample_level(levels[i - 1].pixels.data(), levels[i - 1].width, levels[i - 1].height, 1,
+                             levels[i].pixels.data(), MipOptions());
+        TextureUploader::SubRect rect = { (GLint) i, 0, 0, levels[i].width, levels[i].height,
+                                          levels[i].pixels.data(), (size_t) levels[i].width };
+        rects[i] = rect;
+        frame_bytes += levels[i].pixels.size();
+    }
+    texture_uploader().sub_rects_2d(GL_TEXTURE_2D, GL_RED, GL_UNSIGNED_BYTE, 1, rects.data(), rects.size());
+    frame_rects = (int) rects.size();
+    if (normal_name)
+    {
+        DirtyRect whole = { 0, 0, base.width, base.height };
+        normal_dirty.assign(1, whole);
+        update_normals(field, normal_dirty);
+    }
+    mips_current = true;
+}
+
+void SnowTexture::update(SnowField &field, bool incremental)
+{
+    BenchClock::time_point start = BenchClock::now();
+    glBindTexture(GL_TEXTURE_2D, name);
+    frame_bytes = 0;
+    frame_rects = 0;
+
+    if (!incremental)
+    {
+        field.take_dirty_rects(dirty, false);
+        if (!dirty.empty())
+        {
+            MipLevel &base = levels[0];
+            field.depth_texels(0, 0, base.width, base.height, base.pixels.data(), base.width);
+            texture_uploader().sub_image_2d(GL_TEXTURE_2D, 0, 0, 0, base.width, base.height, GL_RED,
+                                            GL_UNSIGNED_BYTE, base.pixels.data(), base.width);
+            glGenerateMipmap(GL_TEXTURE_2D);
+            frame_bytes = base.pixels.size();
+            frame_rects = 1;
+            mips_current = false;
+
+            if (normal_name)
+            {
+                MipLevel &normals = normal_levels[0];
+                size_t row_bytes = (size_t) normals.width * normal_texel_bytes(packing);
+                height_normals(field.rest_depth(), field.pressed_depth(), field.width(), field.height(),
+                               0, 0, normals.width, normals.height, slope_scale, packing, normals.pixels.data(),
+                               row_bytes);
+                glBindTexture(GL_TEXTURE_2D, normal_name);
+                texture_uploader().sub_image_2d(GL_TEXTURE_2D, 0, 0, 0, normals.width, normals.height,
+                                                normal_format(packing), normal_type(packing), normals.pixels.data(),
+                                                row_bytes);
+                glGenerateMipmap(GL_TEXTURE_2D);
+                glBindTexture(GL_TEXTURE_2D, name);
+                frame_bytes += normals.pixels.size();
+                ++frame_rects;
+            }
+        }
+    }
+    else if (!mips_current)
+        upload_all(field);
+    else
+    {
+        field.take_dirty_rects(dirty);
+        if (normal_name)
+            normal_neighbourhoods(dirty, field.width(), field.height(), normal_dirty);
+        std::vector<TextureUploader::SubRect> rects;
+        for (size_t i = 0; i < levels.size() && !dirty.empty(); ++i)
+        {
+            MipLevel &level = levels[i];
+            halve_rects(dirty, level, i > 0);
+
+            // One level at a time, so that every region reads a parent that
+            // is already up to date
+            for (size_t r = 0; r < dirty.size(); ++r)
+            {
+                const DirtyRect &d = dirty[r];
+                unsigned char *texels = &level.pixels[(size_t) d.y * level.width + d.x];
+                if (i == 0)
+                    field.depth_texels(d.x, d.y, d.width, d.height, texels, level.width);
+                else
+                    downsample_region(levels[i - 1].pixels.data(), levels[i - 1].width, levels[i - 1].height, 1,
+                                      level.pixels.data(), d.x, d.y, d.x + d.width, d.y + d.height);
+                TextureUploader::SubRect rect = { (GLint) i, d.x, d.y, d.width, d.height, texels,
+                                                  (size_t) level.width };
+                rects.push_back(rect);
+            }
+        }
+
+        for (size_t r = 0; r < rects.size(); ++r)
+            frame_bytes += (size_t) rects[r].width * rects[r].height;
+        frame_rects = (int) rects.size();
+        if (!rects.empty())
+            texture_uploader().sub_rects_2d(GL_TEXTURE_2D, GL_RED, GL_UNSIGNED_BYTE, 1, rects.data(), rects.size());
+        if (normal_name)
+            update_normals(field, normal_dirty);
+    }
+
+    total_bytes += frame_bytes;
+    ++updates;
+    frame_ms = bench_ms(start);
+}
+
+void SnowTexture::print_stats() const
+{
+    std::cout << "Snow texture: last update " << frame_rects << " rectangles, " << frame_bytes / 1024.0
+              << " KB (whole level 0: " << levels[0].pixels.size() / 1024.0 << " KB"
+              << (normal_name ? (packing == NORMALS_RG8 ? ", RG8 normals" : ", RGB10_A2 normals") : "")
+              << ") in " << frame_ms << " ms; "
+              << total_bytes / (1024.0 * 1024.0) << " MB over " << updates << " updates" << std::endl;
+}
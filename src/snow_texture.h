@@ -0,0 +1,77 @@
+// The snow simulation's depth (snow_sim.h) as a mipmapped R8 texture for
+// depthMap, kept current by uploading only what changed.
+//
+// A CPU copy of every mip level is kept. Each update takes the field's dirty
+// rectangles, converts just those texels of level 0 and box-filters the
+// matching region of every coarser level (mipmap.h), half the size and
+// rounded outwards per level. All the rectangles of all the levels go out in
+// one batch through the shared pixel unpack buffer ring (pbo_upload.h). The
+// full path - the whole of level 0 and glGenerateMipmap every update - is
+// kept for comparison.
+//
+// With enable_normals(), a second, mipmapped texture holds the normals of
+// the depth (height_normals.h) for normalMap, kept up to date the same way:
+// the dirty rectangles grown by the filter's one-texel reach (wrapping) are
+// regenerated straight from the field's floats, then filtered down.
+
+#ifndef SNOW_TEXTURE_H
+#define SNOW_TEXTURE_H
+
+#include "common.h"
+#include "height_normals.h"
+#include "mipmap.h"
+#include "snow_sim.h"
+
+#include <cstddef>
+#include <vector>
+
+class SnowTexture
+{
+public:
+    // Allocate the texture and upload the field's current depth; listed in
+    // the texture memory report unless a benchmark's throwaway.
+    explicit SnowTexture(SnowField &field, bool report_memory = true);
+    ~SnowTexture();
+
+    GLuint texture() const { return name; }
+
+    // Keep a normal texture as well, from now on; slope_scale as
+    // height_normals(). Binds it on the active unit.
+    void enable_normals(SnowField &field, NormalPacking packing, float slope_scale);
+    GLuint normal_texture() const { return normal_name; }
+    NormalPacking normal_packing() const { return packing; }
+
+    // Bring the textures up to date with field; binds the depth to
+    // GL_TEXTURE_2D on the active unit.
+    void update(SnowField &field, bool incremental = true);
+
+    // Last update
+    size_t frame_bytes;
+    int frame_rects;
+    double frame_ms;
+    // Since start-up
+    size_t total_bytes;
+    int updates;
+
+    void print_stats() const;
+
+private:
+    SnowTexture(const SnowTexture &);
+    SnowTexture &operator=(const SnowTexture &);
+
+    void upload_all(SnowField &field);
+    void update_normals(SnowField &field, std::vector<DirtyRect> &rects);
+
+    GLuint name;
+    std::vector<MipLevel> levels;       // level 0 included
+    std::vector<DirtyRect> dirty;
+    bool mips_current;                  // CPU levels match the textures'
+
+    GLuint normal_name;                 // 0 without normals
+    NormalPacking packing;
+    float slope_scale;
+    std::vector<MipLevel> normal_levels;
+    std::vector<DirtyRect> normal_dirty;
+};
+
+#endif // SNOW_TEXTURE_H
@@ -0,0 +1,24 @@
+// Height and packed normal of the material maps for the stages that read
+// them, fshader5.glsl's parallax march and teshader5.glsl's displacement,
+// pulled in by InitShader's #include. The including shader defines
+// SURFACE_TEXTURE(sampler, coords) as its fetch: texture() where derivatives
+// pick the mip, textureLod() at level 0 where there are none.
+
+uniform sampler2D normalMap;
+uniform sampler2D depthMap;
+// 0: height in depthMap, 1: height in normalMap.a, 2: normalMap = (x, y, height)
+uniform int normalHeightPacking;
+
+// Material sets as texture array layers; a layer < 0 uses the maps above
+uniform sampler2DArray heightArray;
+
+// The height at uv in .a; with packing, the normal texel fetched with it in .rgb
+vec4 materialSurface(vec2 uv, int layer)
+{
+    if (layer >= 0)
+        return vec4(0.0, 0.0, 0.0, SURFACE_TEXTURE(heightArray, vec3(uv, layer)).r);
+    if (normalHeightPacking == 0)
+        return vec4(0.0, 0.0, 0.0, SURFACE_TEXTURE(depthMap, uv).r);
+    vec4 texel = SURFACE_TEXTURE(normalMap, uv);
+    return normalHeightPacking == 1 ? texel : vec4(texel.rg, 0.0, texel.b);
+}
@@ -0,0 +1,353 @@
+#include "tangent_space.h"
+#include "thread_pool.h"
+#include "vertex_format.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define TANGENT_SSE2 1
+#  include <xmmintrin.h>
+#  include <emmintrin.h>
+#endif
+
+// Floats per corner record: weighted tangent, then the corner's vote on the
+// handedness (its weight, negated when the texture-space bitangent points
+// against N x T)
+static const int CORNER_FLOATS = 4;
+
+//----------------------------------------------------------------------------
+// Lanes: the corner kernel is written once against these operations, for one
+// float (scalar) or four floats in an SSE register.
+
+template <typename V> struct Lanes;
+
+template <> struct Lanes<float>
+{
+    enum { WIDTH = 1 };
+
+    // The first 8 floats (position, normal, texcoords) of each vertex, one
+    // per lane
+    static void gather(const float *const src[1], float out[8])
+    {
+        for (int c = 0; c < 8; ++c)
+            out[c] = src[0][c];
+    }
+
+    // in[c] into component c of each lane's corner record
+    static void scatter(const float in[4], float *const dst[1])
+    {
+        for (int c = 0; c < 4; ++c)
+            dst[0][c] = in[c];
+    }
+};
+
+static inline float vsqrt(float a) { return std::sqrt(a); }
+static inline float vrsqrt(float a) { return 1.0f / std::sqrt(a); }
+static inline float vabs(float a) { return std::fabs(a); }
+static inline float vmin(float a, float b) { return std::min(a, b); }
+static inline float vmax(float a, float b) { return std::max(a, b); }
+static inline float vselect_less(float a, float b, float x, float y) { return a < b ? x : y; }
+
+#if TANGENT_SSE2
+struct F4
+{
+    __m128 v;
+    F4() {}
+    F4(__m128 x) : v(x) {}
+    F4(float s) : v(_mm_set1_ps(s)) {}
+};
+
+static inline F4 operator+(F4 a, F4 b) { return _mm_add_ps(a.v, b.v); }
+static inline F4 operator-(F4 a, F4 b) { return _mm_sub_ps(a.v, b.v); }
+static inline F4 operator*(F4 a, F4 b) { return _mm_mul_ps(a.v, b.v); }
+static inline F4 operator/(F4 a, F4 b) { return _mm_div_ps(a.v, b.v); }
+static inline F4 vsqrt(F4 a) { return _mm_sqrt_ps(a.v); }
+
+// 12-bit estimate and one Newton-Raphson step: about 23 bits, at a fraction
+// of the cost of sqrt and divide
+static inline F4 vrsqrt(F4 a)
+{
+    __m128 y = _mm_rsqrt_ps(a.v);
+    __m128 half_a_yy = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), a.v), _mm_mul_ps(y, y));
+    return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), half_a_yy));
+}
+static inline F4 vabs(F4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+static inline F4 vmin(F4 a, F4 b) { return _mm_min_ps(a.v, b.v); }
+static inline F4 vmax(F4 a, F4 b) { return _mm_max_ps(a.v, b.v); }
+
+// a < b ? x : y, per lane
+static inline F4 vselect_less(F4 a, F4 b, F4 x, F4 y)
+{
+    __m128 mask = _mm_cmplt_ps(a.v, b.v);
+    return _mm_or_ps(_mm_and_ps(mask, x.v), _mm_andnot_ps(mask, y.v));
+}
+
+template <> struct Lanes<F4>
+{
+    enum { WIDTH = 4 };
+
+    static void gather(const float *const src[4], F4 out[8])
+    {
+        for (int half = 0; half < 2; ++half)
+        {
+            __m128 r0 = _mm_loadu_ps(src[0] + 4 * half), r1 = _mm_loadu_ps(src[1] + 4 * half);
+            __m128 r2 = _mm_loadu_ps(src[2] + 4 * half), r3 = _mm_loadu_ps(src[3] + 4 * half);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            out[4 * half] = r0, out[4 * half + 1] = r1, out[4 * half + 2] = r2, out[4 * half + 3] = r3;
+        }
+    }
+
+    static void scatter(const F4 in[4], float *const dst[4])
+    {
+        __m128 r0 = in[0].v, r1 = in[1].v, r2 = in[2].v, r3 = in[3].v;
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(dst[0], r0);
+        _mm_storeu_ps(dst[1], r1);
+        _mm_storeu_ps(dst[2], r2);
+        _mm_storeu_ps(dst[3], r3);
+    }
+};
+#endif
+
+template <typename V>
+struct V3
+{
+    V x, y, z;
+};
+
+template <typename V> static inline V3<V> operator+(const V3<V> &a, const V3<V> &b) { V3<V> r = { a.x + b.x, a.y + b.y, a.z + b.z }; return r; }
+template <typename V> static inline V3<V> operator-(const V3<V> &a, const V3<V> &b) { V3<V> r = { a.x - b.x, a.y - b.y, a.z - b.z }; return r; }
+template <typename V> static inline V3<V> operator*(const V3<V> &a, V s) { V3<V> r = { a.x * s, a.y * s, a.z * s }; return r; }
+template <typename V> static inline V dot(const V3<V> &a, const V3<V> &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+template <typename V> static inline V3<V> cross(const V3<V> &a, const V3<V> &b)
+{
+    V3<V> r = { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+    return r;
+}
+
+// acos to within 7e-5 radians (Abramowitz & Stegun 4.4.45); it only weights
+// the corners
+template <typename V>
+static inline V acos_approx(V x)
+{
+    V ax = vmin(vabs(x), V(1.0f));
+    V r = vsqrt(V(1.0f) - ax) * (V(1.5707288f) + ax * (V(-0.2121144f) + ax * (V(0.0742610f) + ax * V(-0.0187293f))));
+    return vselect_less(x, V(0.0f), V(3.14159265f) - r, r);
+}
+
+// Unit vector along v, or zero for a zero vector, scaled by weight
+template <typename V>
+static inline V3<V> normalize_weighted(const V3<V> &v, V weight)
+{
+    return v * (weight * vrsqrt(vmax(dot(v, v), V(1e-30f))));
+}
+
+// Corners of triangles first..first+WIDTH-1 (one per lane): the triangle's
+// texture-space tangent projected into each corner's normal plane, normalized
+// and weighted by the corner angle, and the handedness vote. Corner k of
+// triangle t is record 3t + k of corner_data.
+template <typename V>
+static void corner_batch(const float *vertices, const uint32_t *indices, int first, float *corner_data)
+{
+    const int W = Lanes<V>::WIDTH;
+    V3<V> p[3], n[3];
+    V u[3], v[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        const float *src[W];
+        for (int l = 0; l < W; ++l)
+            src[l] = vertices + (size_t) indices[(size_t) (first + l) * 3 + k] * VERTEX_FLOATS;
+        V lanes[8];
+        Lanes<V>::gather(src, lanes);
+
+        V3<V> position = { lanes[0], lanes[1], lanes[2] };
+        V3<V> normal = { lanes[3], lanes[4], lanes[5] };
+        p[k] = position;
+        n[k] = normalize_weighted(normal, V(1.0f));
+        u[k] = lanes[6];
+        v[k] = lanes[7];
+    }
+
+    V3<V> e1 = p[1] - p[0], e2 = p[2] - p[0];
+    V du1 = u[1] - u[0], dv1 = v[1] - v[0];
+    V du2 = u[2] - u[0], dv2 = v[2] - v[0];
+    V det = du1 * dv2 - du2 * dv1;
+    V r = vselect_less(vabs(det), V(1e-20f), V(0.0f), V(1.0f) / det);   // no UV area: no say
+    V3<V> sdir = (e1 * dv2 - e2 * dv1) * r;
+    V3<V> tdir = (e2 * du1 - e1 * du2) * r;
+
+    for (int k = 0; k < 3; ++k)
+    {
+        V3<V> a = p[(k + 1) % 3] - p[k], b = p[(k + 2) % 3] - p[k];
+        V cosine = dot(a, b) * vrsqrt(vmax(dot(a, a) * dot(b, b), V(1e-30f)));
+        V angle = acos_approx(cosine);
+
+        V3<V> t = normalize_weighted(sdir - n[k] * dot(n[k], sdir), angle);
+        V hand = vselect_less(dot(cross(n[k], t), tdir), V(0.0f), V(0.0f) - angle, angle);
+
+        V record[4] = { t.x, t.y, t.z, hand };
+        float *dst[W];
+        for (int l = 0; l < W; ++l)
+            dst[l] = corner_data + ((size_t) (first + l) * 3 + k) * CORNER_FLOATS;
+        Lanes<V>::scatter(record, dst);
+    }
+}
+
+// Run fn(first, last) over [0, count) in chunks of at least min_chunk, on the
+// pool when asked.
+template <typename Fn>
+static void for_ranges(int count, int min_chunk, bool parallel, Fn fn)
+{
+    int chunks = parallel ? std::min((int) worker_pool().size() + 1, count / min_chunk) : 1;
+    if (chunks <= 1)
+    {
+        fn(0, count);
+        return;
+    }
+
+    worker_pool().parallel_for(chunks, [&](int chunk) {
+        fn((int) ((long long) count * chunk / chunks), (int) ((long long) count * (chunk + 1) / chunks));
+    });
+}
+
+//----------------------------------------------------------------------------
+
+TangentGenerator::TangentGenerator(const uint32_t *triangles, size_t index_count, int vertex_count)
+    : vertex_count(vertex_count), triangle_count((int) (index_count / 3))
+{
+    padded_count = (triangle_count + 3) & ~3;
+    indices.assign(triangles, triangles + (size_t) triangle_count * 3);
+    indices.resize((size_t) padded_count * 3, 0);   // degenerate, and never gathered
+
+    first_corner.assign(vertex_count + 1, 0);
+    for (int t = 0; t < triangle_count; ++t)
+        for (int k = 0; k < 3; ++k)
+            ++first_corner[indices[(size_t) t * 3 + k] + 1];
+    for (int i = 0; i < vertex_count; ++i)
+        first_corner[i + 1] += first_corner[i];
+
+    corners.resize((size_t) triangle_count * 3);
+    std::vector<uint32_t> fill(first_corner.begin(), first_corner.end() - 1);
+    for (int t = 0; t < triangle_count; ++t)
+        for (int k = 0; k < 3; ++k)
+            corners[fill[indices[(size_t) t * 3 + k]]++] = (uint32_t) (t * 3 + k);
+
+    corner_data.resize((size_t) padded_count * 3 * CORNER_FLOATS);
+}
+
+void TangentGenerator::corner_pass(const float *vertices, int first, int last, bool simd)
+{
+    int t = first;
+#if TANGENT_SSE2
+    if (simd)
+        for (; t + 4 <= last; t += 4)
+            corner_batch<F4>(vertices, indices.data(), t, corner_data.data());
+#else
+    (void) simd;
+#endif
+    for (; t < last; ++t)
+        corner_batch<float>(vertices, indices.data(), t, corner_data.data());
+}
+
+void TangentGenerator::vertex_pass(float *vertices, int first, int last) const
+{
+    for (int i = first; i < last; ++i)
+    {
+        float t[3] = { 0.0f, 0.0f, 0.0f }, hand = 0.0f;
+        for (uint32_t c = first_corner[i]; c < first_corner[i + 1]; ++c)
+        {
+            const float *record = &corner_data[(size_t) corners[c] * CORNER_FLOATS];
+            t[0] += record[0];
+            t[1] += record[1];
+            t[2] += record[2];
+            hand += record[3];
+        }
+
+        float *vertex = vertices + (size_t) i * VERTEX_FLOATS;
+        float n[3] = { vertex[3], vertex[4], vertex[5] };
+        float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length > 0.0f)
+            n[0] /= length, n[1] /= length, n[2] /= length;
+        else
+            n[0] = 0.0f, n[1] = 0.0f, n[2] = 1.0f;
+
+        // Gram-Schmidt; a vertex whose triangles have no UV area gets any
+        // tangent perpendicular to the normal
+        float d = t[0] * n[0] + t[1] * n[1] + t[2] * n[2];
+        float tangent[3] = { t[0] - d * n[0], t[1] - d * n[1], t[2] - d * n[2] };
+        length = std::sqrt(tangent[0] * tangent[0] + tangent[1] * tangent[1] + tangent[2] * tangent[2]);
+        if (length < 1e-12f)
+        {
+            float axis[3] = { 1.0f, 0.0f, 0.0f };
+            if (std::fabs(n[0]) > 0.9f)
+                axis[0] = 0.0f, axis[1] = 1.0f;
+            d = axis[0] * n[0] + axis[1] * n[1];
+            tangent[0] = axis[0] - d * n[0];
+            tangent[1] = axis[1] - d * n[1];
+            tangent[2] = -d * n[2];
+            length = std::sqrt(tangent[0] * tangent[0] + tangent[1] * tangent[1] + tangent[2] * tangent[2]);
+        }
+        for (int j = 0; j < 3; ++j)
+            tangent[j] /= length;
+
+        float nt[3] = {
+            n[1] * tangent[2] - n[2] * tangent[1],
+            n[2] * tangent[0] - n[0] * tangent[2],
+            n[0] * tangent[1] - n[1] * tangent[0]
+        };
+        float sign = hand < 0.0f ? -1.0f : 1.0f;
+
+        for (int j = 0; j < 3; ++j)
+        {
+            vertex[8 + j] = tangent[j];
+            vertex[11 + j] = sign * nt[j];
+        }
+    }
+}
+
+void TangentGenerator::generate(float *vertices, const TangentOptions &options)
+{
+    // chunks of whole SSE batches; small meshes stay on the calling thread
+    const int min_batches = 1024, min_vertices = 8192;
+    for_ranges(padded_count / 4, min_batches, options.parallel, [&](int first, int last) {
+        corner_pass(vertices, first * 4, std::min(last * 4, triangle_count), options.simd);
+    });
+    for_ranges(vertex_count, min_vertices, options.parallel, [&](int first, int last) {
+        vertex_pass(vertices, first, last);
+    });
+}
+
+void generate_tangents(float *vertices, int vertex_count, const uint32_t *triangles, size_t index_count,
+                       const TangentOptions &options)
+{
+    TangentGenerator generator(triangles, index_count, vertex_count);
+    generator.generate(vertices, options);
+}
+
+std::vector<uint32_t> strip_triangles(const std::vector<uint32_t> &strips, bool restart, uint32_t restart_index)
+{
+    std::vector<uint32_t> triangles;
+    triangles.reserve(strips.size() * 3);
+    size_t start = 0;
+    for (size_t i = 0; i < strips.size(); ++i)
+    {
+        if (restart && strips[i] == restart_index)
+        {
+            start = i + 1;
+            continue;
+        }
+        if (i < start + 2)
+            continue;
+
+        uint32_t a = strips[i - 2], b = strips[i - 1], c = strips[i];
+        if (a == b || b == c || a == c)
+            continue;
+        if ((i - start) % 2)   // every other triangle of a strip is wound the other way
+            std::swap(a, b);
+        triangles.push_back(a);
+        triangles.push_back(b);
+        triangles.push_back(c);
+    }
+    return triangles;
+}
@@ -0,0 +1,69 @@
+// Per-vertex tangent frames for normal mapping, for meshes in the 14-float
+// vertex layout (vertex_format.h): positions, normals and texcoords in,
+// tangents and bitangents written back in place.
+//
+// The result follows the MikkTSpace conventions: each triangle's texture
+// space tangent is projected into the plane of each corner's vertex normal,
+// normalized and weighted by the corner angle; the per-vertex sum is
+// orthonormalized against the normal, and the bitangent is
+// sign * cross(N, T), the sign being the angle-weighted majority of the
+// corners' texture-space bitangents (so mirrored UVs flip it). Vertices are not split, so the frames
+// match MikkTSpace wherever it would not split either (no UV seams or hard
+// edges sharing a vertex).
+//
+// Work happens in two passes, so neither needs locks: corners are computed
+// for batches of four triangles at a time in SSE lanes (the batch's vertices
+// transposed to struct of arrays on load), then each vertex gathers its
+// corners through an adjacency list built once for the topology. Both passes
+// are split across the worker pool for large meshes. A TangentGenerator keeps
+// the topology and scratch between calls, for meshes that deform every frame.
+
+#ifndef TANGENT_SPACE_H
+#define TANGENT_SPACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct TangentOptions
+{
+    bool simd;        // SSE lanes where available, else one triangle at a time
+    bool parallel;    // split both passes across the worker pool
+
+    TangentOptions() : simd(true), parallel(true) {}
+};
+
+class TangentGenerator
+{
+public:
+    // triangles: index_count / 3 triangles over vertex_count vertices.
+    TangentGenerator(const uint32_t *triangles, size_t index_count, int vertex_count);
+
+    // Recompute the tangent and bitangent of every vertex from its current
+    // position, normal and texcoords.
+    void generate(float *vertices, const TangentOptions &options = TangentOptions());
+
+    int vertices() const { return vertex_count; }
+    int triangles() const { return triangle_count; }
+
+private:
+    void corner_pass(const float *vertices, int first, int last, bool simd);
+    void vertex_pass(float *vertices, int first, int last) const;
+
+    int vertex_count, triangle_count, padded_count;
+    std::vector<uint32_t> indices;          // padded to a multiple of 4 triangles
+    std::vector<uint32_t> first_corner;     // vertex_count + 1 offsets into corners
+    std::vector<uint32_t> corners;          // 3 * triangle + k
+    std::vector<float> corner_data;         // weighted tangent and handedness per corner
+};
+
+// One-off form of TangentGenerator.
+void generate_tangents(float *vertices, int vertex_count, const uint32_t *triangles, size_t index_count,
+                       const TangentOptions &options = TangentOptions());
+
+// Triangle list of triangle strips joined by restart_index (when restart is
+// set) or by degenerate triangles, which are dropped; the winding of odd
+// triangles is fixed up.
+std::vector<uint32_t> strip_triangles(const std::vector<uint32_t> &strips, bool restart, uint32_t restart_index);
+
+#endif // TANGENT_SPACE_H
@@ -0,0 +1,95 @@
+#version 400 core
+
+// Tessellation levels of the surface's triangles from their projected size:
+// each edge is cut into pieces of about tessEdgePixels on screen. A level
+// depends only on its edge's two end points, so the triangles either side of
+// an edge agree on it and no cracks open. Triangles whose displaced extent is
+// entirely off one side of the view get level 0 and are dropped.
+layout (vertices = 3) out;
+
+in TESS_IN {
+    vec3 Position;
+    vec2 TexCoords;
+    vec3 Tangent;
+    vec3 Bitangent;
+    vec3 Normal;
+} tc_in[];
+
+out TESS_IN {
+    vec3 Position;
+    vec2 TexCoords;
+    vec3 Tangent;
+    vec3 Bitangent;
+    vec3 Normal;
+} tc_out[];
+
+uniform mat4 Projection;
+uniform mat4 View;
+
+uniform vec2 viewportSize;          // pixels
+uniform float tessEdgePixels;       // target length of a generated edge
+uniform float tessMaxLevel;         // at most GL_MAX_TESS_GEN_LEVEL
+uniform float displacementScale;    // world units at depth 1 (teshader5.glsl)
+
+vec4 clipPosition(vec3 p)
+{
+    return Projection * View * vec4(p, 1.0);
+}
+
+// Pixel position; points behind the eye are pushed to the near side, which
+// only ever makes their edges longer
+vec2 screenPosition(vec4 clip)
+{
+    return clip.xy / max(clip.w, 1e-3) * 0.5 * viewportSize;
+}
+
+float edgeLevel(vec2 a, vec2 b)
+{
+    return clamp(distance(a, b) / tessEdgePixels, 1.0, tessMaxLevel);
+}
+
+// True when the triangle, swept through its whole displacement range, lies
+// outside one plane of the clip volume
+bool offscreen()
+{
+    vec4 clip[6];
+    for (int i = 0; i < 3; ++i) {
+        clip[i] = clipPosition(tc_in[i].Position);
+        clip[i + 3] = clipPosition(tc_in[i].Position - normalize(tc_in[i].Normal) * displacementScale);
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+        bool below = true, above = true;
+        for (int i = 0; i < 6; ++i) {
+            below = below && clip[i][axis] < -clip[i].w;
+            above = above && clip[i][axis] > clip[i].w;
+        }
+        if (below || above)
+            return true;
+    }
+    return false;
+}
+
+void main()
+{
+    tc_out[gl_InvocationID].Position = tc_in[gl_InvocationID].Position;
+    tc_out[gl_InvocationID].TexCoords = tc_in[gl_InvocationID].TexCoords;
+    tc_out[gl_InvocationID].Tangent = tc_in[gl_InvocationID].Tangent;
+    tc_out[gl_InvocationID].Bitangent = tc_in[gl_InvocationID].Bitangent;
+    tc_out[gl_InvocationID].Normal = tc_in[gl_InvocationID].Normal;
+
+    if (gl_InvocationID == 0) {
+        if (offscreen()) {
+            gl_TessLevelOuter[0] = gl_TessLevelOuter[1] = gl_TessLevelOuter[2] = 0.0;
+            gl_TessLevelInner[0] = 0.0;
+            return;
+        }
+        vec2 s0 = screenPosition(clipPosition(tc_in[0].Position));
+        vec2 s1 = screenPosition(clipPosition(tc_in[1].Position));
+        vec2 s2 = screenPosition(clipPosition(tc_in[2].Position));
+        // outer level i is the edge opposite vertex i
+        gl_TessLevelOuter[0] = edgeLevel(s1, s2);
+        gl_TessLevelOuter[1] = edgeLevel(s2, s0);
+        gl_TessLevelOuter[2] = edgeLevel(s0, s1);
+        gl_TessLevelInner[0] = max(gl_TessLevelOuter[0], max(gl_TessLevelOuter[1], gl_TessLevelOuter[2]));
+    }
+}
@@ -0,0 +1,37 @@
+// CDLOD terrain (cdlod.h) for the vertex shaders that draw it, vshader5.glsl
+// and vshader5_mdi.glsl, pulled in by InitShader's #include. The including
+// shader declares aTexCoords (the vertex's place in its patch grid) and
+// ViewPos. Heights come from depthMap, tiled every terrainTile world units.
+uniform vec2 terrainMorph[8];       // per level: morph start and end distance
+uniform float terrainHeightScale;
+uniform float terrainTile;
+uniform sampler2D depthMap;
+
+float terrainHeight(vec2 xz)
+{
+    return (1.0 - textureLod(depthMap, xz / terrainTile, 0.0).r) * terrainHeightScale;
+}
+
+// Slide the odd vertices of the patch (node: x, z, size, level) onto the
+// next coarser level's grid as the camera distance approaches the end of
+// this level's range
+vec2 terrainPosition(vec4 node, float patchResolution)
+{
+    vec2 xz = node.xy + aTexCoords * node.z;
+    vec2 range = terrainMorph[int(node.w)];
+    float distance = length(ViewPos - vec3(xz.x, terrainHeight(xz), xz.y));
+    float morph = clamp((distance - range.x) / (range.y - range.x), 0.0, 1.0);
+    vec2 odd = fract(aTexCoords * patchResolution * 0.5) * 2.0 / patchResolution;
+    return xz - odd * node.z * morph;
+}
+
+// World-space frame of the terrain at xz; T and B follow the texcoords
+void terrainFrame(vec2 xz, out vec3 T, out vec3 B, out vec3 N)
+{
+    float e = terrainTile / float(textureSize(depthMap, 0).x);
+    float dx = terrainHeight(xz + vec2(e, 0.0)) - terrainHeight(xz - vec2(e, 0.0));
+    float dz = terrainHeight(xz + vec2(0.0, e)) - terrainHeight(xz - vec2(0.0, e));
+    N = normalize(vec3(-dx, 2.0 * e, -dz));
+    T = normalize(vec3(1.0, 0.0, 0.0) - N * N.x);
+    B = cross(T, N);
+}
@@ -0,0 +1,150 @@
+#include "terrain_indirect.h"
+#include "benchmark.h"
+#include "grid_mesh.h"
+#include "thread_pool.h"
+#include "vertex_format.h"
+
+#include <algorithm>
+#include <iostream>
+
+static const int MIN_DRAWS_PER_JOB = 256;
+
+TerrainIndirect::TerrainIndirect(int patch_resolution)
+    : vao(0), vbo(0), ebo(0), command_buffer(0), draw_buffer(0), index_type(GL_UNSIGNED_SHORT),
+      restart_index(0xFFFF), draw_ids(draw_ids_supported()), fill_ms(0.0)
+{
+    GridMeshData grids[2] = { build_grid_mesh(patch_resolution, true), build_grid_mesh(patch_resolution / 2, true) };
+
+    // Both grids in shared buffers, the quadrant grid after the whole-node one
+    std::vector<unsigned char> vertices, packed;
+    std::vector<uint32_t> indices;
+    bool short_indices = grids[0].vertex_count() + grids[1].vertex_count() <= 0xFFFF;
+    index_type = short_indices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    restart_index = short_indices ? 0xFFFF : 0xFFFFFFFF;
+    int vertex_count = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+        resolution[i] = grids[i].resolution;
+        first_index[i] = (GLuint) indices.size();
+        index_count[i] = (GLuint) grids[i].indices.size();
+        base_vertex[i] = vertex_count;
+        for (size_t k = 0; k < grids[i].indices.size(); ++k)
+            indices.push_back(grids[i].indices[k] == grids[i].restart_index ? restart_index : grids[i].indices[k]);
+
+        pack_vertices(VERTEX_PACKED, grids[i].vertices.data(), grids[i].vertex_count(), packed);
+        vertices.insert(vertices.end(), packed.begin(), packed.end());
+        vertex_count += grids[i].vertex_count();
+    }
+
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+    glGenBuffers(1, &ebo);
+    glGenBuffers(1, &command_buffer);
+    glGenBuffers(1, &draw_buffer);
+    glBindVertexArray(vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size(), vertices.data(), GL_STATIC_DRAW);
+    set_vertex_attributes(VERTEX_PACKED);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    if (short_indices)
+    {
+        std::vector<uint16_t> narrow(indices.begin(), indices.end());
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, narrow.size() * sizeof(uint16_t), narrow.data(), GL_STATIC_DRAW);
+    }
+    else
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+
+    // Per-instance reading of the records, for drivers without gl_DrawID
+    glBindBuffer(GL_ARRAY_BUFFER, draw_buffer);
+    for (int k = 0; k < 2; ++k)
+    {
+        glEnableVertexAttribArray(6 + k);
+        glVertexAttribPointer(6 + k, 4, GL_FLOAT, GL_FALSE, sizeof(TerrainDraw), BUFFER_OFFSET(k * 4 * sizeof(float)));
+        glVertexAttribDivisor(6 + k, 1);
+    }
+
+    glBindVertexArray(0);
+}
+
+TerrainIndirect::~TerrainIndirect()
+{
+    glDeleteBuffers(1, &draw_buffer);
+    glDeleteBuffers(1, &command_buffer);
+    glDeleteBuffers(1, &ebo);
+    glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &vao);
+}
+
+bool TerrainIndirect::supported()
+{
+    return GLEW_VERSION_4_3 != 0;
+}
+
+bool TerrainIndirect::draw_ids_supported()
+{
+    return GLEW_VERSION_4_6 || GLEW_ARB_shader_draw_parameters;
+}
+
+void TerrainIndirect::draw(const CdlodTerrain &terrain, GLuint program, bool parallel)
+{
+    const std::vector<TerrainPatch> &patches = terrain.patches();
+    const int count = (int) patches.size();
+    const int whole = terrain.whole_patches();
+    if (count == 0)
+        return;
+
+    BenchClock::time_point start = BenchClock::now();
+    commands.resize(count);
+    draws.resize(count);
+    auto fill = [&](int first, int last) {
+        for (int i = first; i < last; ++i)
+        {
+            int grid = i < whole ? 0 : 1;
+            DrawElementsIndirectCommand &command = commands[i];
+            command.count = index_count[grid];
+            command.instance_count = 1;
+            command.first_index = first_index[grid];
+            command.base_vertex = base_vertex[grid];
+            command.base_instance = i;
+
+            TerrainDraw &draw = draws[i];
+            draw.patch = patches[i];
+            draw.resolution = (float) resolution[grid];
+            draw.padding[0] = draw.padding[1] = draw.padding[2] = 0.0f;
+        }
+    };
+    int jobs = parallel ? std::min((int) worker_pool().size() + 1, count / MIN_DRAWS_PER_JOB) : 1;
+    if (jobs <= 1)
+        fill(0, count);
+    else
+        worker_pool().parallel_for(jobs, [&](int job) {
+            fill((int) ((long long) count * job / jobs), (int) ((long long) count * (job + 1) / jobs));
+        });
+    fill_ms = bench_ms(start);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, count * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, draw_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(TerrainDraw), draws.data(), GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, draw_buffer);
+
+    terrain.set_uniforms(program);
+    glUniform1i(glGetUniformLocation(program, "drawIDFetch"), draw_ids);
+
+    glBindVertexArray(vao);
+    glEnable(GL_PRIMITIVE_RESTART);
+    glPrimitiveRestartIndex(restart_index);
+    glMultiDrawElementsIndirect(GL_TRIANGLE_STRIP, index_type, BUFFER_OFFSET(0), count, 0);
+    glDisable(GL_PRIMITIVE_RESTART);
+    glBindVertexArray(0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void TerrainIndirect::print_stats() const
+{
+    std::cout << "Terrain (indirect): " << commands.size() << " draws in 1 glMultiDrawElementsIndirect, per-draw data by "
+              << (draw_ids ? "gl_DrawID" : "baseInstance attributes") << ", commands filled in " << fill_ms << " ms"
+              << std::endl;
+}
@@ -0,0 +1,81 @@
+// GPU-driven submission of the CDLOD terrain (cdlod.h): the selected patches
+// become an array of indirect draw commands and the whole terrain is drawn
+// with one glMultiDrawElementsIndirect, however many patches there are.
+//
+// Both patch grids live in one vertex and one index buffer, so that every
+// command differs only in its index range, base vertex and base instance.
+// Each draw's patch and grid resolution go into a storage buffer, which
+// vshader5_mdi.glsl indexes with gl_DrawID (GL 4.6 or
+// ARB_shader_draw_parameters); elsewhere the same buffer is bound as
+// per-instance attributes, each command's baseInstance selecting its record.
+// Commands and records are filled in ranges across the worker pool.
+//
+// Needs GL 4.3, which Mesa's llvmpipe provides, so the path runs headless.
+
+#ifndef TERRAIN_INDIRECT_H
+#define TERRAIN_INDIRECT_H
+
+#include "common.h"
+#include "cdlod.h"
+
+#include <vector>
+
+// Layout of GL_DRAW_INDIRECT_BUFFER entries for glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint  base_vertex;
+    GLuint base_instance;
+};
+
+// Per-draw record: TerrainDraw in vshader5_mdi.glsl
+struct TerrainDraw
+{
+    TerrainPatch patch;
+    float resolution;       // quads per side of the patch's grid
+    float padding[3];
+};
+
+class TerrainIndirect
+{
+public:
+    // patch_resolution: CdlodTerrain::patch_resolution() of the terrain drawn.
+    explicit TerrainIndirect(int patch_resolution);
+    ~TerrainIndirect();
+
+    static bool supported();
+
+    // Draw terrain's current selection with one call. program is built from
+    // vshader5_mdi.glsl and in use; depthMap must be bound.
+    void draw(const CdlodTerrain &terrain, GLuint program, bool parallel = true);
+
+    // Per-draw records by gl_DrawID where supported, or by baseInstance
+    // attributes; both are kept working so either can be checked.
+    bool draw_id_fetch() const { return draw_ids; }
+    void set_draw_id_fetch(bool fetch) { draw_ids = fetch && draw_ids_supported(); }
+    static bool draw_ids_supported();
+    void print_stats() const;
+
+private:
+    TerrainIndirect(const TerrainIndirect &);
+    TerrainIndirect &operator=(const TerrainIndirect &);
+
+    GLuint vao, vbo, ebo, command_buffer, draw_buffer;
+    GLenum index_type;
+    GLuint restart_index;
+
+    // Index range and base vertex of the whole-node grid [0] and the
+    // quadrant grid [1]
+    GLuint index_count[2], first_index[2];
+    GLint base_vertex[2];
+    int resolution[2];
+
+    std::vector<DrawElementsIndirectCommand> commands;
+    std::vector<TerrainDraw> draws;
+    bool draw_ids;
+    double fill_ms;
+};
+
+#endif // TERRAIN_INDIRECT_H
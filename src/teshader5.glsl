@@ -0,0 +1,59 @@
+#version 400 core
+
+// Place the generated vertices on the surface and push them into it by the
+// depth map, so that footprints are real geometry: they occlude what lies
+// behind them and cut the silhouette, where parallax only shifts texels.
+// Outputs what vshader5.glsl does, for fshader5.glsl with displaced set.
+layout (triangles, fractional_odd_spacing, ccw) in;
+
+in TESS_IN {
+    vec3 Position;
+    vec2 TexCoords;
+    vec3 Tangent;
+    vec3 Bitangent;
+    vec3 Normal;
+} te_in[];
+
+out VS_OUT {
+    vec3 FragPos;
+    vec2 TexCoords;
+    vec3 TangentLightPos;
+    vec3 TangentViewPos;
+    vec3 TangentFragPos;
+} vs_out;
+flat out int MaterialLayer;     // fshader5.glsl's, the uniform's for the one surface
+
+uniform mat4 Projection;
+uniform mat4 View;
+
+uniform vec3 LightPos;
+uniform vec3 ViewPos;
+
+uniform float displacementScale;    // world units at depth 1
+uniform int materialLayer;
+
+// fshader5.glsl's height sources; the virtual texture has no page level
+// here, so it displaces by depthMap
+#define SURFACE_TEXTURE(sampler, coords) textureLod(sampler, coords, 0.0)
+#include "surface5.glsl"
+
+void main()
+{
+    vec3 w = gl_TessCoord;
+    vec3 position = w.x * te_in[0].Position + w.y * te_in[1].Position + w.z * te_in[2].Position;
+    vec2 uv = w.x * te_in[0].TexCoords + w.y * te_in[1].TexCoords + w.z * te_in[2].TexCoords;
+    vec3 T = normalize(w.x * te_in[0].Tangent + w.y * te_in[1].Tangent + w.z * te_in[2].Tangent);
+    vec3 B = normalize(w.x * te_in[0].Bitangent + w.y * te_in[1].Bitangent + w.z * te_in[2].Bitangent);
+    vec3 N = normalize(w.x * te_in[0].Normal + w.y * te_in[1].Normal + w.z * te_in[2].Normal);
+
+    vs_out.FragPos = position - N * materialSurface(uv, materialLayer).a * displacementScale;
+    vs_out.TexCoords = uv;
+    MaterialLayer = materialLayer;
+
+    mat3 TBN = transpose(mat3(T, B, N));
+    vs_out.TangentLightPos = TBN * LightPos;
+    vs_out.TangentViewPos  = TBN * ViewPos;
+    vs_out.TangentFragPos  = TBN * vs_out.FragPos;
+
+    gl_Position = Projection * View * vec4(vs_out.FragPos, 1.0);
+}
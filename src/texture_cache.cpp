@@ -0,0 +1,219 @@
+#include "texture_cache.h"
+#include "texture_loader.h"
+#include "pbo_upload.h"
+#include "texture_storage.h"
+#include "thread_pool.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+static const char TEXCACHE_MAGIC[4] = { 'T', 'X', 'C', '1' };
+static const uint32_t TEXCACHE_VERSION = 3;
+
+std::string texture_cache_path(const char *source_path)
+{
+    return std::string(source_path) + ".texcache";
+}
+
+static bool source_hash(const char *source_path, uint64_t &hash)
+{
+    MappedFile source;
+    if (!source.open(source_path))
+        return false;
+    hash = hash_bytes(source.data(), source.size());
+    return true;
+}
+
+uint32_t texture_cache_mip_flags(const TextureCacheKey &key)
+{
+    if (!key.cpu_mipmaps)
+        return TEXCACHE_DRIVER_MIPS;
+    return (key.filter == MIP_KAISER ? TEXCACHE_KAISER : 0) | (key.renormalized ? TEXCACHE_RENORMALIZE : 0);
+}
+
+bool open_texture_cache(const char *source_path, CachedTexture &cache, const TextureCacheKey &key)
+{
+    bool compressed = key.compressed;
+    cache.header = NULL;
+
+    int64_t mtime, size;
+    if (!file_stat(source_path, mtime, size))
+        return false;
+    if (!cache.file.open(texture_cache_path(source_path).c_str()))
+        return false;
+
+    const TextureCacheHeader *header = (const TextureCacheHeader *) cache.file.data();
+    bool valid = cache.file.size() >= sizeof(TextureCacheHeader)
+        && memcmp(header->magic, TEXCACHE_MAGIC, 4) == 0
+        && header->version == TEXCACHE_VERSION
+        && header->levels >= 1 && header->levels <= (uint32_t) TEXCACHE_MAX_LEVELS
+        && (header->format == 0) == compressed
+        && header->mip_flags == texture_cache_mip_flags(key);
+
+    valid = valid && header->width >= 1 && header->height >= 1
+        && header->levels <= (uint32_t) mip_level_count(header->width, header->height)
+        && header->channels >= 1 && header->channels <= 4;
+
+    // Every level must hold exactly what its upload will read
+    BlockFormat block_format = BLOCK_BC1;
+    if (valid && compressed)
+        valid = block_format_from_gl(header->internal_format, block_format);
+    else if (valid)
+    {
+        GLenum internal_format, format;
+        sized_format(header->channels, internal_format, format);
+        valid = header->internal_format == internal_format && header->format == format
+            && header->type == GL_UNSIGNED_BYTE;
+    }
+    int width = header->width, height = header->height;
+    for (uint32_t level = 0; valid && level < header->levels; ++level)
+    {
+        uint64_t bytes = compressed ? compressed_size(block_format, width, height)
+                                    : (uint64_t) width * height * header->channels;
+        valid = header->level_size[level] == bytes
+            && header->level_offset[level] <= cache.file.size()
+            && header->level_size[level] <= cache.file.size() - header->level_offset[level];
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    if (valid && (header->source_mtime != mtime || header->source_size != size))
+    {
+        uint64_t hash;
+        valid = header->source_size == size && source_hash(source_path, hash) && hash == header->source_hash;
+    }
+
+    if (!valid)
+    {
+        cache.file.close();
+        return false;
+    }
+
+    cache.header = header;
+    cache.source = source_path;
+    return true;
+}
+
+void upload_cached_texture(GLuint texture, const CachedTexture &cache)
+{
+    const TextureCacheHeader &header = *cache.header;
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    size_t bytes = allocate_texture_2d(header.levels, header.internal_format, header.width, header.height);
+    register_texture(texture, cache.source, texture_group(cache.source), bytes);
+
+    TextureUploader &uploader = texture_uploader();
+    int width = header.width, height = header.height;
+    for (uint32_t level = 0; level < header.levels; ++level)
+    {
+        if (header.format == 0)
+            uploader.compressed_sub_image_2d(GL_TEXTURE_2D, level, header.internal_format, width, height,
+                                             header.level_size[level], cache.level_data(level));
+        else
+            uploader.sub_image_2d(GL_TEXTURE_2D, level, 0, 0, width, height, header.format, header.type,
+                                  cache.level_data(level), (size_t) width * header.channels);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    apply_texture_params(GL_TEXTURE_2D);
+}
+
+//----------------------------------------------------------------------------
+
+static void write_texture_cache(const std::string &source_path, TextureCacheHeader header,
+                                const std::vector<unsigned char> &levels)
+{
+    if (!file_stat(source_path.c_str(), header.source_mtime, header.source_size)
+        || !source_hash(source_path.c_str(), header.source_hash))
+        return;
+
+    std::string path = texture_cache_path(source_path.c_str());
+    std::string temp = path + ".tmp";
+
+    FILE *fp = fopen(temp.c_str(), "wb");
+    if (fp == NULL)
+        return;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(levels.data(), 1, levels.size(), fp) == levels.size();
+    ok = fclose(fp) == 0 && ok;
+
+    remove(path.c_str());
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        remove(temp.c_str());
+        std::cerr << "Could not write texture cache " << path << std::endl;
+    }
+}
+
+void bake_texture_cache(const char *source_path, GLuint texture, int channels, const TextureCacheKey &key)
+{
+    TextureCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXCACHE_MAGIC, 4);
+    header.version = TEXCACHE_VERSION;
+    header.channels = channels;
+    header.type = GL_UNSIGNED_BYTE;
+    header.mip_flags = texture_cache_mip_flags(key);
+
+    GLenum internal_format, format;
+    sized_format(channels, internal_format, format);
+    header.internal_format = internal_format;
+    header.format = format;
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    GLint width = 0, height = 0;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    if (width <= 0 || height <= 0)
+        return;
+    header.width = width;
+    header.height = height;
+
+    GLint compressed = GL_FALSE;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+    if (compressed)
+    {
+        GLint compressed_format = 0;
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &compressed_format);
+        header.internal_format = compressed_format;
+        header.format = 0;
+        header.type = 0;
+    }
+
+    std::shared_ptr< std::vector<unsigned char> > levels = std::make_shared< std::vector<unsigned char> >();
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    for (int level = 0; level < TEXCACHE_MAX_LEVELS; ++level)
+    {
+        size_t bytes = (size_t) width * height * channels;
+        if (compressed)
+        {
+            GLint size = 0;
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+            bytes = size;
+        }
+        header.level_offset[level] = sizeof(TextureCacheHeader) + levels->size();
+        header.level_size[level] = bytes;
+        header.levels = level + 1;
+
+        levels->resize(levels->size() + bytes);
+        unsigned char *dst = levels->data() + levels->size() - bytes;
+        if (compressed)
+            glGetCompressedTexImage(GL_TEXTURE_2D, level, dst);
+        else
+            glGetTexImage(GL_TEXTURE_2D, level, format, GL_UNSIGNED_BYTE, dst);
+
+        if (width == 1 && height == 1)
+            break;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+    std::string source(source_path);
+    worker_pool().submit([source, header, levels] { write_texture_cache(source, header, *levels); });
+}
@@ -0,0 +1,81 @@
+// Pre-baked texture cache. "<image>.texcache" next to a source image holds its
+// full mip chain, tightly packed in the exact layout glTexImage2D consumes, so
+// a warm start maps the file and uploads straight from it without running
+// stb_image, glGenerateMipmap or the block compressor. Compressed textures are
+// stored as their blocks (format == 0 in the header).
+//
+// A cache is used only while the source image still matches it: the recorded
+// size and mtime are checked first, and if those differ (a fresh checkout, a
+// touched file) the source's content hash decides. It must also have been
+// baked with the settings the load would use now (TextureCacheKey).
+
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "common.h"
+#include "mapped_file.h"
+#include "mipmap.h"
+
+#include <string>
+
+const int TEXCACHE_MAX_LEVELS = 16;
+
+struct TextureCacheHeader
+{
+    char     magic[4];          // "TXC1"
+    uint32_t version;
+    int64_t  source_mtime;
+    int64_t  source_size;
+    uint64_t source_hash;
+    uint32_t width, height, channels, levels;
+    uint32_t internal_format;   // sized, e.g. GL_RGB8, or a compressed format
+    uint32_t format, type;      // client format of the stored levels; 0 if compressed
+    uint32_t mip_flags;         // TEXCACHE_* below: how levels 1..n were built
+    uint64_t level_offset[TEXCACHE_MAX_LEVELS];
+    uint64_t level_size[TEXCACHE_MAX_LEVELS];
+};
+
+// What a baked chain depends on besides its source image.
+struct TextureCacheKey
+{
+    bool compressed;
+    bool cpu_mipmaps;       // build_mips(), else glGenerateMipmap
+    MipFilter filter;       // these two only for CPU mips
+    bool renormalized;
+};
+
+const uint32_t TEXCACHE_DRIVER_MIPS = 1 << 0;
+const uint32_t TEXCACHE_KAISER      = 1 << 1;
+const uint32_t TEXCACHE_RENORMALIZE = 1 << 2;
+
+uint32_t texture_cache_mip_flags(const TextureCacheKey &key);
+
+struct CachedTexture
+{
+    MappedFile file;
+    const TextureCacheHeader *header;   // NULL unless the cache was accepted
+    std::string source;                 // the image it was baked from
+
+    CachedTexture() : header(NULL) {}
+    const unsigned char *level_data(int level) const { return file.data() + header->level_offset[level]; }
+};
+
+std::string texture_cache_path(const char *source_path);
+
+// Map and validate the cache for source_path. Touches no GL state, so it is
+// safe to call from a worker thread. Returns false if the cache is missing,
+// malformed (a size, format or level that does not add up, or a level that
+// is not exactly its tightly packed size inside the file), stale, or
+// baked with other settings than key.
+bool open_texture_cache(const char *source_path, CachedTexture &cache, const TextureCacheKey &key);
+
+// Upload every stored level into texture. Context thread only.
+void upload_cached_texture(GLuint texture, const CachedTexture &cache);
+
+// Bake step: read back the mip chain of an already uploaded texture (raw
+// blocks if it is compressed) and write it as the cache for source_path. The
+// readback happens here on the context thread; the file is hashed and written
+// on the worker pool. key is what the texture was built with.
+void bake_texture_cache(const char *source_path, GLuint texture, int channels, const TextureCacheKey &key);
+
+#endif // TEXTURE_CACHE_H
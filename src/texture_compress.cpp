@@ -0,0 +1,330 @@
+#include "texture_compress.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+int block_bytes(BlockFormat format)
+{
+    return format == BLOCK_BC5 ? 16 : 8;
+}
+
+size_t compressed_size(BlockFormat format, int width, int height)
+{
+    return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * block_bytes(format);
+}
+
+GLenum block_gl_format(BlockFormat format)
+{
+    switch (format)
+    {
+    case BLOCK_BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    case BLOCK_BC4: return GL_COMPRESSED_RED_RGTC1;
+    default:        return GL_COMPRESSED_RG_RGTC2;
+    }
+}
+
+bool block_format_from_gl(GLenum internal_format, BlockFormat &format)
+{
+    switch (internal_format)
+    {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: format = BLOCK_BC1; return true;
+    case GL_COMPRESSED_RED_RGTC1:         format = BLOCK_BC4; return true;
+    case GL_COMPRESSED_RG_RGTC2:          format = BLOCK_BC5; return true;
+    default:                              return false;
+    }
+}
+
+int decoded_channels(BlockFormat format)
+{
+    switch (format)
+    {
+    case BLOCK_BC1: return 3;
+    case BLOCK_BC4: return 1;
+    default:        return 2;
+    }
+}
+
+// Gather a 4x4 block (clamped at the image edge) into out[16][3]; channel c
+// of the block comes from source channel min(first + c, channels - 1).
+static void fetch_block(const unsigned char *pixels, int width, int height, int channels,
+                        int bx, int by, int first, int count, unsigned char out[16][3])
+{
+    for (int j = 0; j < 4; ++j)
+    {
+        int y = std::min(by * 4 + j, height - 1);
+        for (int i = 0; i < 4; ++i)
+        {
+            int x = std::min(bx * 4 + i, width - 1);
+            const unsigned char *p = pixels + ((size_t) y * width + x) * channels;
+            for (int c = 0; c < count; ++c)
+                out[j * 4 + i][c] = p[std::min(first + c, channels - 1)];
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// BC1
+
+static uint16_t pack_565(const float c[3])
+{
+    int r = (int) (std::min(255.0f, std::max(0.0f, c[0])) * 31.0f / 255.0f + 0.5f);
+    int g = (int) (std::min(255.0f, std::max(0.0f, c[1])) * 63.0f / 255.0f + 0.5f);
+    int b = (int) (std::min(255.0f, std::max(0.0f, c[2])) * 31.0f / 255.0f + 0.5f);
+    return (uint16_t) ((r << 11) | (g << 5) | b);
+}
+
+static void unpack_565(uint16_t c, int out[3])
+{
+    int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    out[0] = (r << 3) | (r >> 2);
+    out[1] = (g << 2) | (g >> 4);
+    out[2] = (b << 3) | (b >> 2);
+}
+
+static void bc1_palette(uint16_t c0, uint16_t c1, int palette[4][3])
+{
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (int k = 0; k < 3; ++k)
+    {
+        if (c0 > c1)
+        {
+            palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+            palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+        }
+        else
+        {
+            palette[2][k] = (palette[0][k] + palette[1][k]) / 2;
+            palette[3][k] = 0;
+        }
+    }
+}
+
+// Endpoints are the extreme texels along the block's principal axis, found
+// with a few power iterations on the colour covariance (as stb_dxt does).
+static void encode_bc1_block(const unsigned char block[16][3], unsigned char *out)
+{
+    float mean[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; ++i)
+        for (int k = 0; k < 3; ++k)
+            mean[k] += block[i][k];
+    for (int k = 0; k < 3; ++k)
+        mean[k] /= 16.0f;
+
+    float cov[6] = { 0, 0, 0, 0, 0, 0 };
+    for (int i = 0; i < 16; ++i)
+    {
+        float r = block[i][0] - mean[0], g = block[i][1] - mean[1], b = block[i][2] - mean[2];
+        cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+        cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+    }
+
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int iter = 0; iter < 4; ++iter)
+    {
+        float x = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+        float y = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+        float z = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+        float len = std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
+        if (len < 1e-4f)
+            break;
+        axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+    }
+
+    int lo = 0, hi = 0;
+    float lo_dot = 1e30f, hi_dot = -1e30f;
+    for (int i = 0; i < 16; ++i)
+    {
+        float d = block[i][0] * axis[0] + block[i][1] * axis[1] + block[i][2] * axis[2];
+        if (d < lo_dot) { lo_dot = d; lo = i; }
+        if (d > hi_dot) { hi_dot = d; hi = i; }
+    }
+
+    float e0[3] = { (float) block[hi][0], (float) block[hi][1], (float) block[hi][2] };
+    float e1[3] = { (float) block[lo][0], (float) block[lo][1], (float) block[lo][2] };
+    uint16_t c0 = pack_565(e0), c1 = pack_565(e1);
+    if (c0 < c1)
+        std::swap(c0, c1);
+
+    uint32_t indices = 0;
+    if (c0 != c1)
+    {
+        int palette[4][3];
+        bc1_palette(c0, c1, palette);
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, best_error = 1 << 30;
+            for (int p = 0; p < 4; ++p)
+            {
+                int dr = block[i][0] - palette[p][0], dg = block[i][1] - palette[p][1], db = block[i][2] - palette[p][2];
+                int error = dr * dr + dg * dg + db * db;
+                if (error < best_error) { best_error = error; best = p; }
+            }
+            indices |= (uint32_t) best << (2 * i);
+        }
+    }
+
+    out[0] = c0 & 0xff; out[1] = c0 >> 8;
+    out[2] = c1 & 0xff; out[3] = c1 >> 8;
+    for (int b = 0; b < 4; ++b)
+        out[4 + b] = (indices >> (8 * b)) & 0xff;
+}
+
+static void decode_bc1_block(const unsigned char *in, unsigned char block[16][3])
+{
+    uint16_t c0 = in[0] | (in[1] << 8), c1 = in[2] | (in[3] << 8);
+    uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t) in[7] << 24);
+    int palette[4][3];
+    bc1_palette(c0, c1, palette);
+    for (int i = 0; i < 16; ++i)
+        for (int k = 0; k < 3; ++k)
+            block[i][k] = (unsigned char) palette[(indices >> (2 * i)) & 3][k];
+}
+
+//----------------------------------------------------------------------------
+// BC4 (BC5 is two of these)
+
+static void bc4_palette(int a0, int a1, int palette[8])
+{
+    palette[0] = a0;
+    palette[1] = a1;
+    if (a0 > a1)
+    {
+        for (int i = 2; i < 8; ++i)
+            palette[i] = ((8 - i) * a0 + (i - 1) * a1 + 3) / 7;
+    }
+    else
+    {
+        for (int i = 2; i < 6; ++i)
+            palette[i] = ((6 - i) * a0 + (i - 1) * a1 + 2) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+static void encode_bc4_block(const unsigned char block[16][3], int channel, unsigned char *out)
+{
+    int lo = 255, hi = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        lo = std::min(lo, (int) block[i][channel]);
+        hi = std::max(hi, (int) block[i][channel]);
+    }
+
+    uint64_t indices = 0;
+    if (hi != lo)
+    {
+        int palette[8];
+        bc4_palette(hi, lo, palette);
+        for (int i = 0; i < 16; ++i)
+        {
+            int v = block[i][channel], best = 0, best_error = 256;
+            for (int p = 0; p < 8; ++p)
+            {
+                int error = std::abs(v - palette[p]);
+                if (error < best_error) { best_error = error; best = p; }
+            }
+            indices |= (uint64_t) best << (3 * i);
+        }
+    }
+
+    out[0] = (unsigned char) hi;
+    out[1] = (unsigned char) lo;
+    for (int b = 0; b < 6; ++b)
+        out[2 + b] = (indices >> (8 * b)) & 0xff;
+}
+
+static void decode_bc4_block(const unsigned char *in, unsigned char block[16][3], int channel)
+{
+    int palette[8];
+    bc4_palette(in[0], in[1], palette);
+    uint64_t indices = 0;
+    for (int b = 0; b < 6; ++b)
+        indices |= (uint64_t) in[2 + b] << (8 * b);
+    for (int i = 0; i < 16; ++i)
+        block[i][channel] = (unsigned char) palette[(indices >> (3 * i)) & 7];
+}
+
+//----------------------------------------------------------------------------
+
+void encode_blocks(BlockFormat format, const unsigned char *pixels, int width, int height, int channels,
+                   unsigned char *out)
+{
+    int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+    int stride = block_bytes(format);
+
+    worker_pool().parallel_for(blocks_y, [&](int by) {
+        unsigned char block[16][3];
+        unsigned char *dst = out + (size_t) by * blocks_x * stride;
+        for (int bx = 0; bx < blocks_x; ++bx, dst += stride)
+        {
+            switch (format)
+            {
+            case BLOCK_BC1:
+                fetch_block(pixels, width, height, channels, bx, by, 0, 3, block);
+                encode_bc1_block(block, dst);
+                break;
+            case BLOCK_BC4:
+                fetch_block(pixels, width, height, channels, bx, by, 0, 1, block);
+                encode_bc4_block(block, 0, dst);
+                break;
+            case BLOCK_BC5:
+                fetch_block(pixels, width, height, channels, bx, by, 0, 2, block);
+                encode_bc4_block(block, 0, dst);
+                encode_bc4_block(block, 1, dst + 8);
+                break;
+            }
+        }
+    });
+}
+
+void decode_blocks(BlockFormat format, const unsigned char *blocks, int width, int height, unsigned char *out)
+{
+    int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+    int stride = block_bytes(format), channels = decoded_channels(format);
+
+    for (int by = 0; by < blocks_y; ++by)
+    {
+        for (int bx = 0; bx < blocks_x; ++bx)
+        {
+            const unsigned char *src = blocks + ((size_t) by * blocks_x + bx) * stride;
+            unsigned char block[16][3];
+            switch (format)
+            {
+            case BLOCK_BC1: decode_bc1_block(src, block); break;
+            case BLOCK_BC4: decode_bc4_block(src, block, 0); break;
+            case BLOCK_BC5: decode_bc4_block(src, block, 0); decode_bc4_block(src + 8, block, 1); break;
+            }
+
+            for (int j = 0; j < 4 && by * 4 + j < height; ++j)
+                for (int i = 0; i < 4 && bx * 4 + i < width; ++i)
+                    memcpy(out + ((size_t) (by * 4 + j) * width + bx * 4 + i) * channels, block[j * 4 + i], channels);
+        }
+    }
+}
+
+double block_psnr(BlockFormat format, const unsigned char *pixels, int width, int height, int channels,
+                  const unsigned char *blocks)
+{
+    int out_channels = decoded_channels(format);
+    std::vector<unsigned char> decoded((size_t) width * height * out_channels);
+    decode_blocks(format, blocks, width, height, decoded.data());
+
+    double error = 0.0;
+    size_t texels = (size_t) width * height;
+    for (size_t i = 0; i < texels; ++i)
+    {
+        for (int c = 0; c < out_channels; ++c)
+        {
+            double d = (double) decoded[i * out_channels + c] - pixels[i * channels + std::min(c, channels - 1)];
+            error += d * d;
+        }
+    }
+
+    double mse = error / (texels * out_channels);
+    return mse <= 0.0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
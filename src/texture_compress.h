@@ -0,0 +1,46 @@
+// CPU block compression for the material textures, plus a reference decoder
+// used to validate the encoder.
+//
+//   BC1  (DXT1)   4 bpp  RGB             diffuse maps
+//   BC4  (RGTC1)  4 bpp  R               height maps
+//   BC5  (RGTC2)  8 bpp  RG              tangent-space normals; the shader
+//                                        rebuilds Z = sqrt(1 - x^2 - y^2)
+//
+// Images whose size is not a multiple of 4 are padded by clamping to the edge.
+// Block rows are encoded in parallel on the worker pool.
+
+#ifndef TEXTURE_COMPRESS_H
+#define TEXTURE_COMPRESS_H
+
+#include "common.h"
+
+#include <cstddef>
+
+enum BlockFormat { BLOCK_BC1, BLOCK_BC4, BLOCK_BC5 };
+
+// Bytes in one 4x4 block, and in a whole width x height image.
+int block_bytes(BlockFormat format);
+size_t compressed_size(BlockFormat format, int width, int height);
+
+// The glCompressedTexImage2D internal format for a block format, and back;
+// false for a format that is none of them.
+GLenum block_gl_format(BlockFormat format);
+bool block_format_from_gl(GLenum internal_format, BlockFormat &format);
+
+// Encode an 8-bit image with 1-4 interleaved channels. BC1 reads channels
+// 0-2 (grey images are replicated), BC4 channel 0, BC5 channels 0 and 1.
+// out must hold compressed_size() bytes.
+void encode_blocks(BlockFormat format, const unsigned char *pixels, int width, int height, int channels,
+                   unsigned char *out);
+
+// Reference decoder: writes width x height texels of out_channels bytes
+// (3 for BC1, 1 for BC4, 2 for BC5).
+void decode_blocks(BlockFormat format, const unsigned char *blocks, int width, int height, unsigned char *out);
+int decoded_channels(BlockFormat format);
+
+// Round-trip blocks through the reference decoder and return the PSNR (dB)
+// against the channels of the source image that the format stores.
+double block_psnr(BlockFormat format, const unsigned char *pixels, int width, int height, int channels,
+                  const unsigned char *blocks);
+
+#endif // TEXTURE_COMPRESS_H
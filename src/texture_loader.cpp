@@ -0,0 +1,320 @@
+#include "texture_loader.h"
+#include "texture_cache.h"
+#include "pbo_upload.h"
+#include "texture_storage.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+bool cpu_mipmaps = true;
+MipFilter mip_filter = MIP_BOX;
+bool compress_textures = true;
+bool parallel_jpeg = true;
+
+// stb_image hands the IDCT and colour conversion of a JPEG to us in row bands
+// (see "Parallel JPEG finishing" in stb_image.h); they go to the worker pool.
+static void stbi_parallel_for(int count, void (*fn)(void *, int), void *ctx)
+{
+    if (!parallel_jpeg)
+    {
+        for (int i = 0; i < count; ++i)
+            fn(ctx, i);
+        return;
+    }
+    worker_pool().parallel_for(count, [fn, ctx](int i) { fn(ctx, i); });
+}
+
+#define STBI_PARALLEL_FOR(count, fn, ctx) stbi_parallel_for((count), (fn), (ctx))
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed_ms(Clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+// BC1 needs EXT_texture_compression_s3tc; diffuse maps stay uncompressed
+// without it. RGTC (BC4/BC5) is core in GL 3.0.
+static bool block_format_for(TextureUsage usage, BlockFormat &format)
+{
+    switch (usage)
+    {
+    case TEX_NORMAL: format = BLOCK_BC5; return true;
+    case TEX_HEIGHT: format = BLOCK_BC4; return true;
+    default:         format = BLOCK_BC1; return GLEW_EXT_texture_compression_s3tc != 0;
+    }
+}
+
+static void compress_image(DecodedImage &image, BlockFormat format)
+{
+    image.compressed = true;
+    image.block_format = format;
+    image.blocks.resize(image.mips.size() + 1);
+
+    const unsigned char *pixels = image.pixels;
+    int width = image.width, height = image.height;
+    for (size_t level = 0; level < image.blocks.size(); ++level)
+    {
+        if (level > 0)
+        {
+            pixels = image.mips[level - 1].pixels.data();
+            width = image.mips[level - 1].width;
+            height = image.mips[level - 1].height;
+        }
+        image.blocks[level].resize(compressed_size(format, width, height));
+        encode_blocks(format, pixels, width, height, image.channels, image.blocks[level].data());
+    }
+    image.mips.clear();
+}
+
+DecodedImage decode_raw_image(const char *path)
+{
+    Clock::time_point start = Clock::now();
+
+    DecodedImage image;
+    image.path = path;
+    image.pixels = stbi_load(path, &image.width, &image.height, &image.channels, 0);
+    if (!image.pixels)
+        image.width = image.height = image.channels = 0;
+    image.decode_ms = elapsed_ms(start);
+    return image;
+}
+
+DecodedImage decode_image(const char *path, TextureUsage usage)
+{
+    Clock::time_point start = Clock::now();
+
+    DecodedImage image = decode_raw_image(path);
+    if (!image.pixels)
+        return image;
+
+    BlockFormat format;
+    bool compress = compress_textures && block_format_for(usage, format);
+    if (cpu_mipmaps || compress)
+    {
+        image.cpu_mips = true;
+        image.mip_options.filter = mip_filter;
+        image.mip_options.normal_map = usage == TEX_NORMAL;
+        image.mips = build_mips(image.pixels, image.width, image.height, image.channels, image.mip_options);
+    }
+    if (compress)
+        compress_image(image, format);
+
+    image.decode_ms = elapsed_ms(start);
+    return image;
+}
+
+void free_image(DecodedImage &image)
+{
+    // STBI_FREE is free(), so images built by hand use malloc as well
+    stbi_image_free(image.pixels);
+    image.pixels = NULL;
+    image.mips.clear();
+    image.blocks.clear();
+}
+
+void upload_image(GLuint texture, const DecodedImage &image)
+{
+    if (!image.pixels)
+    {
+        std::cout << "Texture failed to load at path: " << image.path << std::endl;
+        return;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    TextureUploader &uploader = texture_uploader();
+
+    if (image.compressed)
+    {
+        GLenum internal_format = block_gl_format(image.block_format);
+        size_t bytes = allocate_texture_2d(image.blocks.size(), internal_format, image.width, image.height);
+        register_texture(texture, image.path, texture_group(image.path), bytes);
+
+        int width = image.width, height = image.height;
+        for (size_t level = 0; level < image.blocks.size(); ++level)
+        {
+            uploader.compressed_sub_image_2d(GL_TEXTURE_2D, level, internal_format, width, height,
+                                             image.blocks[level].size(), image.blocks[level].data());
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+        }
+        apply_texture_params(GL_TEXTURE_2D);
+        return;
+    }
+
+    GLenum internal_format, format;
+    sized_format(image.channels, internal_format, format);
+
+    // Without CPU mips the driver fills the levels, but they are still
+    // allocated here
+    int levels = image.mips.empty() ? mip_level_count(image.width, image.height) : image.mips.size() + 1;
+    size_t bytes = allocate_texture_2d(levels, internal_format, image.width, image.height);
+    register_texture(texture, image.path, texture_group(image.path), bytes);
+
+    uploader.sub_image_2d(GL_TEXTURE_2D, 0, 0, 0, image.width, image.height, format, GL_UNSIGNED_BYTE,
+                          image.pixels, (size_t) image.width * image.channels);
+    for (size_t i = 0; i < image.mips.size(); ++i)
+    {
+        const MipLevel &mip = image.mips[i];
+        uploader.sub_image_2d(GL_TEXTURE_2D, i + 1, 0, 0, mip.width, mip.height, format, GL_UNSIGNED_BYTE,
+                              mip.pixels.data(), (size_t) mip.width * image.channels);
+    }
+
+    if (image.mips.empty())
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+    apply_texture_params(GL_TEXTURE_2D);
+}
+
+void apply_texture_params(GLenum target)
+{
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+// Cache hit: upload the baked mip chain. Miss: upload the decoded image and
+// bake a cache for the next start.
+static void upload_loaded(GLuint texture, DecodedImage &image, const CachedTexture &cache)
+{
+    if (cache.header)
+    {
+        upload_cached_texture(texture, cache);
+        return;
+    }
+
+    upload_image(texture, image);
+    if (!image.pixels || !image.cacheable)
+        return;
+
+    TextureCacheKey key;
+    key.compressed = image.compressed;
+    key.cpu_mipmaps = image.cpu_mips;
+    key.filter = image.mip_options.filter;
+    key.renormalized = image.mip_options.normal_map;
+    bake_texture_cache(image.path.c_str(), texture, image.channels, key);
+}
+
+// What the cache for a texture of this usage must have been baked with, as
+// decode_image() would build it now.
+static TextureCacheKey wanted_cache(TextureUsage usage)
+{
+    BlockFormat format;
+    TextureCacheKey key;
+    key.compressed = compress_textures && block_format_for(usage, format);
+    key.cpu_mipmaps = cpu_mipmaps || key.compressed;
+    key.filter = mip_filter;
+    key.renormalized = usage == TEX_NORMAL;
+    return key;
+}
+
+//----------------------------------------------------------------------------
+
+struct PendingTexture
+{
+    GLuint texture;
+    std::shared_ptr<DecodedImage> image;
+    std::shared_ptr<CachedTexture> cache;
+    std::future<void> decoded;
+};
+
+static std::vector<PendingTexture> pending;
+static Clock::time_point first_request;
+
+GLuint request_texture_job(const std::function<void(DecodedImage &, CachedTexture &)> &job)
+{
+    if (pending.empty())
+        first_request = Clock::now();
+
+    PendingTexture p;
+    glGenTextures(1, &p.texture);
+    p.image = std::make_shared<DecodedImage>();
+    p.cache = std::make_shared<CachedTexture>();
+
+    std::shared_ptr<DecodedImage> image = p.image;
+    std::shared_ptr<CachedTexture> cache = p.cache;
+    p.decoded = worker_pool().submit([image, cache, job] {
+        Clock::time_point start = Clock::now();
+        job(*image, *cache);
+        image->decode_ms = elapsed_ms(start);
+    });
+
+    pending.push_back(std::move(p));
+    return pending.back().texture;
+}
+
+GLuint request_texture(const char *path, TextureUsage usage)
+{
+    std::string file(path);
+    return request_texture_job([file, usage](DecodedImage &image, CachedTexture &cache) {
+        if (open_texture_cache(file.c_str(), cache, wanted_cache(usage)))
+            image.path = file;
+        else
+            image = decode_image(file.c_str(), usage);
+    });
+}
+
+void upload_pending_textures()
+{
+    if (pending.empty())
+        return;
+
+    Clock::time_point wait_start = Clock::now();
+    for (size_t i = 0; i < pending.size(); ++i)
+        pending[i].decoded.wait();
+    double wait_ms = elapsed_ms(wait_start);
+    double wall_ms = elapsed_ms(first_request);
+
+    double serial_ms = 0.0;
+    int cached = 0;
+    Clock::time_point upload_start = Clock::now();
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+        DecodedImage &image = *pending[i].image;
+        serial_ms += image.decode_ms;
+        cached += pending[i].cache->header != NULL;
+        upload_loaded(pending[i].texture, image, *pending[i].cache);
+        free_image(image);
+    }
+    double upload_ms = elapsed_ms(upload_start);
+
+    // serial_ms is what the old one-at-a-time load_texture() calls spent
+    // decoding on the context thread; wait_ms is what is left of it now.
+    std::cout << "Textures: " << pending.size() << " loaded (" << cached << " from cache) on "
+              << worker_pool().size() << " workers in " << wall_ms << " ms (" << serial_ms
+              << " ms serial load, " << wait_ms << " ms blocked), uploaded in " << upload_ms
+              << " ms" << std::endl;
+
+    const TextureUploader &uploader = texture_uploader();
+    std::cout << "  staged " << uploader.bytes_uploaded / 1024 << " KB in " << uploader.uploads << " PBO uploads ("
+              << (uploader.persistent() ? "persistent" : "mapped") << ", " << uploader.stalls << " stalls)"
+              << std::endl;
+
+    pending.clear();
+}
+
+GLuint load_texture(const char *path, TextureUsage usage)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+
+    CachedTexture cache;
+    DecodedImage image;
+    if (open_texture_cache(path, cache, wanted_cache(usage)))
+        image.path = path;
+    else
+        image = decode_image(path, usage);
+
+    upload_loaded(texture, image, cache);
+    free_image(image);
+
+    return texture;
+}
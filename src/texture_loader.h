@@ -0,0 +1,91 @@
+// Texture loading. Images are decoded with stb_image on the worker pool while
+// the context thread does other start-up work (compiling shaders); the GL
+// uploads themselves always happen on the context thread.
+
+#ifndef TEXTURE_LOADER_H
+#define TEXTURE_LOADER_H
+
+#include "common.h"
+#include "mipmap.h"
+#include "texture_compress.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+struct CachedTexture;
+
+// What a texture holds; decides how its mips are filtered and which block
+// format it is compressed to (BC1 colour, BC5 normal, BC4 height).
+enum TextureUsage { TEX_COLOR, TEX_NORMAL, TEX_HEIGHT };
+
+// Build mip chains on the CPU (mipmap.h) instead of with glGenerateMipmap,
+// with this filter. Compressed textures always build theirs on the CPU.
+extern bool cpu_mipmaps;
+extern MipFilter mip_filter;
+
+// Split the IDCT and colour conversion of JPEG decodes into row bands on the
+// worker pool. Entropy decoding stays serial.
+extern bool parallel_jpeg;
+
+// Block-compress textures on the CPU (texture_compress.h) before upload.
+// Normal maps then only keep X and Y; the shader must rebuild Z.
+extern bool compress_textures;
+
+// CPU-side result of decoding an image file.
+struct DecodedImage
+{
+    std::string path;
+    int width, height, channels;
+    unsigned char *pixels;   // owned (malloc'd); released by free_image()
+    std::vector<MipLevel> mips;   // levels 1..n when built on the CPU
+    bool cpu_mips;           // mips built on the CPU with mip_options, else by the driver
+    MipOptions mip_options;
+    bool compressed;
+    BlockFormat block_format;
+    std::vector< std::vector<unsigned char> > blocks;   // levels 0..n when compressed
+    bool cacheable;          // false if path is not a single source image
+    double decode_ms;
+
+    DecodedImage()
+        : width(0), height(0), channels(0), pixels(NULL), cpu_mips(false), compressed(false), block_format(BLOCK_BC1),
+          cacheable(true), decode_ms(0.0) {}
+};
+
+// Decode an image synchronously on the calling thread, building its mip chain
+// when cpu_mipmaps is set and compressing every level when compress_textures
+// is set. pixels is NULL on failure.
+DecodedImage decode_image(const char *path, TextureUsage usage = TEX_COLOR);
+
+// Just the stb_image decode: no mips, no compression.
+DecodedImage decode_raw_image(const char *path);
+void free_image(DecodedImage &image);
+
+// Upload a decoded image into an existing texture name (mipmapped, repeating).
+// Uses the compressed blocks or CPU-built mips when present, glGenerateMipmap
+// otherwise.
+void upload_image(GLuint texture, const DecodedImage &image);
+
+// Repeat wrapping and trilinear filtering for the texture bound to target.
+void apply_texture_params(GLenum target);
+
+// Start loading path on the worker pool: from its pre-baked cache when that is
+// still valid (see texture_cache.h), otherwise by decoding the image, in which
+// case a fresh cache is baked after upload. The returned texture name is valid
+// immediately and can be bound; it receives its contents in
+// upload_pending_textures().
+GLuint request_texture(const char *path, TextureUsage usage = TEX_COLOR);
+
+// Lower-level form of request_texture(): job runs on the worker pool and
+// fills either the image or an accepted cache; the result is uploaded with
+// the other pending textures.
+GLuint request_texture_job(const std::function<void(DecodedImage &, CachedTexture &)> &job);
+
+// Wait for every outstanding request_texture() decode and upload the results.
+// Must be called on the context thread, before the first frame.
+void upload_pending_textures();
+
+// Synchronous load (cache or decode) + upload on the calling thread.
+GLuint load_texture(const char *path, TextureUsage usage = TEX_COLOR);
+
+#endif // TEXTURE_LOADER_H
@@ -0,0 +1,81 @@
+#include "texture_pack.h"
+#include "mipmap.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+const char *packing_name(NormalHeightPacking packing)
+{
+    switch (packing)
+    {
+    case PACK_HEIGHT_IN_ALPHA: return "height in normal alpha";
+    case PACK_XY_HEIGHT:       return "normal XY + height";
+    default:                   return "separate normal/height";
+    }
+}
+
+DecodedImage pack_normal_height(const DecodedImage &normal, const DecodedImage &height,
+                                NormalHeightPacking packing)
+{
+    DecodedImage packed;
+    packed.path = normal.path + "+" + height.path;
+    packed.cacheable = false;
+    if (!normal.pixels || !height.pixels)
+        return packed;
+
+    int width = normal.width, rows = normal.height;
+    std::vector<unsigned char> resized;
+    const unsigned char *h = height.pixels;
+    if (height.width != width || height.height != rows)
+    {
+        resized.resize((size_t) width * rows * height.channels);
+        resize_image(height.pixels, height.width, height.height, height.channels, resized.data(), width, rows);
+        h = resized.data();
+    }
+
+    packed.width = width;
+    packed.height = rows;
+    packed.channels = 4;
+    packed.pixels = (unsigned char *) malloc((size_t) width * rows * 4);
+
+    size_t texels = (size_t) width * rows;
+    for (size_t i = 0; i < texels; ++i)
+    {
+        const unsigned char *n = normal.pixels + i * normal.channels;
+        unsigned char *out = packed.pixels + i * 4;
+        unsigned char height_value = h[i * height.channels];
+        out[0] = n[0];
+        out[1] = n[std::min(1, normal.channels - 1)];
+        if (packing == PACK_XY_HEIGHT)
+        {
+            out[2] = height_value;
+            out[3] = 255;
+        }
+        else
+        {
+            out[2] = n[std::min(2, normal.channels - 1)];
+            out[3] = height_value;
+        }
+    }
+
+    // RGB is only a unit vector in the alpha layout; renormalizing leaves A alone.
+    MipOptions options;
+    options.normal_map = packing == PACK_HEIGHT_IN_ALPHA;
+    packed.mips = build_mips(packed.pixels, width, rows, 4, options);
+    return packed;
+}
+
+GLuint request_packed_texture(const char *normal_path, const char *height_path, NormalHeightPacking packing)
+{
+    std::string normal_file(normal_path), height_file(height_path);
+    return request_texture_job([normal_file, height_file, packing](DecodedImage &image, CachedTexture &) {
+        // Plain decodes: the mips belong to the packed image.
+        DecodedImage normal = decode_raw_image(normal_file.c_str());
+        DecodedImage height = decode_raw_image(height_file.c_str());
+
+        image = pack_normal_height(normal, height, packing);
+        free_image(normal);
+        free_image(height);
+    });
+}
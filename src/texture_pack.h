@@ -0,0 +1,32 @@
+// Normal + height packing. ParallaxMapping() fetches the height on every
+// march step and main() then fetches the normal at the final coordinate; with
+// both in one RGBA texture the march and the lighting share one sampler
+// binding and one cache stream, and the separate depthMap is not touched.
+//
+//   PACK_SEPARATE          normalMap + depthMap, as loaded by request_texture()
+//   PACK_HEIGHT_IN_ALPHA   normalMap = (nx, ny, nz, height)
+//   PACK_XY_HEIGHT         normalMap = (nx, ny, height, -); Z is rebuilt in
+//                          the shader like BC5 normals
+//
+// The packed textures are uncompressed RGBA8: none of the block formats in
+// texture_compress.h carries four independent channels.
+
+#ifndef TEXTURE_PACK_H
+#define TEXTURE_PACK_H
+
+#include "texture_loader.h"
+
+enum NormalHeightPacking { PACK_SEPARATE, PACK_HEIGHT_IN_ALPHA, PACK_XY_HEIGHT, NUM_PACKINGS };
+
+const char *packing_name(NormalHeightPacking packing);
+
+// Combine a decoded normal map and height map (resampled to the normal map's
+// size) into a new RGBA image with a CPU mip chain.
+DecodedImage pack_normal_height(const DecodedImage &normal, const DecodedImage &height,
+                                NormalHeightPacking packing);
+
+// Bake step for request_texture(): decode both images on the worker pool,
+// pack them and upload the result with the other pending textures.
+GLuint request_packed_texture(const char *normal_path, const char *height_path, NormalHeightPacking packing);
+
+#endif // TEXTURE_PACK_H
@@ -0,0 +1,217 @@
+#include "texture_storage.h"
+
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <vector>
+
+void sized_format(int channels, GLenum &internal_format, GLenum &format)
+{
+    switch (channels)
+    {
+    case 1:  internal_format = GL_R8;    format = GL_RED;  break;
+    case 2:  internal_format = GL_RG8;   format = GL_RG;   break;
+    case 4:  internal_format = GL_RGBA8; format = GL_RGBA; break;
+    default: internal_format = GL_RGB8;  format = GL_RGB;  break;
+    }
+}
+
+// Bytes per 4x4 block for the compressed formats we create, 0 otherwise.
+static int block_size(GLenum internal_format)
+{
+    switch (internal_format)
+    {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RED_RGTC1:
+        return 8;
+    case GL_COMPRESSED_RG_RGTC2:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+static int texel_size(GLenum internal_format)
+{
+    switch (internal_format)
+    {
+    case GL_R8:    return 1;
+    case GL_RG8:   return 2;
+    case GL_RGB8:  return 3;
+    default:       return 4;
+    }
+}
+
+size_t texture_storage_bytes(GLenum internal_format, int width, int height, int layers, int levels)
+{
+    int block = block_size(internal_format);
+    size_t bytes = 0;
+    for (int level = 0; level < levels; ++level)
+    {
+        if (block)
+            bytes += (size_t) ((width + 3) / 4) * ((height + 3) / 4) * block * layers;
+        else
+            bytes += (size_t) width * height * texel_size(internal_format) * layers;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    return bytes;
+}
+
+// The client format glTexImage needs alongside a sized internal format, even
+// when no data is passed.
+static GLenum unsized_format(GLenum internal_format)
+{
+    switch (internal_format)
+    {
+    case GL_R8:
+    case GL_R32F:  return GL_RED;
+    case GL_RG8:   return GL_RG;
+    case GL_RGB8:  return GL_RGB;
+    default:       return GL_RGBA;
+    }
+}
+
+size_t allocate_texture_2d(int levels, GLenum internal_format, int width, int height)
+{
+    if (GLEW_ARB_texture_storage)
+    {
+        glTexStorage2D(GL_TEXTURE_2D, levels, internal_format, width, height);
+    }
+    else
+    {
+        int w = width, h = height;
+        for (int level = 0; level < levels; ++level)
+        {
+            if (block_size(internal_format))
+                glCompressedTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0,
+                                       texture_storage_bytes(internal_format, w, h, 1, 1), NULL);
+            else
+                glTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0, unsized_format(internal_format),
+                             GL_UNSIGNED_BYTE, NULL);
+            w = w > 1 ? w / 2 : 1;
+            h = h > 1 ? h / 2 : 1;
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    }
+    return texture_storage_bytes(internal_format, width, height, 1, levels);
+}
+
+size_t allocate_texture_array(int levels, GLenum internal_format, int width, int height, int layers)
+{
+    if (GLEW_ARB_texture_storage)
+    {
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, internal_format, width, height, layers);
+    }
+    else
+    {
+        int w = width, h = height;
+        for (int level = 0; level < levels; ++level)
+        {
+            if (block_size(internal_format))
+                glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, internal_format, w, h, layers, 0,
+                                       texture_storage_bytes(internal_format, w, h, layers, 1), NULL);
+            else
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internal_format, w, h, layers, 0,
+                             unsized_format(internal_format), GL_UNSIGNED_BYTE, NULL);
+            w = w > 1 ? w / 2 : 1;
+            h = h > 1 ? h / 2 : 1;
+        }
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    }
+    return texture_storage_bytes(internal_format, width, height, layers, levels);
+}
+
+//----------------------------------------------------------------------------
+
+struct TextureEntry
+{
+    GLuint texture;
+    std::string name, group;
+    size_t bytes;
+};
+
+static std::vector<TextureEntry> registry;
+
+void register_texture(GLuint texture, const std::string &name, const std::string &group, size_t bytes)
+{
+    for (size_t i = 0; i < registry.size(); ++i)
+    {
+        if (registry[i].texture == texture && registry[i].name == name)
+        {
+            registry[i].group = group;
+            registry[i].bytes = bytes;
+            return;
+        }
+    }
+
+    TextureEntry entry;
+    entry.texture = texture;
+    entry.name = name;
+    entry.group = group;
+    entry.bytes = bytes;
+    registry.push_back(entry);
+}
+
+void unregister_texture(GLuint texture)
+{
+    for (size_t i = registry.size(); i-- > 0;)
+        if (registry[i].texture == texture)
+            registry.erase(registry.begin() + i);
+}
+
+std::string texture_group(const std::string &path)
+{
+    size_t slash = path.find('/');
+    return slash == std::string::npos ? path : path.substr(0, slash);
+}
+
+static double kilobytes(size_t bytes)
+{
+    return bytes / 1024.0;
+}
+
+void report_texture_memory()
+{
+    std::vector<GLuint> order;
+    std::map<GLuint, size_t> per_texture;
+    std::map<std::string, size_t> per_group;
+    size_t total = 0;
+    for (size_t i = 0; i < registry.size(); ++i)
+    {
+        const TextureEntry &entry = registry[i];
+        if (per_texture.find(entry.texture) == per_texture.end())
+            order.push_back(entry.texture);
+        per_texture[entry.texture] += entry.bytes;
+        per_group[entry.group] += entry.bytes;
+        total += entry.bytes;
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Texture memory (" << (GLEW_ARB_texture_storage ? "immutable" : "mutable") << " storage):"
+              << std::endl;
+
+    // Textures with a single entry on one line; arrays with one line per layer
+    for (size_t t = 0; t < order.size(); ++t)
+    {
+        std::vector<const TextureEntry *> entries;
+        for (size_t i = 0; i < registry.size(); ++i)
+            if (registry[i].texture == order[t])
+                entries.push_back(&registry[i]);
+
+        std::cout << "  #" << order[t] << " ";
+        if (entries.size() == 1)
+            std::cout << entries[0]->name << ": ";
+        std::cout << kilobytes(per_texture[order[t]]) << " KB" << std::endl;
+        for (size_t i = 0; entries.size() > 1 && i < entries.size(); ++i)
+            std::cout << "      " << entries[i]->name << ": " << kilobytes(entries[i]->bytes) << " KB" << std::endl;
+    }
+
+    std::cout << "  by material:" << std::endl;
+    for (std::map<std::string, size_t>::const_iterator it = per_group.begin(); it != per_group.end(); ++it)
+        std::cout << "    " << it->first << ": " << kilobytes(it->second) << " KB" << std::endl;
+    std::cout << "  total: " << kilobytes(total) << " KB in " << order.size() << " textures" << std::endl;
+
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout << std::setprecision(6);
+}
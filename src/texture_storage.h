@@ -0,0 +1,47 @@
+// Texture allocation and memory accounting. Storage is allocated up front
+// with a sized internal format and the exact number of levels - immutably
+// with glTexStorage2D/3D where ARB_texture_storage is available, otherwise
+// one glTexImage call per level with no data - and the pixels are then sent
+// with sub-image uploads. The driver never has to guess a layout from an
+// unsized format, nor reallocate when levels arrive.
+//
+// Every allocation is recorded in a registry so that the resident bytes per
+// texture and per material can be reported. The sizes are what the formats
+// hold (RGB8 counts 3 bytes a texel even if the driver pads it to 4).
+
+#ifndef TEXTURE_STORAGE_H
+#define TEXTURE_STORAGE_H
+
+#include "common.h"
+
+#include <cstddef>
+#include <string>
+
+// Sized internal format and matching client format for 8-bit images.
+void sized_format(int channels, GLenum &internal_format, GLenum &format);
+
+// Bytes in levels mip levels of a width x height x layers image.
+size_t texture_storage_bytes(GLenum internal_format, int width, int height, int layers, int levels);
+
+// Allocate levels levels for the texture bound to GL_TEXTURE_2D /
+// GL_TEXTURE_2D_ARRAY. Return the bytes allocated.
+size_t allocate_texture_2d(int levels, GLenum internal_format, int width, int height);
+size_t allocate_texture_array(int levels, GLenum internal_format, int width, int height, int layers);
+
+// Record bytes resident in texture on behalf of group (usually a material).
+// A texture may be registered several times under different names, e.g. one
+// entry per array layer; registering the same texture and name again
+// replaces the entry.
+void register_texture(GLuint texture, const std::string &name, const std::string &group, size_t bytes);
+
+// Drop every entry of texture; call before deleting it.
+void unregister_texture(GLuint texture);
+
+// The group for a file loaded from a material directory: "SnowTextures/x.jpg"
+// is in "SnowTextures".
+std::string texture_group(const std::string &path);
+
+// Print the registry: bytes per texture, per group, and in total.
+void report_texture_memory();
+
+#endif // TEXTURE_STORAGE_H
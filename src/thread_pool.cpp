@@ -0,0 +1,118 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned int num_threads)
+    : stopping(false)
+{
+    if (num_threads == 0)
+    {
+        unsigned int hw = std::thread::hardware_concurrency();
+        num_threads = hw > 1 ? hw - 1 : 1;
+    }
+
+    for (unsigned int i = 0; i < num_threads; ++i)
+        workers.push_back(std::thread(&ThreadPool::worker_loop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> job)
+{
+    std::packaged_task<void()> task(job);
+    std::future<void> result = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(task));
+    }
+    wake.notify_one();
+    return result;
+}
+
+void ThreadPool::worker_loop()
+{
+    for (;;)
+    {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping && jobs.empty())
+                return;
+            task = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        task();
+    }
+}
+
+// Work is handed out one index at a time from a shared counter. The caller
+// helps too and only waits for indices that a worker has already claimed, so
+// a parallel_for issued from inside a pool job can never deadlock waiting for
+// helpers that are stuck in the queue behind it.
+void ThreadPool::parallel_for(int count, const std::function<void(int)>& fn)
+{
+    if (count <= 0)
+        return;
+    if (count == 1 || workers.empty())
+    {
+        for (int i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
+
+    struct Shared
+    {
+        std::atomic<int> next;
+        std::atomic<int> done;
+        std::mutex mutex;
+        std::condition_variable finished;
+        const std::function<void(int)>* fn;
+        int count;
+    };
+    std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+    shared->next = 0;
+    shared->done = 0;
+    shared->fn = &fn;
+    shared->count = count;
+
+    auto drain = [](Shared& s) {
+        int i;
+        while ((i = s.next.fetch_add(1)) < s.count)
+        {
+            (*s.fn)(i);
+            if (s.done.fetch_add(1) + 1 == s.count)
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                s.finished.notify_all();
+            }
+        }
+    };
+
+    int helpers = std::min((int) workers.size(), count - 1);
+    for (int h = 0; h < helpers; ++h)
+        submit([shared, drain] { drain(*shared); });
+
+    drain(*shared);
+
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->finished.wait(lock, [&] { return shared->done.load() == count; });
+}
+
+ThreadPool& worker_pool()
+{
+    static ThreadPool pool;
+    return pool;
+}
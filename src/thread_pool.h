@@ -0,0 +1,45 @@
+// Small fixed-size worker pool shared by the asset loading and simulation code.
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // num_threads == 0 picks one worker per hardware thread, minus the
+    // calling (GL context) thread.
+    explicit ThreadPool(unsigned int num_threads = 0);
+    ~ThreadPool();
+
+    // Queue a job; the future becomes ready once it has run.
+    std::future<void> submit(std::function<void()> job);
+
+    // Run fn(i) for every i in [0, count) on the workers and the calling
+    // thread, returning when all of them have finished. Safe to call from
+    // inside a pool job.
+    void parallel_for(int count, const std::function<void(int)>& fn);
+
+    unsigned int size() const { return (unsigned int) workers.size(); }
+
+private:
+    void worker_loop();
+
+    std::vector<std::thread> workers;
+    std::deque< std::packaged_task<void()> > jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+// The process-wide pool, created on first use.
+ThreadPool& worker_pool();
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,230 @@
+#include "vertex_format.h"
+
+#include <cmath>
+#include <cstring>
+
+const char *vertex_format_name(VertexFormat format)
+{
+    switch (format)
+    {
+    case VERTEX_PACKED:   return "packed (half UV, 2_10_10_10 normal/tangent)";
+    case VERTEX_QTANGENT: return "QTangent (half UV, snorm16 quaternion)";
+    default:              return "float (56 bytes)";
+    }
+}
+
+int vertex_size(VertexFormat format)
+{
+    switch (format)
+    {
+    case VERTEX_PACKED:   return 12 + 4 + 4 + 4;
+    case VERTEX_QTANGENT: return 12 + 4 + 8;
+    default:              return VERTEX_FLOATS * sizeof(float);
+    }
+}
+
+uint16_t float_to_half(float value)
+{
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    uint32_t sign = (f >> 16) & 0x8000;
+    int exponent = (int) ((f >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = f & 0x7FFFFF;
+
+    if (exponent >= 31)     // overflow and infinities; no NaNs in vertex data
+        return (uint16_t) (sign | 0x7C00);
+    if (exponent <= 0)      // subnormal halves, or zero
+    {
+        if (exponent < -10)
+            return (uint16_t) sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            ++half;
+        return (uint16_t) (sign | half);
+    }
+
+    // round to nearest even; a carry out of the mantissa bumps the exponent
+    uint32_t half = sign | ((uint32_t) exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        ++half;
+    return (uint16_t) half;
+}
+
+static int snorm(float value, int max)
+{
+    value = value < -1.0f ? -1.0f : value > 1.0f ? 1.0f : value;
+    return (int) lroundf(value * max);
+}
+
+uint32_t pack_snorm_2_10_10_10(float x, float y, float z, float w)
+{
+    return ((uint32_t) snorm(x, 511) & 0x3FF)
+         | ((uint32_t) snorm(y, 511) & 0x3FF) << 10
+         | ((uint32_t) snorm(z, 511) & 0x3FF) << 20
+         | ((uint32_t) snorm(w, 1) & 0x3) << 30;
+}
+
+static void normalize3(float v[3])
+{
+    float length = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    if (length > 0.0f)
+        v[0] /= length, v[1] /= length, v[2] /= length;
+}
+
+static void cross3(const float a[3], const float b[3], float out[3])
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// Bitangent sign of a frame: +1 when the bitangent agrees with N x T
+static float handedness(const float tangent[3], const float bitangent[3], const float normal[3])
+{
+    float nt[3];
+    cross3(normal, tangent, nt);
+    return nt[0] * bitangent[0] + nt[1] * bitangent[1] + nt[2] * bitangent[2] < 0.0f ? -1.0f : 1.0f;
+}
+
+void encode_qtangent(const float tangent[3], const float bitangent[3], const float normal[3], int16_t out[4])
+{
+    // Orthonormal, right-handed frame: N, T made perpendicular to it, N x T
+    float n[3] = { normal[0], normal[1], normal[2] };
+    normalize3(n);
+    float d = tangent[0] * n[0] + tangent[1] * n[1] + tangent[2] * n[2];
+    float t[3] = { tangent[0] - d * n[0], tangent[1] - d * n[1], tangent[2] - d * n[2] };
+    normalize3(t);
+    float b[3];
+    cross3(n, t, b);
+
+    // Rotation matrix with columns t, b, n to quaternion
+    float q[4];   // x, y, z, w
+    float trace = t[0] + b[1] + n[2];
+    if (trace > 0.0f)
+    {
+        float s = 0.5f / std::sqrt(trace + 1.0f);
+        q[3] = 0.25f / s;
+        q[0] = (b[2] - n[1]) * s;
+        q[1] = (n[0] - t[2]) * s;
+        q[2] = (t[1] - b[0]) * s;
+    }
+    else if (t[0] > b[1] && t[0] > n[2])
+    {
+        float s = 2.0f * std::sqrt(1.0f + t[0] - b[1] - n[2]);
+        q[3] = (b[2] - n[1]) / s;
+        q[0] = 0.25f * s;
+        q[1] = (b[0] + t[1]) / s;
+        q[2] = (n[0] + t[2]) / s;
+    }
+    else if (b[1] > n[2])
+    {
+        float s = 2.0f * std::sqrt(1.0f + b[1] - t[0] - n[2]);
+        q[3] = (n[0] - t[2]) / s;
+        q[0] = (b[0] + t[1]) / s;
+        q[1] = 0.25f * s;
+        q[2] = (n[1] + b[2]) / s;
+    }
+    else
+    {
+        float s = 2.0f * std::sqrt(1.0f + n[2] - t[0] - b[1]);
+        q[3] = (t[1] - b[0]) / s;
+        q[0] = (n[0] + t[2]) / s;
+        q[1] = (n[1] + b[2]) / s;
+        q[2] = 0.25f * s;
+    }
+
+    // q and -q are the same rotation: keep w positive and clear of zero after
+    // quantization, so that its sign is free to carry the handedness
+    float length = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    float flip = q[3] < 0.0f ? -1.0f : 1.0f;
+    for (int i = 0; i < 4; ++i)
+        q[i] *= flip / length;
+    const float bias = 1.0f / 32767.0f;
+    if (q[3] < bias)
+    {
+        float scale = std::sqrt(1.0f - bias * bias) / std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2]);
+        q[0] *= scale, q[1] *= scale, q[2] *= scale;
+        q[3] = bias;
+    }
+
+    float sign = handedness(tangent, bitangent, normal);
+    for (int i = 0; i < 4; ++i)
+        out[i] = (int16_t) snorm(q[i] * sign, 32767);
+}
+
+void pack_vertices(VertexFormat format, const float *vertices, int count, std::vector<unsigned char> &out)
+{
+    int size = vertex_size(format);
+    out.resize((size_t) count * size);
+    if (format == VERTEX_FLOAT)
+    {
+        memcpy(out.data(), vertices, out.size());
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        const float *v = vertices + (size_t) i * VERTEX_FLOATS;
+        const float *position = v, *normal = v + 3, *uv = v + 6, *tangent = v + 8, *bitangent = v + 11;
+        unsigned char *dst = &out[(size_t) i * size];
+
+        memcpy(dst, position, 3 * sizeof(float));
+        uint16_t half_uv[2] = { float_to_half(uv[0]), float_to_half(uv[1]) };
+        memcpy(dst + 12, half_uv, sizeof(half_uv));
+
+        if (format == VERTEX_PACKED)
+        {
+            uint32_t packed[2] = {
+                pack_snorm_2_10_10_10(normal[0], normal[1], normal[2], 0.0f),
+                pack_snorm_2_10_10_10(tangent[0], tangent[1], tangent[2], handedness(tangent, bitangent, normal))
+            };
+            memcpy(dst + 16, packed, sizeof(packed));
+        }
+        else
+        {
+            int16_t q[4];
+            encode_qtangent(tangent, bitangent, normal, q);
+            memcpy(dst + 16, q, sizeof(q));
+        }
+    }
+}
+
+void set_vertex_attributes(VertexFormat format)
+{
+    GLsizei stride = vertex_size(format);
+    for (GLuint i = 0; i <= 5; ++i)
+        glDisableVertexAttribArray(i);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(0));
+    glEnableVertexAttribArray(2);
+
+    switch (format)
+    {
+    case VERTEX_FLOAT:
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(6 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(3 * sizeof(float)));
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(8 * sizeof(float)));
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(11 * sizeof(float)));
+        break;
+    case VERTEX_PACKED:
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(12));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, BUFFER_OFFSET(16));
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, BUFFER_OFFSET(20));
+        break;
+    default:
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(12));
+        glEnableVertexAttribArray(5);
+        glVertexAttribPointer(5, 4, GL_SHORT, GL_TRUE, stride, BUFFER_OFFSET(16));
+        break;
+    }
+}
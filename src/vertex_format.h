@@ -0,0 +1,50 @@
+// Vertex layouts for the tangent-space surface. Meshes are built in the
+// 14-float layout render_quad() uses (position, normal, texcoords, tangent,
+// bitangent: 56 bytes) and can be packed for upload:
+//
+//   VERTEX_FLOAT      as built                                       56 bytes
+//   VERTEX_PACKED     float position, half texcoords, normal and
+//                     tangent as 2_10_10_10 snorm, the tangent's w
+//                     holding the bitangent sign                     24 bytes
+//   VERTEX_QTANGENT   float position, half texcoords, the whole
+//                     tangent frame as one snorm16 quaternion whose
+//                     sign carries the bitangent sign                24 bytes
+//
+// vshader5.glsl decodes all three (uniform vertexFormat). Position stays at
+// location 0 and texcoords at 2 in every layout; normal, tangent and
+// bitangent use 1, 3 and 4, the quaternion 5.
+
+#ifndef VERTEX_FORMAT_H
+#define VERTEX_FORMAT_H
+
+#include "common.h"
+
+#include <cstdint>
+#include <vector>
+
+enum VertexFormat { VERTEX_FLOAT, VERTEX_PACKED, VERTEX_QTANGENT, NUM_VERTEX_FORMATS };
+
+// Floats per vertex of the unpacked layout
+const int VERTEX_FLOATS = 14;
+
+const char *vertex_format_name(VertexFormat format);
+int vertex_size(VertexFormat format);
+
+// Convert count vertices from the 14-float layout; out is resized to
+// count * vertex_size(format).
+void pack_vertices(VertexFormat format, const float *vertices, int count, std::vector<unsigned char> &out);
+
+// Point the attributes of the bound VAO at the bound GL_ARRAY_BUFFER holding
+// vertices in format, and disable the ones the format does not use.
+void set_vertex_attributes(VertexFormat format);
+
+// Building blocks, exposed for other packers.
+uint16_t float_to_half(float value);
+uint32_t pack_snorm_2_10_10_10(float x, float y, float z, float w);
+
+// Quaternion (x, y, z, w) of the frame with columns tangent, bitangent and
+// normal, as snorm16; w is never zero and is negative when the frame is
+// left-handed.
+void encode_qtangent(const float tangent[3], const float bitangent[3], const float normal[3], int16_t out[4]);
+
+#endif // VERTEX_FORMAT_H
@@ -0,0 +1,28 @@
+// Decoding of the vertex layouts of vertex_format.h for the vertex shaders
+// that read meshes in any of them, vshader5.glsl and vshader5_tess.glsl,
+// pulled in by InitShader's #include. The including shader declares
+// aNormal, aTangent, aBitangent and aQTangent at their vertex_format.h
+// locations.
+
+// Vertex layout (vertex_format.h): 0 float, 1 packed, 2 QTangent
+uniform int vertexFormat;
+
+// Object-space tangent frame of the vertex, whatever its layout
+void tangentFrame(out vec3 T, out vec3 B, out vec3 N)
+{
+    if (vertexFormat == 2) {
+        // Columns of the quaternion's rotation; its sign is the handedness
+        vec4 q = normalize(aQTangent);
+        T = vec3(1.0 - 2.0 * (q.y * q.y + q.z * q.z), 2.0 * (q.x * q.y + q.w * q.z), 2.0 * (q.x * q.z - q.w * q.y));
+        N = vec3(2.0 * (q.x * q.z + q.w * q.y), 2.0 * (q.y * q.z - q.w * q.x), 1.0 - 2.0 * (q.x * q.x + q.y * q.y));
+        B = cross(N, T) * (q.w < 0.0 ? -1.0 : 1.0);
+    } else if (vertexFormat == 1) {
+        T = aTangent.xyz;
+        N = aNormal;
+        B = cross(N, T) * (aTangent.w < 0.0 ? -1.0 : 1.0);
+    } else {
+        T = aTangent.xyz;
+        B = aBitangent;
+        N = aNormal;
+    }
+}
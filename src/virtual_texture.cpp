@@ -0,0 +1,504 @@
+#include "virtual_texture.h"
+#include "pbo_upload.h"
+#include "texture_storage.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+static const uint32_t EMPTY_SLOT = 0xffffffffu;
+
+// Tiles generated concurrently, and uploaded per update(); generation is the
+// slow part, uploads are 128x128 sub-images.
+static const size_t MAX_LOADING = 32;
+static const int UPLOADS_PER_FRAME = 8;
+
+static uint32_t tile_key(int level, int x, int y)
+{
+    return (uint32_t) level << 16 | (uint32_t) y << 8 | (uint32_t) x;
+}
+
+static int key_level(uint32_t key) { return key >> 16; }
+static int key_y(uint32_t key) { return (key >> 8) & 0xff; }
+static int key_x(uint32_t key) { return key & 0xff; }
+
+//----------------------------------------------------------------------------
+// Snowfield generator
+
+static uint32_t hash_lattice(int x, int y, uint32_t seed)
+{
+    uint32_t h = (uint32_t) x * 0x8da6b343u ^ (uint32_t) y * 0xd8163841u ^ seed * 0xcb1ab31fu;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return h;
+}
+
+// Value noise with a period of `period` lattice cells, so that every octave
+// tiles over the [0,1) virtual texture.
+static float value_noise(double x, double y, int period, uint32_t seed)
+{
+    double fx = std::floor(x), fy = std::floor(y);
+    int x0 = ((int) fx % period + period) % period, y0 = ((int) fy % period + period) % period;
+    int x1 = (x0 + 1) % period, y1 = (y0 + 1) % period;
+    float tx = (float) (x - fx), ty = (float) (y - fy);
+    tx = tx * tx * (3.0f - 2.0f * tx);
+    ty = ty * ty * (3.0f - 2.0f * ty);
+
+    const float scale = 1.0f / 4294967295.0f;
+    float a = hash_lattice(x0, y0, seed) * scale, b = hash_lattice(x1, y0, seed) * scale;
+    float c = hash_lattice(x0, y1, seed) * scale, d = hash_lattice(x1, y1, seed) * scale;
+    return (a + (b - a) * tx) + ((c + (d - c) * tx) - (a + (b - a) * tx)) * ty;
+}
+
+// Snow height in [0,1] at (u, v) in [0,1)^2 with the given number of octaves.
+static float snow_height(double u, double v, int octaves)
+{
+    float height = 0.0f, amplitude = 0.5f, total = 0.0f;
+    int frequency = 4;
+    for (int octave = 0; octave < octaves; ++octave)
+    {
+        height += amplitude * value_noise(u * frequency, v * frequency, frequency, octave);
+        total += amplitude;
+        amplitude *= 0.5f;
+        frequency *= 2;
+    }
+    return height / total;
+}
+
+void snowfield_tile(VirtualTile &tile)
+{
+    const float relief = 0.02f;
+
+    int level_texels = (tile.pages >> tile.level) * VT_TILE_CONTENT;
+    double spacing = 1.0 / level_texels;
+
+    // One octave per level of detail still present in this level's texels
+    int finest = 0;
+    while ((4 << finest) < level_texels / 2)
+        ++finest;
+    int octaves = std::max(1, finest + 1);
+
+    // Heights with a one-texel apron, for the normals' central differences
+    const int apron = VT_TILE_SIZE + 2;
+    std::vector<float> heights((size_t) apron * apron);
+    for (int j = 0; j < apron; ++j)
+    {
+        int vy = tile.y * VT_TILE_CONTENT + j - 1 - VT_TILE_BORDER;
+        double v = ((vy % level_texels + level_texels) % level_texels + 0.5) * spacing;
+        for (int i = 0; i < apron; ++i)
+        {
+            int vx = tile.x * VT_TILE_CONTENT + i - 1 - VT_TILE_BORDER;
+            double u = ((vx % level_texels + level_texels) % level_texels + 0.5) * spacing;
+            heights[(size_t) j * apron + i] = snow_height(u, v, octaves);
+        }
+    }
+
+    size_t texels = (size_t) VT_TILE_SIZE * VT_TILE_SIZE;
+    tile.height.resize(texels);
+    tile.normal.resize(texels * 2);
+    tile.diffuse.resize(texels * 3);
+
+    static const float crest[3] = { 0.94f, 0.95f, 0.98f }, hollow[3] = { 0.68f, 0.74f, 0.85f };
+    float slope_scale = (float) (relief / (2.0 * spacing));
+    for (int j = 0; j < VT_TILE_SIZE; ++j)
+    {
+        const float *row = &heights[(size_t) (j + 1) * apron + 1];
+        for (int i = 0; i < VT_TILE_SIZE; ++i)
+        {
+            float nx = -(row[i + 1] - row[i - 1]) * slope_scale;
+            float ny = -(row[i + apron] - row[i - apron]) * slope_scale;
+            float inv = 1.0f / std::sqrt(nx * nx + ny * ny + 1.0f);
+
+            size_t t = (size_t) j * VT_TILE_SIZE + i;
+            float depth = 1.0f - row[i];
+            tile.height[t] = (unsigned char) (depth * 255.0f + 0.5f);
+            tile.normal[t * 2 + 0] = (unsigned char) ((nx * inv * 0.5f + 0.5f) * 255.0f + 0.5f);
+            tile.normal[t * 2 + 1] = (unsigned char) ((ny * inv * 0.5f + 0.5f) * 255.0f + 0.5f);
+
+            // Bright snow on the crests, blue-grey in the hollows
+            float shade = std::min(1.0f, std::max(0.0f, (depth - 0.45f) / 0.35f));
+            for (int c = 0; c < 3; ++c)
+                tile.diffuse[t * 3 + c] = (unsigned char) ((crest[c] + (hollow[c] - crest[c]) * shade) * 255.0f + 0.5f);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+
+VirtualTexture::VirtualTexture(int pages, int atlas_tiles, int first_unit, const TileGenerator &generator)
+    : pages(pages), atlas_tiles(atlas_tiles), level_count(0), generator(generator), first_unit(first_unit),
+      feedback_fbo(0), feedback_color(0), feedback_depth(0), feedback_width(0), feedback_height(0),
+      feedback_pbo(0), feedback_fence(0), feedback_frame(0), page_table_dirty(true), frame(0),
+      tiles_loaded(0), tiles_evicted(0), feedback_reads(0), last_requested(0)
+{
+    while ((1 << level_count) <= pages)
+        ++level_count;
+
+    for (int level = 0; level < level_count; ++level)
+    {
+        int size = pages >> level;
+        table.push_back(std::vector<unsigned char>((size_t) size * size * 4, 0));
+    }
+
+    Slot empty = { EMPTY_SLOT, 0 };
+    slots.assign(atlas_tiles * atlas_tiles, empty);
+
+    glGenTextures(1, &page_table);
+    glActiveTexture(GL_TEXTURE0 + first_unit);
+    glBindTexture(GL_TEXTURE_2D, page_table);
+    register_texture(page_table, "virtual page table", "virtual",
+                     allocate_texture_2d(level_count, GL_RGBA8, pages, pages));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    GLuint *atlases[3] = { &atlas_height, &atlas_normal, &atlas_diffuse };
+    static const GLenum formats[3] = { GL_R8, GL_RG8, GL_RGB8 };
+    static const char *const names[3] = { "virtual height atlas", "virtual normal atlas", "virtual diffuse atlas" };
+    int atlas_size = atlas_tiles * VT_TILE_SIZE;
+    for (int i = 0; i < 3; ++i)
+    {
+        glGenTextures(1, atlases[i]);
+        glActiveTexture(GL_TEXTURE0 + first_unit + 1 + i);
+        glBindTexture(GL_TEXTURE_2D, *atlases[i]);
+        register_texture(*atlases[i], names[i], "virtual", allocate_texture_2d(1, formats[i], atlas_size, atlas_size));
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+
+    feedback_program = InitShader("vshader5.glsl", "fshader5_feedback.glsl");
+
+    // The coarsest tile covers everything and is never evicted, so every
+    // page always has something to show.
+    VirtualTile root;
+    root.level = level_count - 1;
+    root.x = root.y = 0;
+    root.pages = pages;
+    generator(root);
+    upload_tile(0, root);
+    resident[tile_key(root.level, 0, 0)] = 0;
+    slots[0].key = tile_key(root.level, 0, 0);
+    update_page_table();
+}
+
+VirtualTexture::~VirtualTexture()
+{
+    for (size_t i = 0; i < jobs.size(); ++i)
+        jobs[i].wait();
+    if (feedback_fence)
+        glDeleteSync(feedback_fence);
+
+    GLuint textures[4] = { page_table, atlas_height, atlas_normal, atlas_diffuse };
+    glDeleteTextures(4, textures);
+    glDeleteTextures(1, &feedback_color);
+    glDeleteRenderbuffers(1, &feedback_depth);
+    glDeleteFramebuffers(1, &feedback_fbo);
+    glDeleteBuffers(1, &feedback_pbo);
+    glDeleteProgram(feedback_program);
+}
+
+void VirtualTexture::bind(GLuint program)
+{
+    glUniform1i(glGetUniformLocation(program, "vtPageTable"), first_unit);
+    glUniform1i(glGetUniformLocation(program, "vtHeight"), first_unit + 1);
+    glUniform1i(glGetUniformLocation(program, "vtNormal"), first_unit + 2);
+    glUniform1i(glGetUniformLocation(program, "vtDiffuse"), first_unit + 3);
+    glUniform1f(glGetUniformLocation(program, "vtPages"), (float) pages);
+    glUniform1f(glGetUniformLocation(program, "vtAtlasTiles"), (float) atlas_tiles);
+    glUniform1f(glGetUniformLocation(program, "vtMaxLevel"), (float) (level_count - 1));
+}
+
+//----------------------------------------------------------------------------
+
+void VirtualTexture::render_feedback(int width, int height, const std::function<void(GLuint)> &draw)
+{
+    int w = std::max(1, width / VT_FEEDBACK_DIVISOR), h = std::max(1, height / VT_FEEDBACK_DIVISOR);
+    if (w != feedback_width || h != feedback_height)
+    {
+        if (!feedback_fbo)
+        {
+            glGenFramebuffers(1, &feedback_fbo);
+            glGenTextures(1, &feedback_color);
+            glGenRenderbuffers(1, &feedback_depth);
+            glGenBuffers(1, &feedback_pbo);
+        }
+
+        // Not bound to a unit of ours, so borrow the page table's and put it back
+        glActiveTexture(GL_TEXTURE0 + first_unit);
+        glBindTexture(GL_TEXTURE_2D, feedback_color);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, page_table);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, feedback_depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, feedback_fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, feedback_color, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedback_depth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "Virtual texture feedback framebuffer is incomplete" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // A resize invalidates any readback in flight
+        if (feedback_fence)
+        {
+            glDeleteSync(feedback_fence);
+            feedback_fence = 0;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedback_pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (size_t) w * h * 4, NULL, GL_STREAM_READ);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        feedback_width = w;
+        feedback_height = h;
+    }
+
+    // One readback in flight at a time; skip the pass until it is consumed
+    if (feedback_fence)
+        return;
+
+    GLint viewport[4];
+    GLfloat clear_color[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, feedback_fbo);
+    glViewport(0, 0, w, h);
+    glClearColor(0, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    glUseProgram(feedback_program);
+    glUniform1f(glGetUniformLocation(feedback_program, "vtPages"), (float) pages);
+    glUniform1f(glGetUniformLocation(feedback_program, "vtMaxLevel"), (float) (level_count - 1));
+    // Derivatives are VT_FEEDBACK_DIVISOR times larger at this resolution
+    glUniform1f(glGetUniformLocation(feedback_program, "vtLodBias"), -std::log2((float) VT_FEEDBACK_DIVISOR));
+    draw(feedback_program);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, feedback_pbo);
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, BUFFER_OFFSET(0));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    feedback_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+}
+
+void VirtualTexture::read_feedback()
+{
+    if (!feedback_fence || glClientWaitSync(feedback_fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+        return;
+    glDeleteSync(feedback_fence);
+    feedback_fence = 0;
+
+    std::unordered_set<uint32_t> requested;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, feedback_pbo);
+    const unsigned char *texels = (const unsigned char *) glMapBufferRange(
+        GL_PIXEL_PACK_BUFFER, 0, (size_t) feedback_width * feedback_height * 4, GL_MAP_READ_BIT);
+    if (texels)
+    {
+        size_t count = (size_t) feedback_width * feedback_height;
+        for (size_t i = 0; i < count; ++i, texels += 4)
+            if (texels[3] && texels[2] < level_count)
+                requested.insert(tile_key(texels[2], texels[0], texels[1]));
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // Ancestors too: they are what a page shows while its own tile loads
+    std::vector<uint32_t> wanted(requested.begin(), requested.end());
+    for (size_t i = 0; i < wanted.size(); ++i)
+    {
+        uint32_t key = wanted[i];
+        int level = key_level(key);
+        if (level + 1 < level_count)
+        {
+            uint32_t parent = tile_key(level + 1, key_x(key) / 2, key_y(key) / 2);
+            if (requested.insert(parent).second)
+                wanted.push_back(parent);
+        }
+    }
+
+    // Coarsest first, so that a sudden jump in view fills in quickly
+    std::sort(wanted.begin(), wanted.end(), [](uint32_t a, uint32_t b) { return a > b; });
+
+    ++feedback_reads;
+    feedback_frame = frame;
+    last_requested = wanted.size();
+    for (size_t i = 0; i < wanted.size(); ++i)
+    {
+        std::unordered_map<uint32_t, int>::iterator it = resident.find(wanted[i]);
+        if (it != resident.end())
+            slots[it->second].last_used = frame;
+        else
+            request(wanted[i]);
+    }
+}
+
+void VirtualTexture::request(uint32_t key)
+{
+    if (loading.size() >= MAX_LOADING || !loading.insert(key).second)
+        return;
+
+    VirtualTile tile;
+    tile.level = key_level(key);
+    tile.x = key_x(key);
+    tile.y = key_y(key);
+    tile.pages = pages;
+    jobs.push_back(worker_pool().submit([this, tile]() mutable {
+        generator(tile);
+        std::lock_guard<std::mutex> lock(finished_mutex);
+        finished.push_back(std::move(tile));
+    }));
+}
+
+// An empty slot, or else the least recently used one that the last feedback
+// did not ask for; -1 if every slot is in view.
+int VirtualTexture::free_slot()
+{
+    int best = -1;
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        if (slots[i].key == EMPTY_SLOT)
+            return i;
+        if (key_level(slots[i].key) == level_count - 1 || slots[i].last_used >= feedback_frame)
+            continue;
+        if (best < 0 || slots[i].last_used < slots[best].last_used)
+            best = i;
+    }
+
+    if (best >= 0)
+    {
+        resident.erase(slots[best].key);
+        slots[best].key = EMPTY_SLOT;
+        ++tiles_evicted;
+    }
+    return best;
+}
+
+void VirtualTexture::upload_tile(int slot, const VirtualTile &tile)
+{
+    int x = (slot % atlas_tiles) * VT_TILE_SIZE, y = (slot / atlas_tiles) * VT_TILE_SIZE;
+    TextureUploader &uploader = texture_uploader();
+
+    glActiveTexture(GL_TEXTURE0 + first_unit + 1);
+    glBindTexture(GL_TEXTURE_2D, atlas_height);
+    uploader.sub_image_2d(GL_TEXTURE_2D, 0, x, y, VT_TILE_SIZE, VT_TILE_SIZE, GL_RED, GL_UNSIGNED_BYTE,
+                          tile.height.data(), VT_TILE_SIZE);
+    glActiveTexture(GL_TEXTURE0 + first_unit + 2);
+    glBindTexture(GL_TEXTURE_2D, atlas_normal);
+    uploader.sub_image_2d(GL_TEXTURE_2D, 0, x, y, VT_TILE_SIZE, VT_TILE_SIZE, GL_RG, GL_UNSIGNED_BYTE,
+                          tile.normal.data(), VT_TILE_SIZE * 2);
+    glActiveTexture(GL_TEXTURE0 + first_unit + 3);
+    glBindTexture(GL_TEXTURE_2D, atlas_diffuse);
+    uploader.sub_image_2d(GL_TEXTURE_2D, 0, x, y, VT_TILE_SIZE, VT_TILE_SIZE, GL_RGB, GL_UNSIGNED_BYTE,
+                          tile.diffuse.data(), VT_TILE_SIZE * 3);
+}
+
+void VirtualTexture::upload_finished()
+{
+    for (size_t i = 0; i < jobs.size(); )
+    {
+        if (jobs[i].wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            jobs[i] = std::move(jobs.back());
+            jobs.pop_back();
+        }
+        else
+            ++i;
+    }
+
+    std::vector<VirtualTile> ready;
+    {
+        std::lock_guard<std::mutex> lock(finished_mutex);
+        size_t count = std::min(finished.size(), (size_t) UPLOADS_PER_FRAME);
+        ready.assign(std::make_move_iterator(finished.begin()), std::make_move_iterator(finished.begin() + count));
+        finished.erase(finished.begin(), finished.begin() + count);
+    }
+
+    for (size_t i = 0; i < ready.size(); ++i)
+    {
+        const VirtualTile &tile = ready[i];
+        uint32_t key = tile_key(tile.level, tile.x, tile.y);
+        loading.erase(key);
+        if (resident.count(key))
+            continue;
+
+        // Every slot in view: drop the tile, the next feedback asks again
+        int slot = free_slot();
+        if (slot < 0)
+            continue;
+
+        upload_tile(slot, tile);
+        slots[slot].key = key;
+        slots[slot].last_used = frame;
+        resident[key] = slot;
+        page_table_dirty = true;
+        ++tiles_loaded;
+    }
+}
+
+// Every page points at its own tile if resident, else at its parent's entry.
+void VirtualTexture::update_page_table()
+{
+    for (int level = level_count - 1; level >= 0; --level)
+    {
+        int size = pages >> level;
+        for (int y = 0; y < size; ++y)
+        {
+            for (int x = 0; x < size; ++x)
+            {
+                unsigned char *entry = &table[level][((size_t) y * size + x) * 4];
+                std::unordered_map<uint32_t, int>::const_iterator it = resident.find(tile_key(level, x, y));
+                if (it != resident.end())
+                {
+                    entry[0] = it->second % atlas_tiles;
+                    entry[1] = it->second / atlas_tiles;
+                    entry[2] = level;
+                    entry[3] = 255;
+                }
+                else if (level + 1 < level_count)
+                {
+                    int parent_size = size / 2;
+                    memcpy(entry, &table[level + 1][((size_t) (y / 2) * parent_size + x / 2) * 4], 4);
+                }
+            }
+        }
+    }
+
+    glActiveTexture(GL_TEXTURE0 + first_unit);
+    glBindTexture(GL_TEXTURE_2D, page_table);
+    TextureUploader &uploader = texture_uploader();
+    for (int level = 0; level < level_count; ++level)
+    {
+        int size = pages >> level;
+        uploader.sub_image_2d(GL_TEXTURE_2D, level, 0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE,
+                              table[level].data(), (size_t) size * 4);
+    }
+    page_table_dirty = false;
+}
+
+void VirtualTexture::update()
+{
+    ++frame;
+    read_feedback();
+    upload_finished();
+    if (page_table_dirty)
+        update_page_table();
+}
+
+void VirtualTexture::print_stats() const
+{
+    size_t tile_bytes = (size_t) VT_TILE_SIZE * VT_TILE_SIZE * (1 + 2 + 3);
+    std::cout << "Virtual texture: " << pages * VT_TILE_CONTENT << "^2 texels, " << level_count << " levels, "
+              << resident.size() << "/" << slots.size() << " tiles resident ("
+              << resident.size() * tile_bytes / 1024 << " KB), " << loading.size() << " loading, "
+              << last_requested << " wanted by the last feedback; " << tiles_loaded << " loaded, "
+              << tiles_evicted << " evicted over " << feedback_reads << " feedback reads" << std::endl;
+}
@@ -0,0 +1,132 @@
+// Virtual texturing for the snowfield's height, normal and diffuse data.
+//
+// The virtual texture is a square of pages x pages tiles at level 0 (and a
+// mip pyramid of coarser levels above it), far more than fits in memory.
+// Only the tiles actually in view are resident, in a physical atlas of
+// atlas_tiles x atlas_tiles slots, one atlas per channel set:
+//
+//   height    R8    depth, as in depthMap
+//   normal    RG8   tangent-space X and Y; the shader rebuilds Z
+//   diffuse   RGB8
+//
+// An indirection texture (the page table, one texel per page, one mip level
+// per virtual level) maps every page to the slot of its finest resident
+// ancestor, so a page that is still loading shows a coarser version of itself
+// rather than a hole. Tiles carry a one-texel border so bilinear filtering
+// inside a slot never reads a neighbouring slot.
+//
+// Each frame the scene is also drawn at low resolution with
+// fshader5_feedback.glsl, which writes the page and level every pixel wants.
+// The feedback is read back through a PBO a frame later (no stall), missing
+// tiles are generated on the worker pool and the results are uploaded a few
+// per frame into free slots, or into the least recently used one.
+
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Physical tile size in texels, including the border on each side.
+const int VT_TILE_SIZE = 128;
+const int VT_TILE_BORDER = 1;
+const int VT_TILE_CONTENT = VT_TILE_SIZE - 2 * VT_TILE_BORDER;
+
+// The feedback pass renders at 1/VT_FEEDBACK_DIVISOR of the frame's size.
+const int VT_FEEDBACK_DIVISOR = 8;
+
+// The pixels of one tile, VT_TILE_SIZE squared, in the atlas formats.
+struct VirtualTile
+{
+    int level, x, y;
+    int pages;    // pages per side at level 0
+    std::vector<unsigned char> height, normal, diffuse;
+};
+
+// Fills a tile's pixels; called on worker threads.
+typedef std::function<void(VirtualTile &)> TileGenerator;
+
+// Procedural snowfield: periodic fractal noise with detail down to the
+// texel at every level.
+void snowfield_tile(VirtualTile &tile);
+
+class VirtualTexture
+{
+public:
+    // pages must be a power of two no greater than 256. The page table and
+    // the atlases live on texture units first_unit..first_unit+3; the
+    // coarsest tile is generated before the constructor returns.
+    VirtualTexture(int pages, int atlas_tiles, int first_unit, const TileGenerator &generator = snowfield_tile);
+    ~VirtualTexture();
+
+    // Point the vt* uniforms of program (which must be in use) at the page
+    // table and atlases.
+    void bind(GLuint program);
+
+    // Draw the feedback pass at 1/VT_FEEDBACK_DIVISOR of the given framebuffer
+    // size. draw receives the feedback program, in use, and must set its
+    // Model/View/Projection uniforms and draw the virtually textured geometry.
+    // The caller's program is no longer in use afterwards.
+    void render_feedback(int width, int height, const std::function<void(GLuint)> &draw);
+
+    // Read the previous feedback, schedule missing tiles, upload finished
+    // ones and refresh the page table. Once per frame.
+    void update();
+
+    void print_stats() const;
+
+    int levels() const { return level_count; }
+
+private:
+    VirtualTexture(const VirtualTexture &);
+    VirtualTexture &operator=(const VirtualTexture &);
+
+    struct Slot
+    {
+        uint32_t key;        // resident tile, or EMPTY_SLOT
+        uint64_t last_used;  // frame it was last requested
+    };
+
+    void read_feedback();
+    void request(uint32_t key);
+    void upload_finished();
+    int free_slot();
+    void upload_tile(int slot, const VirtualTile &tile);
+    void update_page_table();
+
+    int pages, atlas_tiles, level_count;
+    TileGenerator generator;
+
+    GLuint page_table;
+    GLuint atlas_height, atlas_normal, atlas_diffuse;
+    int first_unit;
+
+    GLuint feedback_program;
+    GLuint feedback_fbo, feedback_color, feedback_depth;
+    int feedback_width, feedback_height;
+    GLuint feedback_pbo;
+    GLsync feedback_fence;
+
+    std::vector<Slot> slots;
+    std::unordered_map<uint32_t, int> resident;      // tile key -> slot
+    std::unordered_set<uint32_t> loading;
+    std::vector< std::vector<unsigned char> > table;  // RGBA8 page table, per level
+    uint64_t feedback_frame;                         // frame of the last feedback read
+    std::vector< std::future<void> > jobs;
+    std::mutex finished_mutex;
+    std::vector<VirtualTile> finished;
+    bool page_table_dirty;
+    uint64_t frame;
+
+    // Counters since start-up, and for the last feedback read.
+    int tiles_loaded, tiles_evicted, feedback_reads, last_requested;
+};
+
+#endif // VIRTUAL_TEXTURE_H
@@ -2,8 +2,12 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
-layout (location = 3) in vec3 aTangent;
+layout (location = 3) in vec4 aTangent;     // w: bitangent sign when packed
 layout (location = 4) in vec3 aBitangent;
+layout (location = 5) in vec4 aQTangent;
+layout (location = 6) in vec4 aPatch;       // CDLOD patch: x, z, size, level
+layout (location = 8) in mat4 aInstanceModel;   // patch_field.h, in place of Model
+layout (location = 12) in int aInstanceLayer;   // and of materialLayer
 
 out VS_OUT {
     vec3 FragPos;
@@ -12,6 +16,7 @@ out VS_OUT {
     vec3 TangentViewPos;
     vec3 TangentFragPos;
 } vs_out;
+flat out int MaterialLayer;     // texture array layer, < 0 for the separate maps
 
 uniform mat4 Projection;
 uniform mat4 View;
@@ -20,22 +25,49 @@ uniform mat4 Model;
 uniform vec3 LightPos;
 uniform vec3 ViewPos;
 
+uniform int materialLayer;
+
+// Take the model matrix and material layer from aInstanceModel and
+// aInstanceLayer
+uniform bool instanced;
+
+// CDLOD terrain (cdlod.h): the grid's texcoords place the vertex in its
+// patch (terrain5.glsl)
+uniform bool terrain;
+uniform float patchResolution;      // quads per side of the patch grid
+
+#include "terrain5.glsl"
+#include "vertex_format5.glsl"
+
 void main()
 {
-    // vs_out.FragPos = vec3(View * Model * vec4(aPos, 1.0));   
-    vs_out.FragPos = vec3(Model * vec4(aPos, 1.0));   
-    vs_out.TexCoords = aTexCoords;   
-    
-    vec3 T = normalize(mat3(Model) * aTangent);
-    vec3 B = normalize(mat3(Model) * aBitangent);
-    vec3 N = normalize(mat3(Model) * aNormal);
+    MaterialLayer = instanced ? aInstanceLayer : materialLayer;
+
+    vec3 T, B, N;
+    if (terrain) {
+        vec2 xz = terrainPosition(aPatch, patchResolution);
+        vs_out.FragPos = vec3(xz.x, terrainHeight(xz), xz.y);
+        vs_out.TexCoords = xz / terrainTile;
+        terrainFrame(xz, T, B, N);
+    } else {
+        mat4 model = instanced ? aInstanceModel : Model;
+        // vs_out.FragPos = vec3(View * Model * vec4(aPos, 1.0));   
+        vs_out.FragPos = vec3(model * vec4(aPos, 1.0));   
+        vs_out.TexCoords = aTexCoords;   
+        
+        vec3 tangent, bitangent, normal;
+        tangentFrame(tangent, bitangent, normal);
+        T = normalize(mat3(model) * tangent);
+        B = normalize(mat3(model) * bitangent);
+        N = normalize(mat3(model) * normal);
+    }
     mat3 TBN = transpose(mat3(T, B, N));
 
     vs_out.TangentLightPos = TBN * LightPos;
     vs_out.TangentViewPos  = TBN * ViewPos;
     vs_out.TangentFragPos  = TBN * vs_out.FragPos;
     
-    gl_Position = Projection * View * Model * vec4(aPos, 1.0);
+    gl_Position = Projection * View * vec4(vs_out.FragPos, 1.0);
 }
 
 /*
@@ -0,0 +1,27 @@
+#version 330 core
+// Snow brushes (snow_gpu.h): one instanced quad per brush, in the field's
+// texels, drawn into the depth with min/max blending.
+layout (location = 0) in vec2 aCorner;      // (+-1, +-1)
+layout (location = 1) in vec4 aBrush;       // centre (texture coordinates), half extents
+layout (location = 2) in vec3 aProfile;     // rotation, depth, falloff
+layout (location = 3) in int aShape;        // SnowBrushShape
+
+uniform vec2 fieldSize;
+
+out vec2 Local;                 // texels from the centre along the brush's axes
+flat out vec2 HalfExtents;      // in texels
+flat out vec2 DepthFalloff;
+flat out int Shape;
+
+void main()
+{
+    // Half extents in texels of the width, as SnowStamp's radius; one more
+    // so the quad covers every texel centre inside the shape
+    HalfExtents = aBrush.zw * fieldSize.x;
+    Local = aCorner * (HalfExtents + 1.0);
+    float c = cos(aProfile.x), s = sin(aProfile.x);
+    vec2 texels = aBrush.xy * fieldSize + vec2(c * Local.x - s * Local.y, s * Local.x + c * Local.y);
+    gl_Position = vec4(texels / fieldSize * 2.0 - 1.0, 0.0, 1.0);
+    DepthFalloff = aProfile.yz;
+    Shape = aShape;
+}
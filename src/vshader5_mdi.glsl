@@ -0,0 +1,65 @@
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : enable
+
+// The CDLOD terrain of vshader5.glsl, for one glMultiDrawElementsIndirect
+// over every selected patch (terrain_indirect.h). Each draw's patch and grid
+// resolution come from the TerrainDraws storage buffer indexed by the draw's
+// gl_DrawID; without shader draw parameters, the same buffer is read as the
+// per-instance attributes aPatch and aDrawParams, each command's baseInstance
+// selecting its record.
+layout (location = 2) in vec2 aTexCoords;
+layout (location = 6) in vec4 aPatch;       // x, z, size, level
+layout (location = 7) in vec4 aDrawParams;  // x: quads per side of the patch grid
+
+struct TerrainDraw {
+    vec4 node;       // x, z, size, level
+    vec4 params;     // x: quads per side of the patch grid
+};
+
+layout (std430, binding = 0) readonly buffer TerrainDraws {
+    TerrainDraw draws[];
+};
+
+out VS_OUT {
+    vec3 FragPos;
+    vec2 TexCoords;
+    vec3 TangentLightPos;
+    vec3 TangentViewPos;
+    vec3 TangentFragPos;
+} vs_out;
+flat out int MaterialLayer;     // fshader5.glsl's, the same for every patch
+
+uniform mat4 Projection;
+uniform mat4 View;
+
+uniform vec3 LightPos;
+uniform vec3 ViewPos;
+
+uniform bool drawIDFetch;           // read draws[gl_DrawID]
+uniform int materialLayer;
+
+#include "terrain5.glsl"
+
+void main()
+{
+    TerrainDraw draw = TerrainDraw(aPatch, aDrawParams);
+#ifdef GL_ARB_shader_draw_parameters
+    if (drawIDFetch)
+        draw = draws[gl_DrawIDARB];
+#endif
+
+    vec2 xz = terrainPosition(draw.node, draw.params.x);
+    vs_out.FragPos = vec3(xz.x, terrainHeight(xz), xz.y);
+    vs_out.TexCoords = xz / terrainTile;
+    MaterialLayer = materialLayer;
+
+    vec3 T, B, N;
+    terrainFrame(xz, T, B, N);
+    mat3 TBN = transpose(mat3(T, B, N));
+
+    vs_out.TangentLightPos = TBN * LightPos;
+    vs_out.TangentViewPos  = TBN * ViewPos;
+    vs_out.TangentFragPos  = TBN * vs_out.FragPos;
+
+    gl_Position = Projection * View * vec4(vs_out.FragPos, 1.0);
+}
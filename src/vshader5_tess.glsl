@@ -0,0 +1,34 @@
+#version 400 core
+
+// Vertex stage of the tessellated surface: hands the grid's world-space
+// position and tangent frame on to tcshader5.glsl, which sizes the patches,
+// and teshader5.glsl, which displaces the generated vertices.
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+layout (location = 3) in vec4 aTangent;     // w: bitangent sign when packed
+layout (location = 4) in vec3 aBitangent;
+layout (location = 5) in vec4 aQTangent;
+
+out TESS_IN {
+    vec3 Position;
+    vec2 TexCoords;
+    vec3 Tangent;
+    vec3 Bitangent;
+    vec3 Normal;
+} vs_out;
+
+uniform mat4 Model;
+
+#include "vertex_format5.glsl"
+
+void main()
+{
+    vec3 T, B, N;
+    tangentFrame(T, B, N);
+    vs_out.Position = vec3(Model * vec4(aPos, 1.0));
+    vs_out.TexCoords = aTexCoords;
+    vs_out.Tangent = mat3(Model) * T;
+    vs_out.Bitangent = mat3(Model) * B;
+    vs_out.Normal = mat3(Model) * N;
+}